@@ -13,6 +13,52 @@
 #include "seq_ids.h"
 #include "dialog_ids.h"
 
+#ifndef TARGET_N64
+#include "../pc/audio/audio_thread.h"
+
+// When the audio engine runs on a thread of its own, the calls the game makes into this file
+// are queued and run on that thread at the start of its next audio frame, in the same order.
+enum SoundCall {
+    SOUND_CALL_PLAY_SOUND,
+    SOUND_CALL_AUDIO_SIGNAL_GAME_LOOP_TICK,
+    SOUND_CALL_SEQUENCE_PLAYER_FADE_OUT,
+    SOUND_CALL_FADE_VOLUME_SCALE,
+    SOUND_CALL_FUNC_8031FFB4,
+    SOUND_CALL_SEQUENCE_PLAYER_UNLOWER,
+    SOUND_CALL_SET_SOUND_DISABLED,
+    SOUND_CALL_FUNC_803205E8,
+    SOUND_CALL_FUNC_803206F8,
+    SOUND_CALL_FUNC_80320890,
+    SOUND_CALL_SOUND_BANKS_DISABLE,
+    SOUND_CALL_SOUND_BANKS_ENABLE,
+    SOUND_CALL_FUNC_80320A4C,
+    SOUND_CALL_PLAY_DIALOG_SOUND,
+    SOUND_CALL_PLAY_MUSIC,
+    SOUND_CALL_STOP_BACKGROUND_MUSIC,
+    SOUND_CALL_FADEOUT_BACKGROUND_MUSIC,
+    SOUND_CALL_DROP_QUEUED_BACKGROUND_MUSIC,
+    SOUND_CALL_PLAY_SECONDARY_MUSIC,
+    SOUND_CALL_FUNC_80321080,
+    SOUND_CALL_FUNC_803210D4,
+    SOUND_CALL_PLAY_COURSE_CLEAR,
+    SOUND_CALL_PLAY_PEACHS_JINGLE,
+    SOUND_CALL_PLAY_PUZZLE_JINGLE,
+    SOUND_CALL_PLAY_STAR_FANFARE,
+    SOUND_CALL_PLAY_POWER_STAR_JINGLE,
+    SOUND_CALL_PLAY_RACE_FANFARE,
+    SOUND_CALL_PLAY_TOADS_JINGLE,
+    SOUND_CALL_SOUND_RESET,
+    SOUND_CALL_AUDIO_SET_SOUND_MODE,
+};
+
+#define DEFER_SOUND_CALL(id, arg0, arg1, arg2, arg3, pointer)                         \
+    if (audio_thread_defers_calls()) {                                                 \
+        struct AudioThreadCall call = { id, { arg0, arg1, arg2, arg3 }, pointer };     \
+        audio_thread_push_call(&call);                                                 \
+        return;                                                                        \
+    }
+#endif
+
 #ifdef VERSION_EU
 #define EU_FLOAT(x) x ## f
 #else
@@ -731,6 +777,7 @@ struct SPTask *create_next_audio_frame_task(void) {
     return NULL;
 }
 void create_next_audio_buffer(s16 *samples, u32 num_samples) {
+    run_deferred_sound_calls();
     gAudioFrameCount++;
     if (sGameLoopTicked != 0) {
         update_game_sound();
@@ -744,7 +791,128 @@ void create_next_audio_buffer(s16 *samples, u32 num_samples) {
 #endif
 #endif
 
+#ifndef TARGET_N64
+void run_deferred_sound_calls(void) {
+    struct AudioThreadCall call;
+    struct AudioThreadSnapshot snapshot;
+
+    while (audio_thread_pop_call(&call)) {
+        switch (call.id) {
+            case SOUND_CALL_PLAY_SOUND:
+                play_sound(call.args[0], call.ptr);
+                break;
+            case SOUND_CALL_AUDIO_SIGNAL_GAME_LOOP_TICK:
+                audio_signal_game_loop_tick();
+                break;
+            case SOUND_CALL_SEQUENCE_PLAYER_FADE_OUT:
+                sequence_player_fade_out(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_FADE_VOLUME_SCALE:
+                fade_volume_scale(call.args[0], call.args[1], call.args[2]);
+                break;
+            case SOUND_CALL_FUNC_8031FFB4:
+                func_8031FFB4(call.args[0], call.args[1], call.args[2]);
+                break;
+            case SOUND_CALL_SEQUENCE_PLAYER_UNLOWER:
+                sequence_player_unlower(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_SET_SOUND_DISABLED:
+                set_sound_disabled(call.args[0]);
+                break;
+            case SOUND_CALL_FUNC_803205E8:
+                func_803205E8(call.args[0], call.ptr);
+                break;
+            case SOUND_CALL_FUNC_803206F8:
+                func_803206F8(call.ptr);
+                break;
+            case SOUND_CALL_FUNC_80320890:
+                func_80320890();
+                break;
+            case SOUND_CALL_SOUND_BANKS_DISABLE:
+                sound_banks_disable(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_SOUND_BANKS_ENABLE:
+                sound_banks_enable(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_FUNC_80320A4C:
+                func_80320A4C(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_PLAY_DIALOG_SOUND:
+                play_dialog_sound(call.args[0]);
+                break;
+            case SOUND_CALL_PLAY_MUSIC:
+                play_music(call.args[0], call.args[1], call.args[2]);
+                break;
+            case SOUND_CALL_STOP_BACKGROUND_MUSIC:
+                stop_background_music(call.args[0]);
+                break;
+            case SOUND_CALL_FADEOUT_BACKGROUND_MUSIC:
+                fadeout_background_music(call.args[0], call.args[1]);
+                break;
+            case SOUND_CALL_DROP_QUEUED_BACKGROUND_MUSIC:
+                drop_queued_background_music();
+                break;
+            case SOUND_CALL_PLAY_SECONDARY_MUSIC:
+                play_secondary_music(call.args[0], call.args[1], call.args[2], call.args[3]);
+                break;
+            case SOUND_CALL_FUNC_80321080:
+                func_80321080(call.args[0]);
+                break;
+            case SOUND_CALL_FUNC_803210D4:
+                func_803210D4(call.args[0]);
+                break;
+            case SOUND_CALL_PLAY_COURSE_CLEAR:
+                play_course_clear();
+                break;
+            case SOUND_CALL_PLAY_PEACHS_JINGLE:
+                play_peachs_jingle();
+                break;
+            case SOUND_CALL_PLAY_PUZZLE_JINGLE:
+                play_puzzle_jingle();
+                break;
+            case SOUND_CALL_PLAY_STAR_FANFARE:
+                play_star_fanfare();
+                break;
+            case SOUND_CALL_PLAY_POWER_STAR_JINGLE:
+                play_power_star_jingle(call.args[0]);
+                break;
+            case SOUND_CALL_PLAY_RACE_FANFARE:
+                play_race_fanfare();
+                break;
+            case SOUND_CALL_PLAY_TOADS_JINGLE:
+                play_toads_jingle();
+                break;
+            case SOUND_CALL_SOUND_RESET:
+                sound_reset(call.args[0]);
+                break;
+            case SOUND_CALL_AUDIO_SET_SOUND_MODE:
+                audio_set_sound_mode(call.args[0]);
+                break;
+        }
+    }
+
+    // What the game reads back, as of after the calls
+    snapshot.audio_random = gAudioRandom;
+    snapshot.background_music = sBackgroundMusicQueueSize != 0 ?
+        (sBackgroundMusicQueue[0].priority << 8) + sBackgroundMusicQueue[0].seqId : 0xffff;
+    audio_thread_publish(&snapshot);
+}
+
+u32 get_audio_random(void) {
+    struct AudioThreadSnapshot snapshot;
+
+    if (audio_thread_defers_calls()) {
+        audio_thread_get_snapshot(&snapshot, FALSE);
+        return snapshot.audio_random;
+    }
+    return gAudioRandom;
+}
+#endif
+
 void play_sound(s32 soundBits, f32 *pos) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_SOUND, soundBits, 0, 0, 0, pos);
+#endif
     sSoundRequests[sSoundRequestCount].soundBits = soundBits;
     sSoundRequests[sSoundRequestCount].position = pos;
     sSoundRequestCount++;
@@ -1130,6 +1298,9 @@ static void noop_8031EEC8(void) {
 }
 
 void audio_signal_game_loop_tick(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_AUDIO_SIGNAL_GAME_LOOP_TICK, 0, 0, 0, 0, NULL);
+#endif
     sGameLoopTicked = 1;
 #ifdef VERSION_EU
     maybe_tick_game_sound();
@@ -1519,6 +1690,9 @@ void play_sequence(u8 player, u8 seqId, u16 fadeTimer) {
 }
 
 void sequence_player_fade_out(u8 player, u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SEQUENCE_PLAYER_FADE_OUT, player, fadeTimer, 0, 0, NULL);
+#endif
 #ifdef VERSION_EU
     if (!player) {
         sPlayer0CurSeqId = SEQUENCE_NONE;
@@ -1533,6 +1707,9 @@ void sequence_player_fade_out(u8 player, u16 fadeTimer) {
 }
 
 void fade_volume_scale(u8 player, u8 targetScale, u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FADE_VOLUME_SCALE, player, targetScale, fadeTimer, 0, NULL);
+#endif
     u8 i;
     for (i = 0; i < CHANNELS_MAX; i++) {
         fade_channel_volume_scale(player, i, targetScale, fadeTimer);
@@ -1743,6 +1920,9 @@ void unused_8031FED0(u8 player, u32 bits, s8 arg2) {
 }
 
 void func_8031FFB4(u8 player, u16 fadeTimer, u8 arg2) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_8031FFB4, player, fadeTimer, arg2, 0, NULL);
+#endif
     if (player == 0) {
         sCapVolumeTo40 = TRUE;
         func_803200E4(fadeTimer);
@@ -1752,6 +1932,9 @@ void func_8031FFB4(u8 player, u16 fadeTimer, u8 arg2) {
 }
 
 void sequence_player_unlower(u8 player, u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SEQUENCE_PLAYER_UNLOWER, player, fadeTimer, 0, 0, NULL);
+#endif
     sCapVolumeTo40 = FALSE;
     if (player == 0) {
         if (gSequencePlayers[player].state != SEQUENCE_PLAYER_STATE_FADE_OUT) {
@@ -1810,6 +1993,9 @@ u8 func_803200E4(u16 fadeTimer) {
 }
 
 void set_sound_disabled(u8 disabled) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SET_SOUND_DISABLED, disabled, 0, 0, 0, NULL);
+#endif
     u8 i;
 
     for (i = 0; i < SEQUENCE_PLAYERS; i++) {
@@ -1902,6 +2088,9 @@ void get_currently_playing_sound(u8 bankIndex, u8 *numPlayingSounds, u8 *arg2, u
 }
 
 void func_803205E8(u32 soundBits, f32 *vec) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_803205E8, soundBits, 0, 0, 0, vec);
+#endif
     u8 bankIndex;
     u8 item;
 
@@ -1921,6 +2110,9 @@ void func_803205E8(u32 soundBits, f32 *vec) {
 }
 
 void func_803206F8(f32 *arg0) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_803206F8, 0, 0, 0, 0, arg0);
+#endif
     u8 bankIndex;
     u8 item;
 
@@ -1947,12 +2139,18 @@ static void func_803207DC(u8 bankIndex) {
 }
 
 void func_80320890(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_80320890, 0, 0, 0, 0, NULL);
+#endif
     func_803207DC(1);
     func_803207DC(4);
     func_803207DC(6);
 }
 
 void sound_banks_disable(UNUSED u8 player, u16 bankMask) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SOUND_BANKS_DISABLE, player, bankMask, 0, 0, NULL);
+#endif
     u8 i;
 
     for (i = 0; i < SOUND_BANK_COUNT; i++) {
@@ -1972,6 +2170,9 @@ void disable_all_sequence_players(void) {
 }
 
 void sound_banks_enable(UNUSED u8 player, u16 bankMask) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SOUND_BANKS_ENABLE, player, bankMask, 0, 0, NULL);
+#endif
     u8 i;
 
     for (i = 0; i < SOUND_BANK_COUNT; i++) {
@@ -1992,10 +2193,16 @@ u8 unused_803209D8(u8 player, u8 channelIndex, u8 arg2) {
 }
 
 void func_80320A4C(u8 bankIndex, u8 arg1) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_80320A4C, bankIndex, arg1, 0, 0, NULL);
+#endif
     D_80363808[bankIndex] = arg1;
 }
 
 void play_dialog_sound(u8 dialogID) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_DIALOG_SOUND, dialogID, 0, 0, 0, NULL);
+#endif
     u8 speaker;
 
     if (dialogID >= DIALOG_COUNT) {
@@ -2020,6 +2227,9 @@ void play_dialog_sound(u8 dialogID) {
 }
 
 void play_music(u8 player, u16 seqArgs, u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_MUSIC, player, seqArgs, fadeTimer, 0, NULL);
+#endif
     u8 seqId = seqArgs & 0xff;
     u8 priority = seqArgs >> 8;
     u8 i;
@@ -2079,6 +2289,9 @@ void play_music(u8 player, u16 seqArgs, u16 fadeTimer) {
 }
 
 void stop_background_music(u16 seqId) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_STOP_BACKGROUND_MUSIC, seqId, 0, 0, 0, NULL);
+#endif
     u8 foundIndex;
     u8 i;
 
@@ -2120,18 +2333,32 @@ void stop_background_music(u16 seqId) {
 }
 
 void fadeout_background_music(u16 seqId, u16 fadeOut) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FADEOUT_BACKGROUND_MUSIC, seqId, fadeOut, 0, 0, NULL);
+#endif
     if (sBackgroundMusicQueueSize != 0 && sBackgroundMusicQueue[0].seqId == (u8)(seqId & 0xff)) {
         sequence_player_fade_out(SEQ_PLAYER_LEVEL, fadeOut);
     }
 }
 
 void drop_queued_background_music(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_DROP_QUEUED_BACKGROUND_MUSIC, 0, 0, 0, 0, NULL);
+#endif
     if (sBackgroundMusicQueueSize != 0) {
         sBackgroundMusicQueueSize = 1;
     }
 }
 
 u16 get_current_background_music(void) {
+#ifndef TARGET_N64
+    if (audio_thread_defers_calls()) {
+        struct AudioThreadSnapshot snapshot;
+        // Including the effect of the music calls the game just queued
+        audio_thread_get_snapshot(&snapshot, TRUE);
+        return snapshot.background_music;
+    }
+#endif
     if (sBackgroundMusicQueueSize != 0) {
         return (sBackgroundMusicQueue[0].priority << 8) + sBackgroundMusicQueue[0].seqId;
     }
@@ -2164,6 +2391,9 @@ void func_80320ED8(void) {
 }
 
 void play_secondary_music(u8 seqId, u8 bgMusicVolume, u8 volume, u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_SECONDARY_MUSIC, seqId, bgMusicVolume, volume, fadeTimer, NULL);
+#endif
     UNUSED u32 dummy;
 
     sUnused80332118 = 0;
@@ -2189,6 +2419,9 @@ void play_secondary_music(u8 seqId, u8 bgMusicVolume, u8 volume, u16 fadeTimer)
 }
 
 void func_80321080(u16 fadeTimer) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_80321080, fadeTimer, 0, 0, 0, NULL);
+#endif
     if (D_80363812 != 0) {
         D_80363812 = 0;
         D_80332120 = 0;
@@ -2199,6 +2432,9 @@ void func_80321080(u16 fadeTimer) {
 }
 
 void func_803210D4(u16 fadeOutTime) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_FUNC_803210D4, fadeOutTime, 0, 0, 0, NULL);
+#endif
     u8 i;
 
     if (sHasStartedFadeOut) {
@@ -2229,6 +2465,9 @@ void func_803210D4(u16 fadeOutTime) {
 }
 
 void play_course_clear(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_COURSE_CLEAR, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_CUTSCENE_COLLECT_STAR, 0);
     D_8033211C = 0x80 | 0;
 #ifdef VERSION_EU
@@ -2238,6 +2477,9 @@ void play_course_clear(void) {
 }
 
 void play_peachs_jingle(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_PEACHS_JINGLE, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_PEACH_MESSAGE, 0);
     D_8033211C = 0x80 | 0;
 #ifdef VERSION_EU
@@ -2252,6 +2494,9 @@ void play_peachs_jingle(void) {
  * yoshi, releasing chain chomp, opening the pyramid top, etc.
  */
 void play_puzzle_jingle(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_PUZZLE_JINGLE, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_SOLVE_PUZZLE, 0);
     D_8033211C = 0x80 | 20;
 #ifdef VERSION_EU
@@ -2261,6 +2506,9 @@ void play_puzzle_jingle(void) {
 }
 
 void play_star_fanfare(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_STAR_FANFARE, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_HIGH_SCORE, 0);
     D_8033211C = 0x80 | 20;
 #ifdef VERSION_EU
@@ -2270,6 +2518,9 @@ void play_star_fanfare(void) {
 }
 
 void play_power_star_jingle(u8 arg0) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_POWER_STAR_JINGLE, arg0, 0, 0, 0, NULL);
+#endif
     if (!arg0) {
         D_80363812 = 0;
     }
@@ -2282,6 +2533,9 @@ void play_power_star_jingle(u8 arg0) {
 }
 
 void play_race_fanfare(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_RACE_FANFARE, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_RACE, 0);
     D_8033211C = 0x80 | 20;
 #ifdef VERSION_EU
@@ -2291,6 +2545,9 @@ void play_race_fanfare(void) {
 }
 
 void play_toads_jingle(void) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_PLAY_TOADS_JINGLE, 0, 0, 0, 0, NULL);
+#endif
     play_sequence(SEQ_PLAYER_ENV, SEQ_EVENT_TOAD_MESSAGE, 0);
     D_8033211C = 0x80 | 20;
 #ifdef VERSION_EU
@@ -2300,6 +2557,9 @@ void play_toads_jingle(void) {
 }
 
 void sound_reset(u8 presetId) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_SOUND_RESET, presetId, 0, 0, 0, NULL);
+#endif
 #ifndef VERSION_JP
     if (presetId >= 8) {
         presetId = 0;
@@ -2327,6 +2587,9 @@ void sound_reset(u8 presetId) {
 }
 
 void audio_set_sound_mode(u8 soundMode) {
+#ifndef TARGET_N64
+    DEFER_SOUND_CALL(SOUND_CALL_AUDIO_SET_SOUND_MODE, soundMode, 0, 0, 0, NULL);
+#endif
     D_80332108 = (D_80332108 & 0xf) + (soundMode << 4);
     gSoundMode = soundMode;
 }
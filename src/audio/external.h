@@ -24,6 +24,13 @@ extern f32 gDefaultSoundArgs[3];
 // defined in data.c, used by the game
 extern u32 gAudioRandom;
 
+// The game reads gAudioRandom through this, since it is written on the audio thread on PC
+#ifdef TARGET_N64
+#define get_audio_random() gAudioRandom
+#else
+u32 get_audio_random(void);
+#endif
+
 extern u8 gAudioSPTaskYieldBuffer[]; // ucode yield data ptr; only used in JP
 
 struct SPTask *create_next_audio_frame_task(void);
@@ -62,6 +69,10 @@ void audio_set_sound_mode(u8 arg0);
 
 void audio_init(void); // in load.c
 
+#ifndef TARGET_N64
+void run_deferred_sound_calls(void);
+#endif
+
 #ifdef VERSION_EU
 struct SPTask *unused_80321460(void);
 #endif
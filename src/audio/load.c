@@ -195,7 +195,11 @@ void decrease_sample_dma_ttls() {
     sUnused80226B40 = 0;
 }
 
-void *dma_sample_data(uintptr_t devAddr, u32 size, s32 arg2, u8 *arg3) {
+void *dma_sample_data(uintptr_t devAddr, UNUSED u32 size, UNUSED s32 arg2, UNUSED u8 *arg3) {
+#ifndef TARGET_N64
+    // All sound data is in memory on PC, so samples are read where they are instead of from a copy
+    return (void *) devAddr;
+#else
     s32 hasDma = FALSE;
     struct SharedDma *dma;
     uintptr_t dmaDevAddr;
@@ -306,9 +310,13 @@ void *dma_sample_data(uintptr_t devAddr, u32 size, s32 arg2, u8 *arg3) {
     *arg3 = dmaIndex;
     return dma->buffer + (devAddr - dmaDevAddr);
 #endif
+#endif
 }
 
 void init_sample_dma_buffers(UNUSED s32 arg0) {
+#ifndef TARGET_N64
+    // dma_sample_data doesn't need buffers on PC, with none there are no TTLs to count down either
+#else
     s32 i;
 #ifdef VERSION_EU
 #define j i
@@ -396,6 +404,7 @@ out2:
 #ifdef VERSION_EU
 #undef j
 #endif
+#endif
 }
 
 #ifndef static
@@ -4,6 +4,7 @@
 #include "data.h"
 #include "seqplayer.h"
 #include "synthesis.h"
+#include "external.h"
 
 #ifdef VERSION_EU
 
@@ -138,6 +139,7 @@ struct SPTask *create_next_audio_frame_task(void) {
 void create_next_audio_buffer(s16 *samples, u32 num_samples) {
     s32 writtenCmds;
     OSMesg msg;
+    run_deferred_sound_calls();
     gAudioFrameCount++;
     decrease_sample_dma_ttls();
     if (osRecvMesg(OSMesgQueues[2], &msg, 0) != -1) {
@@ -38,6 +38,14 @@
 
 #define ALIGN(val, amnt) (((val) + (1 << amnt) - 1) & ~((1 << amnt) - 1))
 
+#ifdef TARGET_N64
+#define aADPCMdecSample(pkt, f, s, src, sample, frame) aADPCMdec(pkt, f, s)
+#else
+// The PC mixer decodes straight from the sample data, so the compressed frames aren't loaded into DMEM,
+// or replays frames it decoded before
+#define aADPCMdecSample(pkt, f, s, src, sample, frame) aADPCMdecCachedImpl(f, s, src, sample, frame)
+#endif
+
 struct VolumeChange {
     u16 sourceLeft;
     u16 sourceRight;
@@ -857,11 +865,14 @@ u64 *synthesis_process_notes(s16 *aiBuf, s32 bufLen, u64 *cmd) {
                                 t0 * 9, flags, &note->sampleDmaIndex);
 #endif
                             a3 = (u32)((uintptr_t) v0_2 & 0xf);
+#ifdef TARGET_N64
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA, 0, t0 * 9 + a3);
                             aLoadBuffer(cmd++, VIRTUAL_TO_PHYSICAL2(v0_2 - a3));
+#endif
                         } else {
                             s0 = 0;
                             a3 = 0;
+                            v0_2 = NULL; // nothing is decoded
                         }
 
 #ifdef VERSION_EU
@@ -883,26 +894,28 @@ u64 *synthesis_process_notes(s16 *aiBuf, s32 bufLen, u64 *cmd) {
                         if (nAdpcmSamplesProcessed == 0) {
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3,
                                        DMEM_ADDR_UNCOMPRESSED_NOTE, s0 * 2);
-                            aADPCMdec(cmd++, flags,
-                                      VIRTUAL_TO_PHYSICAL2(synthesisState->synthesisBuffers->adpcmdecState));
+                            aADPCMdecSample(cmd++, flags,
+                                            VIRTUAL_TO_PHYSICAL2(synthesisState->synthesisBuffers->adpcmdecState), v0_2,
+                                            sampleAddr, temp);
                             sp130 = s2 * 2;
                         } else {
                             s5Aligned = ALIGN(s5, 5);
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3,
                                        DMEM_ADDR_UNCOMPRESSED_NOTE + s5Aligned, s0 * 2);
-                            aADPCMdec(cmd++, flags,
-                                      VIRTUAL_TO_PHYSICAL2(synthesisState->synthesisBuffers->adpcmdecState));
+                            aADPCMdecSample(cmd++, flags,
+                                            VIRTUAL_TO_PHYSICAL2(synthesisState->synthesisBuffers->adpcmdecState), v0_2,
+                                            sampleAddr, temp);
                             aDMEMMove(cmd++, DMEM_ADDR_UNCOMPRESSED_NOTE + s5Aligned + (s2 * 2),
                                       DMEM_ADDR_UNCOMPRESSED_NOTE + s5, (nSamplesInThisIteration) * 2);
                         }
 #else
                         if (nAdpcmSamplesProcessed == 0) {
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3, DMEM_ADDR_UNCOMPRESSED_NOTE, s0 * 2);
-                            aADPCMdec(cmd++, flags, VIRTUAL_TO_PHYSICAL2(note->synthesisBuffers->adpcmdecState));
+                            aADPCMdecSample(cmd++, flags, VIRTUAL_TO_PHYSICAL2(note->synthesisBuffers->adpcmdecState), v0_2, sampleAddr, temp);
                             sp130 = s2 * 2;
                         } else {
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3, DMEM_ADDR_UNCOMPRESSED_NOTE + ALIGN(s5, 5), s0 * 2);
-                            aADPCMdec(cmd++, flags, VIRTUAL_TO_PHYSICAL2(note->synthesisBuffers->adpcmdecState));
+                            aADPCMdecSample(cmd++, flags, VIRTUAL_TO_PHYSICAL2(note->synthesisBuffers->adpcmdecState), v0_2, sampleAddr, temp);
                             aDMEMMove(cmd++, DMEM_ADDR_UNCOMPRESSED_NOTE + ALIGN(s5, 5) + (s2 * 2), DMEM_ADDR_UNCOMPRESSED_NOTE + s5, (nSamplesInThisIteration) * 2);
                         }
 #endif
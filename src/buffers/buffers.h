@@ -28,11 +28,9 @@ extern struct SaveBuffer gSaveBuffer;
 
 extern u8 gGfxSPTaskStack[];
 
-#ifdef TARGET_N64
+// The PC port double-buffers too, so the pipelined renderer can interpret one
+// frame while the game builds the next
 #define GFX_NUM_POOLS 2
-#else
-#define GFX_NUM_POOLS 1
-#endif
 extern struct GfxPool gGfxPools[GFX_NUM_POOLS];
 
 #endif // BUFFERS_H
@@ -1827,7 +1827,7 @@ s32 act_flying(struct MarioState *m) {
     if (startPitch <= 0 && m->faceAngle[0] > 0 && m->forwardVel >= 48.0f) {
         play_sound(SOUND_ACTION_FLYING_FAST, m->marioObj->header.gfx.cameraToObject);
 #ifndef VERSION_JP
-        play_sound(SOUND_MARIO_YAHOO_WAHA_YIPPEE + ((gAudioRandom % 5) << 16),
+        play_sound(SOUND_MARIO_YAHOO_WAHA_YIPPEE + ((get_audio_random() % 5) << 16),
                    m->marioObj->header.gfx.cameraToObject);
 #endif
 #ifdef VERSION_SH
@@ -577,7 +577,7 @@ s32 act_panting(struct MarioState *m) {
     }
 
     if (set_mario_animation(m, MARIO_ANIM_WALK_PANTING) == 1) {
-        play_sound(SOUND_MARIO_PANTING + ((gAudioRandom % 3U) << 0x10),
+        play_sound(SOUND_MARIO_PANTING + ((get_audio_random() % 3U) << 0x10),
                    m->marioObj->header.gfx.cameraToObject);
     }
 
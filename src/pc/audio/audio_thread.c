@@ -0,0 +1,295 @@
+// audio_thread.c - sound synthesis off the game thread
+//
+// The synthesis thread produces one chunk per audio frame period into a single producer single consumer
+// ring of PCM frames, and the output thread moves it from there to the audio backend. Neither waits for
+// the game, which passes its sound engine calls in through a second ring (see external.c).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_thread.h"
+
+#ifndef TARGET_WEB
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PCM_RING_FRAMES 4096 // stereo frames, must be a power of two
+#define CALL_RING_SIZE 1024  // must be a power of two
+#define OUTPUT_POLL_US 1000
+#define SAMPLE_RATE 32000
+
+// In both rings only the producer stores head and only the consumer stores tail. They count
+// entries and wrap around on overflow.
+static struct {
+    int16_t samples[PCM_RING_FRAMES * 2];
+    atomic_uint head, tail;
+} pcm_ring;
+
+static struct {
+    struct AudioThreadCall calls[CALL_RING_SIZE];
+    atomic_uint head, tail;
+} call_ring;
+
+static struct {
+    atomic_bool running;
+    atomic_bool quit;
+    bool output_started;
+    struct AudioAPI *api;
+    void (*synthesize)(int16_t *samples, uint32_t num_samples);
+    void (*run_calls)(void);
+    uint32_t samples_high, samples_low;
+    uint32_t desired_buffered;
+    pthread_t synthesis_thread, output_thread;
+
+    atomic_uint underruns;
+    atomic_uint overruns;
+    atomic_uint device_buffered;
+    atomic_uint synthesis_us;
+    atomic_ullong frames_synthesized;
+    atomic_ullong frames_played;
+
+    atomic_uint published_random;
+    atomic_uint published_music;
+    atomic_uint published_calls; // call_ring.tail as of the snapshot
+} audio_thread;
+
+static __thread bool is_audio_thread;
+
+static uint64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static void *synthesis_thread_main(void *arg) {
+    int16_t *buf = malloc(audio_thread.samples_high * 2 * sizeof(int16_t));
+    // One chunk per audio frame, like the N64 which synthesized one per vertical blank
+    uint64_t period_us = 1000000ULL * (audio_thread.samples_high + audio_thread.samples_low) / 2 / SAMPLE_RATE;
+    uint64_t next = get_time_us();
+
+    is_audio_thread = true;
+    while (!atomic_load_explicit(&audio_thread.quit, memory_order_relaxed)) {
+        unsigned int head = atomic_load_explicit(&pcm_ring.head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&pcm_ring.tail, memory_order_acquire);
+        uint32_t buffered = (head - tail) + atomic_load_explicit(&audio_thread.device_buffered, memory_order_relaxed);
+
+        // Run ahead of the clock while there isn't a chunk in reserve, at the start and after stalls
+        uint64_t now = get_time_us();
+        if (now < next && buffered >= audio_thread.desired_buffered + audio_thread.samples_high) {
+            // Also keeps the wait short for a game thread that needs the result of its calls
+            audio_thread.run_calls();
+            sleep_us(next - now < OUTPUT_POLL_US ? next - now : OUTPUT_POLL_US);
+            continue;
+        }
+        // Wait for room in the ring rather than synthesize a chunk that would have to be dropped
+        if (PCM_RING_FRAMES - (head - tail) < audio_thread.samples_high) {
+            atomic_fetch_add_explicit(&audio_thread.overruns, 1, memory_order_relaxed);
+            sleep_us(OUTPUT_POLL_US);
+            continue;
+        }
+        // Don't try to catch up with more than a few late frames
+        next = now > next + 4 * period_us ? now + period_us : next + period_us;
+
+        // Aim for the desired level in the device and one to two chunks in reserve in the ring
+        uint32_t num_samples = buffered < audio_thread.desired_buffered + 2 * audio_thread.samples_high ?
+                               audio_thread.samples_high : audio_thread.samples_low;
+
+        uint64_t t0 = get_time_us();
+        audio_thread.synthesize(buf, num_samples);
+        atomic_store_explicit(&audio_thread.synthesis_us, (unsigned int)(get_time_us() - t0), memory_order_relaxed);
+        atomic_fetch_add_explicit(&audio_thread.frames_synthesized, num_samples, memory_order_relaxed);
+
+        for (uint32_t i = 0; i < num_samples; i++) {
+            uint32_t pos = (head + i) & (PCM_RING_FRAMES - 1);
+            pcm_ring.samples[pos * 2] = buf[i * 2];
+            pcm_ring.samples[pos * 2 + 1] = buf[i * 2 + 1];
+        }
+        atomic_store_explicit(&pcm_ring.head, head + num_samples, memory_order_release);
+    }
+    free(buf);
+    return arg;
+}
+
+static void *output_thread_main(void *arg) {
+    int16_t buf[PCM_RING_FRAMES * 2];
+    bool starved = false;
+
+    while (!atomic_load_explicit(&audio_thread.quit, memory_order_relaxed)) {
+        int device_buffered = audio_thread.api->buffered();
+        atomic_store_explicit(&audio_thread.device_buffered, device_buffered, memory_order_relaxed);
+        if (device_buffered >= (int)audio_thread.desired_buffered) {
+            sleep_us(OUTPUT_POLL_US);
+            continue;
+        }
+
+        // Top the device up to the desired level, the ring keeps the rest in reserve
+        unsigned int tail = atomic_load_explicit(&pcm_ring.tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&pcm_ring.head, memory_order_acquire);
+        uint32_t needed = audio_thread.desired_buffered - device_buffered;
+        uint32_t count = head - tail < needed ? head - tail : needed;
+        if (count < needed && device_buffered < (int)audio_thread.desired_buffered / 4) {
+            // Count each time the device runs nearly dry after the start, not each poll while it stays dry
+            if (!starved && atomic_load_explicit(&audio_thread.frames_played, memory_order_relaxed) != 0) {
+                atomic_fetch_add_explicit(&audio_thread.underruns, 1, memory_order_relaxed);
+                starved = true;
+            }
+        } else if (count == needed) {
+            starved = false;
+        }
+        if (count == 0) {
+            sleep_us(OUTPUT_POLL_US);
+            continue;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t pos = (tail + i) & (PCM_RING_FRAMES - 1);
+            buf[i * 2] = pcm_ring.samples[pos * 2];
+            buf[i * 2 + 1] = pcm_ring.samples[pos * 2 + 1];
+        }
+        atomic_store_explicit(&pcm_ring.tail, tail + count, memory_order_release);
+        audio_thread.api->play((const uint8_t *)buf, count * 4);
+        atomic_fetch_add_explicit(&audio_thread.frames_played, count, memory_order_relaxed);
+    }
+    return arg;
+}
+
+bool audio_thread_start(struct AudioAPI *api, void (*synthesize)(int16_t *samples, uint32_t num_samples),
+                        void (*run_calls)(void), uint32_t samples_high, uint32_t samples_low) {
+    audio_thread.api = api;
+    audio_thread.synthesize = synthesize;
+    audio_thread.run_calls = run_calls;
+    audio_thread.samples_high = samples_high;
+    audio_thread.samples_low = samples_low;
+    audio_thread.desired_buffered = api->get_desired_buffered();
+
+    // Calls made from now on are queued, so set this before the synthesis thread takes over the engine
+    atomic_store(&audio_thread.quit, false);
+    atomic_store(&audio_thread.running, true);
+    if (pthread_create(&audio_thread.synthesis_thread, NULL, synthesis_thread_main, NULL) != 0) {
+        atomic_store(&audio_thread.running, false);
+        return false;
+    }
+    audio_thread.output_started = pthread_create(&audio_thread.output_thread, NULL, output_thread_main, NULL) == 0;
+    if (!audio_thread.output_started) {
+        // The synthesis thread owns the engine now, it just has no one to play its output
+        fprintf(stderr, "Could not start the audio output thread\n");
+    }
+    return true;
+}
+
+void audio_thread_stop(void) {
+    if (!atomic_load(&audio_thread.running)) {
+        return;
+    }
+    atomic_store(&audio_thread.quit, true);
+    pthread_join(audio_thread.synthesis_thread, NULL);
+    if (audio_thread.output_started) {
+        pthread_join(audio_thread.output_thread, NULL);
+    }
+    // Calls still queued are run by whoever synthesizes next
+    atomic_store(&audio_thread.running, false);
+}
+
+bool audio_thread_is_running(void) {
+    return atomic_load_explicit(&audio_thread.running, memory_order_relaxed);
+}
+
+bool audio_thread_defers_calls(void) {
+    return !is_audio_thread && atomic_load_explicit(&audio_thread.running, memory_order_relaxed);
+}
+
+void audio_thread_push_call(const struct AudioThreadCall *call) {
+    unsigned int head = atomic_load_explicit(&call_ring.head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&call_ring.tail, memory_order_acquire) == CALL_RING_SIZE) {
+        // Full, which takes over a thousand calls within one audio frame
+        sleep_us(100);
+    }
+    call_ring.calls[head & (CALL_RING_SIZE - 1)] = *call;
+    atomic_store_explicit(&call_ring.head, head + 1, memory_order_release);
+}
+
+bool audio_thread_pop_call(struct AudioThreadCall *call) {
+    unsigned int tail = atomic_load_explicit(&call_ring.tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&call_ring.head, memory_order_acquire)) {
+        return false;
+    }
+    *call = call_ring.calls[tail & (CALL_RING_SIZE - 1)];
+    atomic_store_explicit(&call_ring.tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void audio_thread_publish(const struct AudioThreadSnapshot *snapshot) {
+    atomic_store_explicit(&audio_thread.published_random, snapshot->audio_random, memory_order_relaxed);
+    atomic_store_explicit(&audio_thread.published_music, snapshot->background_music, memory_order_relaxed);
+    atomic_store_explicit(&audio_thread.published_calls, atomic_load_explicit(&call_ring.tail, memory_order_relaxed),
+                          memory_order_release);
+}
+
+void audio_thread_get_snapshot(struct AudioThreadSnapshot *snapshot, bool wait_for_calls) {
+    // Only the thread making the calls stores head
+    unsigned int head = atomic_load_explicit(&call_ring.head, memory_order_relaxed);
+    while (wait_for_calls && atomic_load_explicit(&audio_thread.running, memory_order_relaxed) &&
+           (int)(atomic_load_explicit(&audio_thread.published_calls, memory_order_acquire) - head) < 0) {
+        sleep_us(100);
+    }
+    snapshot->audio_random = atomic_load_explicit(&audio_thread.published_random, memory_order_relaxed);
+    snapshot->background_music = atomic_load_explicit(&audio_thread.published_music, memory_order_relaxed);
+}
+
+void audio_thread_get_stats(struct AudioThreadStats *stats) {
+    unsigned int head = atomic_load_explicit(&pcm_ring.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&pcm_ring.tail, memory_order_relaxed);
+    stats->underruns = atomic_load_explicit(&audio_thread.underruns, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&audio_thread.overruns, memory_order_relaxed);
+    stats->ring_buffered = head - tail;
+    stats->device_buffered = atomic_load_explicit(&audio_thread.device_buffered, memory_order_relaxed);
+    stats->synthesis_us = atomic_load_explicit(&audio_thread.synthesis_us, memory_order_relaxed);
+    stats->frames_synthesized = atomic_load_explicit(&audio_thread.frames_synthesized, memory_order_relaxed);
+    stats->frames_played = atomic_load_explicit(&audio_thread.frames_played, memory_order_relaxed);
+}
+
+#else
+
+// No threads on the web, audio is synthesized after each game frame there
+bool audio_thread_start(struct AudioAPI *api, void (*synthesize)(int16_t *samples, uint32_t num_samples),
+                        void (*run_calls)(void), uint32_t samples_high, uint32_t samples_low) {
+    return false;
+}
+
+bool audio_thread_is_running(void) {
+    return false;
+}
+
+bool audio_thread_defers_calls(void) {
+    return false;
+}
+
+void audio_thread_stop(void) {
+}
+
+void audio_thread_push_call(const struct AudioThreadCall *call) {
+}
+
+bool audio_thread_pop_call(struct AudioThreadCall *call) {
+    return false;
+}
+
+void audio_thread_publish(const struct AudioThreadSnapshot *snapshot) {
+}
+
+void audio_thread_get_snapshot(struct AudioThreadSnapshot *snapshot, bool wait_for_calls) {
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+void audio_thread_get_stats(struct AudioThreadStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef AUDIO_THREAD_H
+#define AUDIO_THREAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio_api.h"
+
+// A call the game made into the sound engine, queued for the audio thread (see external.c)
+struct AudioThreadCall {
+    uint32_t id;
+    uint32_t args[4];
+    void *ptr;
+};
+
+// Sound engine state the game reads, published by the audio thread after it runs queued calls
+struct AudioThreadSnapshot {
+    uint32_t audio_random;
+    uint16_t background_music;
+};
+
+struct AudioThreadStats {
+    uint32_t underruns;       // times the device ran nearly dry and the ring was empty
+    uint32_t overruns;        // polls where a chunk was due but the ring had no room for it
+    uint32_t ring_buffered;   // frames waiting in the ring
+    uint32_t device_buffered; // frames queued in the audio device
+    uint32_t synthesis_us;    // time spent synthesizing the last chunk
+    uint64_t frames_synthesized;
+    uint64_t frames_played;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts synthesizing on a thread of its own, which feeds the device through a ring drained by a second thread.
+// synthesize is given samples_high or samples_low stereo frames to fill, whichever keeps the device buffer
+// at the backend's desired level. run_calls runs the queued calls, which the thread also does between chunks.
+bool audio_thread_start(struct AudioAPI *api, void (*synthesize)(int16_t *samples, uint32_t num_samples),
+                        void (*run_calls)(void), uint32_t samples_high, uint32_t samples_low);
+// Stops and joins both threads. The engine is then free to be driven from any one thread again.
+void audio_thread_stop(void);
+bool audio_thread_is_running(void);
+// True if calls into the sound engine have to be queued: the audio thread runs and this is another thread
+bool audio_thread_defers_calls(void);
+void audio_thread_push_call(const struct AudioThreadCall *call);
+bool audio_thread_pop_call(struct AudioThreadCall *call);
+// Called on the audio thread after running the queued calls
+void audio_thread_publish(const struct AudioThreadSnapshot *snapshot);
+// With wait_for_calls, waits until the calls this thread queued so far have run, so that the snapshot reflects them
+void audio_thread_get_snapshot(struct AudioThreadSnapshot *snapshot, bool wait_for_calls);
+void audio_thread_get_stats(struct AudioThreadStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
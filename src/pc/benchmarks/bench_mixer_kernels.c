@@ -0,0 +1,127 @@
+// Times each mixer kernel in every kernel set the CPU can run, and the exported aXxxImpl functions,
+// which go through the kernel set picked at runtime. The difference between the last column and the
+// picked set's column is the cost of the dispatch. Each time is the fastest of several rounds, since
+// single rounds vary by more than that cost.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "src/pc/mixer.c"
+
+#define ITERATIONS 50000
+#define ROUNDS 5
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void setup(void) {
+    srand(1);
+    for (size_t i = 0; i < sizeof(rspa.buf); i++) {
+        rspa.buf.as_u8[i] = rand();
+    }
+    for (size_t i = 0; i < sizeof(rspa.adpcm_table) / sizeof(int16_t); i++) {
+        ((int16_t *)rspa.adpcm_table)[i] = rand() % 8192 - 4096;
+    }
+    rspa.nbytes = 320;
+    rspa.vol[0] = 0x1000;
+    rspa.vol[1] = 0x2000;
+    rspa.target[0] = 0x7000;
+    rspa.target[1] = 0x100;
+    rspa.rate[0] = 0x10100;
+    rspa.rate[1] = 0xff00;
+    rspa.vol_dry = 0x5000;
+    rspa.vol_wet = 0x2000;
+}
+
+// Runs one kernel with the buffer addresses a 160 sample update uses. k is NULL for the dispatched
+// aXxxImpl functions.
+static double time_round(const struct MixerKernels *k, int kernel) {
+    static ENVMIX_STATE state;
+    double t0 = now_ns();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        switch (kernel) {
+            case 0:
+                rspa.out = 0;
+                k ? k->interleave(1024, 1664) : aInterleaveImpl(1024, 1664);
+                break;
+            case 1:
+                // Keep the frame headers' scale small, so that the decoded samples stay in range
+                rspa.buf.as_u8[1800] &= 0x7f;
+                rspa.in = 1800;
+                rspa.out = 0;
+                k ? k->adpcm_dec(0, state, rspa.buf.as_u8 + 1800, rspa.buf.as_s16, 320)
+                  : aADPCMdecImpl(0, state);
+                break;
+            case 2:
+                rspa.in = 400;
+                rspa.out = 1200;
+                k ? k->resample(0, 0x6000, state) : aResampleImpl(0, 0x6000, state);
+                break;
+            case 3:
+                rspa.in = 0;
+                rspa.out = 400;
+                rspa.dry_right = 800;
+                rspa.wet_left = 1200;
+                rspa.wet_right = 1600;
+                k ? k->env_mixer(A_INIT | A_AUX, state) : aEnvMixerImpl(A_INIT | A_AUX, state);
+                break;
+            case 4:
+                k ? k->mix(0x4000, 0, 800) : aMixImpl(0x4000, 0, 800);
+                break;
+        }
+    }
+    return (now_ns() - t0) / ITERATIONS;
+}
+
+static double time_kernel(const struct MixerKernels *k, int kernel) {
+    double best = time_round(k, kernel);
+    for (int i = 1; i < ROUNDS; i++) {
+        double t = time_round(k, kernel);
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+int main(void) {
+    static const char *kernel_names[] = { "interleave", "adpcm_dec", "resample", "env_mixer", "mix" };
+    const struct MixerKernels *sets[5];
+    int num_sets = 0;
+
+    sets[num_sets++] = &mixer_kernels_c;
+#if MIXER_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[num_sets++] = &mixer_kernels_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        sets[num_sets++] = &mixer_kernels_sse41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[num_sets++] = &mixer_kernels_avx2;
+    }
+#elif __ARM_NEON
+    sets[num_sets++] = &mixer_kernels_neon;
+#endif
+
+    setup();
+    printf("ns per call, %d samples; the picked set is %s\n", rspa.nbytes / 2, get_kernels()->name);
+    printf("%-12s", "kernel");
+    for (int s = 0; s < num_sets; s++) {
+        printf(" %10s", sets[s]->name);
+    }
+    printf(" %10s\n", "dispatched");
+    for (int kernel = 0; kernel < 5; kernel++) {
+        printf("%-12s", kernel_names[kernel]);
+        for (int s = 0; s < num_sets; s++) {
+            printf(" %10.1f", time_kernel(sets[s], kernel));
+        }
+        printf(" %10.1f\n", time_kernel(NULL, kernel));
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Times the ADPCM decode of notes that play a sample from its start and loop back, with the sample
+// cache off and on. The first pass with the cache on fills it and isn't timed.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "src/pc/mixer.c"
+
+#define SAMPLE_FRAMES 400
+#define NOTES 20
+#define CALLS_PER_NOTE 200
+#define PASSES 50
+
+static uint8_t sample[SAMPLE_FRAMES * 9];
+static int16_t book[128];
+static ADPCM_STATE loop_state;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void play_notes(void) {
+    srand(5);
+    for (int n = 0; n < NOTES; n++) {
+        ADPCM_STATE state = { 0 };
+        uint32_t frame = 0;
+        uint8_t flags = A_INIT;
+        uint32_t loop_frame = 50 + n % 3;
+
+        for (int call = 0; call < CALLS_PER_NOTE; call++) {
+            uint32_t num_frames = 1 + rand() % 12;
+            if (frame + num_frames >= SAMPLE_FRAMES) {
+                frame = loop_frame;
+                flags = A_LOOP;
+                aSetLoopImpl(&loop_state);
+            }
+            aLoadADPCMImpl(16 * 16, book);
+            aSetBufferImpl(0, 0, 0x180, (num_frames * 16 - rand() % 16) * 2);
+            aADPCMdecCachedImpl(flags, state, sample + frame * 9, sample, frame);
+            frame += num_frames;
+            flags = 0;
+        }
+    }
+}
+
+int main(void) {
+    srand(1);
+    for (size_t i = 0; i < sizeof(sample); i++) {
+        sample[i] = rand();
+    }
+    for (int i = 0; i < SAMPLE_FRAMES; i++) {
+        sample[i * 9] = (sample[i * 9] % 13) << 4 | (sample[i * 9] & 1);
+    }
+    for (int i = 0; i < 128; i++) {
+        book[i] = rand() % 4096 - 2048;
+    }
+    for (int i = 0; i < 16; i++) {
+        loop_state[i] = rand();
+    }
+
+    printf("ns per aADPCMdecSample call, %s kernels:\n", get_kernels()->name);
+    for (int cache = 0; cache < 2; cache++) {
+        mixer_set_sample_cache_size(cache ? 1 << 20 : 0);
+        play_notes();
+        double t0 = now_ns();
+        for (int i = 0; i < PASSES; i++) {
+            play_notes();
+        }
+        printf("%-10s %8.1f\n", cache ? "cache on" : "cache off", (now_ns() - t0) / (PASSES * NOTES * CALLS_PER_NOTE));
+    }
+    return 0;
+}
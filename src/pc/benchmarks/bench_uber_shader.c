@@ -0,0 +1,245 @@
+// Runs a synthetic frame of objects that alternate between color combiners through the Fast3D
+// interpreter, with and without the uber shader and deferred draws. The rendering API only counts
+// what it is given, so this measures the interpreter's CPU time and the draw calls, shader binds
+// and vertex data a GPU backend would receive, not the GPU's own cost.
+
+#include <PR/mbi.h>
+#include "macros.h"
+#include "src/pc/gfx/gfx_pc.c"
+
+#define NUM_OBJECTS 512
+#define VERTICES_PER_OBJECT 16
+#define FRAMES 500
+
+struct ShaderProgram {
+    uint32_t shader_id;
+    uint8_t num_inputs;
+    bool used_textures[2];
+};
+
+static struct ShaderProgram programs[64];
+static size_t num_programs;
+
+static struct {
+    uint32_t shader_binds;
+    uint64_t vertex_floats;
+} counters;
+
+static void bench_wm_init(UNUSED const char *game_name, UNUSED bool start_in_fullscreen) {
+}
+
+static void bench_wm_get_dimensions(uint32_t *width, uint32_t *height) {
+    *width = 640;
+    *height = 480;
+}
+
+static void bench_wm_nop(void) {
+}
+
+static bool bench_wm_start_frame(void) {
+    return true;
+}
+
+static struct GfxWindowManagerAPI bench_wapi = {
+    .init = bench_wm_init,
+    .get_dimensions = bench_wm_get_dimensions,
+    .handle_events = bench_wm_nop,
+    .start_frame = bench_wm_start_frame,
+    .swap_buffers_begin = bench_wm_nop,
+    .swap_buffers_end = bench_wm_nop,
+};
+
+static bool bench_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void bench_unload_shader(UNUSED struct ShaderProgram *old_prg) {
+}
+
+static void bench_load_shader(UNUSED struct ShaderProgram *new_prg) {
+    counters.shader_binds++;
+}
+
+static struct ShaderProgram *bench_lookup_shader(uint32_t shader_id) {
+    for (size_t i = 0; i < num_programs; i++) {
+        if (programs[i].shader_id == shader_id) {
+            return &programs[i];
+        }
+    }
+    return NULL;
+}
+
+static struct ShaderProgram *bench_create_and_load_new_shader(uint32_t shader_id) {
+    struct CCFeatures cc_features;
+    struct ShaderProgram *prg = &programs[num_programs++];
+    gfx_cc_get_features(shader_id, &cc_features);
+    prg->shader_id = shader_id;
+    prg->num_inputs = cc_features.num_inputs;
+    prg->used_textures[0] = cc_features.used_textures[0];
+    prg->used_textures[1] = cc_features.used_textures[1];
+    counters.shader_binds++;
+    return prg;
+}
+
+static struct ShaderProgram *bench_create_uber_shader(void) {
+    return bench_create_and_load_new_shader(SHADER_UBER);
+}
+
+static void bench_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->num_inputs;
+    used_textures[0] = prg->used_textures[0];
+    used_textures[1] = prg->used_textures[1];
+}
+
+static uint32_t bench_new_texture(void) {
+    return 0;
+}
+
+static void bench_draw_triangles(UNUSED float buf_vbo[], size_t buf_vbo_len, UNUSED size_t buf_vbo_num_tris) {
+    counters.vertex_floats += buf_vbo_len;
+}
+
+static void bench_rapi_nop(void) {
+}
+
+static void bench_select_texture(UNUSED int tile, UNUSED uint32_t texture_id) {
+}
+
+static void bench_set_bool(UNUSED bool value) {
+}
+
+static void bench_set_rect(UNUSED int x, UNUSED int y, UNUSED int width, UNUSED int height) {
+}
+
+static void bench_set_texture_size(UNUSED uint32_t width, UNUSED uint32_t height) {
+}
+
+static void bench_set_fog_color(UNUSED uint8_t r, UNUSED uint8_t g, UNUSED uint8_t b) {
+}
+
+static struct GfxRenderingAPI bench_rapi = {
+    .z_is_from_0_to_1 = bench_z_is_from_0_to_1,
+    .unload_shader = bench_unload_shader,
+    .load_shader = bench_load_shader,
+    .create_and_load_new_shader = bench_create_and_load_new_shader,
+    .lookup_shader = bench_lookup_shader,
+    .shader_get_info = bench_shader_get_info,
+    .new_texture = bench_new_texture,
+    .select_texture = bench_select_texture,
+    .set_depth_test = bench_set_bool,
+    .set_depth_mask = bench_set_bool,
+    .set_zmode_decal = bench_set_bool,
+    .set_viewport = bench_set_rect,
+    .set_scissor = bench_set_rect,
+    .set_use_alpha = bench_set_bool,
+    .draw_triangles = bench_draw_triangles,
+    .init = bench_rapi_nop,
+    .on_resize = bench_rapi_nop,
+    .start_frame = bench_rapi_nop,
+    .end_frame = bench_rapi_nop,
+    .finish_render = bench_rapi_nop,
+    .set_texture_size = bench_set_texture_size,
+    .set_fog_color = bench_set_fog_color,
+    .create_uber_shader = bench_create_uber_shader,
+};
+
+static Gfx display_list[NUM_OBJECTS * 8 + 16];
+static Vtx vertices[NUM_OBJECTS][VERTICES_PER_OBJECT];
+static Mtx identity;
+static Vp viewport = { { { 640, 480, 511, 0 }, { 640, 480, 511, 0 } } };
+
+// Objects cycle through combiners that only read shade, primitive and environment colors,
+// so that no textures are needed
+static void build_display_list(void) {
+    Gfx *gfx = display_list;
+
+    for (int i = 0; i < 4; i++) {
+        identity.m[i][i] = 1.0f;
+    }
+    srand(1);
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        float x = (rand() % 1800 - 900) / 1000.0f;
+        float y = (rand() % 1800 - 900) / 1000.0f;
+        float z = (rand() % 1800 - 900) / 1000.0f;
+        for (int j = 0; j < VERTICES_PER_OBJECT; j++) {
+            Vtx_t *v = &vertices[i][j].v;
+            v->ob[0] = x + (j % 4) * 0.02f;
+            v->ob[1] = y + (j / 4) * 0.02f;
+            v->ob[2] = z;
+            v->cn[0] = rand();
+            v->cn[1] = rand();
+            v->cn[2] = rand();
+            v->cn[3] = 255;
+        }
+    }
+
+    gSPViewport(gfx++, &viewport);
+    gSPMatrix(gfx++, &identity, G_MTX_PROJECTION | G_MTX_LOAD | G_MTX_NOPUSH);
+    gSPMatrix(gfx++, &identity, G_MTX_MODELVIEW | G_MTX_LOAD | G_MTX_NOPUSH);
+    gSPClearGeometryMode(gfx++, G_LIGHTING | G_FOG | G_CULL_BOTH);
+    gSPSetGeometryMode(gfx++, G_ZBUFFER | G_SHADE | G_SHADING_SMOOTH);
+    gDPSetRenderMode(gfx++, G_RM_AA_ZB_OPA_SURF, G_RM_AA_ZB_OPA_SURF2);
+    gDPSetEnvColor(gfx++, 40, 80, 120, 255);
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        switch (i % 4) {
+            case 0:
+                gDPSetCombineMode(gfx++, G_CC_SHADE, G_CC_SHADE);
+                break;
+            case 1:
+                gDPSetCombineMode(gfx++, G_CC_PRIMITIVE, G_CC_PRIMITIVE);
+                break;
+            case 2:
+                gDPSetCombineMode(gfx++, G_CC_SHADEFADEA, G_CC_SHADEFADEA);
+                break;
+            case 3:
+                gDPSetCombineMode(gfx++, G_CC_FADE, G_CC_FADE);
+                break;
+        }
+        gDPSetPrimColor(gfx++, 0, 0, i, 255 - i, 128, 255);
+        gSPVertex(gfx++, vertices[i], VERTICES_PER_OBJECT, 0);
+        gSP2Triangles(gfx++, 0, 1, 5, 0, 0, 5, 4, 0);
+        gSP2Triangles(gfx++, 2, 3, 7, 0, 2, 7, 6, 0);
+        gSP2Triangles(gfx++, 8, 9, 13, 0, 8, 13, 12, 0);
+        gSP2Triangles(gfx++, 10, 11, 15, 0, 10, 15, 14, 0);
+    }
+    gSPEndDisplayList(gfx++);
+}
+
+static void run_mode(const char *name, bool uber, bool deferred_draws) {
+    struct GfxDrawStats stats;
+
+    gfx_set_uber_shader(uber);
+    gfx_set_deferred_draws(deferred_draws);
+    // Warm up, so that shader creation isn't counted
+    gfx_start_frame();
+    gfx_run(display_list);
+    gfx_end_frame();
+
+    memset(&counters, 0, sizeof(counters));
+    unsigned long t0 = get_time();
+    for (int i = 0; i < FRAMES; i++) {
+        gfx_start_frame();
+        gfx_run(display_list);
+        gfx_end_frame();
+    }
+    unsigned long t1 = get_time();
+    gfx_start_frame();
+    gfx_get_draw_stats(&stats);
+
+    printf("%-16s %10.1f %10u %10u %10u %12llu\n", name, (double)(t1 - t0) / FRAMES,
+           stats.draw_calls, counters.shader_binds / FRAMES, stats.flushes[GFX_FLUSH_SHADER],
+           (unsigned long long)(counters.vertex_floats * 4 / FRAMES));
+}
+
+int main(void) {
+    gfx_init(&bench_wapi, &bench_rapi, "bench_uber_shader", false);
+    build_display_list();
+
+    printf("%d objects of %d triangles, alternating between 4 combiners, per frame:\n", NUM_OBJECTS, 8);
+    printf("%-16s %10s %10s %10s %10s %12s\n", "mode", "cpu us", "draws", "binds", "shader fl", "vertex bytes");
+    run_mode("per combiner", false, false);
+    run_mode("uber", true, false);
+    run_mode("deferred", false, true);
+    run_mode("deferred + uber", true, true);
+    return 0;
+}
@@ -44,6 +44,35 @@ unsigned int configKeyStickUp    = 0x11;
 unsigned int configKeyStickDown  = 0x1F;
 unsigned int configKeyStickLeft  = 0x1E;
 unsigned int configKeyStickRight = 0x20;
+// Texture cache
+unsigned int configTextureCacheMB  = 64;
+bool configTextureCacheContentHash = false;
+bool configTextureDiskCache        = false;
+// Renderer
+bool configDeferredDraws = false;
+bool configPipelinedRendering = false;
+bool configRetainedDisplayLists = false;
+bool configGpuVertexShading = false;
+bool configUberShader = false;
+bool configTextureLayers = false;
+unsigned int configDofQuality = 2;
+unsigned int configRenderScaleMin = 100; // percent of the window size
+unsigned int configRenderScaleMax = 100;
+unsigned int configGpuFrameBudgetUs = 14000;
+// Software renderer
+unsigned int configSoftrastThreads      = 0;
+unsigned int configSoftrastDumpInterval = 0;
+bool configSoftrastDumpPng              = false;
+unsigned int configSoftrastMaxFrames    = 0;
+// Audio
+bool configAudioThread = false;
+unsigned int configSampleCacheKb = 0;
+// Renderer statistics
+bool configRendererStatsOverlay = false;
+bool configRendererStatsDump    = false;
+// Display list capture
+unsigned int configDlCaptureStart  = 0; // frames to run before recording
+unsigned int configDlCaptureFrames = 0;
 
 
 static const struct ConfigOption options[] = {
@@ -61,6 +90,29 @@ static const struct ConfigOption options[] = {
     {.name = "key_stickdown",  .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickDown},
     {.name = "key_stickleft",  .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickLeft},
     {.name = "key_stickright", .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickRight},
+    {.name = "texture_cache_mb",           .type = CONFIG_TYPE_UINT, .uintValue = &configTextureCacheMB},
+    {.name = "texture_cache_content_hash", .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureCacheContentHash},
+    {.name = "texture_disk_cache",         .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureDiskCache},
+    {.name = "deferred_draws",             .type = CONFIG_TYPE_BOOL, .boolValue = &configDeferredDraws},
+    {.name = "pipelined_rendering",        .type = CONFIG_TYPE_BOOL, .boolValue = &configPipelinedRendering},
+    {.name = "retained_display_lists",     .type = CONFIG_TYPE_BOOL, .boolValue = &configRetainedDisplayLists},
+    {.name = "gpu_vertex_shading",         .type = CONFIG_TYPE_BOOL, .boolValue = &configGpuVertexShading},
+    {.name = "uber_shader",                .type = CONFIG_TYPE_BOOL, .boolValue = &configUberShader},
+    {.name = "texture_layers",             .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureLayers},
+    {.name = "dof_quality",                .type = CONFIG_TYPE_UINT, .uintValue = &configDofQuality},
+    {.name = "render_scale_min",           .type = CONFIG_TYPE_UINT, .uintValue = &configRenderScaleMin},
+    {.name = "render_scale_max",           .type = CONFIG_TYPE_UINT, .uintValue = &configRenderScaleMax},
+    {.name = "gpu_frame_budget_us",        .type = CONFIG_TYPE_UINT, .uintValue = &configGpuFrameBudgetUs},
+    {.name = "softrast_threads",           .type = CONFIG_TYPE_UINT, .uintValue = &configSoftrastThreads},
+    {.name = "softrast_dump_interval",     .type = CONFIG_TYPE_UINT, .uintValue = &configSoftrastDumpInterval},
+    {.name = "softrast_dump_png",          .type = CONFIG_TYPE_BOOL, .boolValue = &configSoftrastDumpPng},
+    {.name = "softrast_max_frames",        .type = CONFIG_TYPE_UINT, .uintValue = &configSoftrastMaxFrames},
+    {.name = "audio_thread",               .type = CONFIG_TYPE_BOOL, .boolValue = &configAudioThread},
+    {.name = "sample_cache_kb",            .type = CONFIG_TYPE_UINT, .uintValue = &configSampleCacheKb},
+    {.name = "renderer_stats_overlay",     .type = CONFIG_TYPE_BOOL, .boolValue = &configRendererStatsOverlay},
+    {.name = "renderer_stats_dump",        .type = CONFIG_TYPE_BOOL, .boolValue = &configRendererStatsDump},
+    {.name = "dl_capture_start",           .type = CONFIG_TYPE_UINT, .uintValue = &configDlCaptureStart},
+    {.name = "dl_capture_frames",          .type = CONFIG_TYPE_UINT, .uintValue = &configDlCaptureFrames},
 };
 
 // Reads an entire line from a file (excluding the newline character) and returns an allocated string
@@ -15,6 +15,29 @@ extern unsigned int configKeyStickUp;
 extern unsigned int configKeyStickDown;
 extern unsigned int configKeyStickLeft;
 extern unsigned int configKeyStickRight;
+extern unsigned int configTextureCacheMB;
+extern bool         configTextureCacheContentHash;
+extern bool         configTextureDiskCache;
+extern bool         configDeferredDraws;
+extern bool         configPipelinedRendering;
+extern bool         configRetainedDisplayLists;
+extern bool         configGpuVertexShading;
+extern bool         configUberShader;
+extern bool         configTextureLayers;
+extern unsigned int configDofQuality;
+extern unsigned int configRenderScaleMin;
+extern unsigned int configRenderScaleMax;
+extern unsigned int configGpuFrameBudgetUs;
+extern unsigned int configSoftrastThreads;
+extern unsigned int configSoftrastDumpInterval;
+extern bool         configSoftrastDumpPng;
+extern unsigned int configSoftrastMaxFrames;
+extern bool         configAudioThread;
+extern unsigned int configSampleCacheKb;
+extern bool         configRendererStatsOverlay;
+extern bool         configRendererStatsDump;
+extern unsigned int configDlCaptureStart;
+extern unsigned int configDlCaptureFrames;
 
 void configfile_load(const char *filename);
 void configfile_save(const char *filename);
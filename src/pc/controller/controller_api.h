@@ -8,4 +8,7 @@ struct ControllerAPI {
     void (*read)(OSContPad *pad);
 };
 
+// Reads the controllers on the calling thread for the game's next osContGetReadData
+void controller_poll(void);
+
 #endif
@@ -41,7 +41,13 @@ s32 osContStartReadData(UNUSED OSMesgQueue *mesg) {
     return 0;
 }
 
-void osContGetReadData(OSContPad *pad) {
+// With pipelined rendering the game runs on its own thread, but SDL may only be used from the main
+// thread. The main thread then reads the controllers once per frame with controller_poll, and the
+// game gets the pad it polled.
+static bool use_polled_pad;
+static OSContPad polled_pad;
+
+static void read_controllers(OSContPad *pad) {
     pad->button = 0;
     pad->stick_x = 0;
     pad->stick_y = 0;
@@ -51,3 +57,16 @@ void osContGetReadData(OSContPad *pad) {
         controller_implementations[i]->read(pad);
     }
 }
+
+void controller_poll(void) {
+    read_controllers(&polled_pad);
+    use_polled_pad = true;
+}
+
+void osContGetReadData(OSContPad *pad) {
+    if (use_polled_pad) {
+        *pad = polled_pad;
+        return;
+    }
+    read_controllers(pad);
+}
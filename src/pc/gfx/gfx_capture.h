@@ -0,0 +1,41 @@
+#ifndef GFX_CAPTURE_H
+#define GFX_CAPTURE_H
+
+#include <stdint.h>
+
+// Display list capture file, written by gfx_capture_open and read by gfx_replay.
+// All fields are in host byte order.
+//
+// Layout: the header, data_size bytes of copied memory (vertices, matrices, lights,
+// textures and palettes), then num_frames frames. A frame is a GfxCaptureFrame followed
+// by its commands and then by a GfxCaptureRelocation for each command whose w1 is an offset into the data.
+// The commands of a frame are flattened: G_DL calls are inlined, branches are followed
+// and only the final G_ENDDL is kept.
+
+#define GFX_CAPTURE_MAGIC "SM64DL"
+#define GFX_CAPTURE_FORMAT_VERSION 2
+
+struct GfxCaptureHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t num_frames;
+    uint64_t data_size;
+};
+
+struct GfxCaptureFrame {
+    uint32_t num_commands;
+    uint32_t num_relocations;
+};
+
+struct GfxCaptureCommand {
+    uint32_t w0, w1;
+};
+
+// The size is what the command reads from its offset, or for texture images, what is left of the
+// copied image. gfx_replay checks it against data_size.
+struct GfxCaptureRelocation {
+    uint32_t command;
+    uint32_t size;
+};
+
+#endif
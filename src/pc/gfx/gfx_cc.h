@@ -30,6 +30,9 @@ enum {
 #define SHADER_OPT_FOG (1 << 25)
 #define SHADER_OPT_TEXTURE_EDGE (1 << 26)
 #define SHADER_OPT_NOISE (1 << 27)
+#define SHADER_OPT_LIGHTING (1 << 28) // shade color and texgen computed from a normal attribute
+#define SHADER_OPT_VERTEX_FOG (1 << 29) // fog factor computed from the position
+#define SHADER_UBER (1 << 30) // one program for every combiner, which is given per vertex
 
 struct CCFeatures {
     uint8_t c[2][4];
@@ -37,6 +40,8 @@ struct CCFeatures {
     bool opt_fog;
     bool opt_texture_edge;
     bool opt_noise;
+    bool opt_lighting;
+    bool opt_vertex_fog;
     bool used_textures[2];
     int num_inputs;
     bool do_single[2];
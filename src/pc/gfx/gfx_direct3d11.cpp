@@ -725,7 +725,18 @@ struct GfxRenderingAPI gfx_direct3d11_api = {
     gfx_d3d11_on_resize,
     gfx_d3d11_start_frame,
     gfx_d3d11_end_frame,
-    gfx_d3d11_finish_render
+    gfx_d3d11_finish_render,
+    nullptr, // map_vertex_buffer
+    nullptr, // set_texture_size
+    nullptr, // set_fog_color
+    nullptr, // upload_retained_vertices
+    nullptr, // delete_retained_vertices
+    nullptr, // draw_retained_triangles
+    nullptr, // set_vertex_uniforms
+    nullptr, // create_uber_shader
+    nullptr, // enable_texture_layers
+    nullptr, // upload_texture_layer
+    nullptr // release_texture
 };
 
 #endif
@@ -960,7 +960,18 @@ struct GfxRenderingAPI gfx_direct3d12_api = {
     gfx_direct3d12_on_resize,
     gfx_direct3d12_start_frame,
     gfx_direct3d12_end_frame,
-    gfx_direct3d12_finish_render
+    gfx_direct3d12_finish_render,
+    nullptr, // map_vertex_buffer
+    nullptr, // set_texture_size
+    nullptr, // set_fog_color
+    nullptr, // upload_retained_vertices
+    nullptr, // delete_retained_vertices
+    nullptr, // draw_retained_triangles
+    nullptr, // set_vertex_uniforms
+    nullptr, // create_uber_shader
+    nullptr, // enable_texture_layers
+    nullptr, // upload_texture_layer
+    nullptr // release_texture
 };
 
 #endif
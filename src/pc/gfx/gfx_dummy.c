@@ -187,6 +187,17 @@ struct GfxRenderingAPI gfx_dummy_renderer_api = {
     gfx_dummy_renderer_on_resize,
     gfx_dummy_renderer_start_frame,
     gfx_dummy_renderer_end_frame,
-    gfx_dummy_renderer_finish_render
+    gfx_dummy_renderer_finish_render,
+    NULL, // map_vertex_buffer
+    NULL, // set_texture_size
+    NULL, // set_fog_color
+    NULL, // upload_retained_vertices
+    NULL, // delete_retained_vertices
+    NULL, // draw_retained_triangles
+    NULL, // set_vertex_uniforms
+    NULL, // create_uber_shader
+    NULL, // enable_texture_layers
+    NULL, // upload_texture_layer
+    NULL // release_texture
 };
 #endif
@@ -1,6 +1,9 @@
 #ifdef ENABLE_OPENGL
 
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -28,27 +31,200 @@
 
 #include "gfx_cc.h"
 #include "gfx_rendering_api.h"
+#include "gfx_pc.h"
 
 struct ShaderProgram {
     uint32_t shader_id;
     GLuint opengl_program_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
-    GLint attrib_locations[7];
-    uint8_t attrib_sizes[7];
+    uint8_t num_floats; // vertex stride in 32-bit words
+    GLint attrib_locations[12];
+    uint8_t attrib_sizes[12];
+    GLenum attrib_types[12];
+    uint8_t attrib_offsets[12];
     uint8_t num_attribs;
     bool used_noise;
     GLint frame_count_location;
     GLint window_height_location;
+    GLint tex_size_location;
+    GLint fog_color_location;
+    GLint mvp_location;
+    GLint vertex_shading_location;
+    GLint layer_size_location;
+    bool mvp_dirty; // uMVP holds a retained draw's matrix instead of the identity
 };
 
-static struct ShaderProgram shader_program_pool[64];
-static uint8_t shader_program_pool_size;
+// Programs are allocated one by one, since gfx_pc keeps pointers to them
+static struct ShaderProgram **shader_program_pool;
+static uint32_t shader_program_pool_size, shader_program_pool_capacity;
 static GLuint opengl_vbo;
 
 static uint32_t frame_count;
 static uint32_t current_height;
+static GLfloat tex_size[2] = { 1.0f, 1.0f };
+static GLfloat fog_color[3];
+static struct GfxVertexUniforms vertex_uniforms;
+static const GLfloat identity_matrix[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+
+#ifndef GL_TEXTURE_2D_ARRAY_EXT
+#define GL_TEXTURE_2D_ARRAY_EXT 0x8C1A
+#endif
+
+// Bytes per texture array, which holds up to 256 textures of the same size
+#define TEXTURE_ARRAY_BYTES (2 * 1024 * 1024)
+// Texture unit that layers are uploaded through, so the tiles' bindings are left alone
+#define TEXTURE_LAYER_UPLOAD_UNIT 2
+
+struct TextureArray {
+    GLuint id;
+    uint16_t width, height;
+    uint16_t capacity;
+    uint16_t num_used; // layers below this have been handed out
+    uint16_t num_free;
+    uint8_t free_layers[256];
+    bool released; // every layer was evicted, so the storage was shrunk to a single texel
+};
+
+struct TexturePlacement {
+    uint16_t array; // index + 1, 0 if not placed
+    uint8_t layer;
+};
+
+// Texture layers: every texture is a layer of an array shared with the textures of its size.
+// Wrapping and filtering are done in the shader from the state each vertex carries, the arrays
+// themselves are sampled linearly with GL_REPEAT.
+static struct {
+    bool enabled;
+    void (*TexImage3D)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void *data);
+    void (*TexSubImage3D)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const void *data);
+    struct TextureArray *arrays;
+    uint32_t num_arrays, arrays_capacity;
+    struct TexturePlacement *placements; // indexed by texture id
+    uint32_t num_placements;
+    GLfloat layer_size[4]; // size of the arrays bound to tiles 0 and 1
+} texture_layers;
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef APIENTRY
+#define APIENTRY GL_APIENTRY
+#endif
+
+#define SHADER_BINARY_CACHE_FILE "sm64shaders.bin"
+#define SHADER_BINARY_CACHE_MAGIC 0x53363442 // "S64B"
+
+// Linked programs from earlier runs, loaded from SHADER_BINARY_CACHE_FILE, which holds the latest
+// binary of each shader id. Only used when the driver supports program binaries (GL 4.1 or
+// ARB_get_program_binary).
+static struct {
+    void (APIENTRY *GetProgramBinary)(GLuint program, GLsizei buf_size, GLsizei *length, GLenum *binary_format, void *binary);
+    void (APIENTRY *ProgramBinary)(GLuint program, GLenum binary_format, const void *binary, GLsizei length);
+    void (APIENTRY *ProgramParameteri)(GLuint program, GLenum pname, GLint value);
+    FILE *file;
+    uint32_t driver_hash;
+    struct ShaderBinary {
+        uint32_t shader_id;
+        uint32_t source_hash;
+        GLenum format;
+        GLsizei length;
+        uint8_t *data;
+    } *binaries;
+    uint32_t num_binaries, binaries_capacity;
+} shader_binary_cache;
+
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_RANGE_BIT
+#define GL_MAP_INVALIDATE_RANGE_BIT 0x0004
+#endif
+#ifndef GL_MAP_FLUSH_EXPLICIT_BIT
+#define GL_MAP_FLUSH_EXPLICIT_BIT 0x0010
+#endif
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+
+#define VERTEX_RING_SIZE (16 * 1024 * 1024)
+#define VERTEX_RING_SEGMENTS 4
+#define VERTEX_RING_SEGMENT_SIZE (VERTEX_RING_SIZE / VERTEX_RING_SEGMENTS)
+
+// Streaming vertex buffer. The interpreter writes triangles straight into mapped memory and
+// draws advance through the buffer. Each segment gets a fence when writing moves past it,
+// which is waited on before the segment is written to again.
+static struct {
+    void *(APIENTRY *MapBufferRange)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+    void (APIENTRY *FlushMappedBufferRange)(GLenum target, GLintptr offset, GLsizeiptr length);
+    GLboolean (APIENTRY *UnmapBuffer)(GLenum target);
+    void (APIENTRY *BufferStorage)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+    void *(APIENTRY *FenceSync)(GLenum condition, GLbitfield flags);
+    GLenum (APIENTRY *ClientWaitSync)(void *sync, GLbitfield flags, uint64_t timeout);
+    void (APIENTRY *DeleteSync)(void *sync);
+    bool enabled;
+    bool persistent;
+    GLuint vbo;
+    uint8_t *persistent_ptr;
+    size_t pos;
+    void *fences[VERTEX_RING_SEGMENTS];
+    float *mapped; // region handed out by map_vertex_buffer, NULL if none
+} vertex_ring;
+
+#define RENDER_SCALE_QUERIES 4
+
+// The scene can be drawn to part of the offscreen framebuffer and upscaled by the post passes.
+// With a range of scales, the scale follows the GPU time of the frame, measured with timer queries.
+static struct {
+    void (APIENTRY *GenQueries)(GLsizei n, GLuint *ids);
+    void (APIENTRY *BeginQuery)(GLenum target, GLuint id);
+    void (APIENTRY *EndQuery)(GLenum target);
+    void (APIENTRY *GetQueryObjectiv)(GLuint id, GLenum pname, GLint *params);
+    void (APIENTRY *GetQueryObjectui64v)(GLuint id, GLenum pname, uint64_t *params);
+    bool enabled;     // drawing at a scale other than 1, or possibly so
+    bool dynamic;
+    bool has_queries;
+    float min, max;
+    float scale;
+    float budget_us;
+    float average_us;
+    uint32_t frames_since_change;
+    GLuint queries[RENDER_SCALE_QUERIES];
+    bool pending[RENDER_SCALE_QUERIES];
+    uint32_t query_index;
+    int32_t width, height; // size of the scene in the framebuffer
+    GLint viewport[4], scissor[4]; // as given by the interpreter, in window pixels
+} render_scale = { .scale = 1.0f, .min = 1.0f, .max = 1.0f };
 
 struct System {
     struct Display {
@@ -56,20 +232,23 @@ struct System {
         int32_t height;
     } display;
     struct FBO {
-        struct shader {
-            GLuint program;
-            GLuint vertex;
-            GLuint fragment;
-            struct uniforms {
-                GLuint POST_POS     ;
-                GLuint POST_TEXCOORD;
-                GLuint POST_TEXTURE ;
-                GLuint POST_DEPTH   ;
-            } uniform;
-        } shader;
+        uint32_t quality; // depth of field preset, 0 to draw straight to the window
+        bool created;
         GLuint framebuffer;
         GLuint color_texture;
         GLuint depth_texture;
+        GLuint blur_framebuffers[2];
+        GLuint blur_textures[2];
+        int32_t blur_width, blur_height;
+        GLuint coc_program;
+        GLint coc_color_location, coc_depth_location, coc_focus_location, coc_scale_location;
+        GLuint blur_programs[4];
+        GLint blur_source_locations[4], blur_step_locations[4];
+        GLint coc_scene_scale_location;
+        GLuint composite_program;
+        GLint composite_color_location, composite_blurred_location, composite_scene_scale_location;
+        GLuint copy_program;
+        GLint copy_color_location, copy_scene_scale_location;
     } post;
     GLuint main_program;
     struct ShaderProgram *curShader;
@@ -79,22 +258,42 @@ static bool gfx_opengl_z_is_from_0_to_1(void) {
     return false;
 }
 
-static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg) {
+static void gfx_opengl_vertex_array_set_attribs_at(struct ShaderProgram *prg, size_t base_offset) {
     size_t num_floats = prg->num_floats;
-    size_t pos = 0;
 
     for (int i = 0; i < prg->num_attribs; i++) {
+        // Colors are unsigned bytes scaled to 0..1, texture coordinates are S10.5 integers
+        GLboolean normalized = prg->attrib_types[i] == GL_UNSIGNED_BYTE;
         glEnableVertexAttribArray(prg->attrib_locations[i]);
-        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], GL_FLOAT, GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
-        pos += prg->attrib_sizes[i];
+        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], prg->attrib_types[i], normalized, num_floats * sizeof(float), (void *) (base_offset + prg->attrib_offsets[i]));
     }
 }
 
+static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg) {
+    gfx_opengl_vertex_array_set_attribs_at(prg, 0);
+}
+
 static void gfx_opengl_set_uniforms(struct ShaderProgram *prg) {
     if (prg->used_noise) {
         glUniform1i(prg->frame_count_location, frame_count);
         glUniform1i(prg->window_height_location, current_height);
     }
+    if (prg->tex_size_location != -1) {
+        glUniform2fv(prg->tex_size_location, 1, tex_size);
+    }
+    if (prg->fog_color_location != -1) {
+        glUniform3fv(prg->fog_color_location, 1, fog_color);
+    }
+    if (prg->mvp_dirty) {
+        glUniformMatrix4fv(prg->mvp_location, 1, GL_FALSE, identity_matrix);
+        prg->mvp_dirty = false;
+    }
+    if (prg->vertex_shading_location != -1) {
+        glUniform4fv(prg->vertex_shading_location, sizeof(vertex_uniforms) / (4 * sizeof(float)), (const GLfloat *)&vertex_uniforms);
+    }
+    if (prg->layer_size_location != -1) {
+        glUniform4fv(prg->layer_size_location, 1, texture_layers.layer_size);
+    }
 }
 
 static void gfx_opengl_load_shader_arrays(struct ShaderProgram *new_prg) {
@@ -200,51 +399,345 @@ static void append_formula(char *buf, size_t *len, uint8_t c[2][4], bool do_sing
     }
 }
 
+static struct ShaderProgram *shader_program_pool_add(void) {
+    if (shader_program_pool_size == shader_program_pool_capacity) {
+        uint32_t capacity = shader_program_pool_capacity == 0 ? 64 : shader_program_pool_capacity * 2;
+        struct ShaderProgram **pool = realloc(shader_program_pool, capacity * sizeof(struct ShaderProgram *));
+        if (pool == NULL) {
+            fprintf(stderr, "Out of memory for shader programs\n");
+            abort();
+        }
+        shader_program_pool = pool;
+        shader_program_pool_capacity = capacity;
+    }
+    struct ShaderProgram *prg = calloc(1, sizeof(struct ShaderProgram));
+    if (prg == NULL) {
+        fprintf(stderr, "Out of memory for shader programs\n");
+        abort();
+    }
+    return shader_program_pool[shader_program_pool_size++] = prg;
+}
+
+static GLuint compile_and_link_program(const char *vs_buf, size_t vs_len, const char *fs_buf, size_t fs_len) {
+    const GLchar *sources[2] = { vs_buf, fs_buf };
+    const GLint lengths[2] = { vs_len, fs_len };
+    GLint success;
+
+    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &sources[0], &lengths[0]);
+    glCompileShader(vertex_shader);
+    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        GLint max_length = 0;
+        glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &max_length);
+        char error_log[1024];
+        fprintf(stderr, "Vertex shader compilation failed\n");
+        glGetShaderInfoLog(vertex_shader, max_length, &max_length, &error_log[0]);
+        fprintf(stderr, "%s\n", &error_log[0]);
+        abort();
+    }
+
+    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &sources[1], &lengths[1]);
+    glCompileShader(fragment_shader);
+    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        GLint max_length = 0;
+        glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &max_length);
+        char error_log[1024];
+        fprintf(stderr, "Fragment shader compilation failed\n");
+        glGetShaderInfoLog(fragment_shader, max_length, &max_length, &error_log[0]);
+        fprintf(stderr, "%s\n", &error_log[0]);
+        abort();
+    }
+
+    GLuint shader_program = glCreateProgram();
+    glAttachShader(shader_program, vertex_shader);
+    glAttachShader(shader_program, fragment_shader);
+    if (shader_binary_cache.file != NULL) {
+        shader_binary_cache.ProgramParameteri(shader_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(shader_program);
+    return shader_program;
+}
+
+static uint32_t hash_bytes(uint32_t h, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)buf[i]) * 16777619;
+    }
+    return h;
+}
+
+static uint32_t hash_string(uint32_t h, const char *str) {
+    return str != NULL ? hash_bytes(h, str, strlen(str)) : h;
+}
+
+// Adds a binary, returning true if it replaced an older one of the same shader id
+static bool shader_binary_cache_insert(const struct ShaderBinary *b) {
+    for (uint32_t i = 0; i < shader_binary_cache.num_binaries; i++) {
+        struct ShaderBinary *old = &shader_binary_cache.binaries[i];
+        if (old->shader_id == b->shader_id) {
+            free(old->data);
+            *old = *b;
+            return true;
+        }
+    }
+    if (shader_binary_cache.num_binaries == shader_binary_cache.binaries_capacity) {
+        shader_binary_cache.binaries_capacity = shader_binary_cache.binaries_capacity == 0 ? 64 : shader_binary_cache.binaries_capacity * 2;
+        shader_binary_cache.binaries = realloc(shader_binary_cache.binaries, shader_binary_cache.binaries_capacity * sizeof(struct ShaderBinary));
+    }
+    shader_binary_cache.binaries[shader_binary_cache.num_binaries++] = *b;
+    return false;
+}
+
+static void shader_binary_cache_write(const struct ShaderBinary *b) {
+    fwrite(&b->shader_id, sizeof(b->shader_id), 1, shader_binary_cache.file);
+    fwrite(&b->source_hash, sizeof(b->source_hash), 1, shader_binary_cache.file);
+    fwrite(&b->format, sizeof(b->format), 1, shader_binary_cache.file);
+    fwrite(&b->length, sizeof(b->length), 1, shader_binary_cache.file);
+    fwrite(b->data, b->length, 1, shader_binary_cache.file);
+}
+
+// Clears the error flags, so that a check after some calls only sees errors from those calls.
+// There is one flag per error code, so this ends even if the context is lost.
+static void gl_clear_errors(void) {
+    for (int i = 0; i < 16 && glGetError() != GL_NO_ERROR; i++) {
+    }
+}
+
+static void shader_binary_cache_init(void) {
+    GLint num_formats = 0;
+    shader_binary_cache.GetProgramBinary = SDL_GL_GetProcAddress("glGetProgramBinary");
+    shader_binary_cache.ProgramBinary = SDL_GL_GetProcAddress("glProgramBinary");
+    shader_binary_cache.ProgramParameteri = SDL_GL_GetProcAddress("glProgramParameteri");
+    if (shader_binary_cache.GetProgramBinary == NULL || shader_binary_cache.ProgramBinary == NULL || shader_binary_cache.ProgramParameteri == NULL) {
+        return;
+    }
+    gl_clear_errors();
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    if (glGetError() != GL_NO_ERROR || num_formats == 0) {
+        return;
+    }
+    
+    // Binaries are only valid for the driver that produced them
+    uint32_t driver_hash = 2166136261U;
+    driver_hash = hash_string(driver_hash, (const char *)glGetString(GL_VENDOR));
+    driver_hash = hash_string(driver_hash, (const char *)glGetString(GL_RENDERER));
+    driver_hash = hash_string(driver_hash, (const char *)glGetString(GL_VERSION));
+    shader_binary_cache.driver_hash = driver_hash;
+    
+    FILE *file = fopen(SHADER_BINARY_CACHE_FILE, "rb");
+    bool valid = false;
+    bool compact = false;
+    if (file != NULL) {
+        uint32_t header[2];
+        valid = fread(header, sizeof(header), 1, file) == 1 && header[0] == SHADER_BINARY_CACHE_MAGIC && header[1] == driver_hash;
+        struct ShaderBinary b;
+        while (valid &&
+               fread(&b.shader_id, sizeof(b.shader_id), 1, file) == 1 &&
+               fread(&b.source_hash, sizeof(b.source_hash), 1, file) == 1 &&
+               fread(&b.format, sizeof(b.format), 1, file) == 1 &&
+               fread(&b.length, sizeof(b.length), 1, file) == 1 && b.length > 0 && b.length < (1 << 24)) {
+            b.data = malloc(b.length);
+            if (fread(b.data, b.length, 1, file) != 1) {
+                // Truncated record, written by a run that didn't finish
+                free(b.data);
+                compact = true;
+                break;
+            }
+            // Later records are newer, the older ones are dropped when the file is rewritten
+            compact |= shader_binary_cache_insert(&b);
+        }
+        compact |= !feof(file);
+        fclose(file);
+    }
+    
+    if (valid && !compact) {
+        shader_binary_cache.file = fopen(SHADER_BINARY_CACHE_FILE, "ab");
+        return;
+    }
+    
+    // Rewrite the file with one record per shader id, so it doesn't grow with stale binaries
+    shader_binary_cache.file = fopen(SHADER_BINARY_CACHE_FILE, "wb");
+    if (shader_binary_cache.file != NULL) {
+        uint32_t header[2] = { SHADER_BINARY_CACHE_MAGIC, driver_hash };
+        fwrite(header, sizeof(header), 1, shader_binary_cache.file);
+        for (uint32_t i = 0; i < shader_binary_cache.num_binaries; i++) {
+            shader_binary_cache_write(&shader_binary_cache.binaries[i]);
+        }
+        fflush(shader_binary_cache.file);
+    }
+}
+
+static GLuint load_program_binary(uint32_t shader_id, uint32_t source_hash) {
+    for (uint32_t i = 0; i < shader_binary_cache.num_binaries; i++) {
+        struct ShaderBinary *b = &shader_binary_cache.binaries[i];
+        if (b->shader_id == shader_id && b->source_hash == source_hash) {
+            GLuint program = glCreateProgram();
+            GLint success;
+            shader_binary_cache.ProgramBinary(program, b->format, b->data, b->length);
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            free(b->data);
+            b->data = NULL;
+            b->shader_id = 0xffffffff;
+            if (success) {
+                return program;
+            }
+            // Rejected by the driver, fall back to compiling from source
+            glDeleteProgram(program);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void save_program_binary(uint32_t shader_id, uint32_t source_hash, GLuint program) {
+    if (shader_binary_cache.file == NULL) {
+        return;
+    }
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+    uint8_t *data = malloc(length);
+    GLenum format;
+    GLsizei written;
+    shader_binary_cache.GetProgramBinary(program, length, &written, &format, data);
+    if (written > 0) {
+        // A stale record of the same shader id is removed by the next run's compaction
+        struct ShaderBinary b = { shader_id, source_hash, format, written, data };
+        shader_binary_cache_write(&b);
+        fflush(shader_binary_cache.file);
+    }
+    free(data);
+}
+
+// Layered textures wrap and filter in the shader, since each vertex can have a different mode.
+// Mode bits are G_TX_MIRROR and G_TX_CLAMP of S, then of T, then linear filtering.
+static void append_layer_sampling(char *buf, size_t *len) {
+    append_line(buf, len, "uniform vec4 uLayerSize;");
+    append_line(buf, len, "varying vec4 vLayers;");
+    append_line(buf, len, "vec4 sampleLayer(sampler2DArray tex, vec2 uv, vec2 size, float layer, float mode) {");
+    append_line(buf, len, "    vec2 mirror = vec2(mod(mode, 2.0), mod(floor(mode / 4.0), 2.0));");
+    append_line(buf, len, "    vec2 clampEdge = vec2(mod(floor(mode / 2.0), 2.0), mod(floor(mode / 8.0), 2.0));");
+    append_line(buf, len, "    vec2 wrapped = mix(mix(fract(uv), 1.0 - abs(mod(uv, 2.0) - 1.0), mirror), uv, clampEdge);");
+    append_line(buf, len, "    vec2 edge = max(mirror, clampEdge);");
+    append_line(buf, len, "    vec2 texel = wrapped * size;");
+    append_line(buf, len, "    if (mode >= 16.0) texel = mix(texel, clamp(texel, vec2(0.5), size - 0.5), edge);");
+    append_line(buf, len, "    else texel = mix(floor(texel), clamp(floor(texel), vec2(0.0), size - 1.0), edge) + 0.5;");
+    append_line(buf, len, "    return texture2DArray(tex, vec3(texel / size, layer));");
+    append_line(buf, len, "}");
+}
+
+static void append_texture_fetch(char *buf, size_t *len, int tile) {
+    if (texture_layers.enabled) {
+        *len += sprintf(buf + *len, "vec4 texVal%d = sampleLayer(uTex%d, vTexCoord, uLayerSize.%s, vLayers.%s);\n",
+                        tile, tile, tile == 0 ? "xy" : "zw", tile == 0 ? "x, vLayers.y" : "z, vLayers.w");
+    } else {
+        *len += sprintf(buf + *len, "vec4 texVal%d = texture2D(uTex%d, vTexCoord);\n", tile, tile);
+    }
+}
+
 static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shader_id) {
     struct CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
 
-    char vs_buf[1024];
-    char fs_buf[1024];
+    char vs_buf[2048];
+    char fs_buf[4096];
     size_t vs_len = 0;
     size_t fs_len = 0;
     size_t num_floats = 4;
+    bool use_texture = cc_features.used_textures[0] || cc_features.used_textures[1];
 
     // Vertex shader
     append_line(vs_buf, &vs_len, "#version 110");
     append_line(vs_buf, &vs_len, "attribute vec4 aVtxPos;");
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
+    append_line(vs_buf, &vs_len, "uniform mat4 uMVP;");
+    if (use_texture) {
         append_line(vs_buf, &vs_len, "attribute vec2 aTexCoord;");
         append_line(vs_buf, &vs_len, "varying vec2 vTexCoord;");
-        num_floats += 2;
+        num_floats += 1;
+        if (texture_layers.enabled) {
+            append_line(vs_buf, &vs_len, "attribute vec2 aTileSize;");
+            append_line(vs_buf, &vs_len, "attribute vec4 aLayers;");
+            append_line(vs_buf, &vs_len, "varying vec4 vLayers;");
+            num_floats += 2;
+        } else {
+            append_line(vs_buf, &vs_len, "uniform vec2 uTexSize;");
+        }
     }
     if (cc_features.opt_fog) {
         append_line(vs_buf, &vs_len, "attribute vec4 aFog;");
+        append_line(vs_buf, &vs_len, "uniform vec3 uFogColor;");
         append_line(vs_buf, &vs_len, "varying vec4 vFog;");
-        num_floats += 4;
+        if (!cc_features.opt_vertex_fog) {
+            num_floats += 1;
+        }
+    }
+    if (cc_features.opt_lighting) {
+        append_line(vs_buf, &vs_len, "attribute vec4 aNormal;");
+        num_floats += 1;
+    }
+    if (cc_features.opt_lighting || cc_features.opt_vertex_fog) {
+        // Laid out like struct GfxVertexUniforms
+        append_line(vs_buf, &vs_len, "uniform vec4 uVertexShading[10];");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         vs_len += sprintf(vs_buf + vs_len, "attribute vec%d aInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
         vs_len += sprintf(vs_buf + vs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
+        num_floats += 1;
     }
     append_line(vs_buf, &vs_len, "void main() {");
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord;");
+    append_line(vs_buf, &vs_len, "gl_Position = uMVP * aVtxPos;");
+    if (cc_features.opt_lighting) {
+        // Same steps as the CPU, which accumulates the lights in integers
+        append_line(vs_buf, &vs_len, "vec3 shade = uVertexShading[4].rgb;");
+        for (int i = 0; i < 2; i++) {
+            vs_len += sprintf(vs_buf + vs_len, "float intensity%d = dot(aNormal.xyz, uVertexShading[%d].xyz) / 127.0;\n", i, i);
+            vs_len += sprintf(vs_buf + vs_len, "if (intensity%d > 0.0) shade = floor(shade + intensity%d * uVertexShading[%d].rgb);\n", i, i, i + 2);
+        }
+        append_line(vs_buf, &vs_len, "shade = min(shade, 255.0) / 255.0;");
     }
-    if (cc_features.opt_fog) {
-        append_line(vs_buf, &vs_len, "vFog = aFog;");
+    if (use_texture) {
+        append_line(vs_buf, &vs_len, "vec2 texCoord = aTexCoord;");
+        if (cc_features.opt_lighting) {
+            append_line(vs_buf, &vs_len, "if (uVertexShading[9].x != 0.0) {");
+            append_line(vs_buf, &vs_len, "vec2 gen = vec2(dot(aNormal.xyz, uVertexShading[5].xyz), dot(aNormal.xyz, uVertexShading[6].xyz));");
+            append_line(vs_buf, &vs_len, "texCoord = floor((gen / 127.0 + 1.0) / 4.0 * uVertexShading[8].xy) + uVertexShading[8].zw;");
+            append_line(vs_buf, &vs_len, "}");
+        }
+        if (texture_layers.enabled) {
+            append_line(vs_buf, &vs_len, "vTexCoord = texCoord / (32.0 * aTileSize);");
+            append_line(vs_buf, &vs_len, "vLayers = floor(aLayers * 255.0 + 0.5);");
+        } else {
+            append_line(vs_buf, &vs_len, "vTexCoord = texCoord / (32.0 * uTexSize);");
+        }
+    }
+    if (cc_features.opt_vertex_fog) {
+        append_line(vs_buf, &vs_len, "float fogW = abs(gl_Position.w) < 0.001 ? 0.001 : gl_Position.w;");
+        append_line(vs_buf, &vs_len, "float fogInvW = 1.0 / fogW;");
+        append_line(vs_buf, &vs_len, "if (fogInvW < 0.0) fogInvW = 32767.0;");
+        append_line(vs_buf, &vs_len, "float fogZ = clamp(gl_Position.z * fogInvW * uVertexShading[9].y + uVertexShading[9].z, 0.0, 255.0);");
+        append_line(vs_buf, &vs_len, "vFog = vec4(uFogColor, floor(fogZ) / 255.0);");
+    } else if (cc_features.opt_fog) {
+        append_line(vs_buf, &vs_len, "vFog = vec4(uFogColor, aFog.a);");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         vs_len += sprintf(vs_buf + vs_len, "vInput%d = aInput%d;\n", i + 1, i + 1);
+        if (cc_features.opt_lighting) {
+            vs_len += sprintf(vs_buf + vs_len, "vInput%d.rgb = mix(aInput%d.rgb, shade, uVertexShading[7][%d]);\n", i + 1, i + 1, i);
+        }
     }
-    append_line(vs_buf, &vs_len, "gl_Position = aVtxPos;");
     append_line(vs_buf, &vs_len, "}");
 
     // Fragment shader
     append_line(fs_buf, &fs_len, "#version 110");
     //append_line(fs_buf, &fs_len, "precision mediump float;");
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
+    if (use_texture && texture_layers.enabled) {
+        append_line(fs_buf, &fs_len, "#extension GL_EXT_texture_array : require");
+    }
+    if (use_texture) {
         append_line(fs_buf, &fs_len, "varying vec2 vTexCoord;");
     }
     if (cc_features.opt_fog) {
@@ -254,10 +747,13 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         fs_len += sprintf(fs_buf + fs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
     }
     if (cc_features.used_textures[0]) {
-        append_line(fs_buf, &fs_len, "uniform sampler2D uTex0;");
+        append_line(fs_buf, &fs_len, texture_layers.enabled ? "uniform sampler2DArray uTex0;" : "uniform sampler2D uTex0;");
     }
     if (cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "uniform sampler2D uTex1;");
+        append_line(fs_buf, &fs_len, texture_layers.enabled ? "uniform sampler2DArray uTex1;" : "uniform sampler2D uTex1;");
+    }
+    if (use_texture && texture_layers.enabled) {
+        append_layer_sampling(fs_buf, &fs_len);
     }
 
     if (cc_features.opt_alpha && cc_features.opt_noise) {
@@ -273,10 +769,10 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     append_line(fs_buf, &fs_len, "void main() {");
 
     if (cc_features.used_textures[0]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal0 = texture2D(uTex0, vTexCoord);");
+        append_texture_fetch(fs_buf, &fs_len, 0);
     }
     if (cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal1 = texture2D(uTex1, vTexCoord);");
+        append_texture_fetch(fs_buf, &fs_len, 1);
     }
 
     append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
@@ -323,59 +819,67 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     puts(fs_buf);
     puts("End");*/
 
-    const GLchar *sources[2] = { vs_buf, fs_buf };
-    const GLint lengths[2] = { vs_len, fs_len };
-    GLint success;
-
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &sources[0], &lengths[0]);
-    glCompileShader(vertex_shader);
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLint max_length = 0;
-        glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &max_length);
-        char error_log[1024];
-        fprintf(stderr, "Vertex shader compilation failed\n");
-        glGetShaderInfoLog(vertex_shader, max_length, &max_length, &error_log[0]);
-        fprintf(stderr, "%s\n", &error_log[0]);
-        abort();
+    // A binary is only reused if it was built from the same source
+    uint32_t source_hash = hash_bytes(hash_bytes(2166136261U, vs_buf, vs_len), fs_buf, fs_len);
+    GLuint shader_program = load_program_binary(shader_id, source_hash);
+    if (shader_program == 0) {
+        shader_program = compile_and_link_program(vs_buf, vs_len, fs_buf, fs_len);
+        save_program_binary(shader_id, source_hash, shader_program);
     }
 
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &sources[1], &lengths[1]);
-    glCompileShader(fragment_shader);
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLint max_length = 0;
-        glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &max_length);
-        char error_log[1024];
-        fprintf(stderr, "Fragment shader compilation failed\n");
-        glGetShaderInfoLog(fragment_shader, max_length, &max_length, &error_log[0]);
-        fprintf(stderr, "%s\n", &error_log[0]);
-        abort();
-    }
-
-    GLuint shader_program = glCreateProgram();
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    glLinkProgram(shader_program);
-
     size_t cnt = 0;
+    size_t offset = 0;
 
-    struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
+    // Packed layout: position as 4 floats, then one 32-bit word per remaining attribute
+    struct ShaderProgram *prg = shader_program_pool_add();
     prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aVtxPos");
     prg->attrib_sizes[cnt] = 4;
+    prg->attrib_types[cnt] = GL_FLOAT;
+    prg->attrib_offsets[cnt] = offset;
+    offset += 4 * sizeof(float);
     ++cnt;
 
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
+    if (use_texture) {
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexCoord");
         prg->attrib_sizes[cnt] = 2;
+        prg->attrib_types[cnt] = GL_SHORT;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
+        ++cnt;
+    }
+    
+    if (use_texture && texture_layers.enabled) {
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTileSize");
+        prg->attrib_sizes[cnt] = 2;
+        prg->attrib_types[cnt] = GL_UNSIGNED_SHORT;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
+        ++cnt;
+        
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aLayers");
+        prg->attrib_sizes[cnt] = 4;
+        prg->attrib_types[cnt] = GL_UNSIGNED_BYTE;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
         ++cnt;
     }
 
-    if (cc_features.opt_fog) {
+    if (cc_features.opt_fog && !cc_features.opt_vertex_fog) {
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aFog");
         prg->attrib_sizes[cnt] = 4;
+        prg->attrib_types[cnt] = GL_UNSIGNED_BYTE;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
+        ++cnt;
+    }
+
+    if (cc_features.opt_lighting) {
+        // Raw signed normal, not normalized to match the CPU's division by 127
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aNormal");
+        prg->attrib_sizes[cnt] = 4;
+        prg->attrib_types[cnt] = GL_BYTE;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
         ++cnt;
     }
 
@@ -384,9 +888,30 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         sprintf(name, "aInput%d", i + 1);
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
         prg->attrib_sizes[cnt] = cc_features.opt_alpha ? 4 : 3;
+        prg->attrib_types[cnt] = GL_UNSIGNED_BYTE;
+        prg->attrib_offsets[cnt] = offset;
+        offset += 4;
         ++cnt;
     }
 
+    prg->tex_size_location = -1;
+    prg->fog_color_location = -1;
+    prg->layer_size_location = -1;
+    if (use_texture && texture_layers.enabled) {
+        prg->layer_size_location = glGetUniformLocation(shader_program, "uLayerSize");
+    } else if (use_texture) {
+        prg->tex_size_location = glGetUniformLocation(shader_program, "uTexSize");
+    }
+    if (cc_features.opt_fog) {
+        prg->fog_color_location = glGetUniformLocation(shader_program, "uFogColor");
+    }
+    prg->mvp_location = glGetUniformLocation(shader_program, "uMVP");
+    prg->vertex_shading_location = -1;
+    if (cc_features.opt_lighting || cc_features.opt_vertex_fog) {
+        prg->vertex_shading_location = glGetUniformLocation(shader_program, "uVertexShading");
+    }
+    prg->mvp_dirty = true;
+
     prg->shader_id = shader_id;
     prg->opengl_program_id = shader_program;
     prg->num_inputs = cc_features.num_inputs;
@@ -417,10 +942,167 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     return prg;
 }
 
+static struct ShaderProgram *gfx_opengl_create_uber_shader(void) {
+    char vs_buf[2048];
+    char fs_buf[4096];
+    size_t vs_len = 0;
+    size_t fs_len = 0;
+
+    append_line(vs_buf, &vs_len, "#version 110");
+    append_line(vs_buf, &vs_len, "attribute vec4 aVtxPos;");
+    append_line(vs_buf, &vs_len, "attribute vec2 aTexCoord;");
+    if (texture_layers.enabled) {
+        append_line(vs_buf, &vs_len, "attribute vec2 aTileSize;");
+        append_line(vs_buf, &vs_len, "attribute vec4 aLayers;");
+        append_line(vs_buf, &vs_len, "varying vec4 vLayers;");
+    } else {
+        append_line(vs_buf, &vs_len, "uniform vec2 uTexSize;");
+    }
+    append_line(vs_buf, &vs_len, "attribute vec4 aFog;");
+    for (int i = 1; i <= 4; i++) {
+        vs_len += sprintf(vs_buf + vs_len, "attribute vec4 aInput%d;\nvarying vec4 vInput%d;\n", i, i);
+    }
+    append_line(vs_buf, &vs_len, "attribute vec4 aCombineColor;");
+    append_line(vs_buf, &vs_len, "attribute vec4 aCombineAlpha;");
+    append_line(vs_buf, &vs_len, "attribute vec4 aOptions;");
+    append_line(vs_buf, &vs_len, "uniform mat4 uMVP;");
+    append_line(vs_buf, &vs_len, "uniform vec3 uFogColor;");
+    append_line(vs_buf, &vs_len, "varying vec2 vTexCoord;");
+    append_line(vs_buf, &vs_len, "varying vec4 vFog;");
+    append_line(vs_buf, &vs_len, "varying vec4 vCombineColor;");
+    append_line(vs_buf, &vs_len, "varying vec4 vCombineAlpha;");
+    append_line(vs_buf, &vs_len, "varying vec4 vOptions;");
+    append_line(vs_buf, &vs_len, "void main() {");
+    append_line(vs_buf, &vs_len, "gl_Position = uMVP * aVtxPos;");
+    if (texture_layers.enabled) {
+        append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord / (32.0 * aTileSize);");
+        append_line(vs_buf, &vs_len, "vLayers = floor(aLayers * 255.0 + 0.5);");
+    } else {
+        append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord / (32.0 * uTexSize);");
+    }
+    append_line(vs_buf, &vs_len, "vFog = vec4(uFogColor, aFog.a);");
+    for (int i = 1; i <= 4; i++) {
+        vs_len += sprintf(vs_buf + vs_len, "vInput%d = aInput%d;\n", i, i);
+    }
+    append_line(vs_buf, &vs_len, "vCombineColor = aCombineColor * 255.0;");
+    append_line(vs_buf, &vs_len, "vCombineAlpha = aCombineAlpha * 255.0;");
+    append_line(vs_buf, &vs_len, "vOptions = aOptions * 255.0;");
+    append_line(vs_buf, &vs_len, "}");
+
+    append_line(fs_buf, &fs_len, "#version 110");
+    if (texture_layers.enabled) {
+        append_line(fs_buf, &fs_len, "#extension GL_EXT_texture_array : require");
+        append_line(fs_buf, &fs_len, "uniform sampler2DArray uTex0;");
+        append_line(fs_buf, &fs_len, "uniform sampler2DArray uTex1;");
+    } else {
+        append_line(fs_buf, &fs_len, "uniform sampler2D uTex0;");
+        append_line(fs_buf, &fs_len, "uniform sampler2D uTex1;");
+    }
+    append_line(fs_buf, &fs_len, "varying vec2 vTexCoord;");
+    append_line(fs_buf, &fs_len, "varying vec4 vFog;");
+    for (int i = 1; i <= 4; i++) {
+        fs_len += sprintf(fs_buf + fs_len, "varying vec4 vInput%d;\n", i);
+    }
+    append_line(fs_buf, &fs_len, "varying vec4 vCombineColor;");
+    append_line(fs_buf, &fs_len, "varying vec4 vCombineAlpha;");
+    append_line(fs_buf, &fs_len, "varying vec4 vOptions;");
+    append_line(fs_buf, &fs_len, "uniform int frame_count;");
+    append_line(fs_buf, &fs_len, "uniform int window_height;");
+    if (texture_layers.enabled) {
+        append_layer_sampling(fs_buf, &fs_len);
+    }
+    append_line(fs_buf, &fs_len, "float random(in vec3 value) {");
+    append_line(fs_buf, &fs_len, "    float random = dot(sin(value), vec3(12.9898, 78.233, 37.719));");
+    append_line(fs_buf, &fs_len, "    return fract(sin(random) * 143758.5453);");
+    append_line(fs_buf, &fs_len, "}");
+    // The combiner is the same on all three vertices, so the interpolated items stay whole numbers
+    append_line(fs_buf, &fs_len, "vec4 item(float index, vec4 texVal0, vec4 texVal1) {");
+    append_line(fs_buf, &fs_len, "    if (index < 0.5) return vec4(0.0);");
+    append_line(fs_buf, &fs_len, "    if (index < 1.5) return vInput1;");
+    append_line(fs_buf, &fs_len, "    if (index < 2.5) return vInput2;");
+    append_line(fs_buf, &fs_len, "    if (index < 3.5) return vInput3;");
+    append_line(fs_buf, &fs_len, "    if (index < 4.5) return vInput4;");
+    append_line(fs_buf, &fs_len, "    if (index < 5.5) return texVal0;");
+    append_line(fs_buf, &fs_len, "    if (index < 6.5) return vec4(texVal0.a);");
+    append_line(fs_buf, &fs_len, "    return texVal1;");
+    append_line(fs_buf, &fs_len, "}");
+    append_line(fs_buf, &fs_len, "void main() {");
+    append_texture_fetch(fs_buf, &fs_len, 0);
+    append_texture_fetch(fs_buf, &fs_len, 1);
+    append_line(fs_buf, &fs_len, "vec3 color = (item(vCombineColor.x, texVal0, texVal1).rgb - item(vCombineColor.y, texVal0, texVal1).rgb) * "
+                                 "item(vCombineColor.z, texVal0, texVal1).rgb + item(vCombineColor.w, texVal0, texVal1).rgb;");
+    append_line(fs_buf, &fs_len, "float alpha = (item(vCombineAlpha.x, texVal0, texVal1).a - item(vCombineAlpha.y, texVal0, texVal1).a) * "
+                                 "item(vCombineAlpha.z, texVal0, texVal1).a + item(vCombineAlpha.w, texVal0, texVal1).a;");
+    append_line(fs_buf, &fs_len, "vec4 texel = vec4(color, vOptions.x > 0.5 ? alpha : 1.0);");
+    append_line(fs_buf, &fs_len, "if (vOptions.z > 0.5) { if (texel.a > 0.3) texel.a = 1.0; else discard; }");
+    append_line(fs_buf, &fs_len, "if (vOptions.y > 0.5) texel.rgb = mix(texel.rgb, vFog.rgb, vFog.a);");
+    append_line(fs_buf, &fs_len, "if (vOptions.x > 0.5 && vOptions.w > 0.5) {");
+    append_line(fs_buf, &fs_len, "    texel.a *= floor(random(vec3(floor(gl_FragCoord.xy * (240.0 / float(window_height))), float(frame_count))) + 0.5);");
+    append_line(fs_buf, &fs_len, "}");
+    append_line(fs_buf, &fs_len, "gl_FragColor = texel;");
+    append_line(fs_buf, &fs_len, "}");
+
+    vs_buf[vs_len] = '\0';
+    fs_buf[fs_len] = '\0';
+
+    uint32_t source_hash = hash_bytes(hash_bytes(2166136261U, vs_buf, vs_len), fs_buf, fs_len);
+    GLuint shader_program = load_program_binary(SHADER_UBER, source_hash);
+    if (shader_program == 0) {
+        shader_program = compile_and_link_program(vs_buf, vs_len, fs_buf, fs_len);
+        save_program_binary(SHADER_UBER, source_hash, shader_program);
+    }
+
+    // Position as 4 floats, then one 32-bit word per attribute. The combine words are normalized
+    // like the colors, so the vertex shader scales them back to whole numbers.
+    static const char *attrib_names[] = {
+        "aVtxPos", "aTexCoord", "aTileSize", "aLayers", "aFog", "aInput1", "aInput2", "aInput3", "aInput4",
+        "aCombineColor", "aCombineAlpha", "aOptions"
+    };
+    struct ShaderProgram *prg = shader_program_pool_add();
+    size_t cnt = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < sizeof(attrib_names) / sizeof(attrib_names[0]); i++) {
+        if ((i == 2 || i == 3) && !texture_layers.enabled) {
+            continue;
+        }
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, attrib_names[i]);
+        prg->attrib_sizes[cnt] = i == 1 || i == 2 ? 2 : 4;
+        prg->attrib_types[cnt] = i == 0 ? GL_FLOAT : i == 1 ? GL_SHORT : i == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+        prg->attrib_offsets[cnt] = offset;
+        offset += i == 0 ? 4 * sizeof(float) : 4;
+        ++cnt;
+    }
+    prg->num_attribs = cnt;
+    prg->num_floats = offset / sizeof(float);
+
+    prg->tex_size_location = texture_layers.enabled ? -1 : glGetUniformLocation(shader_program, "uTexSize");
+    prg->layer_size_location = texture_layers.enabled ? glGetUniformLocation(shader_program, "uLayerSize") : -1;
+    prg->fog_color_location = glGetUniformLocation(shader_program, "uFogColor");
+    prg->mvp_location = glGetUniformLocation(shader_program, "uMVP");
+    prg->vertex_shading_location = -1;
+    prg->mvp_dirty = true;
+
+    prg->shader_id = SHADER_UBER;
+    prg->opengl_program_id = shader_program;
+    prg->num_inputs = 4;
+    prg->used_textures[0] = true;
+    prg->used_textures[1] = true;
+
+    gfx_opengl_load_shader(prg);
+
+    glUniform1i(glGetUniformLocation(shader_program, "uTex0"), 0);
+    glUniform1i(glGetUniformLocation(shader_program, "uTex1"), 1);
+    prg->frame_count_location = glGetUniformLocation(shader_program, "frame_count");
+    prg->window_height_location = glGetUniformLocation(shader_program, "window_height");
+    prg->used_noise = true;
+
+    return prg;
+}
+
 static struct ShaderProgram *gfx_opengl_lookup_shader(uint32_t shader_id) {
     for (size_t i = 0; i < shader_program_pool_size; i++) {
-        if (shader_program_pool[i].shader_id == shader_id) {
-            return &shader_program_pool[i];
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
         }
     }
     return NULL;
@@ -440,6 +1122,17 @@ static GLuint gfx_opengl_new_texture(void) {
 
 static void gfx_opengl_select_texture(int tile, GLuint texture_id) {
     glActiveTexture(GL_TEXTURE0 + tile);
+    if (texture_layers.enabled) {
+        // With texture layers, the interpreter selects the arrays returned by upload_texture_layer
+        struct TextureArray *array = &texture_layers.arrays[texture_id - 1];
+        glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->id);
+        texture_layers.layer_size[tile * 2] = array->width;
+        texture_layers.layer_size[tile * 2 + 1] = array->height;
+        if (sys.curShader != NULL && sys.curShader->layer_size_location != -1) {
+            glUniform4fv(sys.curShader->layer_size_location, 1, texture_layers.layer_size);
+        }
+        return;
+    }
     glBindTexture(GL_TEXTURE_2D, texture_id);
 }
 
@@ -484,13 +1177,49 @@ static void gfx_opengl_set_zmode_decal(bool zmode_decal) {
     }
 }
 
+static inline GLint render_scale_apply(int v) {
+    return (GLint)(v * render_scale.scale + 0.5f);
+}
+
 static void gfx_opengl_set_viewport(int x, int y, int width, int height) {
-    glViewport(x, y, width, height);
-    current_height = height;
+    render_scale.viewport[0] = x;
+    render_scale.viewport[1] = y;
+    render_scale.viewport[2] = width;
+    render_scale.viewport[3] = height;
+    glViewport(render_scale_apply(x), render_scale_apply(y), render_scale_apply(width), render_scale_apply(height));
+    current_height = render_scale_apply(height);
 }
 
 static void gfx_opengl_set_scissor(int x, int y, int width, int height) {
-    glScissor(x, y, width, height);
+    render_scale.scissor[0] = x;
+    render_scale.scissor[1] = y;
+    render_scale.scissor[2] = width;
+    render_scale.scissor[3] = height;
+    glScissor(render_scale_apply(x), render_scale_apply(y), render_scale_apply(width), render_scale_apply(height));
+}
+
+static void gfx_opengl_set_texture_size(uint32_t width, uint32_t height) {
+    tex_size[0] = width;
+    tex_size[1] = height;
+    if (sys.curShader != NULL && sys.curShader->tex_size_location != -1) {
+        glUniform2fv(sys.curShader->tex_size_location, 1, tex_size);
+    }
+}
+
+static void gfx_opengl_set_fog_color(uint8_t r, uint8_t g, uint8_t b) {
+    fog_color[0] = r / 255.0f;
+    fog_color[1] = g / 255.0f;
+    fog_color[2] = b / 255.0f;
+    if (sys.curShader != NULL && sys.curShader->fog_color_location != -1) {
+        glUniform3fv(sys.curShader->fog_color_location, 1, fog_color);
+    }
+}
+
+static void gfx_opengl_set_vertex_uniforms(const struct GfxVertexUniforms *uniforms) {
+    vertex_uniforms = *uniforms;
+    if (sys.curShader != NULL && sys.curShader->vertex_shading_location != -1) {
+        glUniform4fv(sys.curShader->vertex_shading_location, sizeof(vertex_uniforms) / (4 * sizeof(float)), (const GLfloat *)&vertex_uniforms);
+    }
 }
 
 static void gfx_opengl_set_use_alpha(bool use_alpha) {
@@ -501,12 +1230,302 @@ static void gfx_opengl_set_use_alpha(bool use_alpha) {
     }
 }
 
+#ifndef GL_NUM_EXTENSIONS
+#define GL_NUM_EXTENSIONS 0x821D
+#endif
+
+// GL 3.0 and GL ES 3.0 list extensions one at a time with glGetStringi, and core profiles no
+// longer return them as one string. Older versions only have the string, where names are
+// matched whole so that one isn't found inside a longer one.
+static bool gl_has_extension(int major, const char *ext) {
+    size_t len = strlen(ext);
+    if (major >= 3) {
+        const GLubyte *(APIENTRY *GetStringi)(GLenum name, GLuint index) = SDL_GL_GetProcAddress("glGetStringi");
+        if (GetStringi != NULL) {
+            GLint num_extensions = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+            for (GLint i = 0; i < num_extensions; i++) {
+                const char *name = (const char *)GetStringi(GL_EXTENSIONS, i);
+                if (name != NULL && strcmp(name, ext) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    for (const char *p = extensions; p != NULL && (p = strstr(p, ext)) != NULL; p += len) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses the GL or GL ES version and checks it against the one a feature became core in,
+// otherwise looks for the extension that provides it
+static bool gl_has_feature(int core_major, int core_minor, int es_major, int es_minor, const char *ext) {
+    const char *version = (const char *)glGetString(GL_VERSION);
+    int major = 0, minor = 0;
+    if (version != NULL) {
+        bool es = strncmp(version, "OpenGL ES ", 10) == 0;
+        if (sscanf(es ? version + 10 : version, "%d.%d", &major, &minor) == 2) {
+            int req_major = es ? es_major : core_major;
+            int req_minor = es ? es_minor : core_minor;
+            if (req_major != 0 && (major > req_major || (major == req_major && minor >= req_minor))) {
+                return true;
+            }
+        }
+    }
+    return ext != NULL && gl_has_extension(major, ext);
+}
+
+static void vertex_ring_init(void) {
+    if (!gl_has_feature(3, 0, 3, 0, "GL_ARB_map_buffer_range") || !gl_has_feature(3, 2, 3, 0, "GL_ARB_sync")) {
+        return;
+    }
+    vertex_ring.MapBufferRange = SDL_GL_GetProcAddress("glMapBufferRange");
+    vertex_ring.FlushMappedBufferRange = SDL_GL_GetProcAddress("glFlushMappedBufferRange");
+    vertex_ring.UnmapBuffer = SDL_GL_GetProcAddress("glUnmapBuffer");
+    vertex_ring.FenceSync = SDL_GL_GetProcAddress("glFenceSync");
+    vertex_ring.ClientWaitSync = SDL_GL_GetProcAddress("glClientWaitSync");
+    vertex_ring.DeleteSync = SDL_GL_GetProcAddress("glDeleteSync");
+    if (vertex_ring.MapBufferRange == NULL || vertex_ring.FlushMappedBufferRange == NULL || vertex_ring.UnmapBuffer == NULL ||
+        vertex_ring.FenceSync == NULL || vertex_ring.ClientWaitSync == NULL || vertex_ring.DeleteSync == NULL) {
+        return;
+    }
+    if (gl_has_feature(4, 4, 0, 0, "GL_ARB_buffer_storage") || gl_has_feature(0, 0, 0, 0, "GL_EXT_buffer_storage")) {
+        vertex_ring.BufferStorage = SDL_GL_GetProcAddress("glBufferStorage");
+        if (vertex_ring.BufferStorage == NULL) {
+            vertex_ring.BufferStorage = SDL_GL_GetProcAddress("glBufferStorageEXT");
+        }
+    }
+    
+    gl_clear_errors();
+    glGenBuffers(1, &vertex_ring.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_ring.vbo);
+    if (vertex_ring.BufferStorage != NULL) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        vertex_ring.BufferStorage(GL_ARRAY_BUFFER, VERTEX_RING_SIZE, NULL, flags);
+        vertex_ring.persistent_ptr = vertex_ring.MapBufferRange(GL_ARRAY_BUFFER, 0, VERTEX_RING_SIZE, flags);
+        vertex_ring.persistent = vertex_ring.persistent_ptr != NULL;
+    }
+    if (!vertex_ring.persistent) {
+        glBufferData(GL_ARRAY_BUFFER, VERTEX_RING_SIZE, NULL, GL_STREAM_DRAW);
+    }
+    vertex_ring.enabled = glGetError() == GL_NO_ERROR;
+    if (!vertex_ring.enabled) {
+        glDeleteBuffers(1, &vertex_ring.vbo);
+    }
+}
+
+static bool gfx_opengl_enable_texture_layers(void) {
+    // The shaders stay at GLSL 1.10, where sampler2DArray comes from the extension
+    if (!gl_has_feature(0, 0, 0, 0, "GL_EXT_texture_array")) {
+        return false;
+    }
+    texture_layers.TexImage3D = SDL_GL_GetProcAddress("glTexImage3D");
+    texture_layers.TexSubImage3D = SDL_GL_GetProcAddress("glTexSubImage3D");
+    if (texture_layers.TexImage3D == NULL || texture_layers.TexSubImage3D == NULL) {
+        texture_layers.TexImage3D = SDL_GL_GetProcAddress("glTexImage3DEXT");
+        texture_layers.TexSubImage3D = SDL_GL_GetProcAddress("glTexSubImage3DEXT");
+    }
+    if (texture_layers.TexImage3D == NULL || texture_layers.TexSubImage3D == NULL) {
+        return false;
+    }
+    texture_layers.enabled = true;
+    return true;
+}
+
+static struct TextureArray *texture_array_create(int width, int height) {
+    if (texture_layers.num_arrays == texture_layers.arrays_capacity) {
+        texture_layers.arrays_capacity = texture_layers.arrays_capacity == 0 ? 16 : texture_layers.arrays_capacity * 2;
+        texture_layers.arrays = realloc(texture_layers.arrays, texture_layers.arrays_capacity * sizeof(struct TextureArray));
+    }
+    struct TextureArray *array = &texture_layers.arrays[texture_layers.num_arrays++];
+    uint32_t capacity = TEXTURE_ARRAY_BYTES / (width * height * 4);
+    array->width = width;
+    array->height = height;
+    array->capacity = capacity < 1 ? 1 : capacity > 256 ? 256 : capacity;
+    array->num_used = 0;
+    array->num_free = 0;
+    array->released = false;
+    glGenTextures(1, &array->id);
+    glActiveTexture(GL_TEXTURE0 + TEXTURE_LAYER_UPLOAD_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->id);
+    texture_layers.TexImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, GL_RGBA, width, height, array->capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    return array;
+}
+
+static uint32_t gfx_opengl_upload_texture_layer(uint32_t texture_id, const uint8_t *rgba32_buf, int width, int height, uint8_t *layer) {
+    if (texture_id >= texture_layers.num_placements) {
+        uint32_t num = texture_id + 256;
+        texture_layers.placements = realloc(texture_layers.placements, num * sizeof(struct TexturePlacement));
+        memset(&texture_layers.placements[texture_layers.num_placements], 0, (num - texture_layers.num_placements) * sizeof(struct TexturePlacement));
+        texture_layers.num_placements = num;
+    }
+    
+    // The texture id is being reused, so its old layer is free
+    struct TexturePlacement *placement = &texture_layers.placements[texture_id];
+    if (placement->array != 0) {
+        struct TextureArray *old = &texture_layers.arrays[placement->array - 1];
+        old->free_layers[old->num_free++] = placement->layer;
+        placement->array = 0;
+    }
+    
+    struct TextureArray *array = NULL;
+    for (uint32_t i = 0; i < texture_layers.num_arrays; i++) {
+        struct TextureArray *a = &texture_layers.arrays[i];
+        if (a->width == width && a->height == height && (a->num_free != 0 || a->num_used < a->capacity)) {
+            array = a;
+            break;
+        }
+    }
+    if (array == NULL) {
+        array = texture_array_create(width, height);
+    }
+    
+    placement->array = array - texture_layers.arrays + 1;
+    placement->layer = array->num_free != 0 ? array->free_layers[--array->num_free] : array->num_used++;
+    
+    glActiveTexture(GL_TEXTURE0 + TEXTURE_LAYER_UPLOAD_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->id);
+    if (array->released) {
+        texture_layers.TexImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, GL_RGBA, width, height, array->capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        array->released = false;
+    }
+    texture_layers.TexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, 0, 0, placement->layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
+    *layer = placement->layer;
+    return placement->array;
+}
+
+// Texture and array names are kept, since the interpreter may still consider them bound to a tile
+static void gfx_opengl_release_texture(uint32_t texture_id) {
+    static const uint8_t texel[4];
+    
+    glActiveTexture(GL_TEXTURE0 + TEXTURE_LAYER_UPLOAD_UNIT);
+    if (!texture_layers.enabled) {
+        glBindTexture(GL_TEXTURE_2D, texture_id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, texel);
+        return;
+    }
+    if (texture_id >= texture_layers.num_placements || texture_layers.placements[texture_id].array == 0) {
+        return;
+    }
+    struct TexturePlacement *placement = &texture_layers.placements[texture_id];
+    struct TextureArray *array = &texture_layers.arrays[placement->array - 1];
+    array->free_layers[array->num_free++] = placement->layer;
+    placement->array = 0;
+    if (array->num_free == array->num_used) {
+        array->num_used = 0;
+        array->num_free = 0;
+        array->released = true;
+        glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->id);
+        texture_layers.TexImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, GL_RGBA, 1, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, texel);
+    }
+}
+
+static void vertex_ring_enter_segment(size_t segment) {
+    if (vertex_ring.fences[segment] != NULL) {
+        while (vertex_ring.ClientWaitSync(vertex_ring.fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        vertex_ring.DeleteSync(vertex_ring.fences[segment]);
+        vertex_ring.fences[segment] = NULL;
+    }
+}
+
+static float *gfx_opengl_map_vertex_buffer(size_t max_floats) {
+    size_t size = max_floats * sizeof(float);
+    if (!vertex_ring.enabled || size > VERTEX_RING_SEGMENT_SIZE) {
+        return NULL;
+    }
+    size_t segment = vertex_ring.pos / VERTEX_RING_SEGMENT_SIZE;
+    if ((vertex_ring.pos + size - 1) / VERTEX_RING_SEGMENT_SIZE != segment) {
+        // Doesn't fit in what's left of this segment, continue at the start of the next one
+        vertex_ring.fences[segment] = vertex_ring.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        segment = (segment + 1) % VERTEX_RING_SEGMENTS;
+        vertex_ring.pos = segment * VERTEX_RING_SEGMENT_SIZE;
+        vertex_ring_enter_segment(segment);
+    }
+    
+    if (vertex_ring.persistent) {
+        vertex_ring.mapped = (float *)(vertex_ring.persistent_ptr + vertex_ring.pos);
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_ring.vbo);
+        vertex_ring.mapped = vertex_ring.MapBufferRange(GL_ARRAY_BUFFER, vertex_ring.pos, size,
+            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+    }
+    return vertex_ring.mapped;
+}
+
 static void gfx_opengl_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
     //printf("flushing %d tris\n", buf_vbo_num_tris);
+    if (sys.curShader->mvp_dirty) {
+        glUniformMatrix4fv(sys.curShader->mvp_location, 1, GL_FALSE, identity_matrix);
+        sys.curShader->mvp_dirty = false;
+    }
+    if (buf_vbo == vertex_ring.mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_ring.vbo);
+        if (!vertex_ring.persistent) {
+            vertex_ring.FlushMappedBufferRange(GL_ARRAY_BUFFER, 0, sizeof(float) * buf_vbo_len);
+            vertex_ring.UnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        gfx_opengl_vertex_array_set_attribs_at(sys.curShader, vertex_ring.pos);
+        glDrawArrays(GL_TRIANGLES, 0, 3 * buf_vbo_num_tris);
+        vertex_ring.pos += (sizeof(float) * buf_vbo_len + 63) & ~(size_t)63;
+        vertex_ring.mapped = NULL;
+        return;
+    }
+    if (vertex_ring.enabled) {
+        glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+        gfx_opengl_vertex_array_set_attribs(sys.curShader);
+    }
     glBufferData(GL_ARRAY_BUFFER, sizeof(float) * buf_vbo_len, buf_vbo, GL_STREAM_DRAW);
     glDrawArrays(GL_TRIANGLES, 0, 3 * buf_vbo_num_tris);
 }
 
+static uint32_t gfx_opengl_upload_retained_vertices(const float buf[], size_t buf_len) {
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    if (vbo == 0) {
+        return 0;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * buf_len, buf, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+    if (sys.curShader != NULL) {
+        gfx_opengl_vertex_array_set_attribs(sys.curShader);
+    }
+    return vbo;
+}
+
+static void gfx_opengl_delete_retained_vertices(uint32_t id) {
+    GLuint vbo = id;
+    glDeleteBuffers(1, &vbo);
+}
+
+static void gfx_opengl_draw_retained_triangles(uint32_t id, size_t vbo_offset, size_t num_vertices, const float mvp[4][4], uint8_t cull_mode) {
+    glBindBuffer(GL_ARRAY_BUFFER, id);
+    gfx_opengl_vertex_array_set_attribs_at(sys.curShader, sizeof(float) * vbo_offset);
+    glUniformMatrix4fv(sys.curShader->mvp_location, 1, GL_FALSE, &mvp[0][0]);
+    sys.curShader->mvp_dirty = true;
+    // The positions aren't clipped and culled on the CPU, so culling has to be done here
+    if (cull_mode != 0) {
+        glEnable(GL_CULL_FACE);
+        glCullFace(cull_mode == 1 ? GL_FRONT : GL_BACK);
+    }
+    glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+    if (cull_mode != 0) {
+        glDisable(GL_CULL_FACE);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+    gfx_opengl_vertex_array_set_attribs(sys.curShader);
+}
+
 static void throw_shader_error(GLenum shader_type, GLuint handle,
         char* shader_text) {
     GLint status;
@@ -548,110 +1567,301 @@ static void throw_shader_error(GLenum shader_type, GLuint handle,
     }
 }
 
-static void compile_post_shaders(void) {
-    char *vertex_shader_source =
-        "#version 100\n"
-        "attribute vec4 v_texCoord;\n"
-        "attribute vec2 m_texCoord;\n"
-        "varying vec2 texCoord;\n"
-        "void main() {\n"
-        "   gl_Position = v_texCoord;\n"
-        "   texCoord = m_texCoord;\n"
-        "}\n\0";
+// Depth of field post processing. The scene is drawn to an offscreen framebuffer, then:
+// 1. the circle of confusion pass downsamples the color and stores the blur amount in alpha,
+// 2. the blur passes run horizontally and vertically at the reduced resolution,
+// 3. the composite pass mixes the sharp and blurred images by the circle of confusion.
+// With depth of field off the scene is drawn straight to the window.
+
+struct DofPreset {
+    uint8_t downscale;
+    uint8_t num_taps; // per side, including the center
+    float offsets[4]; // in texels, between two texels to get both from one bilinear fetch
+    float weights[4];
+};
 
-    FILE *fragment_shader = fopen("fragment.glsl", "ro");
-    if(!fragment_shader) {
-        fprintf(stderr, "Failed to open fragment shader\n");
-        exit(EXIT_FAILURE);
-    }
+static const struct DofPreset dof_presets[] = {
+    { 0, 0, { 0 }, { 0 } },
+    { 4, 2, { 0.0f, 1.3333333333f }, { 0.2941176471f, 0.3529411765f } },
+    { 2, 3, { 0.0f, 1.3846153846f, 3.2307692308f }, { 0.2270270270f, 0.3162162162f, 0.0702702703f } },
+    { 2, 4, { 0.0f, 1.4117647059f, 3.2941176471f, 5.1764705882f }, { 0.1964825502f, 0.2969069647f, 0.0944703979f, 0.0103813624f } },
+};
 
-    fseek(fragment_shader, 0, SEEK_END);
-    size_t frag_size = ftell(fragment_shader);
-    fseek(fragment_shader, 0, SEEK_SET);
+#define DOF_NUM_PRESETS (sizeof(dof_presets) / sizeof(dof_presets[0]))
+
+static const char post_vertex_shader_source[] =
+    "#version 110\n"
+    "attribute vec2 aPos;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(aPos, 0.0, 1.0);\n"
+    "    vTexCoord = aPos * 0.5 + 0.5;\n"
+    "}\n";
+
+static const char coc_fragment_shader_source[] =
+    "#version 110\n"
+    "uniform sampler2D uColor;\n"
+    "uniform sampler2D uDepth;\n"
+    "uniform vec2 uFocus;\n"
+    "uniform float uCocScale;\n"
+    "uniform vec2 uSceneScale;\n"
+    "varying vec2 vTexCoord;\n"
+    "float linear_depth(float depth) {\n"
+    "    return 0.1 * 10000.0 / (10000.0 - depth * (10000.0 - 0.1));\n"
+    "}\n"
+    "void main() {\n"
+    "    vec2 coord = vTexCoord * uSceneScale;\n"
+    "    float coc = abs(linear_depth(texture2D(uDepth, coord).r) - linear_depth(texture2D(uDepth, uFocus * uSceneScale).r));\n"
+    "    gl_FragColor = vec4(texture2D(uColor, coord).rgb, min(coc * uCocScale, 1.0));\n"
+    "}\n";
+
+static const char composite_fragment_shader_source[] =
+    "#version 110\n"
+    "uniform sampler2D uColor;\n"
+    "uniform sampler2D uBlurred;\n"
+    "uniform vec2 uSceneScale;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    vec4 blurred = texture2D(uBlurred, vTexCoord);\n"
+    "    gl_FragColor = vec4(mix(texture2D(uColor, vTexCoord * uSceneScale).rgb, blurred.rgb, blurred.a), 1.0);\n"
+    "}\n";
+
+// Upscales the scene when there's no depth of field
+static const char copy_fragment_shader_source[] =
+    "#version 110\n"
+    "uniform sampler2D uColor;\n"
+    "uniform vec2 uSceneScale;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(texture2D(uColor, vTexCoord * uSceneScale).rgb, 1.0);\n"
+    "}\n";
+
+static GLuint compile_post_program(const char *fs_source) {
+    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    const GLchar *vs_sources[] = { post_vertex_shader_source };
+    glShaderSource(vertex_shader, 1, vs_sources, NULL);
+    glCompileShader(vertex_shader);
+    throw_shader_error(GL_VERTEX_SHADER, vertex_shader, (char *)post_vertex_shader_source);
 
-    char *fragment_shader_source = malloc(frag_size+4096);
-    memset(fragment_shader_source, 0x00, frag_size+4096);
-    fread(fragment_shader_source, 1, frag_size-1, fragment_shader);
-    fragment_shader_source[frag_size] = '\0';
+    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    const GLchar *fs_sources[] = { fs_source };
+    glShaderSource(fragment_shader, 1, fs_sources, NULL);
+    glCompileShader(fragment_shader);
+    throw_shader_error(GL_FRAGMENT_SHADER, fragment_shader, (char *)fs_source);
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "aPos");
+    glLinkProgram(program);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return program;
+}
 
-    sys.post.shader.vertex = glCreateShader(GL_VERTEX_SHADER);
-    sys.post.shader.fragment = glCreateShader(GL_FRAGMENT_SHADER);
-    
-    glShaderSource(sys.post.shader.vertex, 1, 
-            &vertex_shader_source, NULL);
-    glShaderSource(sys.post.shader.fragment, 1, 
-            &fragment_shader_source, NULL);
-    
-    glCompileShader(sys.post.shader.vertex);
-    glCompileShader(sys.post.shader.fragment);
-    
-    throw_shader_error(GL_VERTEX_SHADER, sys.post.shader.vertex,
-            vertex_shader_source);
-    throw_shader_error(GL_FRAGMENT_SHADER, sys.post.shader.fragment,
-            fragment_shader_source);
-    
-    sys.post.shader.program = glCreateProgram();
-    glAttachShader(sys.post.shader.program, sys.post.shader.vertex);
-    glAttachShader(sys.post.shader.program, sys.post.shader.fragment);
+// Separable gaussian blur, with the step scaled by the circle of confusion of the center texel
+static GLuint compile_blur_program(const struct DofPreset *preset) {
+    char fs_buf[2048];
+    size_t fs_len = 0;
+    char line[256];
 
-    glLinkProgram(sys.post.shader.program);
+    append_line(fs_buf, &fs_len, "#version 110");
+    append_line(fs_buf, &fs_len, "uniform sampler2D uSource;");
+    append_line(fs_buf, &fs_len, "uniform vec2 uStep;");
+    append_line(fs_buf, &fs_len, "varying vec2 vTexCoord;");
+    append_line(fs_buf, &fs_len, "void main() {");
+    append_line(fs_buf, &fs_len, "    vec4 center = texture2D(uSource, vTexCoord);");
+    append_line(fs_buf, &fs_len, "    vec2 offset = uStep * center.a;");
+    sprintf(line, "    vec4 color = center * %.6f;", preset->weights[0]);
+    append_line(fs_buf, &fs_len, line);
+    for (int i = 1; i < preset->num_taps; i++) {
+        sprintf(line, "    color += (texture2D(uSource, vTexCoord + offset * %.6f) + texture2D(uSource, vTexCoord - offset * %.6f)) * %.6f;",
+                preset->offsets[i], preset->offsets[i], preset->weights[i]);
+        append_line(fs_buf, &fs_len, line);
+    }
+    append_line(fs_buf, &fs_len, "    gl_FragColor = color;");
+    append_line(fs_buf, &fs_len, "}");
+    fs_buf[fs_len] = '\0';
 
-    glDeleteShader(sys.post.shader.vertex);
-    glDeleteShader(sys.post.shader.fragment);
-    fclose(fragment_shader);
+    return compile_post_program(fs_buf);
 }
 
-static void create_post_textures(void) {
-    GLint old_program;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &old_program);
-
-    // switch to appropriate shader
-    glUseProgram(sys.post.shader.program);
-
-    // set texture properties
-    glGenTextures(1,               &sys.post.color_texture);
-    glBindTexture(GL_TEXTURE_2D,   sys.post.color_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 
-            sys.display.width,
-            sys.display.height,
-            0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+static void post_texture_init(GLuint *texture) {
+    glGenTextures(1, texture);
+    glBindTexture(GL_TEXTURE_2D, *texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
 
-    // set texture properties
-    glGenTextures(1,             &sys.post.depth_texture);
-    glBindTexture(GL_TEXTURE_2D,  sys.post.depth_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-            sys.display.width,
-            sys.display.height,
-            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    
-    // set framebuffer properties
-    glGenFramebuffers(1,             &sys.post.framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, sys.post.framebuffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-        GL_TEXTURE_2D, sys.post.color_texture, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-        GL_TEXTURE_2D, sys.post.depth_texture, 0);
-    
-    // check if it borked
-    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if(status != GL_FRAMEBUFFER_COMPLETE) {
-        printf("Failed to create framebuffer(s)! Error code 0x%X\n",
-                status);
-    }   
-    sys.post.shader.uniform.POST_POS        = glGetAttribLocation(sys.post.shader.program,  "v_texCoord");
-    sys.post.shader.uniform.POST_TEXCOORD   = glGetAttribLocation(sys.post.shader.program,  "m_texCoord");
-    sys.post.shader.uniform.POST_TEXTURE    = glGetUniformLocation(sys.post.shader.program, "color_texture");
-    sys.post.shader.uniform.POST_DEPTH      = glGetUniformLocation(sys.post.shader.program, "depth_texture");
-    
-    glUseProgram(old_program);
+static void post_framebuffer_init(GLuint *framebuffer, GLuint color_texture, GLuint depth_texture) {
+    glGenFramebuffers(1, framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_texture, 0);
+    if (depth_texture != 0) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture, 0);
+    }
+}
+
+static void create_post_resources(void) {
+    sys.post.coc_program = compile_post_program(coc_fragment_shader_source);
+    sys.post.coc_color_location = glGetUniformLocation(sys.post.coc_program, "uColor");
+    sys.post.coc_depth_location = glGetUniformLocation(sys.post.coc_program, "uDepth");
+    sys.post.coc_focus_location = glGetUniformLocation(sys.post.coc_program, "uFocus");
+    sys.post.coc_scale_location = glGetUniformLocation(sys.post.coc_program, "uCocScale");
+    sys.post.coc_scene_scale_location = glGetUniformLocation(sys.post.coc_program, "uSceneScale");
+
+    for (size_t i = 1; i < DOF_NUM_PRESETS; i++) {
+        sys.post.blur_programs[i] = compile_blur_program(&dof_presets[i]);
+        sys.post.blur_source_locations[i] = glGetUniformLocation(sys.post.blur_programs[i], "uSource");
+        sys.post.blur_step_locations[i] = glGetUniformLocation(sys.post.blur_programs[i], "uStep");
+    }
+
+    sys.post.composite_program = compile_post_program(composite_fragment_shader_source);
+    sys.post.composite_color_location = glGetUniformLocation(sys.post.composite_program, "uColor");
+    sys.post.composite_blurred_location = glGetUniformLocation(sys.post.composite_program, "uBlurred");
+    sys.post.composite_scene_scale_location = glGetUniformLocation(sys.post.composite_program, "uSceneScale");
+
+    sys.post.copy_program = compile_post_program(copy_fragment_shader_source);
+    sys.post.copy_color_location = glGetUniformLocation(sys.post.copy_program, "uColor");
+    sys.post.copy_scene_scale_location = glGetUniformLocation(sys.post.copy_program, "uSceneScale");
+
+    post_texture_init(&sys.post.color_texture);
+    post_texture_init(&sys.post.depth_texture);
+    post_texture_init(&sys.post.blur_textures[0]);
+    post_texture_init(&sys.post.blur_textures[1]);
+    post_framebuffer_init(&sys.post.framebuffer, sys.post.color_texture, sys.post.depth_texture);
+    post_framebuffer_init(&sys.post.blur_framebuffers[0], sys.post.blur_textures[0], 0);
+    post_framebuffer_init(&sys.post.blur_framebuffers[1], sys.post.blur_textures[1], 0);
+    sys.post.created = true;
+}
+
+// Sizes the offscreen targets for the window and the depth of field quality
+static void update_post_resources(void) {
+    const struct DofPreset *preset = &dof_presets[sys.post.quality];
+    int32_t width = gfx_current_dimensions.width;
+    int32_t height = gfx_current_dimensions.height;
+
+    if (!sys.post.created) {
+        create_post_resources();
+    }
+
+    if (width != sys.display.width || height != sys.display.height) {
+        sys.display.width = width;
+        sys.display.height = height;
+
+        glBindTexture(GL_TEXTURE_2D, sys.post.color_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glBindTexture(GL_TEXTURE_2D, sys.post.depth_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, sys.post.framebuffer);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            printf("Failed to create framebuffer(s)! Error code 0x%X\n", status);
+        }
+    }
+
+    if (preset->downscale == 0) {
+        return;
+    }
+    int32_t blur_width = (width + preset->downscale - 1) / preset->downscale;
+    int32_t blur_height = (height + preset->downscale - 1) / preset->downscale;
+    if (blur_width != sys.post.blur_width || blur_height != sys.post.blur_height) {
+        sys.post.blur_width = blur_width;
+        sys.post.blur_height = blur_height;
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, sys.post.blur_textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, blur_width, blur_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        }
+    }
+}
+
+void gfx_opengl_set_dof_quality(uint32_t quality) {
+    sys.post.quality = quality < DOF_NUM_PRESETS ? quality : DOF_NUM_PRESETS - 1;
+}
+
+void gfx_opengl_set_render_scale(float min_scale, float max_scale, uint32_t gpu_budget_us) {
+    render_scale.min = min_scale < 0.25f ? 0.25f : min_scale > 1.0f ? 1.0f : min_scale;
+    render_scale.max = max_scale < render_scale.min ? render_scale.min : max_scale > 1.0f ? 1.0f : max_scale;
+    render_scale.scale = render_scale.max;
+    render_scale.budget_us = gpu_budget_us;
+    render_scale.dynamic = render_scale.min < render_scale.max && render_scale.has_queries;
+    render_scale.enabled = render_scale.dynamic || render_scale.max < 1.0f;
+}
+
+static void render_scale_init(void) {
+    if (!gl_has_feature(3, 3, 0, 0, "GL_ARB_timer_query") && !gl_has_feature(0, 0, 0, 0, "GL_EXT_disjoint_timer_query")) {
+        return;
+    }
+    render_scale.GenQueries = SDL_GL_GetProcAddress("glGenQueries");
+    render_scale.BeginQuery = SDL_GL_GetProcAddress("glBeginQuery");
+    render_scale.EndQuery = SDL_GL_GetProcAddress("glEndQuery");
+    render_scale.GetQueryObjectiv = SDL_GL_GetProcAddress("glGetQueryObjectiv");
+    render_scale.GetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+    if (render_scale.GenQueries == NULL) {
+        render_scale.GenQueries = SDL_GL_GetProcAddress("glGenQueriesEXT");
+        render_scale.BeginQuery = SDL_GL_GetProcAddress("glBeginQueryEXT");
+        render_scale.EndQuery = SDL_GL_GetProcAddress("glEndQueryEXT");
+        render_scale.GetQueryObjectiv = SDL_GL_GetProcAddress("glGetQueryObjectivEXT");
+        render_scale.GetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+    }
+    if (render_scale.GenQueries == NULL || render_scale.BeginQuery == NULL || render_scale.EndQuery == NULL ||
+        render_scale.GetQueryObjectiv == NULL || render_scale.GetQueryObjectui64v == NULL) {
+        return;
+    }
+    render_scale.GenQueries(RENDER_SCALE_QUERIES, render_scale.queries);
+    render_scale.has_queries = true;
+}
+
+// Moves the scale towards the GPU time budget
+static void render_scale_update(float gpu_time_us) {
+    render_scale.average_us = render_scale.average_us == 0.0f ? gpu_time_us : render_scale.average_us * 0.9f + gpu_time_us * 0.1f;
+    if (++render_scale.frames_since_change < 15) {
+        return;
+    }
+    // The cost mostly follows the pixel count, which is the square of the scale
+    float ratio = sqrtf(render_scale.budget_us / render_scale.average_us);
+    if (ratio > 0.97f && ratio < 1.1f) {
+        return;
+    }
+    ratio = ratio < 0.9f ? 0.9f : ratio > 1.05f ? 1.05f : ratio;
+    float scale = render_scale.scale * ratio;
+    scale = scale < render_scale.min ? render_scale.min : scale > render_scale.max ? render_scale.max : scale;
+    if (scale != render_scale.scale) {
+        render_scale.scale = scale;
+        render_scale.frames_since_change = 0;
+    }
+}
+
+// Reads back finished queries without waiting, then starts timing this frame
+static void render_scale_begin_frame(void) {
+    for (int i = 0; i < RENDER_SCALE_QUERIES; i++) {
+        if (render_scale.pending[i]) {
+            GLint available = 0;
+            render_scale.GetQueryObjectiv(render_scale.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                uint64_t elapsed_ns;
+                render_scale.GetQueryObjectui64v(render_scale.queries[i], GL_QUERY_RESULT, &elapsed_ns);
+                render_scale.pending[i] = false;
+                render_scale_update(elapsed_ns / 1000.0f);
+            }
+        }
+    }
+    render_scale.query_index = (render_scale.query_index + 1) % RENDER_SCALE_QUERIES;
+    if (!render_scale.pending[render_scale.query_index]) {
+        render_scale.BeginQuery(GL_TIME_ELAPSED, render_scale.queries[render_scale.query_index]);
+        render_scale.pending[render_scale.query_index] = true;
+    } else {
+        render_scale.query_index = RENDER_SCALE_QUERIES; // not timed
+    }
+}
+
+static void render_scale_end_frame(void) {
+    if (render_scale.query_index != RENDER_SCALE_QUERIES) {
+        render_scale.EndQuery(GL_TIME_ELAPSED);
+    }
 }
 
 static void gfx_opengl_init(void) {
@@ -659,10 +1869,11 @@ static void gfx_opengl_init(void) {
     glewInit();
 #endif
     
-    compile_post_shaders();
-    create_post_textures();
+    shader_binary_cache_init();
+    render_scale_init();
     
     glGenBuffers(1, &opengl_vbo);
+    vertex_ring_init();
     
     glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
     
@@ -673,62 +1884,23 @@ static void gfx_opengl_init(void) {
 static void gfx_opengl_on_resize(void) {
 }
 
-static void update_texture_size(void) {
-    GLint old_program;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &old_program);
-    
-    // switch to appropriate shader
-    glUseProgram(sys.post.shader.program);
-    
-    glBindTexture(GL_TEXTURE_2D,   sys.post.color_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 
-            sys.display.width,
-            sys.display.height,
-            0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-
-    glBindTexture(GL_TEXTURE_2D,  sys.post.depth_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-            sys.display.width,
-            sys.display.height,
-            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, sys.post.framebuffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-        GL_TEXTURE_2D, sys.post.color_texture, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-        GL_TEXTURE_2D, sys.post.depth_texture, 0);
-
-    glUseProgram(old_program);
-}
-
-static void update_display_size(void) {
-    GLint m_viewport[4];
-    bool resized = false; 
-    glGetIntegerv( GL_VIEWPORT, m_viewport );
-
-    if(m_viewport[2] != sys.display.width ||
-            m_viewport[3] != sys.display.height) {
-        sys.display.width = m_viewport[2];
-        sys.display.height = m_viewport[3];
-        printf("Display resized to: %d %d\n",
-                sys.display.width,
-                sys.display.height);
-        resized = true;
-    }
-
-    if(!resized)
-        return;
-
-    // if it was resized then change the texture size
-    update_texture_size();
-}
-
 static void gfx_opengl_start_frame(void) {
     frame_count++;
 
-    update_display_size();
-
-    glBindFramebuffer(GL_FRAMEBUFFER, sys.post.framebuffer);
+    if (render_scale.dynamic) {
+        render_scale_begin_frame();
+    }
+    if (sys.post.quality != 0 || render_scale.enabled) {
+        update_post_resources();
+        glBindFramebuffer(GL_FRAMEBUFFER, sys.post.framebuffer);
+    } else {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    render_scale.width = render_scale_apply(sys.display.width);
+    render_scale.height = render_scale_apply(sys.display.height);
+    // The interpreter only sends changes, so a new scale has to be applied here
+    gfx_opengl_set_viewport(render_scale.viewport[0], render_scale.viewport[1], render_scale.viewport[2], render_scale.viewport[3]);
+    gfx_opengl_set_scissor(render_scale.scissor[0], render_scale.scissor[1], render_scale.scissor[2], render_scale.scissor[3]);
 
     glUseProgram(sys.main_program);
     gfx_opengl_load_shader_arrays(sys.curShader);
@@ -742,77 +1914,86 @@ static void gfx_opengl_start_frame(void) {
     glEnable(GL_SCISSOR_TEST);
 }
 
-//struct System {
-//    struct Display {
-//        uint32_t width;
-//        uint32_t height;
-//    } display;
-//    struct FBO {
-//        struct shader {
-//            GLuint program;
-//            GLuint vertex;
-//            GLuint fragment;
-//            struct uniforms {
-//                GLuint POST_POS     ;
-//                GLuint POST_TEXCOORD;
-//                GLuint POST_TEXTURE ;
-//                GLuint POST_DEPTH   ;
-//            } uniform;
-//        } shader;
-//        GLuint framebuffer;
-//        GLuint color_texture;
-//        GLuint depth_texture;
-//    } post;
-//    GLuint main_program;
-//} sys;
+static void draw_post_pass(GLuint framebuffer, int32_t width, int32_t height) {
+    static const GLfloat vertices[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+static void bind_post_texture(int unit, GLuint texture, GLint location) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(location, unit);
+}
 
 static void gfx_opengl_end_frame(void) {
     gfx_opengl_unload_shader(sys.curShader);
     
+    if (sys.post.quality == 0 && !render_scale.enabled) {
+        return;
+    }
+    
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    glUseProgram(sys.post.shader.program);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
     
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // The interpreter keeps track of these, so they are restored afterwards
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_SCISSOR_TEST);
+    glEnableVertexAttribArray(0);
     
-    GLfloat postVertices[] = {
-        -1.0f, -1.0f,  // Position 0
-         0.0f,  0.0f,  // TexCoord 0
-         1.0f, -1.0f,  // Position 1
-         1.0f,  0.0f,  // TexCoord 1
-         1.0f,  1.0f,  // Position 2
-         1.0f,  1.0f,  // TexCoord 2
-        -1.0f,  1.0f,  // Position 3
-         0.0f,  1.0f}; // TexCoord 3
-
-    glVertexAttribPointer(sys.post.shader.uniform.POST_POS,
-        2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), postVertices);
-    glVertexAttribPointer(sys.post.shader.uniform.POST_TEXCOORD,
-        2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), &postVertices[2]);
+    int32_t blur_width = sys.post.blur_width, blur_height = sys.post.blur_height;
+    float scene_scale[2] = { (float)render_scale.width / sys.display.width, (float)render_scale.height / sys.display.height };
     
-    // enable the use of the following attribute elements
-    glEnableVertexAttribArray(sys.post.shader.uniform.POST_POS);
-    glEnableVertexAttribArray(sys.post.shader.uniform.POST_TEXCOORD);
+    if (sys.post.quality == 0) {
+        glUseProgram(sys.post.copy_program);
+        bind_post_texture(0, sys.post.color_texture, sys.post.copy_color_location);
+        glUniform2fv(sys.post.copy_scene_scale_location, 1, scene_scale);
+        draw_post_pass(0, sys.display.width, sys.display.height);
+    } else {
+        glUseProgram(sys.post.coc_program);
+        bind_post_texture(0, sys.post.color_texture, sys.post.coc_color_location);
+        bind_post_texture(1, sys.post.depth_texture, sys.post.coc_depth_location);
+        // Focus on the depth at the bottom left corner
+        glUniform2f(sys.post.coc_focus_location, 0.0f, 0.0f);
+        glUniform1f(sys.post.coc_scale_location, 0.1f);
+        glUniform2fv(sys.post.coc_scene_scale_location, 1, scene_scale);
+        draw_post_pass(sys.post.blur_framebuffers[0], blur_width, blur_height);
     
-    // Bind the textures
-    // Render texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, sys.post.color_texture);
-    glUniform1i(sys.post.shader.uniform.POST_TEXTURE, 0);
+        glUseProgram(sys.post.blur_programs[sys.post.quality]);
+        bind_post_texture(0, sys.post.blur_textures[0], sys.post.blur_source_locations[sys.post.quality]);
+        glUniform2f(sys.post.blur_step_locations[sys.post.quality], 1.0f / blur_width, 0.0f);
+        draw_post_pass(sys.post.blur_framebuffers[1], blur_width, blur_height);
+        bind_post_texture(0, sys.post.blur_textures[1], sys.post.blur_source_locations[sys.post.quality]);
+        glUniform2f(sys.post.blur_step_locations[sys.post.quality], 0.0f, 1.0f / blur_height);
+        draw_post_pass(sys.post.blur_framebuffers[0], blur_width, blur_height);
     
-    // Depth texture
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, sys.post.depth_texture);
-    glUniform1i(sys.post.shader.uniform.POST_DEPTH, 1);
+        glUseProgram(sys.post.composite_program);
+        bind_post_texture(0, sys.post.color_texture, sys.post.composite_color_location);
+        bind_post_texture(1, sys.post.blur_textures[0], sys.post.composite_blurred_location);
+        glUniform2fv(sys.post.composite_scene_scale_location, 1, scene_scale);
+        draw_post_pass(0, sys.display.width, sys.display.height);
+    }
     
-    // draw frame
-    GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
+    glDisableVertexAttribArray(0);
+    glActiveTexture(GL_TEXTURE0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glEnable(GL_SCISSOR_TEST);
+    if (depth_test) {
+        glEnable(GL_DEPTH_TEST);
+    }
+    if (blend) {
+        glEnable(GL_BLEND);
+    }
     
-    glDisableVertexAttribArray(sys.post.shader.uniform.POST_POS);
-    glDisableVertexAttribArray(sys.post.shader.uniform.POST_TEXCOORD);
+    if (render_scale.dynamic) {
+        render_scale_end_frame();
+    }
 }
 
 static void gfx_opengl_finish_render(void) {
@@ -840,7 +2021,18 @@ struct GfxRenderingAPI gfx_opengl_api = {
     gfx_opengl_on_resize,
     gfx_opengl_start_frame,
     gfx_opengl_end_frame,
-    gfx_opengl_finish_render
+    gfx_opengl_finish_render,
+    gfx_opengl_map_vertex_buffer,
+    gfx_opengl_set_texture_size,
+    gfx_opengl_set_fog_color,
+    gfx_opengl_upload_retained_vertices,
+    gfx_opengl_delete_retained_vertices,
+    gfx_opengl_draw_retained_triangles,
+    gfx_opengl_set_vertex_uniforms,
+    gfx_opengl_create_uber_shader,
+    gfx_opengl_enable_texture_layers,
+    gfx_opengl_upload_texture_layer,
+    gfx_opengl_release_texture
 };
 
 #endif
@@ -5,4 +5,10 @@
 
 extern struct GfxRenderingAPI gfx_opengl_api;
 
+// 0 disables depth of field, 1 to 3 are low, medium and high quality
+void gfx_opengl_set_dof_quality(uint32_t quality);
+// Draws the scene at a fraction of the window size. Given a range, the scale adapts to keep the
+// GPU time of a frame within the budget, if the driver has timer queries.
+void gfx_opengl_set_render_scale(float min_scale, float max_scale, uint32_t gpu_budget_us);
+
 #endif
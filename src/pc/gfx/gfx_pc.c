@@ -1,4 +1,6 @@
 #include <math.h>
+#include <float.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +17,62 @@
 #include "gfx_window_manager_api.h"
 #include "gfx_rendering_api.h"
 #include "gfx_screen_config.h"
+#include "gfx_texture_disk_cache.h"
+#include "gfx_capture.h"
+
+#ifdef __SSE4_1__
+#include <immintrin.h>
+#define HAS_SSE41 1
+#define HAS_NEON 0
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_SSE41 0
+#define HAS_NEON 1
+#else
+#define HAS_SSE41 0
+#define HAS_NEON 0
+#endif
+
+#if HAS_SSE41
+typedef __m128 vfloat;
+typedef __m128 vmask;
+#define VF_LOAD(p) _mm_loadu_ps(p)
+#define VF_STORE(p, v) _mm_storeu_ps(p, v)
+#define VF_SET1(x) _mm_set1_ps(x)
+#define VF_ADD(a, b) _mm_add_ps(a, b)
+#define VF_MUL(a, b) _mm_mul_ps(a, b)
+#define VF_DIV(a, b) _mm_div_ps(a, b)
+#define VF_MIN(a, b) _mm_min_ps(a, b)
+#define VF_MAX(a, b) _mm_max_ps(a, b)
+#define VF_NEG(a) _mm_xor_ps(a, _mm_set1_ps(-0.0f))
+#define VF_ABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define VF_TRUNC(a) _mm_cvtepi32_ps(_mm_cvttps_epi32(a))
+#define VF_LT(a, b) _mm_cmplt_ps(a, b)
+#define VF_GT(a, b) _mm_cmpgt_ps(a, b)
+#define VF_SELECT(m, a, b) _mm_blendv_ps(b, a, m)
+#define VF_MOVEMASK(m) _mm_movemask_ps(m)
+#elif HAS_NEON
+typedef float32x4_t vfloat;
+typedef uint32x4_t vmask;
+#define VF_LOAD(p) vld1q_f32(p)
+#define VF_STORE(p, v) vst1q_f32(p, v)
+#define VF_SET1(x) vdupq_n_f32(x)
+#define VF_ADD(a, b) vaddq_f32(a, b)
+#define VF_MUL(a, b) vmulq_f32(a, b)
+#define VF_DIV(a, b) vdivq_f32(a, b)
+#define VF_MIN(a, b) vminq_f32(a, b)
+#define VF_MAX(a, b) vmaxq_f32(a, b)
+#define VF_NEG(a) vnegq_f32(a)
+#define VF_ABS(a) vabsq_f32(a)
+#define VF_TRUNC(a) vcvtq_f32_s32(vcvtq_s32_f32(a))
+#define VF_LT(a, b) vcltq_f32(a, b)
+#define VF_GT(a, b) vcgtq_f32(a, b)
+#define VF_SELECT(m, a, b) vbslq_f32(m, a, b)
+static inline int VF_MOVEMASK(uint32x4_t m) {
+    static const int32_t shifts[4] = {0, 1, 2, 3};
+    return vaddvq_u32(vshlq_u32(vshrq_n_u32(m, 31), vld1q_s32(shifts)));
+}
+#endif
 
 #define SUPPORT_CHECK(x) assert(x)
 
@@ -46,37 +104,64 @@ struct XYWidthHeight {
     uint16_t x, y, width, height;
 };
 
+// Shading a vertex was loaded with that was left to the vertex shader
+#define GPU_SHADING_LIGHTING (1 << 0)
+#define GPU_SHADING_TEXGEN   (1 << 1)
+#define GPU_SHADING_FOG      (1 << 2)
+
 struct LoadedVertex {
     float x, y, z, w;
     float u, v;
     struct RGBA color;
     uint8_t clip_rej;
+    uint8_t gpu_shading;
+    uint8_t uniforms; // index of the lights and fog parameters it was loaded with
 };
 
+#define TEXTURE_CACHE_HASH_SIZE 1024
+#define TEXTURE_CACHE_MAX_ENTRIES 2048
+
 struct TextureHashmapNode {
     struct TextureHashmapNode *next;
+    struct TextureHashmapNode *lru_prev, *lru_next;
     
     const uint8_t *texture_addr;
+    uint64_t content_hash;
     uint8_t fmt, siz;
     
     uint32_t texture_id;
+    uint32_t size_bytes; // size of the uploaded RGBA32 data
+    uint32_t serial; // changes when the node is evicted or reused
     uint8_t cms, cmt;
     bool linear_filter;
+    uint32_t texture_array; // only with texture layers
+    uint8_t texture_layer;
 };
 static struct {
-    struct TextureHashmapNode *hashmap[1024];
-    struct TextureHashmapNode pool[512];
+    struct TextureHashmapNode *hashmap[TEXTURE_CACHE_HASH_SIZE];
+    struct TextureHashmapNode pool[TEXTURE_CACHE_MAX_ENTRIES];
     uint32_t pool_pos;
-} gfx_texture_cache;
+    struct TextureHashmapNode *free_list; // evicted nodes, which keep their texture ids for reuse
+    struct TextureHashmapNode *lru_head, *lru_tail; // head is the most recently used
+    uint64_t resident_bytes;
+    uint64_t budget_bytes;
+    uint32_t next_serial;
+    bool content_hash;
+    struct GfxTextureCacheStats stats, last_frame_stats;
+} gfx_texture_cache = { .budget_bytes = 64 * 1024 * 1024 };
 
 struct ColorCombiner {
     uint32_t cc_id;
     struct ShaderProgram *prg;
     uint8_t shader_input_mapping[2][4];
+    uint8_t num_inputs;
+    bool used_textures[2];
+    uint8_t uber_combine[3][4]; // color items, alpha items and options, written per vertex for the uber shader
 };
 
-static struct ColorCombiner color_combiner_pool[64];
-static uint8_t color_combiner_pool_size;
+static struct ColorCombiner *color_combiner_pool;
+static uint32_t color_combiner_pool_size, color_combiner_pool_capacity;
+static struct ColorCombiner *prev_combiner;
 
 static struct RSP {
     float modelview_matrix_stack[11][4][4];
@@ -94,6 +179,10 @@ static struct RSP {
     uint32_t geometry_mode;
     int16_t fog_mul, fog_offset;
     
+    // Lights and fog parameters of the loaded vertices, for GPU vertex shading
+    struct GfxVertexUniforms vertex_uniforms[MAX_VERTICES];
+    uint8_t current_vertex_uniforms;
+    
     struct {
         // U0.16
         uint16_t s, t;
@@ -145,19 +234,44 @@ static struct RenderingState {
     struct XYWidthHeight viewport, scissor;
     struct ShaderProgram *shader_program;
     struct TextureHashmapNode *textures[2];
+    uint32_t texture_arrays[2];     // only with texture layers
+    uint16_t tex_width, tex_height; // only with packed vertices
+    struct RGBA fog_color;          // only with packed vertices
+    struct GfxVertexUniforms vertex_uniforms; // only with GPU vertex shading
 } rendering_state;
 
+// Backends that implement set_texture_size and set_fog_color take a packed vertex layout:
+// position as 4 floats, texture coordinates as two int16 in S10.5 texel units, the fog factor
+// in the alpha byte of an RGBA8 word and each combiner input as RGBA8.
+static bool packed_vertices;
+
+// With packed vertices, lighting, texgen and fog can be left to the vertex shader. The CPU then
+// only transforms positions, and lit vertices keep their normal in the shade color.
+static bool gpu_vertex_shading;
+
+// With an uber shader every combiner shares one program, so combiner changes don't end a batch.
+// Vertices then always have texture coordinates, fog and four inputs, followed by the combiner.
+static bool uber_shader;
+static struct ShaderProgram *uber_shader_program;
+
+// With texture layers, the backend packs textures of the same size into one texture array. Draws
+// then only rebind when the array changes, since the layer and the sampler state are per vertex.
+static bool texture_layers;
+
 struct GfxDimensions gfx_current_dimensions;
 
 static bool dropped_frame;
 
-static float buf_vbo[MAX_BUFFERED * (26 * 3)]; // 3 vertices in a triangle and 26 floats per vtx
+static float buf_vbo_storage[MAX_BUFFERED * (26 * 3)]; // 3 vertices in a triangle and 26 floats per vtx
+static float *buf_vbo = buf_vbo_storage;
 static size_t buf_vbo_len;
 static size_t buf_vbo_num_tris;
 
 static struct GfxWindowManagerAPI *gfx_wapi;
 static struct GfxRenderingAPI *gfx_rapi;
 
+static struct GfxDrawStats draw_stats, last_frame_draw_stats;
+
 #include <time.h>
 static unsigned long get_time(void) {
     struct timespec ts;
@@ -165,17 +279,785 @@ static unsigned long get_time(void) {
     return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void gfx_flush(void) {
+static void gfx_flush(enum GfxFlushReason reason) {
     if (buf_vbo_len > 0) {
-        int num = buf_vbo_num_tris;
         unsigned long t0 = get_time();
         gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
+        draw_stats.draw_calls++;
+        draw_stats.flushes[reason]++;
         buf_vbo_len = 0;
         buf_vbo_num_tris = 0;
-        unsigned long t1 = get_time();
-        /*if (t1 - t0 > 1000) {
-            printf("f: %d %d\n", num, (int)(t1 - t0));
-        }*/
+        draw_stats.draw_us += get_time() - t0;
+    }
+}
+
+// Points buf_vbo at the memory the next batch of triangles is written to. Backends that can stream
+// vertices hand out part of their mapped vertex buffer, so the triangles aren't copied again.
+static void gfx_buf_vbo_begin(bool direct) {
+    float *mapped = NULL;
+    if (direct && gfx_rapi->map_vertex_buffer != NULL) {
+        mapped = gfx_rapi->map_vertex_buffer(sizeof(buf_vbo_storage) / sizeof(float));
+    }
+    buf_vbo = mapped != NULL ? mapped : buf_vbo_storage;
+}
+
+// Render state a recorded triangle is drawn with
+struct DrawState {
+    struct ShaderProgram *shader_program;
+    struct TextureHashmapNode *textures[2];
+    uint32_t texture_arrays[2]; // instead of the textures with texture layers
+    struct XYWidthHeight viewport, scissor;
+    bool depth_test, depth_mask, decal_mode, alpha_blend;
+    bool used_textures[2];
+    bool linear_filter;
+    uint8_t cms, cmt;
+    bool use_fog;
+    uint16_t tex_width, tex_height; // only with packed vertices
+    struct RGBA fog_color;          // only with packed vertices
+    bool use_vertex_uniforms;
+    struct GfxVertexUniforms vertex_uniforms; // only with GPU vertex shading
+};
+
+struct DrawBatch {
+    struct DrawState state;
+    uint32_t order;
+    uint32_t vbo_offset, vbo_len;
+    uint32_t num_tris;
+    uint32_t retained_buffer; // nonzero for a draw of a retained display list
+    uint32_t mvp_index;
+    uint8_t cull_mode;
+    uint32_t next; // next batch of the same group during submission
+    float bounds[6]; // min x, y, z and max x, y, z of the triangles in normalized device coordinates
+};
+
+// Batches of a sortable run that are drawn together
+struct DrawGroup {
+    uint32_t first, last;
+    float bounds[6];
+};
+
+// In deferred mode, triangles are recorded into a per-frame queue instead of being drawn right away.
+// Within runs of opaque batches, a batch is moved ahead to an earlier batch with the same shader and
+// textures when it can't overlap the batches in between, so that they can be drawn together.
+static struct {
+    bool enabled;
+    float *vbo;
+    size_t vbo_len, vbo_capacity;
+    struct DrawBatch *batches;
+    uint32_t *order;
+    struct DrawGroup *groups;
+    size_t num_batches, batches_capacity;
+    float (*mvps)[4][4]; // matrices of the retained draws
+    size_t num_mvps, mvps_capacity;
+    struct TextureHashmapNode *bound_textures[2];
+    uint32_t bound_texture_arrays[2];
+} deferred;
+
+#define RETAINED_HASH_SIZE 256
+#define RETAINED_MAX_ENTRIES 1024
+#define RETAINED_MAX_CHANGES 4
+#define RETAINED_MAX_AGE 300 // frames
+
+// State groups a retained display list writes, or reads before writing
+#define RETAINED_COMBINE     (1 << 0)
+#define RETAINED_PRIM_COLOR  (1 << 1)
+#define RETAINED_ENV_COLOR   (1 << 2)
+#define RETAINED_FOG_COLOR   (1 << 3)
+#define RETAINED_FILL_COLOR  (1 << 4)
+#define RETAINED_TILE        (1 << 5)
+#define RETAINED_TILE_SIZE   (1 << 6)
+#define RETAINED_LOADED0     (1 << 7)
+#define RETAINED_LOADED1     (1 << 8)
+#define RETAINED_PALETTE     (1 << 9)
+#define RETAINED_TIMG        (1 << 10)
+#define RETAINED_SCALE       (1 << 11)
+#define RETAINED_FOG_PARAMS  (1 << 12)
+
+enum RetainedStatus {
+    RETAINED_NEW,
+    RETAINED_SEEN,     // content hashed once, compiled if unchanged next time
+    RETAINED_READY,
+    RETAINED_REJECTED
+};
+
+struct RetainedDraw {
+    struct DrawState state;
+    uint32_t texture_serials[2];
+    uint32_t vbo_offset, num_vertices;
+    uint8_t cull_mode; // 0: none, 1: front faces, 2: back faces
+};
+
+// A vertex slot the display list loaded, restored with the current matrix on replay
+struct RetainedVertex {
+    Vtx vtx;
+    float u, v;
+    struct RGBA color;
+    uint8_t slot;
+};
+
+struct RetainedExitState {
+    struct RDP rdp;
+    struct RetainedVertex *vertices;
+    uint32_t num_vertices;
+    uint32_t geometry_mode;
+    int16_t fog_mul, fog_offset;
+    uint16_t scale_s, scale_t;
+};
+
+struct RetainedDisplayList {
+    struct RetainedDisplayList *next;
+    const Gfx *dl;
+    uint64_t content_hash, state_hash;
+    uint8_t status;
+    uint8_t changes;
+    uint32_t written, depends;
+    uint32_t last_used_frame;
+    uint32_t buffer_id;
+    struct RetainedDraw *draws;
+    uint32_t num_draws;
+    struct RetainedExitState *exit_state;
+};
+
+// Retained mode: display lists whose commands and vertices don't change between frames are
+// compiled once into a GPU-resident vertex buffer plus draw records. The vertices stay in model
+// space and later frames replay the records with the current matrix, skipping the CPU transform.
+static struct {
+    bool enabled;
+    bool capturing, failed;
+    uint32_t written, depends; // during capture
+    uint32_t frame;
+    struct RetainedDisplayList *hashmap[RETAINED_HASH_SIZE];
+    struct RetainedDisplayList pool[RETAINED_MAX_ENTRIES];
+    struct RetainedDisplayList *free_list;
+    uint32_t pool_pos;
+    Vtx vertices[MAX_VERTICES + 4];    // during capture, in model space
+    bool loaded[MAX_VERTICES + 4];     // slots loaded during capture
+    float *vbo;
+    size_t vbo_len, vbo_capacity;
+    struct RetainedDraw *draws;
+    size_t num_draws, draws_capacity;
+} retained;
+
+static bool gfx_deferred_batch_is_sortable(const struct DrawState *state) {
+    // With depth test and depth writes on and no blending or decals, the draw order doesn't matter
+    return state->depth_test && state->depth_mask && !state->decal_mode && !state->alpha_blend;
+}
+
+static bool gfx_deferred_batch_same_group(const struct DrawState *a, const struct DrawState *b) {
+    return a->shader_program == b->shader_program &&
+           a->textures[0] == b->textures[0] && a->textures[1] == b->textures[1] &&
+           a->texture_arrays[0] == b->texture_arrays[0] && a->texture_arrays[1] == b->texture_arrays[1] &&
+           memcmp(&a->viewport, &b->viewport, sizeof(a->viewport)) == 0;
+}
+
+// Whether two batches may cover the same pixel at the same depth, with a margin for rasterization
+// and depth buffer precision. Equal depths pass the LEQUAL test, so such batches keep their order.
+static bool gfx_deferred_bounds_overlap(const float *a, const float *b) {
+    const float margin = 1.0f / 65536;
+    for (int i = 0; i < 3; i++) {
+        if (a[i] > b[i + 3] + margin || b[i] > a[i + 3] + margin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reorders a run of sortable batches into groups of the same shader and textures. A batch joins the
+// latest group with its state unless a group in between may overlap it, so that the order of any
+// two batches that can draw over each other is kept.
+static void gfx_deferred_group_run(size_t start, size_t end) {
+    size_t num_groups = 0;
+    for (size_t i = start; i < end; i++) {
+        uint32_t index = deferred.order[i];
+        struct DrawBatch *batch = &deferred.batches[index];
+        struct DrawGroup *target = NULL;
+        batch->next = UINT32_MAX;
+        for (size_t g = num_groups; g-- > 0;) {
+            struct DrawGroup *group = &deferred.groups[g];
+            const struct DrawState *state = &deferred.batches[group->first].state;
+            if (gfx_deferred_batch_same_group(state, &batch->state)) {
+                target = group;
+                break;
+            }
+            if (memcmp(&state->viewport, &batch->state.viewport, sizeof(state->viewport)) != 0 ||
+                gfx_deferred_bounds_overlap(group->bounds, batch->bounds)) {
+                break;
+            }
+        }
+        if (target == NULL) {
+            target = &deferred.groups[num_groups++];
+            target->first = index;
+            memcpy(target->bounds, batch->bounds, sizeof(target->bounds));
+        } else {
+            deferred.batches[target->last].next = index;
+            for (int k = 0; k < 3; k++) {
+                target->bounds[k] = fminf(target->bounds[k], batch->bounds[k]);
+                target->bounds[k + 3] = fmaxf(target->bounds[k + 3], batch->bounds[k + 3]);
+            }
+        }
+        target->last = index;
+    }
+    
+    for (size_t g = 0; g < num_groups; g++) {
+        for (uint32_t index = deferred.groups[g].first; index != UINT32_MAX; index = deferred.batches[index].next) {
+            deferred.order[start++] = index;
+        }
+    }
+}
+
+static void gfx_deferred_apply_state(const struct DrawState *state) {
+    if (state->depth_test != rendering_state.depth_test) {
+        gfx_flush(GFX_FLUSH_DEPTH_STATE);
+        gfx_rapi->set_depth_test(state->depth_test);
+        rendering_state.depth_test = state->depth_test;
+    }
+    if (state->depth_mask != rendering_state.depth_mask) {
+        gfx_flush(GFX_FLUSH_DEPTH_STATE);
+        gfx_rapi->set_depth_mask(state->depth_mask);
+        rendering_state.depth_mask = state->depth_mask;
+    }
+    if (state->decal_mode != rendering_state.decal_mode) {
+        gfx_flush(GFX_FLUSH_DEPTH_STATE);
+        gfx_rapi->set_zmode_decal(state->decal_mode);
+        rendering_state.decal_mode = state->decal_mode;
+    }
+    if (memcmp(&state->viewport, &rendering_state.viewport, sizeof(state->viewport)) != 0) {
+        gfx_flush(GFX_FLUSH_VIEWPORT_SCISSOR);
+        gfx_rapi->set_viewport(state->viewport.x, state->viewport.y, state->viewport.width, state->viewport.height);
+        rendering_state.viewport = state->viewport;
+    }
+    if (memcmp(&state->scissor, &rendering_state.scissor, sizeof(state->scissor)) != 0) {
+        gfx_flush(GFX_FLUSH_VIEWPORT_SCISSOR);
+        gfx_rapi->set_scissor(state->scissor.x, state->scissor.y, state->scissor.width, state->scissor.height);
+        rendering_state.scissor = state->scissor;
+    }
+    if (state->shader_program != rendering_state.shader_program) {
+        gfx_flush(GFX_FLUSH_SHADER);
+        gfx_rapi->unload_shader(rendering_state.shader_program);
+        gfx_rapi->load_shader(state->shader_program);
+        rendering_state.shader_program = state->shader_program;
+    }
+    if (state->alpha_blend != rendering_state.alpha_blend) {
+        gfx_flush(GFX_FLUSH_OTHER);
+        gfx_rapi->set_use_alpha(state->alpha_blend);
+        rendering_state.alpha_blend = state->alpha_blend;
+    }
+    if (packed_vertices && (state->used_textures[0] || state->used_textures[1]) &&
+        (state->tex_width != rendering_state.tex_width || state->tex_height != rendering_state.tex_height)) {
+        gfx_flush(GFX_FLUSH_TEXTURE);
+        gfx_rapi->set_texture_size(state->tex_width, state->tex_height);
+        rendering_state.tex_width = state->tex_width;
+        rendering_state.tex_height = state->tex_height;
+    }
+    if (packed_vertices && state->use_fog &&
+        memcmp(&state->fog_color, &rendering_state.fog_color, 3) != 0) {
+        gfx_flush(GFX_FLUSH_OTHER);
+        gfx_rapi->set_fog_color(state->fog_color.r, state->fog_color.g, state->fog_color.b);
+        rendering_state.fog_color = state->fog_color;
+    }
+    if (state->use_vertex_uniforms &&
+        memcmp(&state->vertex_uniforms, &rendering_state.vertex_uniforms, sizeof(state->vertex_uniforms)) != 0) {
+        gfx_flush(GFX_FLUSH_OTHER);
+        gfx_rapi->set_vertex_uniforms(&state->vertex_uniforms);
+        rendering_state.vertex_uniforms = state->vertex_uniforms;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct TextureHashmapNode *node = state->textures[i];
+        if (!state->used_textures[i]) {
+            continue;
+        }
+        if (texture_layers) {
+            if (state->texture_arrays[i] != deferred.bound_texture_arrays[i]) {
+                gfx_flush(GFX_FLUSH_TEXTURE);
+                gfx_rapi->select_texture(i, state->texture_arrays[i]);
+                deferred.bound_texture_arrays[i] = state->texture_arrays[i];
+            }
+            continue;
+        }
+        if (node != deferred.bound_textures[i]) {
+            gfx_flush(GFX_FLUSH_TEXTURE);
+            gfx_rapi->select_texture(i, node->texture_id);
+            deferred.bound_textures[i] = node;
+        }
+        if (state->linear_filter != node->linear_filter || state->cms != node->cms || state->cmt != node->cmt) {
+            gfx_flush(GFX_FLUSH_TEXTURE);
+            gfx_rapi->set_sampler_parameters(i, state->linear_filter, state->cms, state->cmt);
+            node->linear_filter = state->linear_filter;
+            node->cms = state->cms;
+            node->cmt = state->cmt;
+        }
+    }
+}
+
+static void gfx_deferred_submit(void) {
+    if (deferred.num_batches == 0) {
+        return;
+    }
+    
+    // Group each run of depth tested opaque batches
+    size_t i = 0;
+    while (i < deferred.num_batches) {
+        size_t j = i;
+        while (j < deferred.num_batches && gfx_deferred_batch_is_sortable(&deferred.batches[j].state)) {
+            j++;
+        }
+        if (j - i > 1) {
+            gfx_deferred_group_run(i, j);
+        }
+        i = j + 1;
+    }
+    
+    // Textures may have been selected by imports since the last submission
+    deferred.bound_textures[0] = deferred.bound_textures[1] = NULL;
+    deferred.bound_texture_arrays[0] = deferred.bound_texture_arrays[1] = 0;
+    
+    for (i = 0; i < deferred.num_batches; i++) {
+        const struct DrawBatch *batch = &deferred.batches[deferred.order[i]];
+        gfx_deferred_apply_state(&batch->state);
+        
+        if (batch->retained_buffer != 0) {
+            gfx_flush(GFX_FLUSH_OTHER);
+            unsigned long t0 = get_time();
+            gfx_rapi->draw_retained_triangles(batch->retained_buffer, batch->vbo_offset, batch->vbo_len, deferred.mvps[batch->mvp_index], batch->cull_mode);
+            draw_stats.draw_calls++;
+            draw_stats.triangles += batch->num_tris;
+            draw_stats.draw_us += get_time() - t0;
+            continue;
+        }
+        
+        size_t tri_len = batch->vbo_len / batch->num_tris;
+        const float *src = &deferred.vbo[batch->vbo_offset];
+        for (uint32_t t = 0; t < batch->num_tris; t++) {
+            if (buf_vbo_len == 0) {
+                gfx_buf_vbo_begin(true);
+            }
+            memcpy(&buf_vbo[buf_vbo_len], src, tri_len * sizeof(float));
+            buf_vbo_len += tri_len;
+            src += tri_len;
+            if (++buf_vbo_num_tris == MAX_BUFFERED) {
+                gfx_flush(GFX_FLUSH_BUFFER_FULL);
+            }
+        }
+    }
+    gfx_flush(GFX_FLUSH_OTHER);
+    
+    deferred.num_batches = 0;
+    deferred.vbo_len = 0;
+    deferred.num_mvps = 0;
+}
+
+static void gfx_deferred_begin_tri(const struct DrawState *state) {
+    if (deferred.num_batches > 0 && deferred.batches[deferred.num_batches - 1].retained_buffer == 0 &&
+        memcmp(&deferred.batches[deferred.num_batches - 1].state, state, sizeof(*state)) == 0) {
+        return;
+    }
+    if (deferred.num_batches == deferred.batches_capacity) {
+        deferred.batches_capacity = deferred.batches_capacity == 0 ? 1024 : deferred.batches_capacity * 2;
+        deferred.batches = realloc(deferred.batches, deferred.batches_capacity * sizeof(struct DrawBatch));
+        deferred.order = realloc(deferred.order, deferred.batches_capacity * sizeof(uint32_t));
+        deferred.groups = realloc(deferred.groups, deferred.batches_capacity * sizeof(struct DrawGroup));
+    }
+    struct DrawBatch *batch = &deferred.batches[deferred.num_batches];
+    batch->state = *state;
+    for (int i = 0; i < 3; i++) {
+        batch->bounds[i] = FLT_MAX;
+        batch->bounds[i + 3] = -FLT_MAX;
+    }
+    batch->order = deferred.num_batches;
+    batch->vbo_offset = deferred.vbo_len;
+    batch->vbo_len = 0;
+    batch->num_tris = 0;
+    batch->retained_buffer = 0;
+    deferred.order[deferred.num_batches] = deferred.num_batches;
+    deferred.num_batches++;
+    draw_stats.recorded_batches++;
+}
+
+// Moves the triangle that was just written to buf_vbo into the current batch
+static void gfx_deferred_end_tri(void) {
+    if (deferred.vbo_len + buf_vbo_len > deferred.vbo_capacity) {
+        deferred.vbo_capacity = deferred.vbo_capacity == 0 ? 65536 : deferred.vbo_capacity * 2;
+        deferred.vbo = realloc(deferred.vbo, deferred.vbo_capacity * sizeof(float));
+    }
+    memcpy(&deferred.vbo[deferred.vbo_len], buf_vbo, buf_vbo_len * sizeof(float));
+    deferred.vbo_len += buf_vbo_len;
+    
+    struct DrawBatch *batch = &deferred.batches[deferred.num_batches - 1];
+    size_t stride = buf_vbo_len / 3;
+    for (int i = 0; i < 3; i++) {
+        const float *pos = &buf_vbo[i * stride];
+        if (!(pos[3] > 0.0f)) {
+            // Crosses the eye plane, so it could be anywhere on screen
+            for (int k = 0; k < 3; k++) {
+                batch->bounds[k] = -FLT_MAX;
+                batch->bounds[k + 3] = FLT_MAX;
+            }
+            break;
+        }
+        for (int k = 0; k < 3; k++) {
+            float ndc = pos[k] / pos[3];
+            batch->bounds[k] = fminf(batch->bounds[k], ndc);
+            batch->bounds[k + 3] = fmaxf(batch->bounds[k + 3], ndc);
+        }
+    }
+    batch->vbo_len += buf_vbo_len;
+    batch->num_tris++;
+    
+    buf_vbo_len = 0;
+    buf_vbo_num_tris = 0;
+}
+
+// Queues a draw from a retained display list's vertex buffer, in order with the recorded batches
+static void gfx_deferred_add_retained(const struct RetainedDraw *draw, uint32_t buffer_id, uint32_t mvp_index) {
+    if (deferred.num_batches == deferred.batches_capacity) {
+        deferred.batches_capacity = deferred.batches_capacity == 0 ? 1024 : deferred.batches_capacity * 2;
+        deferred.batches = realloc(deferred.batches, deferred.batches_capacity * sizeof(struct DrawBatch));
+        deferred.order = realloc(deferred.order, deferred.batches_capacity * sizeof(uint32_t));
+        deferred.groups = realloc(deferred.groups, deferred.batches_capacity * sizeof(struct DrawGroup));
+    }
+    struct DrawBatch *batch = &deferred.batches[deferred.num_batches];
+    batch->state = draw->state;
+    for (int i = 0; i < 3; i++) {
+        // Not known without transforming the vertices, so it's never moved past other batches
+        batch->bounds[i] = -FLT_MAX;
+        batch->bounds[i + 3] = FLT_MAX;
+    }
+    batch->order = deferred.num_batches;
+    batch->vbo_offset = draw->vbo_offset;
+    batch->vbo_len = draw->num_vertices;
+    batch->num_tris = draw->num_vertices / 3;
+    batch->retained_buffer = buffer_id;
+    batch->mvp_index = mvp_index;
+    batch->cull_mode = draw->cull_mode;
+    deferred.order[deferred.num_batches] = deferred.num_batches;
+    deferred.num_batches++;
+    draw_stats.recorded_batches++;
+}
+
+void gfx_set_deferred_draws(bool enable) {
+    gfx_deferred_submit();
+    deferred.enabled = enable;
+}
+
+void gfx_set_gpu_vertex_shading(bool enable) {
+    gfx_flush(GFX_FLUSH_OTHER);
+    gfx_deferred_submit();
+    gpu_vertex_shading = enable && packed_vertices && gfx_rapi->set_vertex_uniforms != NULL && !uber_shader;
+}
+
+void gfx_set_uber_shader(bool enable) {
+    gfx_flush(GFX_FLUSH_OTHER);
+    gfx_deferred_submit();
+    uber_shader = enable && packed_vertices && gfx_rapi->create_uber_shader != NULL;
+    if (uber_shader) {
+        // The uber shader has no vertex shading of its own
+        gpu_vertex_shading = false;
+        if (uber_shader_program == NULL) {
+            gfx_rapi->unload_shader(rendering_state.shader_program);
+            uber_shader_program = gfx_rapi->create_uber_shader();
+            rendering_state.shader_program = uber_shader_program;
+            draw_stats.shader_creations++;
+        }
+    }
+    // Combiners hold the program they were created with
+    color_combiner_pool_size = 0;
+    prev_combiner = NULL;
+}
+
+void gfx_set_texture_layers(bool enable) {
+    // Texture ids and shaders created before would still be for plain textures
+    if (enable && !texture_layers && packed_vertices && gfx_rapi->enable_texture_layers != NULL &&
+        gfx_texture_cache.pool_pos == 0 && uber_shader_program == NULL) {
+        texture_layers = gfx_rapi->enable_texture_layers();
+    }
+}
+
+void gfx_get_draw_stats(struct GfxDrawStats *stats) {
+    *stats = last_frame_draw_stats;
+}
+
+// One CSV line per frame, per opcode counts are only available through gfx_get_draw_stats
+static struct {
+    FILE *file;
+    uint32_t frame;
+} stats_dump;
+
+void gfx_stats_dump_open(const char *filename) {
+    stats_dump.file = fopen(filename, "w");
+    if (stats_dump.file != NULL) {
+        fprintf(stats_dump.file, "frame,commands,vertices,triangles,clip_rejected,culled,draw_calls,"
+                "flush_depth,flush_viewport,flush_shader,flush_texture,flush_full,flush_other,"
+                "texture_imports,texture_upload_bytes,shader_creations,run_dl_us,draw_us,rectangles\n");
+    }
+}
+
+static void gfx_stats_dump_frame(const struct GfxDrawStats *stats) {
+    uint32_t commands = 0;
+    for (int i = 0; i < 256; i++) {
+        commands += stats->commands[i];
+    }
+    fprintf(stats_dump.file, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%llu,%u,%u,%u,%u\n",
+            stats_dump.frame++, commands, stats->vertices, stats->triangles, stats->clip_rejected, stats->culled,
+            stats->draw_calls, stats->flushes[GFX_FLUSH_DEPTH_STATE], stats->flushes[GFX_FLUSH_VIEWPORT_SCISSOR],
+            stats->flushes[GFX_FLUSH_SHADER], stats->flushes[GFX_FLUSH_TEXTURE], stats->flushes[GFX_FLUSH_BUFFER_FULL],
+            stats->flushes[GFX_FLUSH_OTHER], stats->texture_imports, (unsigned long long)stats->texture_upload_bytes,
+            stats->shader_creations, stats->run_dl_us, stats->draw_us, stats->rectangles);
+}
+
+#define CAPTURE_BUCKETS 4096 // must be a power of two
+
+// Display list capture, see gfx_capture.h for the file layout. The memory a frame's commands point to is
+// copied at the end of the frame. Blocks with the same address, size and contents as one already copied
+// are shared, so that textures keep one address (and one texture cache entry) when the capture is replayed.
+static struct {
+    FILE *file;
+    uint32_t skip_frames;
+    uint32_t frames_left;
+    uint32_t num_frames;
+    bool recording;
+
+    // The frame being recorded
+    struct GfxCaptureCommand *commands;
+    uint32_t num_commands, commands_capacity;
+    struct CaptureReference {
+        uint32_t command;
+        uint32_t size;
+        uintptr_t addr;
+    } *references;
+    uint32_t num_references, references_capacity;
+    struct CaptureRegion {
+        uintptr_t addr;
+        uint32_t size;
+        uint32_t offset;
+    } *regions;
+    uint32_t num_regions, regions_capacity;
+
+    // Shared by all frames
+    uint8_t *data;
+    size_t data_size, data_capacity;
+    struct CaptureBlock {
+        uintptr_t addr;
+        uint32_t size;
+        uint32_t offset;
+        uint32_t next; // index + 1 of the next block in the bucket
+    } *blocks;
+    uint32_t num_blocks, blocks_capacity;
+    uint32_t buckets[CAPTURE_BUCKETS];
+    uint8_t *frames;
+    size_t frames_size, frames_capacity;
+} dl_capture;
+
+void gfx_capture_open(const char *filename, uint32_t start_frame, uint32_t num_frames) {
+    if (num_frames == 0) {
+        return;
+    }
+    dl_capture.file = fopen(filename, "wb");
+    if (dl_capture.file == NULL) {
+        fprintf(stderr, "Could not open %s for the display list capture\n", filename);
+        return;
+    }
+    dl_capture.skip_frames = start_frame;
+    dl_capture.frames_left = num_frames;
+}
+
+static void *gfx_capture_grow(void *buf, uint32_t *capacity, uint32_t count, size_t elem_size) {
+    if (count == *capacity) {
+        *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        buf = realloc(buf, *capacity * elem_size);
+    }
+    return buf;
+}
+
+static size_t gfx_capture_append(uint8_t **buf, size_t *size, size_t *capacity, const void *src, size_t len, size_t align) {
+    size_t offset = (*size + align - 1) & ~(align - 1);
+    if (offset + len > *capacity) {
+        while (offset + len > *capacity) {
+            *capacity = *capacity == 0 ? 1024 * 1024 : *capacity * 2;
+        }
+        *buf = realloc(*buf, *capacity);
+    }
+    memset(*buf + *size, 0, offset - *size);
+    memcpy(*buf + offset, src, len);
+    *size = offset + len;
+    return offset;
+}
+
+static void gfx_capture_region(const void *addr, uint32_t size) {
+    dl_capture.regions = gfx_capture_grow(dl_capture.regions, &dl_capture.regions_capacity, dl_capture.num_regions, sizeof(struct CaptureRegion));
+    dl_capture.regions[dl_capture.num_regions].addr = (uintptr_t)addr;
+    dl_capture.regions[dl_capture.num_regions].size = size;
+    dl_capture.num_regions++;
+}
+
+// Appends a command to the frame. If addr is not NULL, w1 is replaced by the offset of what it points to,
+// and size bytes from there on are copied. A size of 0 is for texture images, which are copied by the loads.
+static void gfx_capture_emit(uint32_t w0, uint32_t w1, const void *addr, uint32_t size) {
+    if (addr != NULL) {
+        dl_capture.references = gfx_capture_grow(dl_capture.references, &dl_capture.references_capacity, dl_capture.num_references, sizeof(struct CaptureReference));
+        dl_capture.references[dl_capture.num_references].command = dl_capture.num_commands;
+        dl_capture.references[dl_capture.num_references].size = size;
+        dl_capture.references[dl_capture.num_references].addr = (uintptr_t)addr;
+        dl_capture.num_references++;
+        if (size != 0) {
+            gfx_capture_region(addr, size);
+        }
+        w1 = 0;
+    }
+    dl_capture.commands = gfx_capture_grow(dl_capture.commands, &dl_capture.commands_capacity, dl_capture.num_commands, sizeof(struct GfxCaptureCommand));
+    dl_capture.commands[dl_capture.num_commands].w0 = w0;
+    dl_capture.commands[dl_capture.num_commands].w1 = w1;
+    dl_capture.num_commands++;
+}
+
+static int gfx_capture_region_cmp(const void *a, const void *b) {
+    uintptr_t addr_a = ((const struct CaptureRegion *)a)->addr;
+    uintptr_t addr_b = ((const struct CaptureRegion *)b)->addr;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+static uint32_t gfx_capture_store_block(uintptr_t addr, uint32_t size) {
+    uint32_t *bucket = &dl_capture.buckets[(addr >> 3) & (CAPTURE_BUCKETS - 1)];
+    for (uint32_t i = *bucket; i != 0; i = dl_capture.blocks[i - 1].next) {
+        struct CaptureBlock *block = &dl_capture.blocks[i - 1];
+        if (block->addr == addr && block->size == size && memcmp(dl_capture.data + block->offset, (const void *)addr, size) == 0) {
+            return block->offset;
+        }
+    }
+    dl_capture.blocks = gfx_capture_grow(dl_capture.blocks, &dl_capture.blocks_capacity, dl_capture.num_blocks, sizeof(struct CaptureBlock));
+    struct CaptureBlock *block = &dl_capture.blocks[dl_capture.num_blocks++];
+    block->addr = addr;
+    block->size = size;
+    block->offset = gfx_capture_append(&dl_capture.data, &dl_capture.data_size, &dl_capture.data_capacity, (const void *)addr, size, 8);
+    block->next = *bucket;
+    *bucket = dl_capture.num_blocks;
+    return block->offset;
+}
+
+static void gfx_capture_write(void) {
+    struct GfxCaptureHeader header = {GFX_CAPTURE_MAGIC, GFX_CAPTURE_FORMAT_VERSION, dl_capture.num_frames, dl_capture.data_size};
+    bool ok = fwrite(&header, sizeof(header), 1, dl_capture.file) == 1 &&
+              fwrite(dl_capture.data, 1, dl_capture.data_size, dl_capture.file) == dl_capture.data_size &&
+              fwrite(dl_capture.frames, 1, dl_capture.frames_size, dl_capture.file) == dl_capture.frames_size;
+    // Buffered data is only written by fclose, so it can fail too
+    if (fclose(dl_capture.file) != 0 || !ok) {
+        fprintf(stderr, "Could not write the display list capture\n");
+    }
+    dl_capture.file = NULL;
+
+    free(dl_capture.commands);
+    free(dl_capture.references);
+    free(dl_capture.regions);
+    free(dl_capture.data);
+    free(dl_capture.blocks);
+    free(dl_capture.frames);
+}
+
+static void gfx_capture_end_frame(void) {
+    gfx_capture_emit((uint32_t)(uint8_t)G_ENDDL << 24, 0, NULL, 0);
+
+    // Merge overlapping regions, then copy them out
+    struct CaptureRegion *regions = dl_capture.regions;
+    uint32_t num_regions = 0;
+    qsort(regions, dl_capture.num_regions, sizeof(struct CaptureRegion), gfx_capture_region_cmp);
+    for (uint32_t i = 0; i < dl_capture.num_regions; i++) {
+        if (num_regions != 0 && regions[i].addr < regions[num_regions - 1].addr + regions[num_regions - 1].size) {
+            struct CaptureRegion *prev = &regions[num_regions - 1];
+            uintptr_t end = regions[i].addr + regions[i].size;
+            if (end > prev->addr + prev->size) {
+                prev->size = end - prev->addr;
+            }
+        } else {
+            regions[num_regions++] = regions[i];
+        }
+    }
+    for (uint32_t i = 0; i < num_regions; i++) {
+        regions[i].offset = gfx_capture_store_block(regions[i].addr, regions[i].size);
+    }
+
+    // Point the references into the copies. Texture images that are never loaded are not followed
+    // by the interpreter, so they are left as NULL.
+    uint32_t num_relocations = 0;
+    for (uint32_t i = 0; i < dl_capture.num_references; i++) {
+        uintptr_t addr = dl_capture.references[i].addr;
+        uint32_t lo = 0, hi = num_regions;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (regions[mid].addr <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo != 0 && addr < regions[lo - 1].addr + regions[lo - 1].size) {
+            struct CaptureReference *reloc = &dl_capture.references[num_relocations++];
+            *reloc = dl_capture.references[i];
+            dl_capture.commands[reloc->command].w1 = regions[lo - 1].offset + (uint32_t)(addr - regions[lo - 1].addr);
+            if (reloc->size == 0) {
+                reloc->size = regions[lo - 1].addr + regions[lo - 1].size - addr;
+            }
+        }
+    }
+
+    struct GfxCaptureFrame frame = {dl_capture.num_commands, num_relocations};
+    gfx_capture_append(&dl_capture.frames, &dl_capture.frames_size, &dl_capture.frames_capacity, &frame, sizeof(frame), 1);
+    gfx_capture_append(&dl_capture.frames, &dl_capture.frames_size, &dl_capture.frames_capacity, dl_capture.commands, dl_capture.num_commands * sizeof(struct GfxCaptureCommand), 1);
+    for (uint32_t i = 0; i < num_relocations; i++) {
+        struct GfxCaptureRelocation reloc = {dl_capture.references[i].command, dl_capture.references[i].size};
+        gfx_capture_append(&dl_capture.frames, &dl_capture.frames_size, &dl_capture.frames_capacity, &reloc, sizeof(reloc), 1);
+    }
+    dl_capture.num_commands = 0;
+    dl_capture.num_references = 0;
+    dl_capture.num_regions = 0;
+    dl_capture.num_frames++;
+
+    if (--dl_capture.frames_left == 0) {
+        dl_capture.recording = false;
+        gfx_capture_write();
+    }
+}
+
+#define SHADER_PREWARM_BUDGET_US 2000
+
+// Shader ids that have been seen, either in earlier runs (loaded from the profile file) or in this one.
+// The ones from earlier runs are compiled a few at a time at the start of each frame.
+static struct {
+    FILE *file;
+    uint32_t *ids;
+    uint32_t num_ids, ids_capacity;
+    uint32_t num_loaded; // ids that came from the file, which are the ones warmed up
+    bool use_defaults; // no profile yet, so the built-in list is warmed up instead
+    uint32_t num_prewarmed;
+} shader_profile;
+
+// Used when there is no profile yet. These are the ones used in the 120 star TAS.
+static const uint32_t default_shader_profile[] = {
+    0x01200200, 0x00000045, 0x00000200, 0x01200a00, 0x00000a00, 0x01a00045, 0x00000551,
+    0x01045045, 0x05a00a00, 0x01200045, 0x05045045, 0x01045a00, 0x01a00a00, 0x0000038d,
+    0x01081081, 0x0120038d, 0x03200045, 0x03200a00, 0x01a00a6f, 0x01141045, 0x07a00a00,
+    0x05200200, 0x03200200, 0x09200200, 0x0920038d, 0x09200045
+};
+
+static bool gfx_shader_profile_contains(uint32_t shader_id) {
+    for (uint32_t i = 0; i < shader_profile.num_ids; i++) {
+        if (shader_profile.ids[i] == shader_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void gfx_shader_profile_add(uint32_t shader_id, bool write) {
+    if (gfx_shader_profile_contains(shader_id)) {
+        return;
+    }
+    if (shader_profile.num_ids == shader_profile.ids_capacity) {
+        shader_profile.ids_capacity = shader_profile.ids_capacity == 0 ? 64 : shader_profile.ids_capacity * 2;
+        shader_profile.ids = realloc(shader_profile.ids, shader_profile.ids_capacity * sizeof(uint32_t));
+    }
+    shader_profile.ids[shader_profile.num_ids++] = shader_id;
+    if (write && shader_profile.file != NULL) {
+        fprintf(shader_profile.file, "%08x\n", shader_id);
+        fflush(shader_profile.file);
     }
 }
 
@@ -185,10 +1067,35 @@ static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint32_t shader
         gfx_rapi->unload_shader(rendering_state.shader_program);
         prg = gfx_rapi->create_and_load_new_shader(shader_id);
         rendering_state.shader_program = prg;
+        draw_stats.shader_creations++;
     }
     return prg;
 }
 
+static void gfx_shader_profile_prewarm(void) {
+    const uint32_t *ids = shader_profile.use_defaults ? default_shader_profile : shader_profile.ids;
+    uint32_t num_ids = shader_profile.use_defaults ? sizeof(default_shader_profile) / sizeof(default_shader_profile[0]) : shader_profile.num_loaded;
+    unsigned long t0 = get_time();
+    while (shader_profile.num_prewarmed < num_ids && get_time() - t0 < SHADER_PREWARM_BUDGET_US) {
+        gfx_lookup_or_create_shader_program(ids[shader_profile.num_prewarmed++]);
+    }
+}
+
+void gfx_shader_profile_load(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file != NULL) {
+        unsigned int shader_id;
+        while (fscanf(file, "%x", &shader_id) == 1) {
+            gfx_shader_profile_add(shader_id, false);
+        }
+        fclose(file);
+    }
+    shader_profile.num_loaded = shader_profile.num_ids;
+    shader_profile.use_defaults = file == NULL;
+    
+    shader_profile.file = fopen(filename, "a");
+}
+
 static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
     uint8_t c[2][4];
     uint32_t shader_id = (cc_id >> 24) << 24;
@@ -231,13 +1138,26 @@ static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
             shader_id |= val << (i * 12 + j * 3);
         }
     }
+    struct CCFeatures cc_features;
+    gfx_cc_get_features(shader_id, &cc_features);
     comb->cc_id = cc_id;
-    comb->prg = gfx_lookup_or_create_shader_program(shader_id);
+    comb->prg = uber_shader ? uber_shader_program : gfx_lookup_or_create_shader_program(shader_id);
+    if (!uber_shader) {
+        // Only recorded when used, so the warm-up doesn't put the built-in list into the file
+        gfx_shader_profile_add(shader_id, true);
+    }
     memcpy(comb->shader_input_mapping, shader_input_mapping, sizeof(shader_input_mapping));
+    comb->num_inputs = cc_features.num_inputs;
+    comb->used_textures[0] = cc_features.used_textures[0];
+    comb->used_textures[1] = cc_features.used_textures[1];
+    memcpy(comb->uber_combine, cc_features.c, sizeof(cc_features.c));
+    comb->uber_combine[2][0] = cc_features.opt_alpha;
+    comb->uber_combine[2][1] = cc_features.opt_fog;
+    comb->uber_combine[2][2] = cc_features.opt_texture_edge;
+    comb->uber_combine[2][3] = cc_features.opt_noise;
 }
 
 static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id) {
-    static struct ColorCombiner *prev_combiner;
     if (prev_combiner != NULL && prev_combiner->cc_id == cc_id) {
         return prev_combiner;
     }
@@ -247,225 +1167,466 @@ static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id)
             return prev_combiner = &color_combiner_pool[i];
         }
     }
-    gfx_flush();
+    if (!uber_shader) {
+        // Creating the program binds it
+        gfx_flush(GFX_FLUSH_SHADER);
+    }
+    if (color_combiner_pool_size == color_combiner_pool_capacity) {
+        // The lighting and fog options are part of the id, so there can be more than 64
+        color_combiner_pool_capacity = color_combiner_pool_capacity == 0 ? 64 : color_combiner_pool_capacity * 2;
+        color_combiner_pool = realloc(color_combiner_pool, color_combiner_pool_capacity * sizeof(struct ColorCombiner));
+    }
     struct ColorCombiner *comb = &color_combiner_pool[color_combiner_pool_size++];
     gfx_generate_cc(comb, cc_id);
     return prev_combiner = comb;
 }
 
+static uint64_t gfx_hash_bytes(uint64_t h, const uint8_t *data, size_t len) {
+    const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * mul;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ data[i]) * mul;
+    }
+    return h ^ (h >> 32);
+}
+
+static void gfx_texture_cache_lru_unlink(struct TextureHashmapNode *node) {
+    if (node->lru_prev != NULL) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        gfx_texture_cache.lru_head = node->lru_next;
+    }
+    if (node->lru_next != NULL) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        gfx_texture_cache.lru_tail = node->lru_prev;
+    }
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void gfx_texture_cache_lru_push_front(struct TextureHashmapNode *node) {
+    node->lru_prev = NULL;
+    node->lru_next = gfx_texture_cache.lru_head;
+    if (gfx_texture_cache.lru_head != NULL) {
+        gfx_texture_cache.lru_head->lru_prev = node;
+    } else {
+        gfx_texture_cache.lru_tail = node;
+    }
+    gfx_texture_cache.lru_head = node;
+}
+
+static size_t gfx_texture_cache_bucket(const uint8_t *orig_addr, uint64_t content_hash) {
+    if (gfx_texture_cache.content_hash) {
+        return content_hash & (TEXTURE_CACHE_HASH_SIZE - 1);
+    }
+    return ((uintptr_t)orig_addr >> 5) & (TEXTURE_CACHE_HASH_SIZE - 1);
+}
+
+// The texture is about to be overwritten, so queued triangles using it must be drawn first
+static void gfx_texture_cache_release_node(struct TextureHashmapNode *node) {
+    for (size_t i = 0; i < deferred.num_batches; i++) {
+        const struct DrawState *state = &deferred.batches[i].state;
+        for (int k = 0; k < 2; k++) {
+            // A reused layer can move to another array, so with texture layers any queued texture counts
+            if (state->used_textures[k] && (texture_layers || state->textures[k] == node)) {
+                gfx_flush(GFX_FLUSH_TEXTURE);
+                gfx_deferred_submit();
+                return;
+            }
+        }
+    }
+}
+
+static void gfx_texture_cache_evict(struct TextureHashmapNode *node) {
+    struct TextureHashmapNode **link = &gfx_texture_cache.hashmap[gfx_texture_cache_bucket(node->texture_addr, node->content_hash)];
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    gfx_texture_cache_lru_unlink(node);
+    gfx_texture_cache.resident_bytes -= node->size_bytes;
+    node->size_bytes = 0;
+    node->serial = 0;
+    node->next = gfx_texture_cache.free_list;
+    gfx_texture_cache.free_list = node;
+    gfx_texture_cache.stats.evictions++;
+}
+
+// Evicts least recently used textures until the cache fits its budget.
+// Textures currently bound to a tile are never evicted.
+static void gfx_texture_cache_enforce_budget(void) {
+    struct TextureHashmapNode *node = gfx_texture_cache.lru_tail;
+    while (node != NULL && gfx_texture_cache.resident_bytes > gfx_texture_cache.budget_bytes) {
+        struct TextureHashmapNode *prev = node->lru_prev;
+        if (node != rendering_state.textures[0] && node != rendering_state.textures[1]) {
+            gfx_texture_cache_evict(node);
+            if (gfx_rapi->release_texture != NULL) {
+                // Otherwise the backend keeps the storage until the node is reused
+                gfx_texture_cache_release_node(node);
+                gfx_rapi->release_texture(node->texture_id);
+            }
+        }
+        node = prev;
+    }
+}
+
+static struct TextureHashmapNode *gfx_texture_cache_alloc_node(void) {
+    struct TextureHashmapNode *node = gfx_texture_cache.free_list;
+    if (node != NULL) {
+        gfx_texture_cache_release_node(node);
+        gfx_texture_cache.free_list = node->next;
+        return node;
+    }
+    if (gfx_texture_cache.pool_pos < TEXTURE_CACHE_MAX_ENTRIES) {
+        node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
+        node->texture_id = gfx_rapi->new_texture();
+        return node;
+    }
+    // Pool is full, so take the least recently used texture that isn't bound
+    for (node = gfx_texture_cache.lru_tail; node != NULL; node = node->lru_prev) {
+        if (node != rendering_state.textures[0] && node != rendering_state.textures[1]) {
+            gfx_texture_cache_release_node(node);
+            gfx_texture_cache_evict(node);
+            gfx_texture_cache.free_list = node->next;
+            return node;
+        }
+    }
+    abort();
+}
+
+static uint64_t gfx_texture_content_hash(int tile, uint32_t fmt, uint32_t siz) {
+    uint64_t h = gfx_hash_bytes(((uint64_t)fmt << 8) | siz, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes);
+    if (fmt == G_IM_FMT_CI) {
+        h = gfx_hash_bytes(h, rdp.palette, siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2);
+    }
+    return h;
+}
+
 static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, uint32_t fmt, uint32_t siz) {
-    size_t hash = (uintptr_t)orig_addr;
-    hash = (hash >> 5) & 0x3ff;
+    uint64_t content_hash = gfx_texture_cache.content_hash ? gfx_texture_content_hash(tile, fmt, siz) : 0;
+    size_t hash = gfx_texture_cache_bucket(orig_addr, content_hash);
     struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[hash];
-    while (*node != NULL && *node - gfx_texture_cache.pool < (int)gfx_texture_cache.pool_pos) {
-        if ((*node)->texture_addr == orig_addr && (*node)->fmt == fmt && (*node)->siz == siz) {
-            gfx_rapi->select_texture(tile, (*node)->texture_id);
+    while (*node != NULL) {
+        bool match = gfx_texture_cache.content_hash ? (*node)->content_hash == content_hash : (*node)->texture_addr == orig_addr;
+        if (match && (*node)->fmt == fmt && (*node)->siz == siz) {
+            if (!texture_layers) {
+                gfx_rapi->select_texture(tile, (*node)->texture_id);
+            }
+            gfx_texture_cache_lru_unlink(*node);
+            gfx_texture_cache_lru_push_front(*node);
+            gfx_texture_cache.stats.hits++;
             *n = *node;
             return true;
         }
         node = &(*node)->next;
     }
-    if (gfx_texture_cache.pool_pos == sizeof(gfx_texture_cache.pool) / sizeof(struct TextureHashmapNode)) {
-        // Pool is full. We just invalidate everything and start over.
-        gfx_texture_cache.pool_pos = 0;
-        node = &gfx_texture_cache.hashmap[hash];
-        //puts("Clearing texture cache");
-    }
-    *node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
-    if ((*node)->texture_addr == NULL) {
-        (*node)->texture_id = gfx_rapi->new_texture();
-    }
-    gfx_rapi->select_texture(tile, (*node)->texture_id);
-    gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
-    (*node)->cms = 0;
-    (*node)->cmt = 0;
-    (*node)->linear_filter = false;
-    (*node)->next = NULL;
-    (*node)->texture_addr = orig_addr;
-    (*node)->fmt = fmt;
-    (*node)->siz = siz;
-    *n = *node;
+    
+    struct TextureHashmapNode *new_node = gfx_texture_cache_alloc_node();
+    new_node->next = gfx_texture_cache.hashmap[hash];
+    gfx_texture_cache.hashmap[hash] = new_node;
+    gfx_texture_cache_lru_push_front(new_node);
+    
+    if (!texture_layers) {
+        gfx_rapi->select_texture(tile, new_node->texture_id);
+        gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+    }
+    new_node->cms = 0;
+    new_node->cmt = 0;
+    new_node->linear_filter = false;
+    new_node->texture_addr = orig_addr;
+    new_node->content_hash = content_hash;
+    new_node->fmt = fmt;
+    new_node->siz = siz;
+    new_node->size_bytes = 0;
+    new_node->serial = ++gfx_texture_cache.next_serial;
+    gfx_texture_cache.stats.misses++;
+    *n = new_node;
     return false;
 }
 
-static void import_texture_rgba16(int tile) {
-    uint8_t rgba32_buf[8192];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint16_t col16 = (rdp.loaded_texture[tile].addr[2 * i] << 8) | rdp.loaded_texture[tile].addr[2 * i + 1];
+// Called after a texture has been uploaded to account for its size
+static void gfx_texture_cache_uploaded(struct TextureHashmapNode *node, uint32_t size_bytes) {
+    node->size_bytes = size_bytes;
+    gfx_texture_cache.resident_bytes += size_bytes;
+    gfx_texture_cache.stats.upload_bytes += size_bytes;
+    gfx_texture_cache_enforce_budget();
+}
+
+void gfx_texture_cache_set_budget(uint32_t budget_bytes) {
+    gfx_texture_cache.budget_bytes = budget_bytes;
+}
+
+void gfx_texture_cache_set_content_hash(bool enable) {
+    if (gfx_texture_cache.content_hash != enable) {
+        // Entries are bucketed by address or hash depending on the mode, so start over
+        memset(gfx_texture_cache.hashmap, 0, sizeof(gfx_texture_cache.hashmap));
+        gfx_texture_cache.free_list = NULL;
+        for (uint32_t i = 0; i < gfx_texture_cache.pool_pos; i++) {
+            gfx_texture_cache.pool[i].size_bytes = 0;
+            gfx_texture_cache.pool[i].lru_prev = gfx_texture_cache.pool[i].lru_next = NULL;
+            gfx_texture_cache.pool[i].next = gfx_texture_cache.free_list;
+            gfx_texture_cache.free_list = &gfx_texture_cache.pool[i];
+        }
+        gfx_texture_cache.lru_head = gfx_texture_cache.lru_tail = NULL;
+        gfx_texture_cache.resident_bytes = 0;
+        rendering_state.textures[0] = rendering_state.textures[1] = NULL;
+        rdp.textures_changed[0] = rdp.textures_changed[1] = true;
+        gfx_texture_cache.content_hash = enable;
+    }
+}
+
+void gfx_texture_cache_get_stats(struct GfxTextureCacheStats *stats) {
+    *stats = gfx_texture_cache.last_frame_stats;
+}
+
+// Texel decode tables, built once in gfx_texture_decoder_init. Entries are RGBA32 texels
+// stored in memory byte order, so they can be copied straight into the output buffer.
+static uint32_t rgba16_lut[65536];
+static uint32_t ia8_lut[256];
+static uint32_t ia4_lut[256][2];
+static uint32_t i4_lut[256][2];
+
+// CI decode tables, rebuilt only when the palette contents change
+static struct {
+    const uint8_t *addr;
+    uint8_t raw[256 * 2];
+    uint32_t lut[256];
+} tlut_cache_ci4, tlut_cache_ci8;
+
+// TMEM is 4 kB, so a 4-bit texture expands to at most 8192 RGBA32 texels
+static uint32_t rgba32_buf[8192];
+
+static uint32_t make_rgba32(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    uint8_t bytes[4] = { r, g, b, a };
+    uint32_t texel;
+    memcpy(&texel, bytes, 4);
+    return texel;
+}
+
+static void gfx_texture_decoder_init(void) {
+    for (uint32_t col16 = 0; col16 < 65536; col16++) {
         uint8_t a = col16 & 1;
         uint8_t r = col16 >> 11;
         uint8_t g = (col16 >> 6) & 0x1f;
         uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+        rgba16_lut[col16] = make_rgba32(SCALE_5_8(r), SCALE_5_8(g), SCALE_5_8(b), a ? 255 : 0);
+    }
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint8_t intensity = byte >> 4;
+        uint8_t alpha = byte & 0xf;
+        ia8_lut[byte] = make_rgba32(SCALE_4_8(intensity), SCALE_4_8(intensity), SCALE_4_8(intensity), SCALE_4_8(alpha));
+        
+        for (int j = 0; j < 2; j++) {
+            uint8_t part = (byte >> (4 - j * 4)) & 0xf;
+            uint8_t ia_intensity = part >> 1;
+            uint8_t ia_alpha = part & 1;
+            ia4_lut[byte][j] = make_rgba32(SCALE_3_8(ia_intensity), SCALE_3_8(ia_intensity), SCALE_3_8(ia_intensity), ia_alpha ? 255 : 0);
+            i4_lut[byte][j] = make_rgba32(SCALE_4_8(part), SCALE_4_8(part), SCALE_4_8(part), 255);
+        }
+    }
+}
+
+static const uint32_t *gfx_lookup_tlut(int num_colors) {
+    __typeof__(tlut_cache_ci8) *cache = num_colors == 16 ? &tlut_cache_ci4 : &tlut_cache_ci8;
+    if (cache->addr == rdp.palette && memcmp(cache->raw, rdp.palette, num_colors * 2) == 0) {
+        return cache->lut;
+    }
+    cache->addr = rdp.palette;
+    memcpy(cache->raw, rdp.palette, num_colors * 2);
+    for (int i = 0; i < num_colors; i++) {
+        cache->lut[i] = rgba16_lut[(rdp.palette[i * 2] << 8) | rdp.palette[i * 2 + 1]]; // Big endian load
+    }
+    return cache->lut;
+}
+
+// Expands 8-bit intensity texels to (i, i, i, 255), returns the number of texels done
+static uint32_t decode_i8_simd(uint32_t *dst, const uint8_t *src, uint32_t n) {
+    uint32_t i = 0;
+#if HAS_SSE41
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i m0 = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+    const __m128i m1 = _mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+    const __m128i m2 = _mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1);
+    const __m128i m3 = _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i + 0), _mm_or_si128(_mm_shuffle_epi8(x, m0), alpha));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_or_si128(_mm_shuffle_epi8(x, m1), alpha));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_or_si128(_mm_shuffle_epi8(x, m2), alpha));
+        _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_or_si128(_mm_shuffle_epi8(x, m3), alpha));
+    }
+#elif HAS_NEON
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t x = vld1q_u8(src + i);
+        uint8x16x4_t out = {{ x, x, x, vdupq_n_u8(255) }};
+        vst4q_u8((uint8_t *)(dst + i), out);
+    }
+#endif
+    return i;
+}
+
+// Expands 16-bit (intensity, alpha) texels to (i, i, i, a), returns the number of texels done
+static uint32_t decode_ia16_simd(uint32_t *dst, const uint8_t *src, uint32_t n) {
+    uint32_t i = 0;
+#if HAS_SSE41
+    const __m128i m0 = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    const __m128i m1 = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(dst + i + 0), _mm_shuffle_epi8(x, m0));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_shuffle_epi8(x, m1));
+    }
+#elif HAS_NEON
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t x = vld2q_u8(src + 2 * i);
+        uint8x16x4_t out = {{ x.val[0], x.val[0], x.val[0], x.val[1] }};
+        vst4q_u8((uint8_t *)(dst + i), out);
+    }
+#endif
+    return i;
+}
+
+// Key of the texture being decoded in the disk cache, 0 if it shouldn't be stored there
+static uint64_t disk_cache_key;
+// Texture being imported, which layered uploads are placed for
+static struct TextureHashmapNode *import_node;
+
+static void gfx_upload_texture(const uint8_t *rgba32_buf, uint32_t width, uint32_t height) {
+    if (texture_layers) {
+        import_node->texture_array = gfx_rapi->upload_texture_layer(import_node->texture_id, rgba32_buf, width, height, &import_node->texture_layer);
+    } else {
+        gfx_rapi->upload_texture(rgba32_buf, width, height);
+    }
+    draw_stats.texture_upload_bytes += width * height * 4;
+}
+
+static void gfx_upload_decoded_texture(const uint8_t *buf, uint32_t width, uint32_t height) {
+    gfx_upload_texture(buf, width, height);
+    if (disk_cache_key != 0) {
+        gfx_texture_disk_cache_store(disk_cache_key, buf, width, height);
+    }
+}
+
+static void import_texture_rgba16(int tile) {
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    
+    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
+        rgba32_buf[i] = rgba16_lut[(addr[2 * i] << 8) | addr[2 * i + 1]];
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_rgba32(int tile) {
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = (rdp.loaded_texture[tile].size_bytes / 2) / rdp.texture_tile.line_size_bytes;
-    gfx_rapi->upload_texture(rdp.loaded_texture[tile].addr, width, height);
+    gfx_upload_texture(rdp.loaded_texture[tile].addr, width, height);
 }
 
 static void import_texture_ia4(int tile) {
-    uint8_t rgba32_buf[32768];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint8_t intensity = part >> 1;
-        uint8_t alpha = part & 1;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_3_8(r);
-        rgba32_buf[4*i + 1] = SCALE_3_8(g);
-        rgba32_buf[4*i + 2] = SCALE_3_8(b);
-        rgba32_buf[4*i + 3] = alpha ? 255 : 0;
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    
+    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
+        memcpy(&rgba32_buf[2 * i], ia4_lut[addr[i]], 8);
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_ia8(int tile) {
-    uint8_t rgba32_buf[16384];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
     
     for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i] >> 4;
-        uint8_t alpha = rdp.loaded_texture[tile].addr[i] & 0xf;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = SCALE_4_8(alpha);
+        rgba32_buf[i] = ia8_lut[addr[i]];
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_ia16(int tile) {
-    uint8_t rgba32_buf[8192];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    uint32_t n = rdp.loaded_texture[tile].size_bytes / 2;
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[2 * i];
-        uint8_t alpha = rdp.loaded_texture[tile].addr[2 * i + 1];
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = alpha;
+    for (uint32_t i = decode_ia16_simd(rgba32_buf, addr, n); i < n; i++) {
+        rgba32_buf[i] = make_rgba32(addr[2 * i], addr[2 * i], addr[2 * i], addr[2 * i + 1]);
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_i4(int tile) {
-    uint8_t rgba32_buf[32768];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
 
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint8_t intensity = part;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = 255;
+    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
+        memcpy(&rgba32_buf[2 * i], i4_lut[addr[i]], 8);
     }
 
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_i8(int tile) {
-    uint8_t rgba32_buf[16384];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    uint32_t n = rdp.loaded_texture[tile].size_bytes;
 
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i];
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = 255;
+    for (uint32_t i = decode_i8_simd(rgba32_buf, addr, n); i < n; i++) {
+        rgba32_buf[i] = make_rgba32(addr[i], addr[i], addr[i], 255);
     }
 
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 
 static void import_texture_ci4(int tile) {
-    uint8_t rgba32_buf[32768];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    const uint32_t *tlut = gfx_lookup_tlut(16);
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t idx = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
-        uint8_t a = col16 & 1;
-        uint8_t r = col16 >> 11;
-        uint8_t g = (col16 >> 6) & 0x1f;
-        uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
+        rgba32_buf[2 * i + 0] = tlut[addr[i] >> 4];
+        rgba32_buf[2 * i + 1] = tlut[addr[i] & 0xf];
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture_ci8(int tile) {
-    uint8_t rgba32_buf[16384];
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    const uint32_t *tlut = gfx_lookup_tlut(256);
     
     for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t idx = rdp.loaded_texture[tile].addr[i];
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
-        uint8_t a = col16 & 1;
-        uint8_t r = col16 >> 11;
-        uint8_t g = (col16 >> 6) & 0x1f;
-        uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+        rgba32_buf[i] = tlut[addr[i]];
     }
     
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_decoded_texture((const uint8_t *)rgba32_buf, width, height);
 }
 
 static void import_texture(int tile) {
@@ -475,8 +1636,24 @@ static void import_texture(int tile) {
     if (gfx_texture_cache_lookup(tile, &rendering_state.textures[tile], rdp.loaded_texture[tile].addr, fmt, siz)) {
         return;
     }
+    draw_stats.texture_imports++;
+    import_node = rendering_state.textures[tile];
+    
+    disk_cache_key = 0;
+    if (gfx_texture_disk_cache_is_open() && !(fmt == G_IM_FMT_RGBA && siz == G_IM_SIZ_32b)) {
+        uint64_t content_hash = gfx_texture_cache.content_hash ? rendering_state.textures[tile]->content_hash : gfx_texture_content_hash(tile, fmt, siz);
+        uint32_t line_size = rdp.texture_tile.line_size_bytes;
+        uint32_t width, height;
+        // The decoded dimensions depend on the line size, so it's part of the key
+        disk_cache_key = gfx_hash_bytes(content_hash, (const uint8_t *)&line_size, sizeof(line_size));
+        const uint8_t *cached = gfx_texture_disk_cache_find(disk_cache_key, &width, &height);
+        if (cached != NULL) {
+            gfx_upload_texture(cached, width, height);
+            gfx_texture_cache_uploaded(rendering_state.textures[tile], width * height * 4);
+            return;
+        }
+    }
     
-    int t0 = get_time();
     if (fmt == G_IM_FMT_RGBA) {
         if (siz == G_IM_SIZ_16b) {
             import_texture_rgba16(tile);
@@ -514,8 +1691,16 @@ static void import_texture(int tile) {
     } else {
         abort();
     }
-    int t1 = get_time();
-    //printf("Time diff: %d\n", t1 - t0);
+    
+    uint32_t size_bytes = rdp.loaded_texture[tile].size_bytes;
+    if (siz == G_IM_SIZ_4b) {
+        size_bytes *= 8;
+    } else if (siz == G_IM_SIZ_8b) {
+        size_bytes *= 4;
+    } else if (siz == G_IM_SIZ_16b) {
+        size_bytes *= 2;
+    }
+    gfx_texture_cache_uploaded(rendering_state.textures[tile], size_bytes);
 }
 
 static void gfx_normalize_vector(float v[3]) {
@@ -607,109 +1792,502 @@ static float gfx_adjust_x_for_aspect_ratio(float x) {
     return x * (4.0f / 3.0f) / ((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
 }
 
-static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
-    for (size_t i = 0; i < n_vertices; i++, dest_index++) {
-        const Vtx_t *v = &vertices[i].v;
-        const Vtx_tn *vn = &vertices[i].n;
-        struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
-        
-        float x = v->ob[0] * rsp.MP_matrix[0][0] + v->ob[1] * rsp.MP_matrix[1][0] + v->ob[2] * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
-        float y = v->ob[0] * rsp.MP_matrix[0][1] + v->ob[1] * rsp.MP_matrix[1][1] + v->ob[2] * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
-        float z = v->ob[0] * rsp.MP_matrix[0][2] + v->ob[1] * rsp.MP_matrix[1][2] + v->ob[2] * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
-        float w = v->ob[0] * rsp.MP_matrix[0][3] + v->ob[1] * rsp.MP_matrix[1][3] + v->ob[2] * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
+static void gfx_calculate_lights(void) {
+    for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+        calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
+    }
+    static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
+    static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
+    calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
+    calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
+    rsp.lights_changed = false;
+}
+
+// Snapshots the lights and fog parameters the vertices being loaded are shaded with. Returns the
+// index of the snapshot, which is reused while the parameters stay the same.
+static uint8_t gfx_update_vertex_uniforms(size_t dest_index, size_t n_vertices) {
+    struct GfxVertexUniforms snapshot;
+    struct GfxVertexUniforms *u = &snapshot;
+    memset(u, 0, sizeof(*u));
+    if (rsp.geometry_mode & G_LIGHTING) {
+        for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+            for (int c = 0; c < 3; c++) {
+                u->light_dirs[i][c] = rsp.current_lights_coeffs[i][c];
+                u->light_colors[i][c] = rsp.current_lights[i].col[c];
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            u->ambient_color[c] = rsp.current_lights[rsp.current_num_lights - 1].col[c];
+            u->lookat[0][c] = rsp.current_lookat_coeffs[0][c];
+            u->lookat[1][c] = rsp.current_lookat_coeffs[1][c];
+        }
+    }
+    if (rsp.geometry_mode & G_FOG) {
+        u->params[1] = rsp.fog_mul;
+        u->params[2] = rsp.fog_offset;
+    }
+    if (memcmp(u, &rsp.vertex_uniforms[rsp.current_vertex_uniforms], sizeof(*u)) == 0) {
+        return rsp.current_vertex_uniforms;
+    }
+    
+    // Take a snapshot that none of the vertices staying loaded still refers to
+    bool used[MAX_VERTICES] = { false };
+    for (size_t i = 0; i < MAX_VERTICES; i++) {
+        if ((i < dest_index || i >= dest_index + n_vertices) && rsp.loaded_vertices[i].gpu_shading != 0) {
+            used[rsp.loaded_vertices[i].uniforms] = true;
+        }
+    }
+    uint8_t index = 0;
+    while (used[index]) {
+        index++;
+    }
+    rsp.vertex_uniforms[index] = snapshot;
+    rsp.current_vertex_uniforms = index;
+    return index;
+}
+
+// Does the shading left to the vertex shader on the CPU after all, with the parameters the vertex
+// was loaded with. For triangles whose vertices can't be drawn with one vertex shader setup.
+static void gfx_shade_vertex_on_cpu(struct LoadedVertex *d) {
+    const struct GfxVertexUniforms *u = &rsp.vertex_uniforms[d->uniforms];
+    if (d->gpu_shading & GPU_SHADING_LIGHTING) {
+        // Not lit yet, so the shade color still holds the normal
+        int8_t n[3] = { (int8_t)d->color.r, (int8_t)d->color.g, (int8_t)d->color.b };
+        int r = u->ambient_color[0];
+        int g = u->ambient_color[1];
+        int b = u->ambient_color[2];
         
-        x = gfx_adjust_x_for_aspect_ratio(x);
+        for (int i = 0; i < MAX_LIGHTS; i++) {
+            float intensity = 0;
+            intensity += n[0] * u->light_dirs[i][0];
+            intensity += n[1] * u->light_dirs[i][1];
+            intensity += n[2] * u->light_dirs[i][2];
+            intensity /= 127.0f;
+            if (intensity > 0.0f) {
+                r += intensity * u->light_colors[i][0];
+                g += intensity * u->light_colors[i][1];
+                b += intensity * u->light_colors[i][2];
+            }
+        }
         
-        short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
-        short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
+        d->color.r = r > 255 ? 255 : r;
+        d->color.g = g > 255 ? 255 : g;
+        d->color.b = b > 255 ? 255 : b;
         
-        if (rsp.geometry_mode & G_LIGHTING) {
-            if (rsp.lights_changed) {
-                for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                    calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
-                }
-                static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
-                static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
-                calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
-                calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
-                rsp.lights_changed = false;
-            }
+        if (d->gpu_shading & GPU_SHADING_TEXGEN) {
+            float dotx = 0, doty = 0;
+            dotx += n[0] * u->lookat[0][0];
+            dotx += n[1] * u->lookat[0][1];
+            dotx += n[2] * u->lookat[0][2];
+            doty += n[0] * u->lookat[1][0];
+            doty += n[1] * u->lookat[1][1];
+            doty += n[2] * u->lookat[1][2];
             
-            int r = rsp.current_lights[rsp.current_num_lights - 1].col[0];
-            int g = rsp.current_lights[rsp.current_num_lights - 1].col[1];
-            int b = rsp.current_lights[rsp.current_num_lights - 1].col[2];
-            
-            for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                float intensity = 0;
-                intensity += vn->n[0] * rsp.current_lights_coeffs[i][0];
-                intensity += vn->n[1] * rsp.current_lights_coeffs[i][1];
-                intensity += vn->n[2] * rsp.current_lights_coeffs[i][2];
-                intensity /= 127.0f;
-                if (intensity > 0.0f) {
-                    r += intensity * rsp.current_lights[i].col[0];
-                    g += intensity * rsp.current_lights[i].col[1];
-                    b += intensity * rsp.current_lights[i].col[2];
-                }
+            d->u = (short)(int32_t)((dotx / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.s);
+            d->v = (short)(int32_t)((doty / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.t);
+        }
+    }
+    if (d->gpu_shading & GPU_SHADING_FOG) {
+        float w = d->w;
+        if (fabsf(w) < 0.001f) {
+            // To avoid division by zero
+            w = 0.001f;
+        }
+        
+        float winv = 1.0f / w;
+        if (winv < 0.0f) {
+            winv = 32767.0f;
+        }
+        
+        float fog_z = d->z * winv * u->params[1] + u->params[2];
+        if (fog_z < 0) fog_z = 0;
+        if (fog_z > 255) fog_z = 255;
+        d->color.a = fog_z; // Use alpha variable to store fog factor
+    }
+    d->gpu_shading = 0;
+}
+
+// Reference implementation, also used for the vertices that don't fill a whole SIMD group
+static void gfx_sp_vertex_one(const Vtx *vtx, struct LoadedVertex *d, uint32_t geometry_mode) {
+    const Vtx_t *v = &vtx->v;
+    const Vtx_tn *vn = &vtx->n;
+    
+    float x = v->ob[0] * rsp.MP_matrix[0][0] + v->ob[1] * rsp.MP_matrix[1][0] + v->ob[2] * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
+    float y = v->ob[0] * rsp.MP_matrix[0][1] + v->ob[1] * rsp.MP_matrix[1][1] + v->ob[2] * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
+    float z = v->ob[0] * rsp.MP_matrix[0][2] + v->ob[1] * rsp.MP_matrix[1][2] + v->ob[2] * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
+    float w = v->ob[0] * rsp.MP_matrix[0][3] + v->ob[1] * rsp.MP_matrix[1][3] + v->ob[2] * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
+    
+    x = gfx_adjust_x_for_aspect_ratio(x);
+    
+    short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
+    short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
+    
+    if (geometry_mode & G_LIGHTING) {
+        int r = rsp.current_lights[rsp.current_num_lights - 1].col[0];
+        int g = rsp.current_lights[rsp.current_num_lights - 1].col[1];
+        int b = rsp.current_lights[rsp.current_num_lights - 1].col[2];
+        
+        for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+            float intensity = 0;
+            intensity += vn->n[0] * rsp.current_lights_coeffs[i][0];
+            intensity += vn->n[1] * rsp.current_lights_coeffs[i][1];
+            intensity += vn->n[2] * rsp.current_lights_coeffs[i][2];
+            intensity /= 127.0f;
+            if (intensity > 0.0f) {
+                r += intensity * rsp.current_lights[i].col[0];
+                g += intensity * rsp.current_lights[i].col[1];
+                b += intensity * rsp.current_lights[i].col[2];
             }
+        }
+        
+        d->color.r = r > 255 ? 255 : r;
+        d->color.g = g > 255 ? 255 : g;
+        d->color.b = b > 255 ? 255 : b;
+        
+        if (geometry_mode & G_TEXTURE_GEN) {
+            float dotx = 0, doty = 0;
+            dotx += vn->n[0] * rsp.current_lookat_coeffs[0][0];
+            dotx += vn->n[1] * rsp.current_lookat_coeffs[0][1];
+            dotx += vn->n[2] * rsp.current_lookat_coeffs[0][2];
+            doty += vn->n[0] * rsp.current_lookat_coeffs[1][0];
+            doty += vn->n[1] * rsp.current_lookat_coeffs[1][1];
+            doty += vn->n[2] * rsp.current_lookat_coeffs[1][2];
             
-            d->color.r = r > 255 ? 255 : r;
-            d->color.g = g > 255 ? 255 : g;
-            d->color.b = b > 255 ? 255 : b;
-            
-            if (rsp.geometry_mode & G_TEXTURE_GEN) {
-                float dotx = 0, doty = 0;
-                dotx += vn->n[0] * rsp.current_lookat_coeffs[0][0];
-                dotx += vn->n[1] * rsp.current_lookat_coeffs[0][1];
-                dotx += vn->n[2] * rsp.current_lookat_coeffs[0][2];
-                doty += vn->n[0] * rsp.current_lookat_coeffs[1][0];
-                doty += vn->n[1] * rsp.current_lookat_coeffs[1][1];
-                doty += vn->n[2] * rsp.current_lookat_coeffs[1][2];
-                
-                U = (int32_t)((dotx / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.s);
-                V = (int32_t)((doty / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.t);
-            }
-        } else {
-            d->color.r = v->cn[0];
-            d->color.g = v->cn[1];
-            d->color.b = v->cn[2];
+            U = (int32_t)((dotx / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.s);
+            V = (int32_t)((doty / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.t);
+        }
+    } else {
+        d->color.r = v->cn[0];
+        d->color.g = v->cn[1];
+        d->color.b = v->cn[2];
+    }
+    
+    d->u = U;
+    d->v = V;
+    
+    // trivial clip rejection
+    d->clip_rej = 0;
+    if (x < -w) d->clip_rej |= 1;
+    if (x > w) d->clip_rej |= 2;
+    if (y < -w) d->clip_rej |= 4;
+    if (y > w) d->clip_rej |= 8;
+    if (z < -w) d->clip_rej |= 16;
+    if (z > w) d->clip_rej |= 32;
+    
+    d->x = x;
+    d->y = y;
+    d->z = z;
+    d->w = w;
+    
+    if (geometry_mode & G_FOG) {
+        if (fabsf(w) < 0.001f) {
+            // To avoid division by zero
+            w = 0.001f;
         }
         
-        d->u = U;
-        d->v = V;
+        float winv = 1.0f / w;
+        if (winv < 0.0f) {
+            winv = 32767.0f;
+        }
         
-        // trivial clip rejection
-        d->clip_rej = 0;
-        if (x < -w) d->clip_rej |= 1;
-        if (x > w) d->clip_rej |= 2;
-        if (y < -w) d->clip_rej |= 4;
-        if (y > w) d->clip_rej |= 8;
-        if (z < -w) d->clip_rej |= 16;
-        if (z > w) d->clip_rej |= 32;
+        float fog_z = z * winv * rsp.fog_mul + rsp.fog_offset;
+        if (fog_z < 0) fog_z = 0;
+        if (fog_z > 255) fog_z = 255;
+        d->color.a = fog_z; // Use alpha variable to store fog factor
+    } else {
+        d->color.a = v->cn[3];
+    }
+}
+
+#if HAS_SSE41 || HAS_NEON
+// Processes 4 vertices at a time. The operations are done in the same order as in
+// gfx_sp_vertex_one, so the results are bit-identical to the scalar path.
+static void gfx_sp_vertex_x4(const Vtx *vertices, struct LoadedVertex *d, float aspect_ratio, uint32_t geometry_mode) {
+    // Structure-of-arrays staging of the input vertices
+    float ob[3][4];
+    float n[3][4];
+    
+    // Structure-of-arrays outputs
+    float pos[4][4];
+    float rgb[3][4];
+    float texgen[2][4];
+    float fog[4];
+    int clip[6];
+    
+    for (int i = 0; i < 4; i++) {
+        ob[0][i] = vertices[i].v.ob[0];
+        ob[1][i] = vertices[i].v.ob[1];
+        ob[2][i] = vertices[i].v.ob[2];
+        n[0][i] = vertices[i].n.n[0];
+        n[1][i] = vertices[i].n.n[1];
+        n[2][i] = vertices[i].n.n[2];
+    }
+    
+    vfloat obx = VF_LOAD(ob[0]);
+    vfloat oby = VF_LOAD(ob[1]);
+    vfloat obz = VF_LOAD(ob[2]);
+    vfloat xyzw[4];
+    
+    for (int j = 0; j < 4; j++) {
+        xyzw[j] = VF_ADD(VF_ADD(VF_ADD(VF_MUL(obx, VF_SET1(rsp.MP_matrix[0][j])),
+                                       VF_MUL(oby, VF_SET1(rsp.MP_matrix[1][j]))),
+                                VF_MUL(obz, VF_SET1(rsp.MP_matrix[2][j]))),
+                         VF_SET1(rsp.MP_matrix[3][j]));
+    }
+    xyzw[0] = VF_DIV(VF_MUL(xyzw[0], VF_SET1(4.0f / 3.0f)), VF_SET1(aspect_ratio));
+    
+    vfloat w = xyzw[3];
+    vfloat neg_w = VF_NEG(w);
+    clip[0] = VF_MOVEMASK(VF_LT(xyzw[0], neg_w));
+    clip[1] = VF_MOVEMASK(VF_GT(xyzw[0], w));
+    clip[2] = VF_MOVEMASK(VF_LT(xyzw[1], neg_w));
+    clip[3] = VF_MOVEMASK(VF_GT(xyzw[1], w));
+    clip[4] = VF_MOVEMASK(VF_LT(xyzw[2], neg_w));
+    clip[5] = VF_MOVEMASK(VF_GT(xyzw[2], w));
+    
+    for (int j = 0; j < 4; j++) {
+        VF_STORE(pos[j], xyzw[j]);
+    }
+    
+    if (geometry_mode & G_LIGHTING) {
+        vfloat nx = VF_LOAD(n[0]);
+        vfloat ny = VF_LOAD(n[1]);
+        vfloat nz = VF_LOAD(n[2]);
+        vfloat col[3];
         
-        d->x = x;
-        d->y = y;
-        d->z = z;
-        d->w = w;
+        for (int c = 0; c < 3; c++) {
+            col[c] = VF_SET1(rsp.current_lights[rsp.current_num_lights - 1].col[c]);
+        }
+        for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+            vfloat intensity = VF_ADD(VF_ADD(VF_MUL(nx, VF_SET1(rsp.current_lights_coeffs[i][0])),
+                                             VF_MUL(ny, VF_SET1(rsp.current_lights_coeffs[i][1]))),
+                                      VF_MUL(nz, VF_SET1(rsp.current_lights_coeffs[i][2])));
+            intensity = VF_DIV(intensity, VF_SET1(127.0f));
+            vmask lit = VF_GT(intensity, VF_SET1(0.0f));
+            for (int c = 0; c < 3; c++) {
+                // Accumulation happens in an int in the scalar path, so truncate after each light
+                vfloat sum = VF_TRUNC(VF_ADD(col[c], VF_MUL(intensity, VF_SET1(rsp.current_lights[i].col[c]))));
+                col[c] = VF_SELECT(lit, sum, col[c]);
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            VF_STORE(rgb[c], VF_MIN(col[c], VF_SET1(255.0f)));
+        }
         
-        if (rsp.geometry_mode & G_FOG) {
-            if (fabsf(w) < 0.001f) {
-                // To avoid division by zero
-                w = 0.001f;
+        if (geometry_mode & G_TEXTURE_GEN) {
+            for (int k = 0; k < 2; k++) {
+                vfloat dot = VF_ADD(VF_ADD(VF_MUL(nx, VF_SET1(rsp.current_lookat_coeffs[k][0])),
+                                           VF_MUL(ny, VF_SET1(rsp.current_lookat_coeffs[k][1]))),
+                                    VF_MUL(nz, VF_SET1(rsp.current_lookat_coeffs[k][2])));
+                dot = VF_DIV(VF_ADD(VF_DIV(dot, VF_SET1(127.0f)), VF_SET1(1.0f)), VF_SET1(4.0f));
+                dot = VF_MUL(dot, VF_SET1(k == 0 ? rsp.texture_scaling_factor.s : rsp.texture_scaling_factor.t));
+                VF_STORE(texgen[k], dot);
             }
-            
-            float winv = 1.0f / w;
-            if (winv < 0.0f) {
-                winv = 32767.0f;
+        }
+    }
+    
+    if (geometry_mode & G_FOG) {
+        // To avoid division by zero
+        vfloat wc = VF_SELECT(VF_LT(VF_ABS(w), VF_SET1(0.001f)), VF_SET1(0.001f), w);
+        vfloat winv = VF_DIV(VF_SET1(1.0f), wc);
+        winv = VF_SELECT(VF_LT(winv, VF_SET1(0.0f)), VF_SET1(32767.0f), winv);
+        vfloat fog_z = VF_ADD(VF_MUL(VF_MUL(xyzw[2], winv), VF_SET1(rsp.fog_mul)), VF_SET1(rsp.fog_offset));
+        fog_z = VF_MIN(VF_MAX(fog_z, VF_SET1(0.0f)), VF_SET1(255.0f));
+        VF_STORE(fog, fog_z);
+    }
+    
+    // Scatter back into the array-of-structures vertex cache
+    for (int i = 0; i < 4; i++) {
+        const Vtx_t *v = &vertices[i].v;
+        short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
+        short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
+        
+        if (geometry_mode & G_LIGHTING) {
+            d[i].color.r = rgb[0][i];
+            d[i].color.g = rgb[1][i];
+            d[i].color.b = rgb[2][i];
+            if (geometry_mode & G_TEXTURE_GEN) {
+                U = (int32_t)texgen[0][i];
+                V = (int32_t)texgen[1][i];
             }
-            
-            float fog_z = z * winv * rsp.fog_mul + rsp.fog_offset;
-            if (fog_z < 0) fog_z = 0;
-            if (fog_z > 255) fog_z = 255;
-            d->color.a = fog_z; // Use alpha variable to store fog factor
         } else {
-            d->color.a = v->cn[3];
+            d[i].color.r = v->cn[0];
+            d[i].color.g = v->cn[1];
+            d[i].color.b = v->cn[2];
         }
+        d[i].color.a = (geometry_mode & G_FOG) ? (uint8_t)fog[i] : v->cn[3];
+        
+        d[i].u = U;
+        d[i].v = V;
+        d[i].clip_rej = ((clip[0] >> i) & 1) | (((clip[1] >> i) & 1) << 1) |
+                        (((clip[2] >> i) & 1) << 2) | (((clip[3] >> i) & 1) << 3) |
+                        (((clip[4] >> i) & 1) << 4) | (((clip[5] >> i) & 1) << 5);
+        d[i].x = pos[0][i];
+        d[i].y = pos[1][i];
+        d[i].z = pos[2][i];
+        d[i].w = pos[3][i];
+    }
+}
+#endif
+
+static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+    if ((rsp.geometry_mode & G_LIGHTING) && rsp.lights_changed) {
+        gfx_calculate_lights();
+    }
+    
+    draw_stats.vertices += n_vertices;
+    
+    // What the CPU does per vertex, the rest is left to the vertex shader
+    uint32_t geometry_mode = rsp.geometry_mode;
+    uint8_t gpu_shading = 0;
+    uint8_t uniforms = 0;
+    if (gpu_vertex_shading && (geometry_mode & (G_LIGHTING | G_FOG))) {
+        uniforms = gfx_update_vertex_uniforms(dest_index, n_vertices);
+        if (geometry_mode & G_LIGHTING) {
+            gpu_shading |= GPU_SHADING_LIGHTING;
+            if (geometry_mode & G_TEXTURE_GEN) {
+                gpu_shading |= GPU_SHADING_TEXGEN;
+            }
+        }
+        if (geometry_mode & G_FOG) {
+            gpu_shading |= GPU_SHADING_FOG;
+        }
+        geometry_mode &= ~(G_LIGHTING | G_TEXTURE_GEN | G_FOG);
+    }
+    
+    size_t i = 0;
+#if HAS_SSE41 || HAS_NEON
+    float aspect_ratio = (float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height;
+    for (; i + 4 <= n_vertices; i += 4) {
+        gfx_sp_vertex_x4(&vertices[i], &rsp.loaded_vertices[dest_index + i], aspect_ratio, geometry_mode);
+    }
+#endif
+    for (; i < n_vertices; i++) {
+        gfx_sp_vertex_one(&vertices[i], &rsp.loaded_vertices[dest_index + i], geometry_mode);
+    }
+    for (i = 0; i < n_vertices; i++) {
+        rsp.loaded_vertices[dest_index + i].gpu_shading = gpu_shading;
+        rsp.loaded_vertices[dest_index + i].uniforms = uniforms;
+    }
+    
+    if (retained.capturing) {
+        // Lit, fogged and texgen vertices depend on the matrix, so they can't be replayed
+        if (rsp.geometry_mode & (G_LIGHTING | G_FOG | G_TEXTURE_GEN)) {
+            retained.failed = true;
+        }
+        if (!(retained.written & RETAINED_SCALE)) {
+            retained.depends |= RETAINED_SCALE;
+        }
+        memcpy(&retained.vertices[dest_index], vertices, n_vertices * sizeof(Vtx));
+        memset(&retained.loaded[dest_index], true, n_vertices);
+    }
+}
+
+// Texel coordinate to S10.5 fixed point, the format the RSP itself uses for texture coordinates
+static inline int16_t gfx_pack_s10_5(float texel) {
+    float fixed = texel * 32.0f;
+    if (fixed < -32768.0f) fixed = -32768.0f;
+    if (fixed > 32767.0f) fixed = 32767.0f;
+    return (int16_t)lroundf(fixed);
+}
+
+static struct RGBA gfx_cc_input_color(uint8_t input, const struct LoadedVertex *v, float w) {
+    struct RGBA color;
+    switch (input) {
+        case CC_PRIM:
+            return rdp.prim_color;
+        case CC_SHADE:
+            return v->color;
+        case CC_ENV:
+            return rdp.env_color;
+        case CC_LOD:
+        {
+            float distance_frac = (w - 3000.0f) / 3000.0f;
+            if (distance_frac < 0.0f) distance_frac = 0.0f;
+            if (distance_frac > 1.0f) distance_frac = 1.0f;
+            color.r = color.g = color.b = color.a = distance_frac * 255.0f;
+            return color;
+        }
+        default:
+            memset(&color, 0, sizeof(color));
+            return color;
+    }
+}
+
+// Checks that a triangle can be replayed with a different matrix, and notes which state it reads
+// that was set before the display list started
+static bool gfx_retained_capture_supported(const struct ColorCombiner *comb, uint8_t num_inputs, const bool used_textures[2], bool use_fog) {
+    uint32_t reads = RETAINED_COMBINE;
+    if (use_fog) {
+        return false;
+    }
+    for (int i = 0; i < num_inputs; i++) {
+        for (int k = 0; k < 2; k++) {
+            switch (comb->shader_input_mapping[k][i]) {
+                case CC_LOD:
+                    return false;
+                case CC_PRIM:
+                    reads |= RETAINED_PRIM_COLOR;
+                    break;
+                case CC_ENV:
+                    reads |= RETAINED_ENV_COLOR;
+                    break;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (used_textures[i] && texture_layers) {
+            // Layers are written into the vertices, and move when a texture is evicted
+            return false;
+        }
+        if (used_textures[i]) {
+            reads |= (RETAINED_LOADED0 << i) | RETAINED_TILE | RETAINED_TILE_SIZE;
+            if (rdp.texture_tile.fmt == G_IM_FMT_CI) {
+                reads |= RETAINED_PALETTE;
+            }
+        }
+    }
+    retained.depends |= reads & ~retained.written;
+    return true;
+}
+
+static void gfx_retained_begin_tri(const struct DrawState *state) {
+    // Room for three vertices of the largest layout
+    if (retained.vbo_len + 3 * 26 > retained.vbo_capacity) {
+        retained.vbo_capacity = retained.vbo_capacity == 0 ? 65536 : retained.vbo_capacity * 2;
+        retained.vbo = realloc(retained.vbo, retained.vbo_capacity * sizeof(float));
+    }
+    
+    uint8_t cull_mode = 0;
+    switch (rsp.geometry_mode & G_CULL_BOTH) {
+        case G_CULL_FRONT:
+            cull_mode = 1;
+            break;
+        case G_CULL_BACK:
+            cull_mode = 2;
+            break;
+    }
+    
+    struct RetainedDraw *draw = retained.num_draws == 0 ? NULL : &retained.draws[retained.num_draws - 1];
+    if (draw != NULL && draw->cull_mode == cull_mode && memcmp(&draw->state, state, sizeof(*state)) == 0) {
+        return;
+    }
+    if (retained.num_draws == retained.draws_capacity) {
+        retained.draws_capacity = retained.draws_capacity == 0 ? 64 : retained.draws_capacity * 2;
+        retained.draws = realloc(retained.draws, retained.draws_capacity * sizeof(struct RetainedDraw));
+    }
+    draw = &retained.draws[retained.num_draws++];
+    draw->state = *state;
+    for (int i = 0; i < 2; i++) {
+        draw->texture_serials[i] = state->used_textures[i] ? state->textures[i]->serial : 0;
     }
+    draw->vbo_offset = retained.vbo_len;
+    draw->num_vertices = 0;
+    draw->cull_mode = cull_mode;
+}
+
+static void gfx_retained_end_tri(void) {
+    retained.draws[retained.num_draws - 1].num_vertices += 3;
 }
 
 static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
@@ -720,12 +2298,23 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     
     //if (rand()%2) return;
     
-    if (v1->clip_rej & v2->clip_rej & v3->clip_rej) {
+    if (retained.capturing) {
+        // Clipping and culling are left to the GPU, as they depend on the matrix
+        if (retained.failed || (rsp.geometry_mode & G_CULL_BOTH) == G_CULL_BOTH) {
+            return;
+        }
+        // Vertices loaded before the display list started have no model space position to replay
+        if (!retained.loaded[vtx1_idx] || !retained.loaded[vtx2_idx] || !retained.loaded[vtx3_idx]) {
+            retained.failed = true;
+            return;
+        }
+    } else if (v1->clip_rej & v2->clip_rej & v3->clip_rej) {
         // The whole triangle lies outside the visible area
+        draw_stats.clip_rejected++;
         return;
     }
     
-    if ((rsp.geometry_mode & G_CULL_BOTH) != 0) {
+    if (!retained.capturing && (rsp.geometry_mode & G_CULL_BOTH) != 0) {
         float dx1 = v1->x / (v1->w) - v2->x / (v2->w);
         float dy1 = v1->y / (v1->w) - v2->y / (v2->w);
         float dx2 = v3->x / (v3->w) - v2->x / (v2->w);
@@ -740,51 +2329,27 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
         
         switch (rsp.geometry_mode & G_CULL_BOTH) {
             case G_CULL_FRONT:
-                if (cross <= 0) return;
+                if (cross <= 0) {
+                    draw_stats.culled++;
+                    return;
+                }
                 break;
             case G_CULL_BACK:
-                if (cross >= 0) return;
+                if (cross >= 0) {
+                    draw_stats.culled++;
+                    return;
+                }
                 break;
             case G_CULL_BOTH:
                 // Why is this even an option?
+                draw_stats.culled++;
                 return;
         }
     }
     
     bool depth_test = (rsp.geometry_mode & G_ZBUFFER) == G_ZBUFFER;
-    if (depth_test != rendering_state.depth_test) {
-        gfx_flush();
-        gfx_rapi->set_depth_test(depth_test);
-        rendering_state.depth_test = depth_test;
-    }
-    
     bool z_upd = (rdp.other_mode_l & Z_UPD) == Z_UPD;
-    if (z_upd != rendering_state.depth_mask) {
-        gfx_flush();
-        gfx_rapi->set_depth_mask(z_upd);
-        rendering_state.depth_mask = z_upd;
-    }
-    
     bool zmode_decal = (rdp.other_mode_l & ZMODE_DEC) == ZMODE_DEC;
-    if (zmode_decal != rendering_state.decal_mode) {
-        gfx_flush();
-        gfx_rapi->set_zmode_decal(zmode_decal);
-        rendering_state.decal_mode = zmode_decal;
-    }
-    
-    if (rdp.viewport_or_scissor_changed) {
-        if (memcmp(&rdp.viewport, &rendering_state.viewport, sizeof(rdp.viewport)) != 0) {
-            gfx_flush();
-            gfx_rapi->set_viewport(rdp.viewport.x, rdp.viewport.y, rdp.viewport.width, rdp.viewport.height);
-            rendering_state.viewport = rdp.viewport;
-        }
-        if (memcmp(&rdp.scissor, &rendering_state.scissor, sizeof(rdp.scissor)) != 0) {
-            gfx_flush();
-            gfx_rapi->set_scissor(rdp.scissor.x, rdp.scissor.y, rdp.scissor.width, rdp.scissor.height);
-            rendering_state.scissor = rdp.scissor;
-        }
-        rdp.viewport_or_scissor_changed = false;
-    }
     
     uint32_t cc_id = rdp.combine_mode;
     
@@ -793,6 +2358,30 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     bool texture_edge = (rdp.other_mode_l & CVG_X_ALPHA) == CVG_X_ALPHA;
     bool use_noise = (rdp.other_mode_l & G_AC_DITHER) == G_AC_DITHER;
     
+    // The shading left to the vertex shader was decided when the vertices were loaded. If they don't
+    // agree on it, or were loaded with fog that is off now, it's done on the CPU after all.
+    struct LoadedVertex cpu_shaded[3];
+    uint8_t gpu_shading = v1->gpu_shading;
+    if ((v1->gpu_shading | v2->gpu_shading | v3->gpu_shading) != 0) {
+        const struct GfxVertexUniforms *u1 = &rsp.vertex_uniforms[v1->uniforms];
+        bool same = v2->gpu_shading == gpu_shading && v3->gpu_shading == gpu_shading &&
+            (v2->uniforms == v1->uniforms || memcmp(&rsp.vertex_uniforms[v2->uniforms], u1, sizeof(*u1)) == 0) &&
+            (v3->uniforms == v1->uniforms || memcmp(&rsp.vertex_uniforms[v3->uniforms], u1, sizeof(*u1)) == 0);
+        if (!same || !gpu_vertex_shading || ((gpu_shading & GPU_SHADING_FOG) && !use_fog)) {
+            for (int i = 0; i < 3; i++) {
+                cpu_shaded[i] = *v_arr[i];
+                gfx_shade_vertex_on_cpu(&cpu_shaded[i]);
+                v_arr[i] = &cpu_shaded[i];
+            }
+            v1 = v_arr[0];
+            v2 = v_arr[1];
+            v3 = v_arr[2];
+            gpu_shading = 0;
+        }
+    }
+    bool gpu_lighting = (gpu_shading & GPU_SHADING_LIGHTING) != 0;
+    bool vertex_fog = use_fog && (gpu_shading & GPU_SHADING_FOG);
+    
     if (texture_edge) {
         use_alpha = true;
     }
@@ -801,6 +2390,8 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     if (use_fog) cc_id |= SHADER_OPT_FOG;
     if (texture_edge) cc_id |= SHADER_OPT_TEXTURE_EDGE;
     if (use_noise) cc_id |= SHADER_OPT_NOISE;
+    if (gpu_lighting) cc_id |= SHADER_OPT_LIGHTING;
+    if (vertex_fog) cc_id |= SHADER_OPT_VERTEX_FOG;
     
     if (!use_alpha) {
         cc_id &= ~0xfff000;
@@ -808,56 +2399,244 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     
     struct ColorCombiner *comb = gfx_lookup_or_create_color_combiner(cc_id);
     struct ShaderProgram *prg = comb->prg;
-    if (prg != rendering_state.shader_program) {
-        gfx_flush();
-        gfx_rapi->unload_shader(rendering_state.shader_program);
-        gfx_rapi->load_shader(prg);
-        rendering_state.shader_program = prg;
+    uint8_t num_inputs = comb->num_inputs;
+    const bool *used_textures = comb->used_textures;
+    bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
+    bool use_texture = used_textures[0] || used_textures[1];
+    uint32_t tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
+    uint32_t tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+    
+    if (retained.capturing && !gfx_retained_capture_supported(comb, num_inputs, used_textures, use_fog)) {
+        retained.failed = true;
+        return;
     }
-    if (use_alpha != rendering_state.alpha_blend) {
-        gfx_flush();
-        gfx_rapi->set_use_alpha(use_alpha);
-        rendering_state.alpha_blend = use_alpha;
+    
+    bool use_vertex_uniforms = gpu_lighting || vertex_fog;
+    struct GfxVertexUniforms vertex_uniforms;
+    if (use_vertex_uniforms) {
+        memset(&vertex_uniforms, 0, sizeof(vertex_uniforms));
+        if (gpu_lighting) {
+            memcpy(&vertex_uniforms, &rsp.vertex_uniforms[v1->uniforms], offsetof(struct GfxVertexUniforms, lit_inputs));
+            for (int j = 0; j < num_inputs; j++) {
+                vertex_uniforms.lit_inputs[j] = comb->shader_input_mapping[0][j] == CC_SHADE;
+            }
+            if (use_texture && (gpu_shading & GPU_SHADING_TEXGEN)) {
+                float filter_offset = linear_filter ? 16.0f : 0.0f; // half a texel
+                vertex_uniforms.texgen[0] = rsp.texture_scaling_factor.s;
+                vertex_uniforms.texgen[1] = rsp.texture_scaling_factor.t;
+                vertex_uniforms.texgen[2] = filter_offset - rdp.texture_tile.uls * 8;
+                vertex_uniforms.texgen[3] = filter_offset - rdp.texture_tile.ult * 8;
+                vertex_uniforms.params[0] = 1.0f;
+            }
+        }
+        if (vertex_fog) {
+            vertex_uniforms.params[1] = rsp.vertex_uniforms[v1->uniforms].params[1];
+            vertex_uniforms.params[2] = rsp.vertex_uniforms[v1->uniforms].params[2];
+        }
     }
-    uint8_t num_inputs;
-    bool used_textures[2];
-    gfx_rapi->shader_get_info(prg, &num_inputs, used_textures);
     
-    for (int i = 0; i < 2; i++) {
-        if (used_textures[i]) {
-            if (rdp.textures_changed[i]) {
-                gfx_flush();
-                import_texture(i);
-                rdp.textures_changed[i] = false;
+    if (deferred.enabled || retained.capturing) {
+        struct DrawState state;
+        memset(&state, 0, sizeof(state));
+        for (int i = 0; i < 2; i++) {
+            if (used_textures[i]) {
+                if (rdp.textures_changed[i]) {
+                    import_texture(i);
+                    rdp.textures_changed[i] = false;
+                }
+                if (texture_layers) {
+                    state.texture_arrays[i] = rendering_state.textures[i]->texture_array;
+                } else {
+                    state.textures[i] = rendering_state.textures[i];
+                }
+                state.used_textures[i] = true;
+            }
+        }
+        if (use_texture && !texture_layers) {
+            state.linear_filter = linear_filter;
+            state.cms = rdp.texture_tile.cms;
+            state.cmt = rdp.texture_tile.cmt;
+        }
+        state.shader_program = prg;
+        state.viewport = rdp.viewport;
+        state.scissor = rdp.scissor;
+        state.depth_test = depth_test;
+        state.depth_mask = z_upd;
+        state.decal_mode = zmode_decal;
+        state.alpha_blend = use_alpha;
+        if (packed_vertices && use_texture && !texture_layers) {
+            state.tex_width = tex_width;
+            state.tex_height = tex_height;
+        }
+        if (packed_vertices && use_fog) {
+            state.use_fog = true;
+            state.fog_color = rdp.fog_color;
+            state.fog_color.a = 0;
+        }
+        if (use_vertex_uniforms) {
+            state.use_vertex_uniforms = true;
+            state.vertex_uniforms = vertex_uniforms;
+        }
+        if (uber_shader && !retained.capturing && deferred.num_batches > 0) {
+            // State that this combiner doesn't read is taken from the open batch, so it can continue
+            const struct DrawState *open = &deferred.batches[deferred.num_batches - 1].state;
+            if (!use_texture) {
+                memcpy(state.textures, open->textures, sizeof(state.textures));
+                memcpy(state.texture_arrays, open->texture_arrays, sizeof(state.texture_arrays));
+                memcpy(state.used_textures, open->used_textures, sizeof(state.used_textures));
+                state.linear_filter = open->linear_filter;
+                state.cms = open->cms;
+                state.cmt = open->cmt;
+                state.tex_width = open->tex_width;
+                state.tex_height = open->tex_height;
+            }
+            if (!use_fog) {
+                state.use_fog = open->use_fog;
+                state.fog_color = open->fog_color;
+            }
+        }
+        if (retained.capturing) {
+            gfx_retained_begin_tri(&state);
+        } else {
+            gfx_deferred_begin_tri(&state);
+        }
+    } else {
+        if (depth_test != rendering_state.depth_test) {
+            gfx_flush(GFX_FLUSH_DEPTH_STATE);
+            gfx_rapi->set_depth_test(depth_test);
+            rendering_state.depth_test = depth_test;
+        }
+        
+        if (z_upd != rendering_state.depth_mask) {
+            gfx_flush(GFX_FLUSH_DEPTH_STATE);
+            gfx_rapi->set_depth_mask(z_upd);
+            rendering_state.depth_mask = z_upd;
+        }
+        
+        if (zmode_decal != rendering_state.decal_mode) {
+            gfx_flush(GFX_FLUSH_DEPTH_STATE);
+            gfx_rapi->set_zmode_decal(zmode_decal);
+            rendering_state.decal_mode = zmode_decal;
+        }
+        
+        if (rdp.viewport_or_scissor_changed) {
+            if (memcmp(&rdp.viewport, &rendering_state.viewport, sizeof(rdp.viewport)) != 0) {
+                gfx_flush(GFX_FLUSH_VIEWPORT_SCISSOR);
+                gfx_rapi->set_viewport(rdp.viewport.x, rdp.viewport.y, rdp.viewport.width, rdp.viewport.height);
+                rendering_state.viewport = rdp.viewport;
             }
-            bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
-            if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
-                gfx_flush();
-                gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
-                rendering_state.textures[i]->linear_filter = linear_filter;
-                rendering_state.textures[i]->cms = rdp.texture_tile.cms;
-                rendering_state.textures[i]->cmt = rdp.texture_tile.cmt;
+            if (memcmp(&rdp.scissor, &rendering_state.scissor, sizeof(rdp.scissor)) != 0) {
+                gfx_flush(GFX_FLUSH_VIEWPORT_SCISSOR);
+                gfx_rapi->set_scissor(rdp.scissor.x, rdp.scissor.y, rdp.scissor.width, rdp.scissor.height);
+                rendering_state.scissor = rdp.scissor;
             }
+            rdp.viewport_or_scissor_changed = false;
+        }
+        
+        if (prg != rendering_state.shader_program) {
+            gfx_flush(GFX_FLUSH_SHADER);
+            gfx_rapi->unload_shader(rendering_state.shader_program);
+            gfx_rapi->load_shader(prg);
+            rendering_state.shader_program = prg;
+        }
+        if (use_alpha != rendering_state.alpha_blend) {
+            gfx_flush(GFX_FLUSH_OTHER);
+            gfx_rapi->set_use_alpha(use_alpha);
+            rendering_state.alpha_blend = use_alpha;
+        }
+        
+        for (int i = 0; i < 2; i++) {
+            if (used_textures[i]) {
+                if (rdp.textures_changed[i]) {
+                    if (!texture_layers) {
+                        gfx_flush(GFX_FLUSH_TEXTURE);
+                    }
+                    import_texture(i);
+                    rdp.textures_changed[i] = false;
+                }
+                if (texture_layers) {
+                    uint32_t array = rendering_state.textures[i]->texture_array;
+                    if (array != rendering_state.texture_arrays[i]) {
+                        gfx_flush(GFX_FLUSH_TEXTURE);
+                        gfx_rapi->select_texture(i, array);
+                        rendering_state.texture_arrays[i] = array;
+                    }
+                } else if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
+                    gfx_flush(GFX_FLUSH_TEXTURE);
+                    gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
+                    rendering_state.textures[i]->linear_filter = linear_filter;
+                    rendering_state.textures[i]->cms = rdp.texture_tile.cms;
+                    rendering_state.textures[i]->cmt = rdp.texture_tile.cmt;
+                }
+            }
+        }
+        
+        if (packed_vertices) {
+            if (use_texture && !texture_layers && (tex_width != rendering_state.tex_width || tex_height != rendering_state.tex_height)) {
+                gfx_flush(GFX_FLUSH_TEXTURE);
+                gfx_rapi->set_texture_size(tex_width, tex_height);
+                rendering_state.tex_width = tex_width;
+                rendering_state.tex_height = tex_height;
+            }
+            if (use_fog && memcmp(&rdp.fog_color, &rendering_state.fog_color, 3) != 0) {
+                gfx_flush(GFX_FLUSH_OTHER);
+                gfx_rapi->set_fog_color(rdp.fog_color.r, rdp.fog_color.g, rdp.fog_color.b);
+                rendering_state.fog_color = rdp.fog_color;
+            }
+        }
+        if (use_vertex_uniforms && memcmp(&vertex_uniforms, &rendering_state.vertex_uniforms, sizeof(vertex_uniforms)) != 0) {
+            gfx_flush(GFX_FLUSH_OTHER);
+            gfx_rapi->set_vertex_uniforms(&vertex_uniforms);
+            rendering_state.vertex_uniforms = vertex_uniforms;
         }
     }
     
-    bool use_texture = used_textures[0] || used_textures[1];
-    uint32_t tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
-    uint32_t tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+    if (buf_vbo_len == 0 && !retained.capturing) {
+        // Deferred triangles are copied into the queue, so only write directly to the GPU when drawing now
+        gfx_buf_vbo_begin(!deferred.enabled);
+    }
     
     bool z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
     
+    uint16_t tile_size[2] = { tex_width, tex_height };
+    uint8_t layers[4] = { 0 };
+    if (texture_layers) {
+        uint8_t mode = (rdp.texture_tile.cms & 3) | ((rdp.texture_tile.cmt & 3) << 2) | (linear_filter << 4);
+        for (int i = 0; i < 2; i++) {
+            if (used_textures[i]) {
+                layers[i * 2] = rendering_state.textures[i]->texture_layer;
+                layers[i * 2 + 1] = mode;
+            }
+        }
+    }
+    
+    float *vbo = buf_vbo;
+    size_t vbo_len = buf_vbo_len;
+    if (retained.capturing) {
+        vbo = retained.vbo;
+        vbo_len = retained.vbo_len;
+    }
+    
     for (int i = 0; i < 3; i++) {
-        float z = v_arr[i]->z, w = v_arr[i]->w;
-        if (z_is_from_0_to_1) {
-            z = (z + w) / 2.0f;
-        }
-        buf_vbo[buf_vbo_len++] = v_arr[i]->x;
-        buf_vbo[buf_vbo_len++] = v_arr[i]->y;
-        buf_vbo[buf_vbo_len++] = z;
-        buf_vbo[buf_vbo_len++] = w;
+        if (retained.capturing) {
+            // Retained vertices stay in model space, the matrix is applied when drawing
+            const Vtx_t *model = &retained.vertices[v_arr[i] - rsp.loaded_vertices].v;
+            vbo[vbo_len++] = model->ob[0];
+            vbo[vbo_len++] = model->ob[1];
+            vbo[vbo_len++] = model->ob[2];
+            vbo[vbo_len++] = 1.0f;
+        } else {
+            float z = v_arr[i]->z, w = v_arr[i]->w;
+            if (z_is_from_0_to_1) {
+                z = (z + w) / 2.0f;
+            }
+            vbo[vbo_len++] = v_arr[i]->x;
+            vbo[vbo_len++] = v_arr[i]->y;
+            vbo[vbo_len++] = z;
+            vbo[vbo_len++] = w;
+        }
         
-        if (use_texture) {
+        if (use_texture || uber_shader) {
             float u = (v_arr[i]->u - rdp.texture_tile.uls * 8) / 32.0f;
             float v = (v_arr[i]->v - rdp.texture_tile.ult * 8) / 32.0f;
             if ((rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT) {
@@ -865,67 +2644,81 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
                 u += 0.5f;
                 v += 0.5f;
             }
-            buf_vbo[buf_vbo_len++] = u / tex_width;
-            buf_vbo[buf_vbo_len++] = v / tex_height;
+            if (packed_vertices) {
+                // S10.5 texel coordinates, the backend divides by the texture size
+                int16_t uv[2] = { gfx_pack_s10_5(u), gfx_pack_s10_5(v) };
+                memcpy(&vbo[vbo_len++], uv, sizeof(uv));
+                if (texture_layers) {
+                    memcpy(&vbo[vbo_len++], tile_size, sizeof(tile_size));
+                    memcpy(&vbo[vbo_len++], layers, sizeof(layers));
+                }
+            } else {
+                vbo[vbo_len++] = u / tex_width;
+                vbo[vbo_len++] = v / tex_height;
+            }
+        }
+        
+        if ((use_fog || uber_shader) && !vertex_fog) {
+            if (packed_vertices) {
+                // The fog color is a uniform, only the fog factor is per vertex
+                uint8_t fog[4] = { 0, 0, 0, v_arr[i]->color.a };
+                memcpy(&vbo[vbo_len++], fog, sizeof(fog));
+            } else {
+                vbo[vbo_len++] = rdp.fog_color.r / 255.0f;
+                vbo[vbo_len++] = rdp.fog_color.g / 255.0f;
+                vbo[vbo_len++] = rdp.fog_color.b / 255.0f;
+                vbo[vbo_len++] = v_arr[i]->color.a / 255.0f; // fog factor (not alpha)
+            }
         }
         
-        if (use_fog) {
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.r / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.g / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.b / 255.0f;
-            buf_vbo[buf_vbo_len++] = v_arr[i]->color.a / 255.0f; // fog factor (not alpha)
+        if (gpu_lighting) {
+            // Not lit on the CPU, so the shade color still holds the normal
+            int8_t normal[4] = { (int8_t)v_arr[i]->color.r, (int8_t)v_arr[i]->color.g, (int8_t)v_arr[i]->color.b, 0 };
+            memcpy(&vbo[vbo_len++], normal, sizeof(normal));
         }
         
         for (int j = 0; j < num_inputs; j++) {
-            struct RGBA *color;
-            struct RGBA tmp;
-            for (int k = 0; k < 1 + (use_alpha ? 1 : 0); k++) {
-                switch (comb->shader_input_mapping[k][j]) {
-                    case CC_PRIM:
-                        color = &rdp.prim_color;
-                        break;
-                    case CC_SHADE:
-                        color = &v_arr[i]->color;
-                        break;
-                    case CC_ENV:
-                        color = &rdp.env_color;
-                        break;
-                    case CC_LOD:
-                    {
-                        float distance_frac = (v1->w - 3000.0f) / 3000.0f;
-                        if (distance_frac < 0.0f) distance_frac = 0.0f;
-                        if (distance_frac > 1.0f) distance_frac = 1.0f;
-                        tmp.r = tmp.g = tmp.b = tmp.a = distance_frac * 255.0f;
-                        color = &tmp;
-                        break;
-                    }
-                    default:
-                        memset(&tmp, 0, sizeof(tmp));
-                        color = &tmp;
-                        break;
-                }
-                if (k == 0) {
-                    buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->b / 255.0f;
+            struct RGBA color = gfx_cc_input_color(comb->shader_input_mapping[0][j], v_arr[i], v1->w);
+            if (use_alpha) {
+                uint8_t alpha_input = comb->shader_input_mapping[1][j];
+                if (use_fog && alpha_input == CC_SHADE) {
+                    // Shade alpha is 100% for fog
+                    color.a = 255;
                 } else {
-                    if (use_fog && color == &v_arr[i]->color) {
-                        // Shade alpha is 100% for fog
-                        buf_vbo[buf_vbo_len++] = 1.0f;
-                    } else {
-                        buf_vbo[buf_vbo_len++] = color->a / 255.0f;
-                    }
+                    color.a = gfx_cc_input_color(alpha_input, v_arr[i], v1->w).a;
+                }
+            }
+            if (packed_vertices) {
+                memcpy(&vbo[vbo_len++], &color, sizeof(color));
+            } else {
+                vbo[vbo_len++] = color.r / 255.0f;
+                vbo[vbo_len++] = color.g / 255.0f;
+                vbo[vbo_len++] = color.b / 255.0f;
+                if (use_alpha) {
+                    vbo[vbo_len++] = color.a / 255.0f;
                 }
             }
         }
-        /*struct RGBA *color = &v_arr[i]->color;
-        buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->b / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->a / 255.0f;*/
+        
+        if (uber_shader) {
+            for (int j = num_inputs; j < 4; j++) {
+                memset(&vbo[vbo_len++], 0, sizeof(float));
+            }
+            memcpy(&vbo[vbo_len], comb->uber_combine, sizeof(comb->uber_combine));
+            vbo_len += 3;
+        }
+    }
+    if (retained.capturing) {
+        retained.vbo_len = vbo_len;
+        gfx_retained_end_tri();
+        return;
     }
-    if (++buf_vbo_num_tris == MAX_BUFFERED) {
-        gfx_flush();
+    buf_vbo_len = vbo_len;
+    draw_stats.triangles++;
+    if (deferred.enabled) {
+        gfx_deferred_end_tri();
+    } else if (++buf_vbo_num_tris == MAX_BUFFERED) {
+        gfx_flush(GFX_FLUSH_BUFFER_FULL);
     }
 }
 
@@ -1001,6 +2794,7 @@ static void gfx_sp_moveword(uint8_t index, uint16_t offset, uint32_t data) {
         case G_MW_FOG:
             rsp.fog_mul = (int16_t)(data >> 16);
             rsp.fog_offset = (int16_t)data;
+            retained.written |= RETAINED_FOG_PARAMS;
             break;
     }
 }
@@ -1008,6 +2802,7 @@ static void gfx_sp_moveword(uint8_t index, uint16_t offset, uint32_t data) {
 static void gfx_sp_texture(uint16_t sc, uint16_t tc, uint8_t level, uint8_t tile, uint8_t on) {
     rsp.texture_scaling_factor.s = sc;
     rsp.texture_scaling_factor.t = tc;
+    retained.written |= RETAINED_SCALE;
 }
 
 static void gfx_dp_set_scissor(uint32_t mode, uint32_t ulx, uint32_t uly, uint32_t lrx, uint32_t lry) {
@@ -1027,6 +2822,7 @@ static void gfx_dp_set_scissor(uint32_t mode, uint32_t ulx, uint32_t uly, uint32
 static void gfx_dp_set_texture_image(uint32_t format, uint32_t size, uint32_t width, const void* addr) {
     rdp.texture_to_load.addr = addr;
     rdp.texture_to_load.siz = size;
+    retained.written |= RETAINED_TIMG;
 }
 
 static void gfx_dp_set_tile(uint8_t fmt, uint32_t siz, uint32_t line, uint32_t tmem, uint8_t tile, uint32_t palette, uint32_t cmt, uint32_t maskt, uint32_t shiftt, uint32_t cms, uint32_t masks, uint32_t shifts) {
@@ -1039,10 +2835,12 @@ static void gfx_dp_set_tile(uint8_t fmt, uint32_t siz, uint32_t line, uint32_t t
         rdp.texture_tile.line_size_bytes = line * 8;
         rdp.textures_changed[0] = true;
         rdp.textures_changed[1] = true;
+        retained.written |= RETAINED_TILE;
     }
     
     if (tile == G_TX_LOADTILE) {
         rdp.texture_to_load.tile_number = tmem / 256;
+        retained.written |= RETAINED_TIMG;
     }
 }
 
@@ -1054,6 +2852,7 @@ static void gfx_dp_set_tile_size(uint8_t tile, uint16_t uls, uint16_t ult, uint1
         rdp.texture_tile.lrt = lrt;
         rdp.textures_changed[0] = true;
         rdp.textures_changed[1] = true;
+        retained.written |= RETAINED_TILE_SIZE;
     }
 }
 
@@ -1061,6 +2860,10 @@ static void gfx_dp_load_tlut(uint8_t tile, uint32_t high_index) {
     SUPPORT_CHECK(tile == G_TX_LOADTILE);
     SUPPORT_CHECK(rdp.texture_to_load.siz == G_IM_SIZ_16b);
     rdp.palette = rdp.texture_to_load.addr;
+    retained.written |= RETAINED_PALETTE;
+    if (dl_capture.recording) {
+        gfx_capture_region(rdp.palette, (high_index + 1) * sizeof(uint16_t));
+    }
 }
 
 static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t lrs, uint32_t dxt) {
@@ -1089,8 +2892,12 @@ static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
     rdp.loaded_texture[rdp.texture_to_load.tile_number].size_bytes = size_bytes;
     assert(size_bytes <= 4096 && "bug: too big texture");
     rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    if (dl_capture.recording) {
+        gfx_capture_region(rdp.texture_to_load.addr, size_bytes);
+    }
     
     rdp.textures_changed[rdp.texture_to_load.tile_number] = true;
+    retained.written |= RETAINED_LOADED0 << rdp.texture_to_load.tile_number;
 }
 
 static void gfx_dp_load_tile(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t lrs, uint32_t lrt) {
@@ -1120,12 +2927,16 @@ static void gfx_dp_load_tile(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
 
     assert(size_bytes <= 4096 && "bug: too big texture");
     rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    if (dl_capture.recording) {
+        gfx_capture_region(rdp.texture_to_load.addr, size_bytes);
+    }
     rdp.texture_tile.uls = uls;
     rdp.texture_tile.ult = ult;
     rdp.texture_tile.lrs = lrs;
     rdp.texture_tile.lrt = lrt;
 
     rdp.textures_changed[rdp.texture_to_load.tile_number] = true;
+    retained.written |= (RETAINED_LOADED0 << rdp.texture_to_load.tile_number) | RETAINED_TILE_SIZE;
 }
 
 
@@ -1159,6 +2970,7 @@ static inline uint32_t color_comb(uint32_t a, uint32_t b, uint32_t c, uint32_t d
 
 static void gfx_dp_set_combine_mode(uint32_t rgb, uint32_t alpha) {
     rdp.combine_mode = rgb | (alpha << 12);
+    retained.written |= RETAINED_COMBINE;
 }
 
 static void gfx_dp_set_env_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1166,6 +2978,7 @@ static void gfx_dp_set_env_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.env_color.g = g;
     rdp.env_color.b = b;
     rdp.env_color.a = a;
+    retained.written |= RETAINED_ENV_COLOR;
 }
 
 static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1173,6 +2986,7 @@ static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.prim_color.g = g;
     rdp.prim_color.b = b;
     rdp.prim_color.a = a;
+    retained.written |= RETAINED_PRIM_COLOR;
 }
 
 static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1180,6 +2994,7 @@ static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.fog_color.g = g;
     rdp.fog_color.b = b;
     rdp.fog_color.a = a;
+    retained.written |= RETAINED_FOG_COLOR;
 }
 
 static void gfx_dp_set_fill_color(uint32_t packed_color) {
@@ -1192,6 +3007,7 @@ static void gfx_dp_set_fill_color(uint32_t packed_color) {
     rdp.fill_color.g = SCALE_5_8(g);
     rdp.fill_color.b = SCALE_5_8(b);
     rdp.fill_color.a = a * 255;
+    retained.written |= RETAINED_FILL_COLOR;
 }
 
 static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lry) {
@@ -1216,6 +3032,23 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     ulxf = gfx_adjust_x_for_aspect_ratio(ulxf);
     lrxf = gfx_adjust_x_for_aspect_ratio(lrxf);
     
+    // A rectangle that lies within the current viewport is moved into that viewport's clip space,
+    // so the viewport stays as it is and consecutive rectangles end up in the same batch
+    const struct XYWidthHeight *vp = &rdp.viewport;
+    float left = (fminf(ulxf, lrxf) + 1.0f) * 0.5f * gfx_current_dimensions.width;
+    float right = (fmaxf(ulxf, lrxf) + 1.0f) * 0.5f * gfx_current_dimensions.width;
+    float bottom = (fminf(ulyf, lryf) + 1.0f) * 0.5f * gfx_current_dimensions.height;
+    float top = (fmaxf(ulyf, lryf) + 1.0f) * 0.5f * gfx_current_dimensions.height;
+    bool in_viewport = vp->width != 0 && vp->height != 0 &&
+                       left >= vp->x - 0.01f && right <= vp->x + vp->width + 0.01f &&
+                       bottom >= vp->y - 0.01f && top <= vp->y + vp->height + 0.01f;
+    if (in_viewport) {
+        ulxf = ((ulxf + 1.0f) * 0.5f * gfx_current_dimensions.width - vp->x) * 2.0f / vp->width - 1.0f;
+        lrxf = ((lrxf + 1.0f) * 0.5f * gfx_current_dimensions.width - vp->x) * 2.0f / vp->width - 1.0f;
+        ulyf = ((ulyf + 1.0f) * 0.5f * gfx_current_dimensions.height - vp->y) * 2.0f / vp->height - 1.0f;
+        lryf = ((lryf + 1.0f) * 0.5f * gfx_current_dimensions.height - vp->y) * 2.0f / vp->height - 1.0f;
+    }
+    
     struct LoadedVertex* ul = &rsp.loaded_vertices[MAX_VERTICES + 0];
     struct LoadedVertex* ll = &rsp.loaded_vertices[MAX_VERTICES + 1];
     struct LoadedVertex* lr = &rsp.loaded_vertices[MAX_VERTICES + 2];
@@ -1246,16 +3079,21 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     struct XYWidthHeight viewport_saved = rdp.viewport;
     uint32_t geometry_mode_saved = rsp.geometry_mode;
     
-    rdp.viewport = default_viewport;
-    rdp.viewport_or_scissor_changed = true;
+    if (!in_viewport) {
+        rdp.viewport = default_viewport;
+        rdp.viewport_or_scissor_changed = true;
+    }
     rsp.geometry_mode = 0;
     
     gfx_sp_tri1(MAX_VERTICES + 0, MAX_VERTICES + 1, MAX_VERTICES + 3);
     gfx_sp_tri1(MAX_VERTICES + 1, MAX_VERTICES + 2, MAX_VERTICES + 3);
+    draw_stats.rectangles++;
     
     rsp.geometry_mode = geometry_mode_saved;
-    rdp.viewport = viewport_saved;
-    rdp.viewport_or_scissor_changed = true;
+    if (!in_viewport) {
+        rdp.viewport = viewport_saved;
+        rdp.viewport_or_scissor_changed = true;
+    }
     
     if (cycle_type == G_CYC_COPY) {
         rdp.other_mode_h = saved_other_mode_h;
@@ -1340,10 +3178,12 @@ static void gfx_dp_fill_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t
 
 static void gfx_dp_set_z_image(void *z_buf_address) {
     rdp.z_buf_address = z_buf_address;
+    retained.failed = true;
 }
 
 static void gfx_dp_set_color_image(uint32_t format, uint32_t size, uint32_t width, void* address) {
     rdp.color_image_address = address;
+    retained.failed = true;
 }
 
 static void gfx_sp_set_other_mode(uint32_t shift, uint32_t num_bits, uint64_t mode) {
@@ -1361,10 +3201,445 @@ static inline void *seg_addr(uintptr_t w1) {
 #define C0(pos, width) ((cmd->words.w0 >> (pos)) & ((1U << width) - 1))
 #define C1(pos, width) ((cmd->words.w1 >> (pos)) & ((1U << width) - 1))
 
+static void gfx_capture_command(const Gfx *cmd) {
+    uint32_t opcode = cmd->words.w0 >> 24;
+    const void *addr = NULL;
+    uint32_t size = 0;
+    
+    switch (opcode) {
+        case G_DL:
+        case (uint8_t)G_ENDDL:
+            // Calls are inlined by gfx_run_dl and gfx_capture_end_frame ends the frame
+            return;
+        case G_MTX:
+            addr = seg_addr(cmd->words.w1);
+            size = sizeof(Mtx);
+            break;
+        case G_MOVEMEM:
+            addr = seg_addr(cmd->words.w1);
+#ifdef F3DEX_GBI_2
+            size = (C0(19, 5) + 1) * 8;
+#else
+            size = C0(0, 16);
+#endif
+            // Lights are always read in full, even ambient ones
+            if (size < sizeof(Light_t)) {
+                size = sizeof(Light_t);
+            }
+            break;
+        case G_VTX:
+            addr = seg_addr(cmd->words.w1);
+#ifdef F3DEX_GBI_2
+            size = C0(12, 8) * sizeof(Vtx);
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+            size = C0(10, 6) * sizeof(Vtx);
+#else
+            size = C0(0, 16) / sizeof(Vtx) * sizeof(Vtx);
+#endif
+            break;
+        case G_SETTIMG:
+            addr = seg_addr(cmd->words.w1);
+            break;
+    }
+    // The color and depth image addresses are only compared with each other, so they are kept as they are
+    gfx_capture_emit(cmd->words.w0, cmd->words.w1, addr, size);
+}
+
+static void gfx_run_dl(Gfx* cmd);
+
+// Hashes a display list together with the display lists it calls and the vertices it loads.
+// Returns false if it contains commands that can't be retained.
+static bool gfx_retained_hash_dl(const Gfx *cmd, uint64_t *hash, int depth) {
+    if (depth > 8) {
+        return false;
+    }
+    for (size_t count = 0; count < 65536; count++, cmd++) {
+        *hash = gfx_hash_bytes(*hash, (const uint8_t *)cmd, sizeof(Gfx));
+        switch (cmd->words.w0 >> 24) {
+            case G_MTX:
+            case (uint8_t)G_POPMTX:
+            case G_TEXRECT:
+            case G_TEXRECTFLIP:
+            case G_FILLRECT:
+                return false;
+            case G_VTX:
+            {
+#ifdef F3DEX_GBI_2
+                size_t n_vertices = C0(12, 8);
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+                size_t n_vertices = C0(10, 6);
+#else
+                size_t n_vertices = C0(0, 16) / sizeof(Vtx);
+#endif
+                *hash = gfx_hash_bytes(*hash, seg_addr(cmd->words.w1), n_vertices * sizeof(Vtx));
+                break;
+            }
+            case G_DL:
+                if (C0(16, 1) == 0) {
+                    if (!gfx_retained_hash_dl((const Gfx *)seg_addr(cmd->words.w1), hash, depth + 1)) {
+                        return false;
+                    }
+                } else {
+                    cmd = (const Gfx *)seg_addr(cmd->words.w1);
+                    --cmd; // increase after break
+                }
+                break;
+            case (uint8_t)G_ENDDL:
+                return true;
+        }
+    }
+    return false;
+}
+
+// Hashes the state a display list depends on: the render modes, which it can't be replayed
+// without, and the groups it reads before setting them itself
+static uint64_t gfx_retained_state_hash(const struct RDP *r, uint32_t geometry_mode, uint16_t scale_s, uint16_t scale_t, uint32_t depends) {
+    uint64_t h = gfx_hash_bytes(depends, (const uint8_t *)&geometry_mode, sizeof(geometry_mode));
+    h = gfx_hash_bytes(h, (const uint8_t *)&r->other_mode_l, sizeof(r->other_mode_l));
+    h = gfx_hash_bytes(h, (const uint8_t *)&r->other_mode_h, sizeof(r->other_mode_h));
+    h = gfx_hash_bytes(h, (const uint8_t *)&r->viewport, sizeof(r->viewport));
+    h = gfx_hash_bytes(h, (const uint8_t *)&r->scissor, sizeof(r->scissor));
+    if (depends & RETAINED_COMBINE) {
+        h = gfx_hash_bytes(h, (const uint8_t *)&r->combine_mode, sizeof(r->combine_mode));
+    }
+    if (depends & RETAINED_PRIM_COLOR) {
+        h = gfx_hash_bytes(h, (const uint8_t *)&r->prim_color, sizeof(r->prim_color));
+    }
+    if (depends & RETAINED_ENV_COLOR) {
+        h = gfx_hash_bytes(h, (const uint8_t *)&r->env_color, sizeof(r->env_color));
+    }
+    if (depends & (RETAINED_TILE | RETAINED_TILE_SIZE)) {
+        h = gfx_hash_bytes(h, (const uint8_t *)&r->texture_tile, sizeof(r->texture_tile));
+    }
+    for (int i = 0; i < 2; i++) {
+        if (depends & (RETAINED_LOADED0 << i)) {
+            h = gfx_hash_bytes(h, (const uint8_t *)&r->loaded_texture[i], sizeof(r->loaded_texture[i]));
+        }
+    }
+    if (depends & RETAINED_PALETTE) {
+        h = gfx_hash_bytes(h, (const uint8_t *)&r->palette, sizeof(r->palette));
+    }
+    if (depends & RETAINED_SCALE) {
+        uint16_t scale[2] = { scale_s, scale_t };
+        h = gfx_hash_bytes(h, (const uint8_t *)scale, sizeof(scale));
+    }
+    return h;
+}
+
+static struct RetainedDisplayList *gfx_retained_lookup(const Gfx *dl) {
+    struct RetainedDisplayList **bucket = &retained.hashmap[((uintptr_t)dl >> 3) & (RETAINED_HASH_SIZE - 1)];
+    for (struct RetainedDisplayList *e = *bucket; e != NULL; e = e->next) {
+        if (e->dl == dl) {
+            return e;
+        }
+    }
+    struct RetainedDisplayList *e = retained.free_list;
+    if (e != NULL) {
+        retained.free_list = e->next;
+    } else if (retained.pool_pos < RETAINED_MAX_ENTRIES) {
+        e = &retained.pool[retained.pool_pos++];
+    } else {
+        return NULL;
+    }
+    memset(e, 0, sizeof(*e));
+    e->dl = dl;
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+// Frees the compiled data of an entry, which then has to be captured again
+static void gfx_retained_release(struct RetainedDisplayList *e) {
+    if (e->buffer_id != 0) {
+        // Draws queued by an earlier replay still read the buffer
+        for (size_t i = 0; i < deferred.num_batches; i++) {
+            if (deferred.batches[i].retained_buffer == e->buffer_id) {
+                gfx_deferred_submit();
+                break;
+            }
+        }
+        gfx_rapi->delete_retained_vertices(e->buffer_id);
+        e->buffer_id = 0;
+    }
+    free(e->draws);
+    if (e->exit_state != NULL) {
+        free(e->exit_state->vertices);
+        free(e->exit_state);
+    }
+    e->draws = NULL;
+    e->exit_state = NULL;
+    e->num_draws = 0;
+    if (e->status == RETAINED_READY) {
+        e->status = RETAINED_SEEN;
+    }
+}
+
+static bool gfx_retained_textures_valid(const struct RetainedDisplayList *e) {
+    for (uint32_t i = 0; i < e->num_draws; i++) {
+        const struct RetainedDraw *draw = &e->draws[i];
+        for (int j = 0; j < 2; j++) {
+            if (draw->state.used_textures[j] && draw->state.textures[j]->serial != draw->texture_serials[j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool gfx_retained_capture(struct RetainedDisplayList *e, Gfx *dl) {
+    struct RDP entry_rdp = rdp;
+    uint32_t entry_geometry_mode = rsp.geometry_mode;
+    uint16_t entry_scale_s = rsp.texture_scaling_factor.s, entry_scale_t = rsp.texture_scaling_factor.t;
+    int16_t entry_fog_mul = rsp.fog_mul, entry_fog_offset = rsp.fog_offset;
+    Light_t entry_lights[MAX_LIGHTS + 1];
+    uint8_t entry_num_lights = rsp.current_num_lights;
+    memcpy(entry_lights, rsp.current_lights, sizeof(entry_lights));
+    
+    // Textures imported during the capture are bound right away
+    gfx_flush(GFX_FLUSH_OTHER);
+    
+    retained.capturing = true;
+    retained.failed = false;
+    retained.written = retained.depends = 0;
+    retained.vbo_len = 0;
+    retained.num_draws = 0;
+    memset(retained.loaded, 0, sizeof(retained.loaded));
+    gfx_run_dl(dl);
+    retained.capturing = false;
+    
+    if (rsp.current_num_lights != entry_num_lights || memcmp(entry_lights, rsp.current_lights, sizeof(entry_lights)) != 0) {
+        retained.failed = true;
+    }
+    if (!retained.failed && retained.vbo_len != 0) {
+        e->buffer_id = gfx_rapi->upload_retained_vertices(retained.vbo, retained.vbo_len);
+        retained.failed = e->buffer_id == 0;
+    }
+    if (retained.failed) {
+        rdp = entry_rdp;
+        rdp.textures_changed[0] = rdp.textures_changed[1] = true;
+        rsp.geometry_mode = entry_geometry_mode;
+        rsp.texture_scaling_factor.s = entry_scale_s;
+        rsp.texture_scaling_factor.t = entry_scale_t;
+        rsp.fog_mul = entry_fog_mul;
+        rsp.fog_offset = entry_fog_offset;
+        memcpy(rsp.current_lights, entry_lights, sizeof(entry_lights));
+        rsp.current_num_lights = entry_num_lights;
+        e->status = RETAINED_REJECTED;
+        return false;
+    }
+    
+    e->num_draws = retained.num_draws;
+    e->draws = malloc(retained.num_draws * sizeof(struct RetainedDraw));
+    memcpy(e->draws, retained.draws, retained.num_draws * sizeof(struct RetainedDraw));
+    e->written = retained.written;
+    e->depends = retained.depends;
+    e->state_hash = gfx_retained_state_hash(&entry_rdp, entry_geometry_mode, entry_scale_s, entry_scale_t, e->depends);
+    e->exit_state = malloc(sizeof(struct RetainedExitState));
+    e->exit_state->rdp = rdp;
+    e->exit_state->geometry_mode = rsp.geometry_mode;
+    e->exit_state->fog_mul = rsp.fog_mul;
+    e->exit_state->fog_offset = rsp.fog_offset;
+    e->exit_state->scale_s = rsp.texture_scaling_factor.s;
+    e->exit_state->scale_t = rsp.texture_scaling_factor.t;
+    e->exit_state->num_vertices = 0;
+    e->exit_state->vertices = malloc((MAX_VERTICES + 4) * sizeof(struct RetainedVertex));
+    for (uint32_t i = 0; i < MAX_VERTICES + 4; i++) {
+        if (retained.loaded[i]) {
+            // Lighting, fog and texgen aren't retained, so only the position depends on the matrix
+            struct RetainedVertex *rv = &e->exit_state->vertices[e->exit_state->num_vertices++];
+            rv->vtx = retained.vertices[i];
+            rv->u = rsp.loaded_vertices[i].u;
+            rv->v = rsp.loaded_vertices[i].v;
+            rv->color = rsp.loaded_vertices[i].color;
+            rv->slot = i;
+        }
+    }
+    e->status = RETAINED_READY;
+    return true;
+}
+
+static void gfx_retained_replay(const struct RetainedDisplayList *e) {
+    if (e->num_draws != 0) {
+        float mvp[4][4];
+        memcpy(mvp, rsp.MP_matrix, sizeof(mvp));
+        for (int i = 0; i < 4; i++) {
+            mvp[i][0] = gfx_adjust_x_for_aspect_ratio(mvp[i][0]);
+        }
+        
+        if (deferred.enabled) {
+            // The draws are queued with the other batches, which keeps the order without a submit
+            if (deferred.num_mvps == deferred.mvps_capacity) {
+                deferred.mvps_capacity = deferred.mvps_capacity == 0 ? 256 : deferred.mvps_capacity * 2;
+                deferred.mvps = realloc(deferred.mvps, deferred.mvps_capacity * sizeof(deferred.mvps[0]));
+            }
+            memcpy(deferred.mvps[deferred.num_mvps], mvp, sizeof(mvp));
+        } else {
+            gfx_flush(GFX_FLUSH_OTHER);
+            deferred.bound_textures[0] = deferred.bound_textures[1] = NULL;
+            deferred.bound_texture_arrays[0] = deferred.bound_texture_arrays[1] = 0;
+        }
+        
+        for (uint32_t i = 0; i < e->num_draws; i++) {
+            const struct RetainedDraw *draw = &e->draws[i];
+            for (int j = 0; j < 2; j++) {
+                if (draw->state.used_textures[j]) {
+                    gfx_texture_cache_lru_unlink(draw->state.textures[j]);
+                    gfx_texture_cache_lru_push_front(draw->state.textures[j]);
+                }
+            }
+            if (deferred.enabled) {
+                gfx_deferred_add_retained(draw, e->buffer_id, deferred.num_mvps);
+                continue;
+            }
+            gfx_deferred_apply_state(&draw->state);
+            unsigned long t0 = get_time();
+            gfx_rapi->draw_retained_triangles(e->buffer_id, draw->vbo_offset, draw->num_vertices, mvp, draw->cull_mode);
+            draw_stats.draw_calls++;
+            draw_stats.triangles += draw->num_vertices / 3;
+            draw_stats.draw_us += get_time() - t0;
+        }
+        if (deferred.enabled) {
+            deferred.num_mvps++;
+        }
+    }
+    
+    // Leave the vertex slots as running the display list would have
+    const struct RetainedExitState *x = e->exit_state;
+    for (uint32_t i = 0; i < x->num_vertices; i++) {
+        const struct RetainedVertex *rv = &x->vertices[i];
+        struct LoadedVertex *d = &rsp.loaded_vertices[rv->slot];
+        gfx_sp_vertex_one(&rv->vtx, d, 0);
+        d->gpu_shading = 0;
+        d->u = rv->u;
+        d->v = rv->v;
+        d->color = rv->color;
+    }
+    
+    // And the rest of the state too
+    rdp.other_mode_l = x->rdp.other_mode_l;
+    rdp.other_mode_h = x->rdp.other_mode_h;
+    rdp.viewport = x->rdp.viewport;
+    rdp.scissor = x->rdp.scissor;
+    rdp.viewport_or_scissor_changed = x->rdp.viewport_or_scissor_changed;
+    rsp.geometry_mode = x->geometry_mode;
+    if (e->written & RETAINED_COMBINE) rdp.combine_mode = x->rdp.combine_mode;
+    if (e->written & RETAINED_PRIM_COLOR) rdp.prim_color = x->rdp.prim_color;
+    if (e->written & RETAINED_ENV_COLOR) rdp.env_color = x->rdp.env_color;
+    if (e->written & RETAINED_FOG_COLOR) rdp.fog_color = x->rdp.fog_color;
+    if (e->written & RETAINED_FILL_COLOR) rdp.fill_color = x->rdp.fill_color;
+    if (e->written & RETAINED_TILE) {
+        rdp.texture_tile.fmt = x->rdp.texture_tile.fmt;
+        rdp.texture_tile.siz = x->rdp.texture_tile.siz;
+        rdp.texture_tile.cms = x->rdp.texture_tile.cms;
+        rdp.texture_tile.cmt = x->rdp.texture_tile.cmt;
+        rdp.texture_tile.line_size_bytes = x->rdp.texture_tile.line_size_bytes;
+    }
+    if (e->written & RETAINED_TILE_SIZE) {
+        rdp.texture_tile.uls = x->rdp.texture_tile.uls;
+        rdp.texture_tile.ult = x->rdp.texture_tile.ult;
+        rdp.texture_tile.lrs = x->rdp.texture_tile.lrs;
+        rdp.texture_tile.lrt = x->rdp.texture_tile.lrt;
+    }
+    if (e->written & RETAINED_LOADED0) rdp.loaded_texture[0] = x->rdp.loaded_texture[0];
+    if (e->written & RETAINED_LOADED1) rdp.loaded_texture[1] = x->rdp.loaded_texture[1];
+    if (e->written & RETAINED_PALETTE) rdp.palette = x->rdp.palette;
+    if (e->written & RETAINED_TIMG) rdp.texture_to_load = x->rdp.texture_to_load;
+    if (e->written & RETAINED_SCALE) {
+        rsp.texture_scaling_factor.s = x->scale_s;
+        rsp.texture_scaling_factor.t = x->scale_t;
+    }
+    if (e->written & RETAINED_FOG_PARAMS) {
+        rsp.fog_mul = x->fog_mul;
+        rsp.fog_offset = x->fog_offset;
+    }
+    // The textures bound by the replay aren't the ones the immediate path tracks
+    rdp.textures_changed[0] = rdp.textures_changed[1] = true;
+}
+
+// Runs a called display list in retained mode if possible. Returns false if the caller should
+// interpret it as usual. Display lists that load vertices are assumed to draw only with those.
+static bool gfx_retained_run(Gfx *dl) {
+    // The display list capture needs every command to go through gfx_run_dl
+    if (!retained.enabled || retained.capturing || dl_capture.recording) {
+        return false;
+    }
+    struct RetainedDisplayList *e = gfx_retained_lookup(dl);
+    if (e == NULL || e->status == RETAINED_REJECTED) {
+        return false;
+    }
+    e->last_used_frame = retained.frame;
+    
+    // Hashed in full every frame, so edits to the vertices or to called display lists take effect at once
+    uint64_t content_hash = 0;
+    if (!gfx_retained_hash_dl(dl, &content_hash, 0)) {
+        gfx_retained_release(e);
+        e->status = RETAINED_REJECTED;
+        return false;
+    }
+    if (e->status == RETAINED_NEW || content_hash != e->content_hash) {
+        // Only display lists that stay the same from one frame to the next are compiled
+        if (e->status != RETAINED_NEW && ++e->changes >= RETAINED_MAX_CHANGES) {
+            gfx_retained_release(e);
+            e->status = RETAINED_REJECTED;
+            return false;
+        }
+        gfx_retained_release(e);
+        e->content_hash = content_hash;
+        e->status = RETAINED_SEEN;
+        return false;
+    }
+    if (e->status == RETAINED_READY) {
+        uint64_t state_hash = gfx_retained_state_hash(&rdp, rsp.geometry_mode, rsp.texture_scaling_factor.s, rsp.texture_scaling_factor.t, e->depends);
+        if (state_hash != e->state_hash || !gfx_retained_textures_valid(e)) {
+            gfx_retained_release(e);
+            if (++e->changes >= RETAINED_MAX_CHANGES) {
+                e->status = RETAINED_REJECTED;
+                return false;
+            }
+        }
+    }
+    if (e->status != RETAINED_READY && !gfx_retained_capture(e, dl)) {
+        return false;
+    }
+    gfx_retained_replay(e);
+    return true;
+}
+
+// Drops entries that haven't been used for a while
+static void gfx_retained_age(void) {
+    for (int i = 0; i < RETAINED_HASH_SIZE; i++) {
+        struct RetainedDisplayList **link = &retained.hashmap[i];
+        while (*link != NULL) {
+            struct RetainedDisplayList *e = *link;
+            if (retained.frame - e->last_used_frame > RETAINED_MAX_AGE) {
+                gfx_retained_release(e);
+                *link = e->next;
+                e->next = retained.free_list;
+                retained.free_list = e;
+            } else {
+                link = &e->next;
+            }
+        }
+    }
+}
+
+void gfx_set_retained_display_lists(bool enable) {
+    retained.enabled = enable && gfx_rapi->upload_retained_vertices != NULL;
+    if (!retained.enabled) {
+        // Drop everything, so that nothing stale is replayed if it gets enabled again
+        retained.frame += RETAINED_MAX_AGE + 1;
+        gfx_retained_age();
+    }
+}
+
 static void gfx_run_dl(Gfx* cmd) {
     int dummy = 0;
     for (;;) {
         uint32_t opcode = cmd->words.w0 >> 24;
+        draw_stats.commands[opcode]++;
+        if (dl_capture.recording) {
+            gfx_capture_command(cmd);
+        }
         
         switch (opcode) {
             // RSP commands:
@@ -1415,7 +3690,9 @@ static void gfx_run_dl(Gfx* cmd) {
             case G_DL:
                 if (C0(16, 1) == 0) {
                     // Push return address
-                    gfx_run_dl((Gfx *)seg_addr(cmd->words.w1));
+                    if (!gfx_retained_run((Gfx *)seg_addr(cmd->words.w1))) {
+                        gfx_run_dl((Gfx *)seg_addr(cmd->words.w1));
+                    }
                 } else {
                     cmd = (Gfx *)seg_addr(cmd->words.w1);
                     --cmd; // increase after break
@@ -1613,39 +3890,8 @@ void gfx_init(struct GfxWindowManagerAPI *wapi, struct GfxRenderingAPI *rapi, co
     gfx_rapi = rapi;
     gfx_wapi->init(game_name, start_in_fullscreen);
     gfx_rapi->init();
-    
-    // Used in the 120 star TAS
-    static uint32_t precomp_shaders[] = {
-        0x01200200,
-        0x00000045,
-        0x00000200,
-        0x01200a00,
-        0x00000a00,
-        0x01a00045,
-        0x00000551,
-        0x01045045,
-        0x05a00a00,
-        0x01200045,
-        0x05045045,
-        0x01045a00,
-        0x01a00a00,
-        0x0000038d,
-        0x01081081,
-        0x0120038d,
-        0x03200045,
-        0x03200a00,
-        0x01a00a6f,
-        0x01141045,
-        0x07a00a00,
-        0x05200200,
-        0x03200200,
-        0x09200200,
-        0x0920038d,
-        0x09200045
-    };
-    for (size_t i = 0; i < sizeof(precomp_shaders) / sizeof(uint32_t); i++) {
-        gfx_lookup_or_create_shader_program(precomp_shaders[i]);
-    }
+    packed_vertices = gfx_rapi->set_texture_size != NULL && gfx_rapi->set_fog_color != NULL;
+    gfx_texture_decoder_init();
 }
 
 struct GfxRenderingAPI *gfx_get_current_rendering_api(void) {
@@ -1660,6 +3906,24 @@ void gfx_start_frame(void) {
         gfx_current_dimensions.height = 1;
     }
     gfx_current_dimensions.aspect_ratio = (float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height;
+    
+    gfx_texture_cache.stats.num_entries = gfx_texture_cache.pool_pos;
+    for (struct TextureHashmapNode *node = gfx_texture_cache.free_list; node != NULL; node = node->next) {
+        gfx_texture_cache.stats.num_entries--;
+    }
+    gfx_texture_cache.stats.resident_bytes = gfx_texture_cache.resident_bytes;
+    gfx_texture_cache.last_frame_stats = gfx_texture_cache.stats;
+    memset(&gfx_texture_cache.stats, 0, sizeof(gfx_texture_cache.stats));
+    last_frame_draw_stats = draw_stats;
+    memset(&draw_stats, 0, sizeof(draw_stats));
+    if (stats_dump.file != NULL) {
+        gfx_stats_dump_frame(&last_frame_draw_stats);
+    }
+    
+    if (retained.enabled) {
+        retained.frame++;
+        gfx_retained_age();
+    }
 }
 
 void gfx_run(Gfx *commands) {
@@ -1672,13 +3936,24 @@ void gfx_run(Gfx *commands) {
         return;
     }
     dropped_frame = false;
+    if (dl_capture.file != NULL && !dl_capture.recording && dl_capture.skip_frames-- == 0) {
+        dl_capture.recording = true;
+    }
     
-    double t0 = gfx_wapi->get_time();
     gfx_rapi->start_frame();
+    // Deferred submissions select arrays without going through rendering_state
+    rendering_state.texture_arrays[0] = rendering_state.texture_arrays[1] = 0;
+    if (!uber_shader) {
+        gfx_shader_profile_prewarm();
+    }
+    unsigned long t0 = get_time();
     gfx_run_dl(commands);
-    gfx_flush();
-    double t1 = gfx_wapi->get_time();
-    //printf("Process %f %f\n", t1, t1 - t0);
+    gfx_flush(GFX_FLUSH_OTHER);
+    gfx_deferred_submit();
+    draw_stats.run_dl_us += get_time() - t0;
+    if (dl_capture.recording) {
+        gfx_capture_end_frame();
+    }
     gfx_rapi->end_frame();
     gfx_wapi->swap_buffers_begin();
 }
@@ -11,6 +11,41 @@ struct GfxDimensions {
     float aspect_ratio;
 };
 
+struct GfxTextureCacheStats {
+    uint32_t hits, misses, evictions;
+    uint32_t num_entries;
+    uint64_t upload_bytes;
+    uint64_t resident_bytes;
+};
+
+// Why a batch of triangles had to be sent to the rendering API
+enum GfxFlushReason {
+    GFX_FLUSH_DEPTH_STATE,      // depth test, depth mask or decal mode changed
+    GFX_FLUSH_VIEWPORT_SCISSOR,
+    GFX_FLUSH_SHADER,
+    GFX_FLUSH_TEXTURE,          // texture import, binding, sampler or size change
+    GFX_FLUSH_BUFFER_FULL,
+    GFX_FLUSH_OTHER,            // blending, fog, vertex uniforms and the end of the frame
+    GFX_FLUSH_REASON_COUNT
+};
+
+struct GfxDrawStats {
+    uint32_t draw_calls;       // draw_triangles calls issued to the rendering API
+    uint32_t recorded_batches; // runs of triangles with the same state in deferred mode
+    uint32_t commands[256];    // display list commands run, by opcode
+    uint32_t vertices;         // vertices transformed
+    uint32_t triangles;        // triangles emitted
+    uint32_t clip_rejected;    // triangles entirely outside one of the clip planes
+    uint32_t culled;           // triangles dropped by back or front face culling
+    uint32_t rectangles;       // texture and fill rectangles
+    uint32_t flushes[GFX_FLUSH_REASON_COUNT];
+    uint32_t texture_imports;
+    uint64_t texture_upload_bytes;
+    uint32_t shader_creations;
+    uint32_t run_dl_us;        // time spent running the frame's display list, including draws
+    uint32_t draw_us;          // time spent in the rendering API's draw calls
+};
+
 extern struct GfxDimensions gfx_current_dimensions;
 
 #ifdef __cplusplus
@@ -22,6 +57,18 @@ struct GfxRenderingAPI *gfx_get_current_rendering_api(void);
 void gfx_start_frame(void);
 void gfx_run(Gfx *commands);
 void gfx_end_frame(void);
+void gfx_shader_profile_load(const char *filename);
+void gfx_set_deferred_draws(bool enable);
+void gfx_set_retained_display_lists(bool enable);
+void gfx_set_gpu_vertex_shading(bool enable);
+void gfx_set_uber_shader(bool enable);
+void gfx_set_texture_layers(bool enable);
+void gfx_get_draw_stats(struct GfxDrawStats *stats);
+void gfx_stats_dump_open(const char *filename);
+void gfx_capture_open(const char *filename, uint32_t start_frame, uint32_t num_frames);
+void gfx_texture_cache_set_budget(uint32_t budget_bytes);
+void gfx_texture_cache_set_content_hash(bool enable);
+void gfx_texture_cache_get_stats(struct GfxTextureCacheStats *stats);
 
 #ifdef __cplusplus
 }
@@ -7,6 +7,17 @@
 
 struct ShaderProgram;
 
+// Vertex shading state for backends that light and fog vertices themselves, laid out as vec4s
+struct GfxVertexUniforms {
+    float light_dirs[2][4];   // in model space, dotted with the raw normal and divided by 127
+    float light_colors[2][4]; // 0..255
+    float ambient_color[4];
+    float lookat[2][4];       // texgen directions, like light_dirs
+    float lit_inputs[4];      // 1 for the combiner inputs whose color is the shade color
+    float texgen[4];          // S and T scale, S and T offset in S10.5 units
+    float params[4];          // texgen enabled, fog multiplier, fog offset
+};
+
 struct GfxRenderingAPI {
     bool (*z_is_from_0_to_1)(void);
     void (*unload_shader)(struct ShaderProgram *old_prg);
@@ -30,6 +41,35 @@ struct GfxRenderingAPI {
     void (*start_frame)(void);
     void (*end_frame)(void);
     void (*finish_render)(void);
+    // Optional: returns memory for up to max_floats of vertex data, which the next
+    // draw_triangles call consumes in place. NULL if streaming is not available.
+    float *(*map_vertex_buffer)(size_t max_floats);
+    // Optional: a backend that sets both of these takes packed vertices, where texture
+    // coordinates are S10.5 texels scaled by the texture size and fog comes from a uniform.
+    void (*set_texture_size)(uint32_t width, uint32_t height);
+    void (*set_fog_color)(uint8_t r, uint8_t g, uint8_t b);
+    // Optional: vertex buffers that stay on the GPU, holding model space positions that are
+    // transformed by the given matrix when drawn. Upload returns 0 on failure.
+    uint32_t (*upload_retained_vertices)(const float buf[], size_t buf_len);
+    void (*delete_retained_vertices)(uint32_t id);
+    void (*draw_retained_triangles)(uint32_t id, size_t vbo_offset, size_t num_vertices, const float mvp[4][4], uint8_t cull_mode);
+    // Optional: lighting, texgen and fog in the vertex shader, for shaders with SHADER_OPT_LIGHTING
+    // or SHADER_OPT_VERTEX_FOG. Lit vertices carry their normal as four signed bytes after the fog.
+    void (*set_vertex_uniforms)(const struct GfxVertexUniforms *uniforms);
+    // Optional, with packed vertices: one shader that evaluates any combiner. Every vertex then has
+    // texture coordinates, fog and four inputs, followed by the color items, the alpha items and the
+    // alpha, fog, texture edge and noise options as three words of four bytes.
+    struct ShaderProgram *(*create_uber_shader)(void);
+    // Optional, with packed vertices: every texture becomes a layer of an array shared with textures
+    // of the same size, so changing textures only changes bindings between sizes. Once enabled,
+    // uploads return the array and layer the texture was placed in, select_texture takes arrays,
+    // and each textured vertex has the tile size as two uint16 after its texture coordinates,
+    // followed by the layer and the sampler state of both tiles as four bytes.
+    bool (*enable_texture_layers)(void);
+    uint32_t (*upload_texture_layer)(uint32_t texture_id, const uint8_t *rgba32_buf, int width, int height, uint8_t *layer);
+    // Optional: frees the storage of a texture evicted from the texture cache. The id stays valid
+    // and gets new contents from a later upload.
+    void (*release_texture)(uint32_t texture_id);
 };
 
 #endif
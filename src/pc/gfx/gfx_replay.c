@@ -0,0 +1,271 @@
+// gfx_replay.c - runs display list captures through the interpreter, without the game
+//
+// Usage: gfx_replay [options] <capture file>
+// Captures are made by setting dl_capture_frames (and dl_capture_start) in sm64config.txt,
+// see gfx_capture.h for the format. Every frame of the capture is run in order, as many times
+// as asked for, and the average time per frame of each phase is printed.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "gfx_pc.h"
+#include "gfx_capture.h"
+#include "gfx_opengl.h"
+#include "gfx_direct3d11.h"
+#include "gfx_direct3d12.h"
+#include "gfx_dxgi.h"
+#include "gfx_sdl.h"
+#include "gfx_dummy.h"
+#include "gfx_soft.h"
+
+struct ReplayFrame {
+    Gfx *commands;
+    uint32_t num_commands;
+};
+
+static uint8_t *capture_data;
+static struct ReplayFrame *frames;
+static uint32_t num_frames;
+
+static struct {
+    bool deferred_draws;
+    bool retained_display_lists;
+    bool gpu_vertex_shading;
+    bool uber_shader;
+    bool texture_layers;
+    unsigned int iterations;
+} options = { .iterations = 10 };
+
+static unsigned long get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void free_capture(void) {
+    for (uint32_t i = 0; i < num_frames; i++) {
+        free(frames[i].commands);
+    }
+    free(frames);
+    free(capture_data);
+    frames = NULL;
+    capture_data = NULL;
+    num_frames = 0;
+}
+
+// Reads size bytes if that many are left in the file, so that sizes from a corrupt file are never allocated
+static bool read_checked(void *buf, uint64_t size, FILE *file, uint64_t *bytes_left) {
+    if (size > *bytes_left || fread(buf, 1, size, file) != size) {
+        return false;
+    }
+    *bytes_left -= size;
+    return true;
+}
+
+static bool load_capture(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+    long file_size;
+    if (fseek(file, 0, SEEK_END) != 0 || (file_size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Could not read %s\n", filename);
+        fclose(file);
+        return false;
+    }
+    uint64_t bytes_left = file_size;
+    struct GfxCaptureHeader header;
+    if (!read_checked(&header, sizeof(header), file, &bytes_left) || memcmp(header.magic, GFX_CAPTURE_MAGIC, sizeof(GFX_CAPTURE_MAGIC)) != 0 ||
+        header.format_version != GFX_CAPTURE_FORMAT_VERSION) {
+        fprintf(stderr, "%s is not a display list capture\n", filename);
+        fclose(file);
+        return false;
+    }
+    // Each frame takes at least its header, so the counts can be checked before anything is allocated
+    if (header.data_size > bytes_left || header.num_frames > (bytes_left - header.data_size) / sizeof(struct GfxCaptureFrame)) {
+        goto truncated;
+    }
+    // One more byte or frame than needed here and below, so that an empty allocation isn't NULL
+    capture_data = malloc(header.data_size + 1);
+    frames = calloc(header.num_frames + 1, sizeof(struct ReplayFrame));
+    if (capture_data == NULL || frames == NULL || !read_checked(capture_data, header.data_size, file, &bytes_left)) {
+        goto truncated;
+    }
+
+    while (num_frames < header.num_frames) {
+        struct GfxCaptureFrame frame;
+        if (!read_checked(&frame, sizeof(frame), file, &bytes_left) ||
+            frame.num_commands > bytes_left / sizeof(struct GfxCaptureCommand)) {
+            goto truncated;
+        }
+        struct GfxCaptureCommand *commands = malloc(frame.num_commands * sizeof(struct GfxCaptureCommand) + 1);
+        Gfx *dl = malloc(frame.num_commands * sizeof(Gfx) + 1);
+        if (commands == NULL || dl == NULL ||
+            !read_checked(commands, frame.num_commands * sizeof(struct GfxCaptureCommand), file, &bytes_left)) {
+            free(commands);
+            free(dl);
+            goto truncated;
+        }
+        for (uint32_t i = 0; i < frame.num_commands; i++) {
+            dl[i].words.w0 = commands[i].w0;
+            dl[i].words.w1 = commands[i].w1;
+        }
+        free(commands);
+        for (uint32_t i = 0; i < frame.num_relocations; i++) {
+            struct GfxCaptureRelocation reloc;
+            if (!read_checked(&reloc, sizeof(reloc), file, &bytes_left) || reloc.command >= frame.num_commands ||
+                dl[reloc.command].words.w1 > header.data_size || reloc.size > header.data_size - dl[reloc.command].words.w1) {
+                free(dl);
+                goto truncated;
+            }
+            dl[reloc.command].words.w1 = (uintptr_t)(capture_data + dl[reloc.command].words.w1);
+        }
+        frames[num_frames].commands = dl;
+        frames[num_frames].num_commands = frame.num_commands;
+        num_frames++;
+    }
+    fclose(file);
+    return true;
+
+truncated:
+    fprintf(stderr, "%s is truncated or corrupt\n", filename);
+    free_capture();
+    fclose(file);
+    return false;
+}
+
+#ifdef ENABLE_GFX_DUMMY
+// The dummy window manager paces frames to 30 per second
+static void gfx_replay_swap_buffers_end(void) {
+}
+#endif
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-deferred] [-retained] [-gpu-vertex] [-uber] [-layers] <capture file>\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.iterations = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-deferred") == 0) {
+            options.deferred_draws = true;
+        } else if (strcmp(argv[i], "-retained") == 0) {
+            options.retained_display_lists = true;
+        } else if (strcmp(argv[i], "-gpu-vertex") == 0) {
+            options.gpu_vertex_shading = true;
+        } else if (strcmp(argv[i], "-uber") == 0) {
+            options.uber_shader = true;
+        } else if (strcmp(argv[i], "-layers") == 0) {
+            options.texture_layers = true;
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (filename == NULL || options.iterations == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!load_capture(filename)) {
+        return 1;
+    }
+
+    struct GfxRenderingAPI *rendering_api;
+    static struct GfxWindowManagerAPI wm_api;
+#if defined(ENABLE_DX12)
+    rendering_api = &gfx_direct3d12_api;
+    wm_api = gfx_dxgi_api;
+#elif defined(ENABLE_DX11)
+    rendering_api = &gfx_direct3d11_api;
+    wm_api = gfx_dxgi_api;
+#elif defined(ENABLE_OPENGL)
+    rendering_api = &gfx_opengl_api;
+    wm_api = gfx_sdl;
+#elif defined(ENABLE_GFX_DUMMY)
+    rendering_api = &gfx_dummy_renderer_api;
+    wm_api = gfx_dummy_wm_api;
+    wm_api.swap_buffers_end = gfx_replay_swap_buffers_end;
+#elif defined(ENABLE_SOFTRAST)
+    rendering_api = &gfx_soft_renderer_api;
+    wm_api = gfx_soft_wm_api;
+    gfx_soft_set_options(0, 0, false, 0);
+#endif
+
+    gfx_init(&wm_api, rendering_api, "Display list replay", false);
+    gfx_set_deferred_draws(options.deferred_draws);
+    gfx_set_retained_display_lists(options.retained_display_lists);
+    gfx_set_gpu_vertex_shading(options.gpu_vertex_shading);
+    gfx_set_texture_layers(options.texture_layers);
+    gfx_set_uber_shader(options.uber_shader);
+
+    // Times in microseconds, summed over all replayed frames
+    uint64_t start_us = 0, run_us = 0, end_us = 0, run_dl_us = 0, draw_us = 0;
+    uint64_t draw_calls = 0, triangles = 0, texture_imports = 0, shader_creations = 0;
+    uint64_t num_replayed = 0;
+    struct GfxDrawStats stats;
+    // In 64 bits, since the product of two 32-bit counts can overflow
+    uint64_t num_to_replay = (uint64_t)options.iterations * num_frames;
+
+    unsigned long t_begin = get_time();
+    for (uint64_t i = 0; i <= num_to_replay; i++) {
+        unsigned long t0 = get_time();
+        gfx_start_frame();
+        unsigned long t1 = get_time();
+        start_us += t1 - t0;
+
+        // The statistics of the previous frame are made available by gfx_start_frame
+        if (i != 0) {
+            gfx_get_draw_stats(&stats);
+            run_dl_us += stats.run_dl_us;
+            draw_us += stats.draw_us;
+            draw_calls += stats.draw_calls;
+            triangles += stats.triangles;
+            texture_imports += stats.texture_imports;
+            shader_creations += stats.shader_creations;
+        }
+        if (i == num_to_replay) {
+            break;
+        }
+
+        gfx_run(frames[i % num_frames].commands);
+        unsigned long t2 = get_time();
+        gfx_end_frame();
+        unsigned long t3 = get_time();
+        run_us += t2 - t1;
+        end_us += t3 - t2;
+        num_replayed++;
+    }
+    unsigned long total_us = get_time() - t_begin;
+
+    if (num_replayed == 0) {
+        printf("The capture has no frames\n");
+        free_capture();
+        return 0;
+    }
+    printf("%llu frames (%u captured x %u), %.1f frames per second\n", (unsigned long long)num_replayed, num_frames, options.iterations,
+           num_replayed * 1e6 / (total_us != 0 ? total_us : 1));
+    printf("per frame:  start_frame %8.1f us\n", (double)start_us / num_replayed);
+    printf("            run         %8.1f us\n", (double)run_us / num_replayed);
+    printf("              run_dl    %8.1f us\n", (double)run_dl_us / num_replayed);
+    printf("              draw      %8.1f us\n", (double)draw_us / num_replayed);
+    printf("            end_frame   %8.1f us\n", (double)end_us / num_replayed);
+    printf("            %.1f draw calls, %.1f triangles, %.2f texture imports, %.2f shader creations\n",
+           (double)draw_calls / num_replayed, (double)triangles / num_replayed,
+           (double)texture_imports / num_replayed, (double)shader_creations / num_replayed);
+    free_capture();
+    return 0;
+}
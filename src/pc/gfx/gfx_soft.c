@@ -0,0 +1,1015 @@
+#ifdef ENABLE_SOFTRAST
+
+// Software rendering backend, for machines without a GPU. Triangles are clipped and set up as they
+// are submitted, then binned into screen tiles at the end of the frame. The tiles are rasterized in
+// parallel by a pool of worker threads, each tile drawing its triangles in submission order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <PR/gbi.h>
+#include "macros.h"
+
+#include "gfx_cc.h"
+#include "gfx_window_manager_api.h"
+#include "gfx_rendering_api.h"
+#include "gfx_screen_config.h"
+#include "gfx_soft.h"
+
+#define SOFT_TILE_SIZE 64
+#define SOFT_MAX_THREADS 32
+#define SOFT_MAX_ATTRIBS 22 // texture coordinates, fog and four RGBA inputs
+
+typedef float vf4 __attribute__((vector_size(16)));
+typedef int32_t vi4 __attribute__((vector_size(16)));
+
+struct ShaderProgram {
+    uint32_t shader_id;
+    struct CCFeatures cc;
+    uint8_t num_floats; // per vertex
+};
+
+struct SoftTextureData {
+    int width, height;
+    uint8_t *rgba;
+    struct SoftTextureData *next_garbage;
+};
+
+struct SoftTexture {
+    struct SoftTextureData *data;
+    bool linear_filter;
+    uint8_t cms, cmt;
+};
+
+struct SoftSampler {
+    const struct SoftTextureData *data;
+    bool linear_filter;
+    uint8_t cms, cmt;
+};
+
+// State a triangle is drawn with, a new one is recorded whenever something changes
+struct SoftState {
+    const struct ShaderProgram *prg;
+    struct SoftSampler samplers[2];
+    bool depth_test, depth_mask, decal, alpha_blend;
+    int scissor[4]; // x0, y0, x1, y1, with y counted from the bottom like in OpenGL
+};
+
+struct SoftVertex {
+    float x, y, z; // window coordinates, z from 0 to 1
+    float inv_w;
+    float attribs[SOFT_MAX_ATTRIBS]; // divided by w for perspective correct interpolation
+};
+
+struct SoftTriangle {
+    uint32_t state;
+    int bbox[4]; // x0, y0, x1, y1, inclusive, already clamped to the scissor
+    struct SoftVertex v[3];
+};
+
+// Programs are allocated one by one, since gfx_pc keeps pointers to them
+static struct ShaderProgram **shader_program_pool;
+static uint32_t shader_program_pool_size, shader_program_pool_capacity;
+static const struct ShaderProgram *cur_prg;
+
+static struct SoftTexture *textures;
+static uint32_t num_textures, textures_capacity;
+static uint32_t bound_textures[2];
+static int active_tile;
+// Replaced texture data may still be referenced by this frame's triangles
+static struct SoftTextureData *garbage_textures;
+
+static bool cur_depth_test, cur_depth_mask, cur_decal, cur_alpha_blend;
+static int viewport[4], scissor[4];
+
+static struct {
+    struct SoftState *states;
+    uint32_t num_states, states_capacity;
+    struct SoftTriangle *tris;
+    uint32_t num_tris, tris_capacity;
+    uint32_t *tile_tris; // triangle indices of every tile, one after the other
+    uint32_t *tile_start, *tile_count;
+    uint32_t tile_tris_capacity;
+} frame;
+
+static uint32_t fb_width, fb_height;
+static uint32_t tiles_x, tiles_y;
+static uint8_t *color_buffer; // RGBA, bottom row first
+static float *depth_buffer;
+static uint32_t frame_count;
+
+static struct {
+    pthread_t threads[SOFT_MAX_THREADS];
+    uint32_t num_threads; // including the thread submitting the frame
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond, done_cond;
+    uint32_t generation;
+    uint32_t next_tile, tiles_done;
+} pool;
+
+static struct {
+    unsigned int threads, dump_interval, max_frames;
+    bool dump_png;
+} options;
+
+void gfx_soft_set_options(unsigned int threads, unsigned int dump_interval, bool dump_png, unsigned int max_frames) {
+    options.threads = threads;
+    options.dump_interval = dump_interval;
+    options.dump_png = dump_png;
+    options.max_frames = max_frames;
+}
+
+// Grows one of the renderer's arrays, aborting if there is no memory left
+static void *gfx_soft_grow(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Out of memory in the software renderer\n");
+        abort();
+    }
+    return ptr;
+}
+
+static bool gfx_soft_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void gfx_soft_unload_shader(UNUSED struct ShaderProgram *old_prg) {
+}
+
+static void gfx_soft_load_shader(struct ShaderProgram *new_prg) {
+    cur_prg = new_prg;
+}
+
+static struct ShaderProgram *shader_program_pool_add(void) {
+    if (shader_program_pool_size == shader_program_pool_capacity) {
+        uint32_t capacity = shader_program_pool_capacity == 0 ? 64 : shader_program_pool_capacity * 2;
+        struct ShaderProgram **pool = realloc(shader_program_pool, capacity * sizeof(struct ShaderProgram *));
+        if (pool == NULL) {
+            fprintf(stderr, "Out of memory for shader programs\n");
+            abort();
+        }
+        shader_program_pool = pool;
+        shader_program_pool_capacity = capacity;
+    }
+    struct ShaderProgram *prg = calloc(1, sizeof(struct ShaderProgram));
+    if (prg == NULL) {
+        fprintf(stderr, "Out of memory for shader programs\n");
+        abort();
+    }
+    return shader_program_pool[shader_program_pool_size++] = prg;
+}
+
+static struct ShaderProgram *gfx_soft_create_and_load_new_shader(uint32_t shader_id) {
+    struct ShaderProgram *prg = shader_program_pool_add();
+    prg->shader_id = shader_id;
+    gfx_cc_get_features(shader_id, &prg->cc);
+    // Same float layout gfx_pc emits for backends without packed vertices
+    prg->num_floats = 4;
+    if (prg->cc.used_textures[0] || prg->cc.used_textures[1]) {
+        prg->num_floats += 2;
+    }
+    if (prg->cc.opt_fog) {
+        prg->num_floats += 4;
+    }
+    prg->num_floats += prg->cc.num_inputs * (prg->cc.opt_alpha ? 4 : 3);
+    cur_prg = prg;
+    return prg;
+}
+
+static struct ShaderProgram *gfx_soft_lookup_shader(uint32_t shader_id) {
+    for (size_t i = 0; i < shader_program_pool_size; i++) {
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
+        }
+    }
+    return NULL;
+}
+
+static void gfx_soft_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->cc.num_inputs;
+    used_textures[0] = prg->cc.used_textures[0];
+    used_textures[1] = prg->cc.used_textures[1];
+}
+
+static uint32_t gfx_soft_new_texture(void) {
+    if (num_textures == textures_capacity) {
+        textures_capacity *= 2;
+        textures = gfx_soft_grow(textures, textures_capacity * sizeof(struct SoftTexture));
+    }
+    memset(&textures[num_textures], 0, sizeof(struct SoftTexture));
+    return num_textures++;
+}
+
+static void gfx_soft_select_texture(int tile, uint32_t texture_id) {
+    active_tile = tile;
+    bound_textures[tile] = texture_id;
+}
+
+static void gfx_soft_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    struct SoftTexture *tex = &textures[bound_textures[active_tile]];
+    if (tex->data != NULL) {
+        tex->data->next_garbage = garbage_textures;
+        garbage_textures = tex->data;
+    }
+    struct SoftTextureData *data = malloc(sizeof(struct SoftTextureData));
+    data->width = width;
+    data->height = height;
+    data->rgba = malloc(width * height * 4);
+    memcpy(data->rgba, rgba32_buf, width * height * 4);
+    tex->data = data;
+}
+
+static void gfx_soft_release_texture(uint32_t texture_id) {
+    struct SoftTexture *tex = &textures[texture_id];
+    if (tex->data != NULL) {
+        tex->data->next_garbage = garbage_textures;
+        garbage_textures = tex->data;
+        tex->data = NULL;
+    }
+}
+
+static void gfx_soft_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    struct SoftTexture *tex = &textures[bound_textures[tile]];
+    tex->linear_filter = linear_filter;
+    tex->cms = cms;
+    tex->cmt = cmt;
+}
+
+static void gfx_soft_set_depth_test(bool depth_test) {
+    cur_depth_test = depth_test;
+}
+
+static void gfx_soft_set_depth_mask(bool z_upd) {
+    cur_depth_mask = z_upd;
+}
+
+static void gfx_soft_set_zmode_decal(bool zmode_decal) {
+    cur_decal = zmode_decal;
+}
+
+static void gfx_soft_set_viewport(int x, int y, int width, int height) {
+    viewport[0] = x;
+    viewport[1] = y;
+    viewport[2] = width;
+    viewport[3] = height;
+}
+
+static void gfx_soft_set_scissor(int x, int y, int width, int height) {
+    scissor[0] = x;
+    scissor[1] = y;
+    scissor[2] = x + width - 1;
+    scissor[3] = y + height - 1;
+}
+
+static void gfx_soft_set_use_alpha(bool use_alpha) {
+    cur_alpha_blend = use_alpha;
+}
+
+static uint32_t gfx_soft_current_state(void) {
+    struct SoftState state;
+    memset(&state, 0, sizeof(state));
+    state.prg = cur_prg;
+    for (int i = 0; i < 2; i++) {
+        if (cur_prg->cc.used_textures[i]) {
+            const struct SoftTexture *tex = &textures[bound_textures[i]];
+            state.samplers[i].data = tex->data;
+            state.samplers[i].linear_filter = tex->linear_filter;
+            state.samplers[i].cms = tex->cms;
+            state.samplers[i].cmt = tex->cmt;
+        }
+    }
+    state.depth_test = cur_depth_test;
+    state.depth_mask = cur_depth_mask;
+    state.decal = cur_decal;
+    state.alpha_blend = cur_alpha_blend;
+    state.scissor[0] = scissor[0] < 0 ? 0 : scissor[0];
+    state.scissor[1] = scissor[1] < 0 ? 0 : scissor[1];
+    state.scissor[2] = scissor[2] >= (int)fb_width ? (int)fb_width - 1 : scissor[2];
+    state.scissor[3] = scissor[3] >= (int)fb_height ? (int)fb_height - 1 : scissor[3];
+
+    if (frame.num_states != 0 && memcmp(&frame.states[frame.num_states - 1], &state, sizeof(state)) == 0) {
+        return frame.num_states - 1;
+    }
+    if (frame.num_states == frame.states_capacity) {
+        frame.states_capacity = frame.states_capacity == 0 ? 1024 : frame.states_capacity * 2;
+        frame.states = gfx_soft_grow(frame.states, frame.states_capacity * sizeof(struct SoftState));
+    }
+    frame.states[frame.num_states] = state;
+    return frame.num_states++;
+}
+
+// Clip space vertex: position followed by the attributes
+struct SoftClipVertex {
+    float v[4 + SOFT_MAX_ATTRIBS];
+};
+
+static void gfx_soft_lerp_vertex(struct SoftClipVertex *out, const struct SoftClipVertex *a, const struct SoftClipVertex *b, float t, int n) {
+    for (int i = 0; i < n; i++) {
+        out->v[i] = a->v[i] + (b->v[i] - a->v[i]) * t;
+    }
+}
+
+// Clips a polygon against the near plane (z >= -w), also keeping w positive
+static int gfx_soft_clip_near(struct SoftClipVertex *out, const struct SoftClipVertex *in, int num_in, int n) {
+    int num_out = 0;
+    for (int i = 0; i < num_in; i++) {
+        const struct SoftClipVertex *a = &in[i];
+        const struct SoftClipVertex *b = &in[(i + 1) % num_in];
+        float da = a->v[2] + a->v[3];
+        float db = b->v[2] + b->v[3];
+        if (a->v[3] <= 1e-5f) da = fminf(da, a->v[3] - 1e-5f);
+        if (b->v[3] <= 1e-5f) db = fminf(db, b->v[3] - 1e-5f);
+        if (da >= 0) {
+            out[num_out++] = *a;
+        }
+        if ((da >= 0) != (db >= 0)) {
+            gfx_soft_lerp_vertex(&out[num_out++], a, b, da / (da - db), n);
+        }
+    }
+    return num_out;
+}
+
+static void gfx_soft_project(struct SoftVertex *out, const struct SoftClipVertex *in, int num_attribs) {
+    float inv_w = 1.0f / in->v[3];
+    out->x = viewport[0] + (in->v[0] * inv_w + 1.0f) * 0.5f * viewport[2];
+    out->y = viewport[1] + (in->v[1] * inv_w + 1.0f) * 0.5f * viewport[3];
+    out->z = (in->v[2] * inv_w + 1.0f) * 0.5f;
+    out->inv_w = inv_w;
+    for (int i = 0; i < num_attribs; i++) {
+        out->attribs[i] = in->v[4 + i] * inv_w;
+    }
+}
+
+static void gfx_soft_add_triangle(uint32_t state, const struct SoftVertex *v0, const struct SoftVertex *v1, const struct SoftVertex *v2) {
+    const struct SoftState *st = &frame.states[state];
+    float x0 = fminf(v0->x, fminf(v1->x, v2->x));
+    float y0 = fminf(v0->y, fminf(v1->y, v2->y));
+    float x1 = fmaxf(v0->x, fmaxf(v1->x, v2->x));
+    float y1 = fmaxf(v0->y, fmaxf(v1->y, v2->y));
+
+    // Pixels whose centers could be covered
+    int bbox[4];
+    bbox[0] = x0 < st->scissor[0] ? st->scissor[0] : (int)floorf(x0);
+    bbox[1] = y0 < st->scissor[1] ? st->scissor[1] : (int)floorf(y0);
+    bbox[2] = x1 > st->scissor[2] ? st->scissor[2] : (int)ceilf(x1);
+    bbox[3] = y1 > st->scissor[3] ? st->scissor[3] : (int)ceilf(y1);
+    if (bbox[0] > bbox[2] || bbox[1] > bbox[3]) {
+        return;
+    }
+
+    if (frame.num_tris == frame.tris_capacity) {
+        frame.tris_capacity = frame.tris_capacity == 0 ? 4096 : frame.tris_capacity * 2;
+        frame.tris = gfx_soft_grow(frame.tris, frame.tris_capacity * sizeof(struct SoftTriangle));
+    }
+    struct SoftTriangle *tri = &frame.tris[frame.num_tris++];
+    tri->state = state;
+    memcpy(tri->bbox, bbox, sizeof(bbox));
+    tri->v[0] = *v0;
+    tri->v[1] = *v1;
+    tri->v[2] = *v2;
+}
+
+static void gfx_soft_draw_triangles(float buf_vbo[], UNUSED size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+    uint32_t state = gfx_soft_current_state();
+    int num_floats = cur_prg->num_floats;
+    int num_attribs = num_floats - 4;
+
+    for (size_t t = 0; t < buf_vbo_num_tris; t++) {
+        struct SoftClipVertex in[3], clipped[4];
+        for (int i = 0; i < 3; i++) {
+            memcpy(in[i].v, &buf_vbo[(t * 3 + i) * num_floats], num_floats * sizeof(float));
+        }
+        int n = 3;
+        const struct SoftClipVertex *poly = in;
+        if (in[0].v[2] < -in[0].v[3] || in[1].v[2] < -in[1].v[3] || in[2].v[2] < -in[2].v[3] ||
+            in[0].v[3] <= 1e-5f || in[1].v[3] <= 1e-5f || in[2].v[3] <= 1e-5f) {
+            n = gfx_soft_clip_near(clipped, in, 3, num_floats);
+            poly = clipped;
+        }
+        if (n < 3) {
+            continue;
+        }
+        struct SoftVertex projected[4];
+        for (int i = 0; i < n; i++) {
+            gfx_soft_project(&projected[i], &poly[i], num_attribs);
+        }
+        for (int i = 2; i < n; i++) {
+            gfx_soft_add_triangle(state, &projected[0], &projected[i - 1], &projected[i]);
+        }
+    }
+}
+
+struct Color {
+    float r, g, b, a;
+};
+
+static inline int gfx_soft_wrap(int coord, int size, uint8_t mode) {
+    if (mode & G_TX_CLAMP) {
+        return coord < 0 ? 0 : coord >= size ? size - 1 : coord;
+    }
+    if (mode & G_TX_MIRROR) {
+        int period = coord >= 0 ? coord / size : (coord + 1) / size - 1;
+        coord -= period * size;
+        return (period & 1) ? size - 1 - coord : coord;
+    }
+    coord %= size;
+    return coord < 0 ? coord + size : coord;
+}
+
+static inline struct Color gfx_soft_texel(const struct SoftTextureData *data, int x, int y) {
+    const uint8_t *p = &data->rgba[(y * data->width + x) * 4];
+    struct Color c = { p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f, p[3] / 255.0f };
+    return c;
+}
+
+static struct Color gfx_soft_sample(const struct SoftSampler *s, float u, float v) {
+    const struct SoftTextureData *data = s->data;
+    if (data == NULL) {
+        struct Color c = { 0, 0, 0, 0 };
+        return c;
+    }
+    float x = u * data->width;
+    float y = v * data->height;
+    if (!s->linear_filter) {
+        return gfx_soft_texel(data, gfx_soft_wrap((int)floorf(x), data->width, s->cms), gfx_soft_wrap((int)floorf(y), data->height, s->cmt));
+    }
+    x -= 0.5f;
+    y -= 0.5f;
+    float fx = floorf(x), fy = floorf(y);
+    float ax = x - fx, ay = y - fy;
+    int x0 = gfx_soft_wrap((int)fx, data->width, s->cms), x1 = gfx_soft_wrap((int)fx + 1, data->width, s->cms);
+    int y0 = gfx_soft_wrap((int)fy, data->height, s->cmt), y1 = gfx_soft_wrap((int)fy + 1, data->height, s->cmt);
+    struct Color c00 = gfx_soft_texel(data, x0, y0), c10 = gfx_soft_texel(data, x1, y0);
+    struct Color c01 = gfx_soft_texel(data, x0, y1), c11 = gfx_soft_texel(data, x1, y1);
+    struct Color c;
+    c.r = (c00.r * (1 - ax) + c10.r * ax) * (1 - ay) + (c01.r * (1 - ax) + c11.r * ax) * ay;
+    c.g = (c00.g * (1 - ax) + c10.g * ax) * (1 - ay) + (c01.g * (1 - ax) + c11.g * ax) * ay;
+    c.b = (c00.b * (1 - ax) + c10.b * ax) * (1 - ay) + (c01.b * (1 - ax) + c11.b * ax) * ay;
+    c.a = (c00.a * (1 - ax) + c10.a * ax) * (1 - ay) + (c01.a * (1 - ax) + c11.a * ax) * ay;
+    return c;
+}
+
+// Value of a combiner item, with TEXEL0A broadcasting the texel alpha
+static inline struct Color gfx_soft_cc_item(uint8_t item, const struct Color inputs[4], const struct Color *tex0, const struct Color *tex1) {
+    struct Color c = { 0, 0, 0, 0 };
+    switch (item) {
+        case SHADER_INPUT_1:
+        case SHADER_INPUT_2:
+        case SHADER_INPUT_3:
+        case SHADER_INPUT_4:
+            return inputs[item - SHADER_INPUT_1];
+        case SHADER_TEXEL0:
+            return *tex0;
+        case SHADER_TEXEL0A:
+            c.r = c.g = c.b = c.a = tex0->a;
+            return c;
+        case SHADER_TEXEL1:
+            return *tex1;
+    }
+    return c;
+}
+
+// Same as the generated GLSL shaders. (a - b) * c + d covers the single, multiply and mix forms.
+static bool gfx_soft_shade(const struct SoftState *st, const float *attribs, float frag_x, float frag_y, struct Color *out) {
+    const struct CCFeatures *cc = &st->prg->cc;
+    int pos = 0;
+    struct Color tex0 = { 0, 0, 0, 0 }, tex1 = { 0, 0, 0, 0 };
+    if (cc->used_textures[0] || cc->used_textures[1]) {
+        float u = attribs[pos++], v = attribs[pos++];
+        if (cc->used_textures[0]) {
+            tex0 = gfx_soft_sample(&st->samplers[0], u, v);
+        }
+        if (cc->used_textures[1]) {
+            tex1 = gfx_soft_sample(&st->samplers[1], u, v);
+        }
+    }
+    const float *fog = NULL;
+    if (cc->opt_fog) {
+        fog = &attribs[pos];
+        pos += 4;
+    }
+    struct Color inputs[4];
+    for (int i = 0; i < cc->num_inputs; i++) {
+        inputs[i].r = attribs[pos++];
+        inputs[i].g = attribs[pos++];
+        inputs[i].b = attribs[pos++];
+        inputs[i].a = cc->opt_alpha ? attribs[pos++] : 1.0f;
+    }
+
+    struct Color a = gfx_soft_cc_item(cc->c[0][0], inputs, &tex0, &tex1);
+    struct Color b = gfx_soft_cc_item(cc->c[0][1], inputs, &tex0, &tex1);
+    struct Color c = gfx_soft_cc_item(cc->c[0][2], inputs, &tex0, &tex1);
+    struct Color d = gfx_soft_cc_item(cc->c[0][3], inputs, &tex0, &tex1);
+    out->r = (a.r - b.r) * c.r + d.r;
+    out->g = (a.g - b.g) * c.g + d.g;
+    out->b = (a.b - b.b) * c.b + d.b;
+    out->a = 1.0f;
+    if (cc->opt_alpha) {
+        float aa = gfx_soft_cc_item(cc->c[1][0], inputs, &tex0, &tex1).a;
+        float ab = gfx_soft_cc_item(cc->c[1][1], inputs, &tex0, &tex1).a;
+        float ac = gfx_soft_cc_item(cc->c[1][2], inputs, &tex0, &tex1).a;
+        float ad = gfx_soft_cc_item(cc->c[1][3], inputs, &tex0, &tex1).a;
+        out->a = (aa - ab) * ac + ad;
+
+        if (cc->opt_texture_edge) {
+            if (out->a > 0.3f) {
+                out->a = 1.0f;
+            } else {
+                return false;
+            }
+        }
+    }
+    if (fog != NULL) {
+        out->r += (fog[0] - out->r) * fog[3];
+        out->g += (fog[1] - out->g) * fog[3];
+        out->b += (fog[2] - out->b) * fog[3];
+    }
+    if (cc->opt_alpha && cc->opt_noise) {
+        float value = sinf(floorf(frag_x * (240.0f / fb_height))) * 12.9898f + sinf(floorf(frag_y * (240.0f / fb_height))) * 78.233f + sinf((float)frame_count) * 37.719f;
+        float random = sinf(value) * 143758.5453f;
+        random -= floorf(random);
+        out->a *= floorf(random + 0.5f);
+    }
+    return true;
+}
+
+static inline float gfx_soft_saturate(float v) {
+    return v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
+}
+
+static void gfx_soft_rasterize(const struct SoftTriangle *tri, const int rect[4]) {
+    const struct SoftState *st = &frame.states[tri->state];
+    const struct SoftVertex *v0 = &tri->v[0], *v1 = &tri->v[1], *v2 = &tri->v[2];
+
+    float area = (v1->x - v0->x) * (v2->y - v0->y) - (v1->y - v0->y) * (v2->x - v0->x);
+    if (area == 0.0f) {
+        return;
+    }
+    if (area < 0.0f) {
+        // Culling is done before, so just make the winding counter-clockwise
+        const struct SoftVertex *tmp = v1;
+        v1 = v2;
+        v2 = tmp;
+        area = -area;
+    }
+    float inv_area = 1.0f / area;
+
+    // Edge functions, e_i(x, y) = a_i * x + b_i * y + c_i, positive inside
+    const struct SoftVertex *ev[3][2] = { { v1, v2 }, { v2, v0 }, { v0, v1 } };
+    float ea[3], eb[3], ec[3];
+    bool top_left[3];
+    for (int i = 0; i < 3; i++) {
+        const struct SoftVertex *p = ev[i][0], *q = ev[i][1];
+        ea[i] = p->y - q->y;
+        eb[i] = q->x - p->x;
+        ec[i] = p->x * q->y - p->y * q->x;
+        // Pixels exactly on an edge belong to only one of the triangles sharing it
+        top_left[i] = ea[i] > 0.0f || (ea[i] == 0.0f && eb[i] < 0.0f);
+    }
+
+    int num_attribs = st->prg->num_floats - 4;
+    float decal_bias = st->decal ? 2.0f / 65536.0f : 0.0f;
+    const vf4 lane = { 0.5f, 1.5f, 2.5f, 3.5f };
+
+    for (int y = rect[1]; y <= rect[3]; y++) {
+        float fy = y + 0.5f;
+        vf4 row[3];
+        for (int i = 0; i < 3; i++) {
+            row[i] = (vf4){ 0, 0, 0, 0 } + (eb[i] * fy + ec[i]);
+        }
+        for (int x = rect[0]; x <= rect[2]; x += 4) {
+            vf4 fx = lane + (float)x;
+            vf4 w[3];
+            vi4 inside = (vi4){ -1, -1, -1, -1 };
+            for (int i = 0; i < 3; i++) {
+                w[i] = row[i] + fx * ea[i];
+                inside &= top_left[i] ? (w[i] >= 0.0f) : (w[i] > 0.0f);
+            }
+            if ((inside[0] | inside[1] | inside[2] | inside[3]) == 0) {
+                continue;
+            }
+            for (int k = 0; k < 4 && x + k <= rect[2]; k++) {
+                if (!inside[k]) {
+                    continue;
+                }
+                float b0 = w[0][k] * inv_area, b1 = w[1][k] * inv_area, b2 = w[2][k] * inv_area;
+                size_t pix = (size_t)y * fb_width + x + k;
+                float z = v0->z * b0 + v1->z * b1 + v2->z * b2 - decal_bias;
+                if (st->depth_test && z > depth_buffer[pix]) {
+                    continue;
+                }
+
+                float inv_w = v0->inv_w * b0 + v1->inv_w * b1 + v2->inv_w * b2;
+                float w_corr = 1.0f / inv_w;
+                float attribs[SOFT_MAX_ATTRIBS];
+                for (int j = 0; j < num_attribs; j++) {
+                    attribs[j] = (v0->attribs[j] * b0 + v1->attribs[j] * b1 + v2->attribs[j] * b2) * w_corr;
+                }
+
+                struct Color c;
+                if (!gfx_soft_shade(st, attribs, x + k + 0.5f, fy, &c)) {
+                    continue;
+                }
+                if (st->depth_test && st->depth_mask) {
+                    depth_buffer[pix] = z;
+                }
+                uint8_t *dst = &color_buffer[pix * 4];
+                float r = gfx_soft_saturate(c.r), g = gfx_soft_saturate(c.g), b = gfx_soft_saturate(c.b);
+                if (st->alpha_blend) {
+                    float a = gfx_soft_saturate(c.a);
+                    r = r * a + dst[0] / 255.0f * (1.0f - a);
+                    g = g * a + dst[1] / 255.0f * (1.0f - a);
+                    b = b * a + dst[2] / 255.0f * (1.0f - a);
+                }
+                dst[0] = (uint8_t)(r * 255.0f + 0.5f);
+                dst[1] = (uint8_t)(g * 255.0f + 0.5f);
+                dst[2] = (uint8_t)(b * 255.0f + 0.5f);
+                dst[3] = 255;
+            }
+        }
+    }
+}
+
+static void gfx_soft_rasterize_tile(uint32_t tile) {
+    int tx = tile % tiles_x, ty = tile / tiles_x;
+    int x0 = tx * SOFT_TILE_SIZE, y0 = ty * SOFT_TILE_SIZE;
+    int x1 = x0 + SOFT_TILE_SIZE - 1, y1 = y0 + SOFT_TILE_SIZE - 1;
+    if (x1 >= (int)fb_width) x1 = fb_width - 1;
+    if (y1 >= (int)fb_height) y1 = fb_height - 1;
+
+    const uint32_t *indices = &frame.tile_tris[frame.tile_start[tile]];
+    for (uint32_t i = 0; i < frame.tile_count[tile]; i++) {
+        const struct SoftTriangle *tri = &frame.tris[indices[i]];
+        int rect[4] = {
+            tri->bbox[0] > x0 ? tri->bbox[0] : x0,
+            tri->bbox[1] > y0 ? tri->bbox[1] : y0,
+            tri->bbox[2] < x1 ? tri->bbox[2] : x1,
+            tri->bbox[3] < y1 ? tri->bbox[3] : y1
+        };
+        gfx_soft_rasterize(tri, rect);
+    }
+}
+
+// Takes tiles until there are none left. Returns after the last tile it took is done.
+static void gfx_soft_work(void) {
+    uint32_t num_tiles = tiles_x * tiles_y;
+    for (;;) {
+        pthread_mutex_lock(&pool.mutex);
+        uint32_t tile = pool.next_tile++;
+        pthread_mutex_unlock(&pool.mutex);
+        if (tile >= num_tiles) {
+            break;
+        }
+        gfx_soft_rasterize_tile(tile);
+        pthread_mutex_lock(&pool.mutex);
+        if (++pool.tiles_done == num_tiles) {
+            pthread_cond_signal(&pool.done_cond);
+        }
+        pthread_mutex_unlock(&pool.mutex);
+    }
+}
+
+static void *gfx_soft_worker_main(UNUSED void *arg) {
+    uint32_t generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool.mutex);
+        while (pool.generation == generation) {
+            pthread_cond_wait(&pool.start_cond, &pool.mutex);
+        }
+        generation = pool.generation;
+        pthread_mutex_unlock(&pool.mutex);
+        gfx_soft_work();
+    }
+    return NULL;
+}
+
+static void gfx_soft_bin_triangles(void) {
+    uint32_t num_tiles = tiles_x * tiles_y;
+    memset(frame.tile_count, 0, num_tiles * sizeof(uint32_t));
+    size_t total = 0;
+    for (uint32_t i = 0; i < frame.num_tris; i++) {
+        const int *bbox = frame.tris[i].bbox;
+        for (int ty = bbox[1] / SOFT_TILE_SIZE; ty <= bbox[3] / SOFT_TILE_SIZE; ty++) {
+            for (int tx = bbox[0] / SOFT_TILE_SIZE; tx <= bbox[2] / SOFT_TILE_SIZE; tx++) {
+                frame.tile_count[ty * tiles_x + tx]++;
+                total++;
+            }
+        }
+    }
+    if (total > frame.tile_tris_capacity) {
+        frame.tile_tris_capacity = total * 2;
+        frame.tile_tris = gfx_soft_grow(frame.tile_tris, frame.tile_tris_capacity * sizeof(uint32_t));
+    }
+    uint32_t start = 0;
+    for (uint32_t t = 0; t < num_tiles; t++) {
+        frame.tile_start[t] = start;
+        start += frame.tile_count[t];
+        frame.tile_count[t] = 0;
+    }
+    for (uint32_t i = 0; i < frame.num_tris; i++) {
+        const int *bbox = frame.tris[i].bbox;
+        for (int ty = bbox[1] / SOFT_TILE_SIZE; ty <= bbox[3] / SOFT_TILE_SIZE; ty++) {
+            for (int tx = bbox[0] / SOFT_TILE_SIZE; tx <= bbox[2] / SOFT_TILE_SIZE; tx++) {
+                uint32_t t = ty * tiles_x + tx;
+                frame.tile_tris[frame.tile_start[t] + frame.tile_count[t]++] = i;
+            }
+        }
+    }
+}
+
+static void gfx_soft_init(void) {
+    fb_width = DESIRED_SCREEN_WIDTH;
+    fb_height = DESIRED_SCREEN_HEIGHT;
+    tiles_x = (fb_width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    tiles_y = (fb_height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    color_buffer = calloc(fb_width * fb_height, 4);
+    depth_buffer = malloc(fb_width * fb_height * sizeof(float));
+    frame.tile_start = malloc(tiles_x * tiles_y * sizeof(uint32_t));
+    frame.tile_count = malloc(tiles_x * tiles_y * sizeof(uint32_t));
+
+    // Texture 0 stays empty, for samplers nothing was bound to
+    textures_capacity = 1024;
+    textures = calloc(textures_capacity, sizeof(struct SoftTexture));
+    num_textures = 1;
+
+    gfx_soft_set_viewport(0, 0, fb_width, fb_height);
+    gfx_soft_set_scissor(0, 0, fb_width, fb_height);
+
+    pool.num_threads = options.threads;
+    if (pool.num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.num_threads = cpus > 0 ? cpus : 1;
+    }
+    if (pool.num_threads > SOFT_MAX_THREADS) {
+        pool.num_threads = SOFT_MAX_THREADS;
+    }
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.start_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    for (uint32_t i = 1; i < pool.num_threads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, gfx_soft_worker_main, NULL) != 0) {
+            pool.num_threads = i;
+            break;
+        }
+    }
+}
+
+static void gfx_soft_on_resize(void) {
+}
+
+static void gfx_soft_start_frame(void) {
+    frame_count++;
+    while (garbage_textures != NULL) {
+        struct SoftTextureData *next = garbage_textures->next_garbage;
+        free(garbage_textures->rgba);
+        free(garbage_textures);
+        garbage_textures = next;
+    }
+    frame.num_states = 0;
+    frame.num_tris = 0;
+    memset(color_buffer, 0, fb_width * fb_height * 4);
+    for (size_t i = 0; i < fb_width * fb_height; i++) {
+        depth_buffer[i] = 1.0f;
+    }
+}
+
+static void gfx_soft_end_frame(void) {
+    gfx_soft_bin_triangles();
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.next_tile = 0;
+    pool.tiles_done = 0;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    gfx_soft_work();
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.tiles_done != tiles_x * tiles_y) {
+        pthread_cond_wait(&pool.done_cond, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static void gfx_soft_finish_render(void) {
+}
+
+static uint32_t gfx_soft_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void gfx_soft_put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void gfx_soft_write_png_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t len) {
+    uint8_t header[8];
+    gfx_soft_put_be32(header, len);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = gfx_soft_crc32(gfx_soft_crc32(0, header + 4, 4), data, len);
+    uint8_t footer[4];
+    gfx_soft_put_be32(footer, crc);
+    fwrite(header, 1, 8, file);
+    if (len != 0) {
+        fwrite(data, 1, len, file);
+    }
+    fwrite(footer, 1, 4, file);
+}
+
+// PNG with uncompressed deflate blocks, so no zlib is needed
+static void gfx_soft_write_png(FILE *file, const uint8_t *rgb, uint32_t width, uint32_t height) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, 8, file);
+
+    uint8_t ihdr[13];
+    gfx_soft_put_be32(ihdr, width);
+    gfx_soft_put_be32(ihdr + 4, height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = 2; // RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    gfx_soft_write_png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    size_t raw_len = (size_t)(width * 3 + 1) * height;
+    uint8_t *raw = malloc(raw_len);
+    for (uint32_t y = 0; y < height; y++) {
+        raw[y * (width * 3 + 1)] = 0; // no filter
+        memcpy(&raw[y * (width * 3 + 1) + 1], &rgb[y * width * 3], width * 3);
+    }
+    size_t num_blocks = (raw_len + 65534) / 65535;
+    size_t idat_len = 2 + raw_len + num_blocks * 5 + 4;
+    uint8_t *idat = malloc(idat_len);
+    uint8_t *p = idat;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    uint32_t s1 = 1, s2 = 0;
+    for (size_t pos = 0; pos < raw_len; pos += 65535) {
+        size_t len = raw_len - pos < 65535 ? raw_len - pos : 65535;
+        *p++ = pos + len == raw_len;
+        *p++ = len & 0xff;
+        *p++ = len >> 8;
+        *p++ = ~len & 0xff;
+        *p++ = (~len >> 8) & 0xff;
+        memcpy(p, &raw[pos], len);
+        p += len;
+        for (size_t i = 0; i < len; i++) {
+            s1 = (s1 + raw[pos + i]) % 65521;
+            s2 = (s2 + s1) % 65521;
+        }
+    }
+    gfx_soft_put_be32(p, (s2 << 16) | s1);
+    gfx_soft_write_png_chunk(file, "IDAT", idat, idat_len);
+    gfx_soft_write_png_chunk(file, "IEND", NULL, 0);
+    free(idat);
+    free(raw);
+}
+
+static void gfx_soft_dump_frame(void) {
+    char filename[64];
+    sprintf(filename, "frame_%06u.%s", frame_count, options.dump_png ? "png" : "ppm");
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        return;
+    }
+    // Top row first
+    uint8_t *rgb = malloc(fb_width * fb_height * 3);
+    for (uint32_t y = 0; y < fb_height; y++) {
+        const uint8_t *src = &color_buffer[(size_t)(fb_height - 1 - y) * fb_width * 4];
+        for (uint32_t x = 0; x < fb_width; x++) {
+            memcpy(&rgb[(y * fb_width + x) * 3], &src[x * 4], 3);
+        }
+    }
+    if (options.dump_png) {
+        gfx_soft_write_png(file, rgb, fb_width, fb_height);
+    } else {
+        fprintf(file, "P6\n%u %u\n255\n", fb_width, fb_height);
+        fwrite(rgb, 1, fb_width * fb_height * 3, file);
+    }
+    free(rgb);
+    fclose(file);
+}
+
+static void gfx_soft_wm_init(UNUSED const char *game_name, UNUSED bool start_in_fullscreen) {
+}
+
+static void gfx_soft_wm_set_keyboard_callbacks(UNUSED bool (*on_key_down)(int scancode), UNUSED bool (*on_key_up)(int scancode), UNUSED void (*on_all_keys_up)(void)) {
+}
+
+static void gfx_soft_wm_set_fullscreen_changed_callback(UNUSED void (*on_fullscreen_changed)(bool is_now_fullscreen)) {
+}
+
+static void gfx_soft_wm_set_fullscreen(UNUSED bool enable) {
+}
+
+static void gfx_soft_wm_main_loop(void (*run_one_game_iter)(void)) {
+    // There's no display to pace against, so frames are produced as fast as they can be
+    while (1) {
+        run_one_game_iter();
+    }
+}
+
+static void gfx_soft_wm_get_dimensions(uint32_t *width, uint32_t *height) {
+    *width = DESIRED_SCREEN_WIDTH;
+    *height = DESIRED_SCREEN_HEIGHT;
+}
+
+static void gfx_soft_wm_handle_events(void) {
+}
+
+static bool gfx_soft_wm_start_frame(void) {
+    return true;
+}
+
+static void gfx_soft_wm_swap_buffers_begin(void) {
+    if (options.dump_interval != 0 && frame_count % options.dump_interval == 0) {
+        gfx_soft_dump_frame();
+    }
+}
+
+static void gfx_soft_wm_swap_buffers_end(void) {
+    if (options.max_frames != 0 && frame_count >= options.max_frames) {
+        exit(0);
+    }
+}
+
+static double gfx_soft_wm_get_time(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct GfxWindowManagerAPI gfx_soft_wm_api = {
+    gfx_soft_wm_init,
+    gfx_soft_wm_set_keyboard_callbacks,
+    gfx_soft_wm_set_fullscreen_changed_callback,
+    gfx_soft_wm_set_fullscreen,
+    gfx_soft_wm_main_loop,
+    gfx_soft_wm_get_dimensions,
+    gfx_soft_wm_handle_events,
+    gfx_soft_wm_start_frame,
+    gfx_soft_wm_swap_buffers_begin,
+    gfx_soft_wm_swap_buffers_end,
+    gfx_soft_wm_get_time
+};
+
+struct GfxRenderingAPI gfx_soft_renderer_api = {
+    gfx_soft_z_is_from_0_to_1,
+    gfx_soft_unload_shader,
+    gfx_soft_load_shader,
+    gfx_soft_create_and_load_new_shader,
+    gfx_soft_lookup_shader,
+    gfx_soft_shader_get_info,
+    gfx_soft_new_texture,
+    gfx_soft_select_texture,
+    gfx_soft_upload_texture,
+    gfx_soft_set_sampler_parameters,
+    gfx_soft_set_depth_test,
+    gfx_soft_set_depth_mask,
+    gfx_soft_set_zmode_decal,
+    gfx_soft_set_viewport,
+    gfx_soft_set_scissor,
+    gfx_soft_set_use_alpha,
+    gfx_soft_draw_triangles,
+    gfx_soft_init,
+    gfx_soft_on_resize,
+    gfx_soft_start_frame,
+    gfx_soft_end_frame,
+    gfx_soft_finish_render,
+    NULL, // map_vertex_buffer
+    NULL, // set_texture_size
+    NULL, // set_fog_color
+    NULL, // upload_retained_vertices
+    NULL, // delete_retained_vertices
+    NULL, // draw_retained_triangles
+    NULL, // set_vertex_uniforms
+    NULL, // create_uber_shader
+    NULL, // enable_texture_layers
+    NULL, // upload_texture_layer
+    gfx_soft_release_texture
+};
+
+#endif
@@ -0,0 +1,18 @@
+#ifdef ENABLE_SOFTRAST
+
+#ifndef GFX_SOFT_H
+#define GFX_SOFT_H
+
+#include "gfx_rendering_api.h"
+#include "gfx_window_manager_api.h"
+
+extern struct GfxRenderingAPI gfx_soft_renderer_api;
+extern struct GfxWindowManagerAPI gfx_soft_wm_api;
+
+// threads: 0 for one per CPU. dump_interval: write every Nth frame to an image, 0 for none.
+// max_frames: exit after that many frames, 0 for no limit.
+void gfx_soft_set_options(unsigned int threads, unsigned int dump_interval, bool dump_png, unsigned int max_frames);
+
+#endif
+
+#endif
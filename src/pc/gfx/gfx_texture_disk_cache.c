@@ -0,0 +1,192 @@
+// gfx_texture_disk_cache.c - decoded RGBA32 textures persisted in a single memory-mapped file
+//
+// Layout: a header, then an open addressing index keyed by texture content hash,
+// then the texel data. The file is created at its full size up front (sparse where
+// the filesystem allows it), so the mapping never needs to grow.
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "gfx_texture_disk_cache.h"
+
+#define CACHE_MAGIC "SM64TEX"
+#define CACHE_FORMAT_VERSION 1
+#define CACHE_INDEX_SIZE 8192 // must be a power of two
+#define CACHE_DATA_SIZE (96 * 1024 * 1024)
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t index_size;
+    uint64_t data_size;
+    char version_tag[32];
+    uint64_t data_used;
+    uint32_t num_entries;
+    uint32_t pad;
+};
+
+struct CacheIndexEntry {
+    uint64_t key; // 0 means empty
+    uint64_t offset;
+    uint32_t width, height;
+};
+
+#define CACHE_DATA_OFFSET ((sizeof(struct CacheHeader) + CACHE_INDEX_SIZE * sizeof(struct CacheIndexEntry) + 4095) & ~(size_t)4095)
+#define CACHE_FILE_SIZE (CACHE_DATA_OFFSET + CACHE_DATA_SIZE)
+
+static struct {
+    uint8_t *base;
+    struct CacheHeader *header;
+    struct CacheIndexEntry *index;
+    uint8_t *data;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#else
+    int fd;
+#endif
+} disk_cache;
+
+static void *map_file(const char *path) {
+#ifdef _WIN32
+    disk_cache.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (disk_cache.file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    disk_cache.mapping = CreateFileMappingA(disk_cache.file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)CACHE_FILE_SIZE >> 32), (DWORD)CACHE_FILE_SIZE, NULL);
+    if (disk_cache.mapping == NULL) {
+        CloseHandle(disk_cache.file);
+        return NULL;
+    }
+    void *ptr = MapViewOfFile(disk_cache.mapping, FILE_MAP_ALL_ACCESS, 0, 0, CACHE_FILE_SIZE);
+    if (ptr == NULL) {
+        CloseHandle(disk_cache.mapping);
+        CloseHandle(disk_cache.file);
+    }
+    return ptr;
+#else
+    disk_cache.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (disk_cache.fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(disk_cache.fd, &st) != 0 || ((size_t)st.st_size != CACHE_FILE_SIZE && ftruncate(disk_cache.fd, CACHE_FILE_SIZE) != 0)) {
+        close(disk_cache.fd);
+        return NULL;
+    }
+    void *ptr = mmap(NULL, CACHE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk_cache.fd, 0);
+    if (ptr == MAP_FAILED) {
+        close(disk_cache.fd);
+        return NULL;
+    }
+    return ptr;
+#endif
+}
+
+static void unmap_file(void) {
+#ifdef _WIN32
+    UnmapViewOfFile(disk_cache.base);
+    CloseHandle(disk_cache.mapping);
+    CloseHandle(disk_cache.file);
+#else
+    munmap(disk_cache.base, CACHE_FILE_SIZE);
+    close(disk_cache.fd);
+#endif
+}
+
+bool gfx_texture_disk_cache_open(const char *path, const char *version_tag) {
+    if (disk_cache.base != NULL) {
+        gfx_texture_disk_cache_close();
+    }
+    disk_cache.base = map_file(path);
+    if (disk_cache.base == NULL) {
+        fprintf(stderr, "Could not open texture cache %s\n", path);
+        return false;
+    }
+    disk_cache.header = (struct CacheHeader *)disk_cache.base;
+    disk_cache.index = (struct CacheIndexEntry *)(disk_cache.base + sizeof(struct CacheHeader));
+    disk_cache.data = disk_cache.base + CACHE_DATA_OFFSET;
+    
+    struct CacheHeader *h = disk_cache.header;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || h->format_version != CACHE_FORMAT_VERSION ||
+        h->index_size != CACHE_INDEX_SIZE || h->data_size != CACHE_DATA_SIZE || h->data_used > CACHE_DATA_SIZE ||
+        strncmp(h->version_tag, version_tag, sizeof(h->version_tag)) != 0) {
+        // New file, old format or a different game version: start over
+        memset(disk_cache.index, 0, CACHE_INDEX_SIZE * sizeof(struct CacheIndexEntry));
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        h->format_version = CACHE_FORMAT_VERSION;
+        h->index_size = CACHE_INDEX_SIZE;
+        h->data_size = CACHE_DATA_SIZE;
+        strncpy(h->version_tag, version_tag, sizeof(h->version_tag) - 1);
+    }
+    return true;
+}
+
+void gfx_texture_disk_cache_close(void) {
+    if (disk_cache.base != NULL) {
+        unmap_file();
+        disk_cache.base = NULL;
+    }
+}
+
+bool gfx_texture_disk_cache_is_open(void) {
+    return disk_cache.base != NULL;
+}
+
+static struct CacheIndexEntry *find_slot(uint64_t key) {
+    for (uint32_t i = 0; i < CACHE_INDEX_SIZE; i++) {
+        struct CacheIndexEntry *e = &disk_cache.index[(key + i) & (CACHE_INDEX_SIZE - 1)];
+        if (e->key == key || e->key == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *gfx_texture_disk_cache_find(uint64_t key, uint32_t *width, uint32_t *height) {
+    if (disk_cache.base == NULL) {
+        return NULL;
+    }
+    key |= key == 0;
+    struct CacheIndexEntry *e = find_slot(key);
+    if (e == NULL || e->key != key || e->offset + (uint64_t)e->width * e->height * 4 > CACHE_DATA_SIZE) {
+        return NULL;
+    }
+    *width = e->width;
+    *height = e->height;
+    return disk_cache.data + e->offset;
+}
+
+void gfx_texture_disk_cache_store(uint64_t key, const uint8_t *rgba32_buf, uint32_t width, uint32_t height) {
+    if (disk_cache.base == NULL) {
+        return;
+    }
+    key |= key == 0;
+    struct CacheHeader *h = disk_cache.header;
+    uint64_t size = ((uint64_t)width * height * 4 + 15) & ~(uint64_t)15;
+    if (h->num_entries >= CACHE_INDEX_SIZE * 3 / 4 || h->data_used + size > CACHE_DATA_SIZE) {
+        // Full, keep what we have
+        return;
+    }
+    struct CacheIndexEntry *e = find_slot(key);
+    if (e == NULL || e->key == key) {
+        return;
+    }
+    // Write the texels before publishing the index entry
+    memcpy(disk_cache.data + h->data_used, rgba32_buf, (size_t)width * height * 4);
+    e->offset = h->data_used;
+    e->width = width;
+    e->height = height;
+    e->key = key;
+    h->data_used += size;
+    h->num_entries++;
+}
@@ -0,0 +1,13 @@
+#ifndef GFX_TEXTURE_DISK_CACHE_H
+#define GFX_TEXTURE_DISK_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool gfx_texture_disk_cache_open(const char *path, const char *version_tag);
+void gfx_texture_disk_cache_close(void);
+bool gfx_texture_disk_cache_is_open(void);
+const uint8_t *gfx_texture_disk_cache_find(uint64_t key, uint32_t *width, uint32_t *height);
+void gfx_texture_disk_cache_store(uint64_t key, const uint8_t *rgba32_buf, uint32_t width, uint32_t height);
+
+#endif
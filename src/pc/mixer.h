@@ -1,6 +1,7 @@
 #ifndef MIXER_H
 #define MIXER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <ultra64.h>
 
@@ -30,10 +31,28 @@ void aInterleaveImpl(uint16_t left, uint16_t right);
 void aDMEMMoveImpl(uint16_t in_addr, uint16_t out_addr, int nbytes);
 void aSetLoopImpl(ADPCM_STATE *adpcm_loop_state);
 void aADPCMdecImpl(uint8_t flags, ADPCM_STATE state);
+// Like aADPCMdec, but reads the compressed frames from the sample data instead of a copy in the buffer
+void aADPCMdecFromImpl(uint8_t flags, ADPCM_STATE state, const void *source_addr);
+// Like aADPCMdecFrom, but takes the decoded frames from the sample cache when it has them. The frames are
+// the ones from frame on of the sample at sample_addr.
+void aADPCMdecCachedImpl(uint8_t flags, ADPCM_STATE state, const void *source_addr, const uint8_t *sample_addr,
+                         uint32_t frame);
 void aResampleImpl(uint8_t flags, uint16_t pitch, RESAMPLE_STATE state);
 void aEnvMixerImpl(uint8_t flags, ENVMIX_STATE state);
 void aMixImpl(int16_t gain, uint16_t in_addr, uint16_t out_addr);
 
+struct SampleCacheStats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    size_t bytes;
+};
+
+// Keeps up to bytes of decoded samples, 0 turns the cache off
+void mixer_set_sample_cache_size(size_t bytes);
+// Can be called from any thread. Each counter is current, but they may not be from the same decode.
+void mixer_get_sample_cache_stats(struct SampleCacheStats *stats);
+
 #define aSegment(pkt, s, b) do { } while(0)
 #define aClearBuffer(pkt, d, c) aClearBufferImpl(d, c)
 #define aLoadBuffer(pkt, s) aLoadBufferImpl(s)
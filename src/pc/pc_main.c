@@ -1,5 +1,9 @@
 #include <stdlib.h>
 
+#ifndef TARGET_WEB
+#include <pthread.h>
+#endif
+
 #ifdef TARGET_WEB
 #include <emscripten.h>
 #include <emscripten/html5.h>
@@ -8,6 +12,7 @@
 #include "sm64.h"
 
 #include "game/memory.h"
+#include "buffers/buffers.h"
 #include "audio/external.h"
 
 #include "gfx/gfx_pc.h"
@@ -18,6 +23,8 @@
 #include "gfx/gfx_glx.h"
 #include "gfx/gfx_sdl.h"
 #include "gfx/gfx_dummy.h"
+#include "gfx/gfx_soft.h"
+#include "gfx/gfx_texture_disk_cache.h"
 
 #include "audio/audio_api.h"
 #include "audio/audio_wasapi.h"
@@ -25,7 +32,10 @@
 #include "audio/audio_alsa.h"
 #include "audio/audio_sdl.h"
 #include "audio/audio_null.h"
+#include "audio/audio_thread.h"
+#include "mixer.h"
 
+#include "controller/controller_api.h"
 #include "controller/controller_keyboard.h"
 
 #include "configfile.h"
@@ -33,6 +43,21 @@
 #include "compat.h"
 
 #define CONFIG_FILE "sm64config.txt"
+#define SHADER_PROFILE_FILE "sm64shaders.txt"
+#define TEXTURE_CACHE_FILE "sm64texcache.bin"
+#define RENDERER_STATS_FILE "sm64gfxstats.csv"
+#define DL_CAPTURE_FILE "sm64dl.bin"
+
+// Decoded textures are only valid for the game version they came from
+#if defined(VERSION_JP)
+#define TEXTURE_CACHE_TAG "sm64.jp"
+#elif defined(VERSION_EU)
+#define TEXTURE_CACHE_TAG "sm64.eu"
+#elif defined(VERSION_SH)
+#define TEXTURE_CACHE_TAG "sm64.sh"
+#else
+#define TEXTURE_CACHE_TAG "sm64.us"
+#endif
 
 OSMesg D_80339BEC;
 OSMesgQueue gSIEventMesgQueue;
@@ -60,11 +85,83 @@ void set_vblank_handler(UNUSED s32 index, UNUSED struct VblankHandler *handler,
 
 static uint8_t inited = 0;
 
+#ifndef TARGET_WEB
+// Pipelined rendering: the game runs on its own thread and hands each finished display list
+// to the main thread, which interprets it while the game builds the next frame in the other
+// gGfxPools entry. At most one frame is in flight, so neither pool is overwritten while in use.
+struct Semaphore {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+};
+
+static struct {
+    bool enabled;
+    pthread_t thread;
+    struct Semaphore frame_ready; // posted by the game thread when a display list is finished
+    struct Semaphore can_build;   // posted by the main thread when the game may start a frame
+    Gfx *display_list;
+    struct GfxDrawStats draw_stats; // taken by the main thread for the overlay, read by the game thread
+} pipeline;
+
+static void semaphore_init(struct Semaphore *sem, int count) {
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->count = count;
+}
+
+static void semaphore_post(struct Semaphore *sem) {
+    pthread_mutex_lock(&sem->mutex);
+    sem->count++;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+static void semaphore_wait(struct Semaphore *sem) {
+    pthread_mutex_lock(&sem->mutex);
+    while (sem->count == 0) {
+        pthread_cond_wait(&sem->cond, &sem->mutex);
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->mutex);
+}
+#endif
+
 #include "game/game_init.h" // for gGlobalTimer
+#include "game/print.h"
+
+// Shows the renderer counters of the last frame with the HUD font
+static void print_renderer_stats(const struct GfxDrawStats *stats) {
+    print_text_fmt_int(22, 88, "DRAWS %d", stats->draw_calls);
+    print_text_fmt_int(22, 72, "TRIS %d", stats->triangles);
+    print_text_fmt_int(22, 56, "TEXTURES %d", stats->texture_imports);
+    print_text_fmt_int(22, 40, "DL US %d", stats->run_dl_us);
+    print_text_fmt_int(22, 24, "DRAW US %d", stats->draw_us);
+    if (audio_thread_is_running()) {
+        struct AudioThreadStats audio_stats;
+        audio_thread_get_stats(&audio_stats);
+        print_text_fmt_int(22, 104, "UNDERRUNS %d", audio_stats.underruns);
+    }
+    if (configSampleCacheKb != 0) {
+        struct SampleCacheStats cache_stats;
+        mixer_get_sample_cache_stats(&cache_stats);
+        if (cache_stats.hits + cache_stats.misses != 0) {
+            print_text_fmt_int(22, 120, "SAMPLE HITS %d", (int)(100ULL * cache_stats.hits / (cache_stats.hits + cache_stats.misses)));
+        }
+        print_text_fmt_int(22, 136, "SAMPLE KB %d", (int)(cache_stats.bytes / 1024));
+    }
+}
+
 void send_display_list(struct SPTask *spTask) {
     if (!inited) {
         return;
     }
+#ifndef TARGET_WEB
+    if (pipeline.enabled) {
+        pipeline.display_list = (Gfx *)spTask->task.t.data_ptr;
+        return;
+    }
+#endif
     gfx_run((Gfx *)spTask->task.t.data_ptr);
 }
 
@@ -78,10 +175,10 @@ void send_display_list(struct SPTask *spTask) {
 #define SAMPLES_LOW 528
 #endif
 
-void produce_one_frame(void) {
-    gfx_start_frame();
-    game_loop_one_iteration();
-    
+static void produce_audio(void) {
+    if (audio_thread_is_running()) {
+        return;
+    }
     int samples_left = audio_api->buffered();
     u32 num_audio_samples = samples_left < audio_api->get_desired_buffered() ? SAMPLES_HIGH : SAMPLES_LOW;
     //printf("Audio samples: %d %u\n", samples_left, num_audio_samples);
@@ -95,6 +192,63 @@ void produce_one_frame(void) {
     }
     //printf("Audio samples before submitting: %d\n", audio_api->buffered());
     audio_api->play((u8 *)audio_buffer, 2 * num_audio_samples * 4);
+}
+
+#ifndef TARGET_WEB
+static void *game_thread_main(UNUSED void *arg) {
+    while (1) {
+        semaphore_wait(&pipeline.can_build);
+        pipeline.display_list = NULL;
+        if (configRendererStatsOverlay) {
+            print_renderer_stats(&pipeline.draw_stats);
+        }
+        game_loop_one_iteration();
+        // Audio stays on the game thread, in step with the sound state the game updates
+        produce_audio();
+        semaphore_post(&pipeline.frame_ready);
+    }
+    return NULL;
+}
+
+static void start_pipelined_rendering(void) {
+    // Input is read here on the main thread from now on, ready before the game's first frame
+    controller_poll();
+    semaphore_init(&pipeline.frame_ready, 0);
+    semaphore_init(&pipeline.can_build, 1);
+    pipeline.enabled = true;
+    if (pthread_create(&pipeline.thread, NULL, game_thread_main, NULL) != 0) {
+        pipeline.enabled = false;
+    }
+}
+#endif
+
+void produce_one_frame(void) {
+    gfx_start_frame();
+#ifndef TARGET_WEB
+    if (pipeline.enabled) {
+        semaphore_wait(&pipeline.frame_ready);
+        Gfx *display_list = pipeline.display_list;
+        controller_poll();
+        // The main thread updates the draw stats in gfx_start_frame, so the game thread gets a copy
+        if (configRendererStatsOverlay) {
+            gfx_get_draw_stats(&pipeline.draw_stats);
+        }
+        // The previous frame's pool is free again, let the game start the next frame
+        semaphore_post(&pipeline.can_build);
+        if (display_list != NULL) {
+            gfx_run(display_list);
+        }
+        gfx_end_frame();
+        return;
+    }
+#endif
+    if (configRendererStatsOverlay) {
+        struct GfxDrawStats stats;
+        gfx_get_draw_stats(&stats);
+        print_renderer_stats(&stats);
+    }
+    game_loop_one_iteration();
+    produce_audio();
     
     gfx_end_frame();
 }
@@ -143,7 +297,10 @@ static void on_fullscreen_changed(bool is_now_fullscreen) {
 void main_func(void) {
 #ifdef USE_SYSTEM_MALLOC
     main_pool_init();
-    gGfxAllocOnlyPool = alloc_only_pool_init();
+    for (int i = 0; i < GFX_NUM_POOLS; i++) {
+        gGfxAllocOnlyPools[i] = alloc_only_pool_init();
+    }
+    gGfxAllocOnlyPool = gGfxAllocOnlyPools[0];
 #else
     static u64 pool[0x165000/8 / 4 * sizeof(void *)];
     main_pool_init(pool, pool + sizeof(pool) / sizeof(pool[0]));
@@ -175,9 +332,35 @@ void main_func(void) {
 #elif defined(ENABLE_GFX_DUMMY)
     rendering_api = &gfx_dummy_renderer_api;
     wm_api = &gfx_dummy_wm_api;
+#elif defined(ENABLE_SOFTRAST)
+    rendering_api = &gfx_soft_renderer_api;
+    wm_api = &gfx_soft_wm_api;
+    gfx_soft_set_options(configSoftrastThreads, configSoftrastDumpInterval, configSoftrastDumpPng, configSoftrastMaxFrames);
 #endif
 
     gfx_init(wm_api, rendering_api, "Super Mario 64 PC-Port", configFullscreen);
+    gfx_shader_profile_load(SHADER_PROFILE_FILE);
+    gfx_set_deferred_draws(configDeferredDraws);
+    gfx_set_retained_display_lists(configRetainedDisplayLists);
+    gfx_set_gpu_vertex_shading(configGpuVertexShading);
+    gfx_set_texture_layers(configTextureLayers);
+    gfx_set_uber_shader(configUberShader);
+#ifdef ENABLE_OPENGL
+    gfx_opengl_set_dof_quality(configDofQuality);
+    gfx_opengl_set_render_scale(configRenderScaleMin / 100.0f, configRenderScaleMax / 100.0f, configGpuFrameBudgetUs);
+#endif
+    // The budget is in bytes, so anything from 4096 MB up is clamped to just under 4 GB
+    uint64_t texture_cache_bytes = (uint64_t)configTextureCacheMB * 1024 * 1024;
+    gfx_texture_cache_set_budget(texture_cache_bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)texture_cache_bytes);
+    gfx_texture_cache_set_content_hash(configTextureCacheContentHash);
+    if (configTextureDiskCache && gfx_texture_disk_cache_open(TEXTURE_CACHE_FILE, TEXTURE_CACHE_TAG)) {
+        // Textures are only looked up from gfx_run on this thread, which is also the one that exits
+        atexit(gfx_texture_disk_cache_close);
+    }
+    if (configRendererStatsDump) {
+        gfx_stats_dump_open(RENDERER_STATS_FILE);
+    }
+    gfx_capture_open(DL_CAPTURE_FILE, configDlCaptureStart, configDlCaptureFrames);
     
     wm_api->set_fullscreen_changed_callback(on_fullscreen_changed);
     wm_api->set_keyboard_callbacks(keyboard_on_key_down, keyboard_on_key_up, keyboard_on_all_keys_up);
@@ -207,6 +390,7 @@ void main_func(void) {
     }
 
     audio_init();
+    mixer_set_sample_cache_size((size_t)configSampleCacheKb * 1024);
     sound_init();
 
     thread5_game_loop(NULL);
@@ -217,6 +401,15 @@ void main_func(void) {
     inited = 1;
 #else
     inited = 1;
+    if (configAudioThread) {
+        // Synthesis needs nothing from the game from here on but its sound calls, which get queued
+        if (audio_thread_start(audio_api, create_next_audio_buffer, run_deferred_sound_calls, SAMPLES_HIGH, SAMPLES_LOW)) {
+            atexit(audio_thread_stop);
+        }
+    }
+    if (configPipelinedRendering) {
+        start_pipelined_rendering();
+    }
     while (1) {
         wm_api->main_loop(produce_one_frame);
     }
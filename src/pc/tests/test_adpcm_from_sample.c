@@ -0,0 +1,96 @@
+// Checks that decoding ADPCM straight from the sample data, as synthesis.c does on PC, leaves DMEM and
+// the decoder state the same as loading the compressed frames into DMEM and decoding them there, as it
+// does on N64.
+
+#include <stdio.h>
+
+#include "src/pc/mixer.c"
+
+#define SEEDS 5000
+
+// From synthesis.c
+#define DMEM_ADDR_UNCOMPRESSED_NOTE 0x180
+#define DMEM_ADDR_COMPRESSED_ADPCM_DATA 0x3f0
+#define DMEM_ADDR_LEFT_CH 0x4c0
+
+// The most frames that decode below the compressed data
+#define MAX_FRAMES ((DMEM_ADDR_COMPRESSED_ADPCM_DATA - DMEM_ADDR_UNCOMPRESSED_NOTE) / 32 - 1)
+
+static uint8_t sample[4096];
+static ADPCM_STATE loop_state;
+
+static void fill_dmem(void) {
+    for (size_t i = 0; i < sizeof(rspa.buf); i++) {
+        rspa.buf.as_u8[i] = i * 7;
+    }
+}
+
+int main(void) {
+    static uint8_t expected[sizeof(rspa.buf)];
+    static const uint8_t flag_choices[] = { 0, A_INIT, A_LOOP };
+    int failures = 0;
+
+    for (unsigned int seed = 1; seed <= SEEDS; seed++) {
+        srand(seed);
+        for (size_t i = 0; i < sizeof(sample); i++) {
+            sample[i] = rand();
+        }
+        for (size_t i = 0; i < sizeof(rspa.adpcm_table) / sizeof(int16_t); i++) {
+            ((int16_t *)rspa.adpcm_table)[i] = rand() % 8192 - 4096;
+        }
+        for (int i = 0; i < 16; i++) {
+            loop_state[i] = rand();
+        }
+
+        // The frames start anywhere in the sample data, so a3 is the misalignment synthesis.c loads around
+        int t0 = rand() % (MAX_FRAMES + 1);
+        uint8_t *frames = sample + 64 + rand() % 1024;
+        int a3 = (uintptr_t)frames & 0xf;
+        for (int i = 0; i < t0; i++) {
+            frames[i * 9] = (frames[i * 9] % 13) << 4 | (frames[i * 9] & 7);
+        }
+        int s0 = t0 == 0 ? 0 : t0 * 16 - rand() % 16;
+        uint8_t flags = flag_choices[rand() % 3];
+        ADPCM_STATE dma_state, sample_state, cached_state;
+        for (int i = 0; i < 16; i++) {
+            dma_state[i] = sample_state[i] = cached_state[i] = rand();
+        }
+        aSetLoopImpl(&loop_state);
+
+        fill_dmem();
+        aSetBufferImpl(0, DMEM_ADDR_COMPRESSED_ADPCM_DATA, 0, t0 * 9 + a3);
+        aLoadBufferImpl(frames - a3);
+        aSetBufferImpl(0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3, DMEM_ADDR_UNCOMPRESSED_NOTE, s0 * 2);
+        aADPCMdecImpl(flags, dma_state);
+        memcpy(expected, rspa.buf.as_u8, sizeof(expected));
+
+        // The compressed data is never loaded, so only the rest of DMEM is compared
+        fill_dmem();
+        aSetBufferImpl(0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3, DMEM_ADDR_UNCOMPRESSED_NOTE, s0 * 2);
+        aADPCMdecFromImpl(flags, sample_state, frames);
+        if (memcmp(expected, rspa.buf.as_u8, DMEM_ADDR_COMPRESSED_ADPCM_DATA) != 0
+            || memcmp(expected + DMEM_ADDR_LEFT_CH, rspa.buf.as_u8 + DMEM_ADDR_LEFT_CH,
+                      sizeof(expected) - DMEM_ADDR_LEFT_CH) != 0
+            || memcmp(dma_state, sample_state, sizeof(ADPCM_STATE)) != 0) {
+            if (failures++ < 10) {
+                printf("seed %u: aADPCMdecFrom differs from aADPCMdec (%d frames, flags %d)\n", seed, t0, flags);
+            }
+        }
+
+        // aADPCMdecSample, with the sample cache off
+        fill_dmem();
+        aSetBufferImpl(0, DMEM_ADDR_COMPRESSED_ADPCM_DATA + a3, DMEM_ADDR_UNCOMPRESSED_NOTE, s0 * 2);
+        aADPCMdecCachedImpl(flags, cached_state, frames, sample, (frames - sample) / 9);
+        if (memcmp(expected, rspa.buf.as_u8, DMEM_ADDR_COMPRESSED_ADPCM_DATA) != 0
+            || memcmp(expected + DMEM_ADDR_LEFT_CH, rspa.buf.as_u8 + DMEM_ADDR_LEFT_CH,
+                      sizeof(expected) - DMEM_ADDR_LEFT_CH) != 0
+            || memcmp(dma_state, cached_state, sizeof(ADPCM_STATE)) != 0) {
+            if (failures++ < 10) {
+                printf("seed %u: aADPCMdecCached differs from aADPCMdec (%d frames, flags %d)\n", seed, t0, flags);
+            }
+        }
+    }
+
+    printf("test_adpcm_from_sample: %d mismatches (%s kernels)\n", failures, get_kernels()->name);
+    return failures != 0;
+}
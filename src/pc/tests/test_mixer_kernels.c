@@ -0,0 +1,144 @@
+// Checks that every set of mixer kernels the CPU can run gives the same output as the scalar kernels,
+// from the same random buffer, state and parameters. The scalar aEnvMixer and aMix round differently
+// from the SIMD ones, and the SIMD aEnvMixer keeps its volumes as floats in the state, so those two
+// are checked against the first SIMD set instead.
+
+#include <stdio.h>
+
+#include "src/pc/mixer.c"
+
+#define SEEDS 2000
+
+enum {
+    KERNEL_INTERLEAVE,
+    KERNEL_ADPCM_DEC,
+    KERNEL_RESAMPLE,
+    KERNEL_ENV_MIXER,
+    KERNEL_MIX,
+    KERNEL_COUNT
+};
+
+static const char *kernel_names[KERNEL_COUNT] = { "interleave", "adpcm_dec", "resample", "env_mixer", "mix" };
+static const bool matches_scalar[KERNEL_COUNT] = { true, true, true, false, false };
+
+static uint8_t initial_buf[sizeof(rspa.buf)];
+// ENVMIX_STATE is the largest of the states the kernels take
+static ENVMIX_STATE initial_state;
+static uint8_t result_buf[5][sizeof(rspa.buf)];
+static ENVMIX_STATE result_state[5];
+
+static int supported_kernel_sets(const struct MixerKernels **sets) {
+    int count = 0;
+
+    sets[count++] = &mixer_kernels_c;
+#if MIXER_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[count++] = &mixer_kernels_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        sets[count++] = &mixer_kernels_sse41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[count++] = &mixer_kernels_avx2;
+    }
+#elif __ARM_NEON
+    sets[count++] = &mixer_kernels_neon;
+#endif
+    return count;
+}
+
+static void randomize(unsigned int seed) {
+    srand(seed);
+    for (size_t i = 0; i < sizeof(initial_buf); i++) {
+        initial_buf[i] = rand();
+    }
+    for (size_t i = 0; i < sizeof(initial_state) / sizeof(initial_state[0]); i++) {
+        initial_state[i] = rand();
+    }
+    for (size_t i = 0; i < sizeof(rspa.adpcm_table) / sizeof(int16_t); i++) {
+        ((int16_t *)rspa.adpcm_table)[i] = rand() % 8192 - 4096;
+    }
+    // Keep the frame headers' scale in the range the game's samples use
+    for (int i = 0; i < 40; i++) {
+        uint8_t *header = &initial_buf[1800 + i * 9];
+        *header = (*header % 13) << 4 | (*header & 7);
+    }
+}
+
+static void run_kernel(const struct MixerKernels *k, int kernel, unsigned int seed, uint8_t *buf, int16_t *state) {
+    memcpy(rspa.buf.as_u8, initial_buf, sizeof(initial_buf));
+    memcpy(state, initial_state, sizeof(initial_state));
+    rspa.nbytes = 320;
+    switch (kernel) {
+        case KERNEL_INTERLEAVE:
+            rspa.out = 0;
+            k->interleave(1024, 1664);
+            break;
+        case KERNEL_ADPCM_DEC:
+            k->adpcm_dec(seed & 1 ? A_INIT : 0, state, rspa.buf.as_u8 + 1800, rspa.buf.as_s16, 320);
+            break;
+        case KERNEL_RESAMPLE:
+            rspa.in = 400;
+            rspa.out = 1200;
+            k->resample(seed & 1 ? A_INIT : 0, 0x4000 + seed % 0x8000, state);
+            break;
+        case KERNEL_ENV_MIXER:
+            rspa.in = 0;
+            rspa.out = 400;
+            rspa.dry_right = 800;
+            rspa.wet_left = 1200;
+            rspa.wet_right = 1600;
+            rspa.vol[0] = seed * 2654435761u & 0x7fff;
+            rspa.vol[1] = 1234;
+            rspa.target[0] = 0x7000;
+            rspa.target[1] = 100;
+            rspa.rate[0] = 0x10100;
+            rspa.rate[1] = 0xff00;
+            rspa.vol_dry = 0x5000;
+            rspa.vol_wet = 0x2000;
+            // The second call continues the ramp from the state the first one left
+            k->env_mixer(A_INIT | A_AUX, state);
+            k->env_mixer(A_AUX, state);
+            break;
+        case KERNEL_MIX:
+            k->mix(seed % 3 == 0 ? -0x8000 : (int16_t)seed, 0, 800);
+            break;
+    }
+    memcpy(buf, rspa.buf.as_u8, sizeof(rspa.buf));
+}
+
+int main(void) {
+    const struct MixerKernels *sets[5];
+    int num_sets = supported_kernel_sets(sets);
+    int failures = 0;
+
+    for (int kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+        for (unsigned int seed = 1; seed <= SEEDS; seed++) {
+            randomize(seed);
+            for (int s = 0; s < num_sets; s++) {
+                run_kernel(sets[s], kernel, seed, result_buf[s], result_state[s]);
+            }
+            for (int s = 1; s < num_sets; s++) {
+                int ref = matches_scalar[kernel] ? 0 : 1;
+                if (s == ref) {
+                    continue;
+                }
+                if (memcmp(result_buf[s], result_buf[ref], sizeof(rspa.buf)) != 0
+                    || memcmp(result_state[s], result_state[ref], sizeof(initial_state)) != 0) {
+                    if (failures++ < 10) {
+                        printf("%s, seed %u: %s differs from %s\n", kernel_names[kernel], seed,
+                               sets[s]->name, sets[ref]->name);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("test_mixer_kernels: %d mismatches across", failures);
+    for (int s = 0; s < num_sets; s++) {
+        printf(" %s", sets[s]->name);
+    }
+    printf("\n");
+    return failures != 0;
+}
@@ -0,0 +1,93 @@
+// Checks that decoding through the sample cache gives the same samples and decoder states as decoding
+// every time, for notes that play two samples from their start and loop back, with a cache budget that
+// keeps everything and with budgets that only hold part of it.
+
+#include <stdio.h>
+
+#include "src/pc/mixer.c"
+
+#define SAMPLE_FRAMES 400
+#define NOTES 20
+#define CALLS_PER_NOTE 200
+
+static uint8_t samples[2][SAMPLE_FRAMES * 9];
+static int16_t book[128];
+static ADPCM_STATE loop_state;
+
+// Plays the notes the way synthesis.c decodes them, and returns a hash of the decoded samples and states
+static uint64_t play_notes(void) {
+    uint64_t hash = 0;
+
+    srand(5);
+    for (int n = 0; n < NOTES; n++) {
+        ADPCM_STATE state = { 0 };
+        uint32_t frame = 0;
+        uint8_t flags = A_INIT;
+        uint32_t loop_frame = 50 + n % 3;
+        const uint8_t *sample = samples[n % 2];
+
+        for (int call = 0; call < CALLS_PER_NOTE; call++) {
+            uint32_t num_frames = 1 + rand() % 12;
+            if (frame + num_frames >= SAMPLE_FRAMES) {
+                frame = loop_frame;
+                flags = A_LOOP;
+                aSetLoopImpl(&loop_state);
+            }
+            aLoadADPCMImpl(16 * 16, book);
+            aSetBufferImpl(0, 0, 0x180, (num_frames * 16 - rand() % 16) * 2);
+            aADPCMdecCachedImpl(flags, state, sample + frame * 9, sample, frame);
+            for (uint32_t i = 0; i < (num_frames + 1) * 16; i++) {
+                hash = hash * 31 + (uint16_t)rspa.buf.as_s16[0x180 / 2 + i];
+            }
+            for (int i = 0; i < 16; i++) {
+                hash = hash * 31 + (uint16_t)state[i];
+            }
+            frame += num_frames;
+            flags = 0;
+        }
+    }
+    return hash;
+}
+
+int main(void) {
+    static const size_t budgets[] = { 1 << 20, 20000, 4000 };
+    int failures = 0;
+
+    srand(1);
+    for (int s = 0; s < 2; s++) {
+        for (size_t i = 0; i < sizeof(samples[s]); i++) {
+            samples[s][i] = rand();
+        }
+        for (int i = 0; i < SAMPLE_FRAMES; i++) {
+            samples[s][i * 9] = (samples[s][i * 9] % 13) << 4 | (samples[s][i * 9] & 1);
+        }
+    }
+    for (int i = 0; i < 128; i++) {
+        book[i] = rand() % 4096 - 2048;
+    }
+    for (int i = 0; i < 16; i++) {
+        loop_state[i] = rand();
+    }
+
+    mixer_set_sample_cache_size(0);
+    uint64_t expected = play_notes();
+    for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+        struct SampleCacheStats before, stats;
+        // Start from an empty cache
+        mixer_set_sample_cache_size(0);
+        mixer_get_sample_cache_stats(&before);
+        mixer_set_sample_cache_size(budgets[b]);
+        bool same = play_notes() == expected;
+        mixer_get_sample_cache_stats(&stats);
+        printf("budget %zu: %s, %u hits, %u misses, %u evictions, %zu bytes\n", budgets[b],
+               same ? "same output" : "DIFFERENT OUTPUT", stats.hits - before.hits, stats.misses - before.misses,
+               stats.evictions - before.evictions, stats.bytes);
+        if (!same || stats.bytes > budgets[b]) {
+            failures++;
+        }
+    }
+    mixer_set_sample_cache_size(0);
+
+    printf("test_sample_cache: %d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,93 @@
+// Checks that reading samples in place, as dma_sample_data does on PC, gives the same bytes as the N64
+// path, which copies them into the shared DMA buffers and returns a pointer into one of those. The N64
+// path is compiled from load.c here, with osPiStartDma doing the copy the way the PC port's does, for
+// notes that stream through a sample and jump around in it while the buffers' TTLs count down.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ultra64.h>
+
+#include "macros.h"
+#include "src/audio/data.h"
+#include "src/audio/external.h"
+#include "src/audio/heap.h"
+#include "src/audio/load.h"
+#include "src/audio/seqplayer.h"
+
+#define TARGET_N64
+#include "src/audio/load.c"
+#undef TARGET_N64
+
+#define NOTES 16
+#define UPDATES 20000
+#define SAMPLE_SIZE (1 << 20)
+
+// What the DMA functions use from the rest of the audio code. The test is linked with
+// --gc-sections, so the rest of load.c doesn't need anything else.
+struct SoundAllocPool gNotesAndBuffersPool;
+#ifdef VERSION_EU
+s32 gCurrAudioFrameDmaCount;
+#else
+volatile s32 gCurrAudioFrameDmaCount;
+#endif
+
+void *soundAlloc(UNUSED struct SoundAllocPool *pool, u32 size) {
+    return calloc(1, size);
+}
+
+void osInvalDCache(UNUSED void *vaddr, UNUSED size_t nbytes) {
+}
+
+s32 osPiStartDma(UNUSED OSIoMesg *mb, UNUSED s32 priority, UNUSED s32 direction, uintptr_t devAddr, void *vAddr,
+                 size_t nbytes, UNUSED OSMesgQueue *mq) {
+    memcpy(vAddr, (const void *) devAddr, nbytes);
+    return 0;
+}
+
+int main(void) {
+    static u8 sample[SAMPLE_SIZE];
+    u32 pos[NOTES];
+    u8 dma_index[NOTES] = { 0 };
+    int failures = 0;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(sample); i++) {
+        sample[i] = rand();
+    }
+    for (int n = 0; n < NOTES; n++) {
+        pos[n] = rand() % (SAMPLE_SIZE / 9 - 32);
+    }
+    gMaxSimultaneousNotes = NOTES;
+#ifdef VERSION_EU
+    gAudioBufferParameters.presetUnk4 = 1;
+#endif
+    init_sample_dma_buffers(NOTES);
+
+    for (int update = 0; update < UPDATES; update++) {
+        for (int n = 0; n < NOTES; n++) {
+            u32 size = (1 + rand() % 16) * 9;
+            // Now and then a note loops back or starts over somewhere else
+            if (rand() % 64 == 0) {
+                pos[n] = rand() % (SAMPLE_SIZE / 9 - 32);
+            }
+            const u8 *dev_addr = sample + pos[n] * 9;
+            const u8 *data = dma_sample_data((uintptr_t) dev_addr, size, rand() % 2, &dma_index[n]);
+            if (memcmp(data, dev_addr, size) != 0) {
+                if (failures++ < 10) {
+                    printf("update %d, note %d: the DMA buffer differs from the sample at %u\n", update, n,
+                           (unsigned int) (pos[n] * 9));
+                }
+            }
+            pos[n] += size / 9;
+            if (pos[n] >= SAMPLE_SIZE / 9 - 32) {
+                pos[n] = 0;
+            }
+        }
+        decrease_sample_dma_ttls();
+        gCurrAudioFrameDmaCount = 0;
+    }
+
+    printf("test_sample_dma: %d mismatches\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,171 @@
+// Checks that the shader program and color combiner pools grow past 64 entries: a profile of 200
+// shader ids is warmed up through the software rasterizer, then a frame is drawn with more combiners
+// than that. Programs must keep their addresses while the pools grow, and the built-in list of
+// shaders that is warmed up when there is no profile must not end up in the profile file.
+
+#include <unistd.h>
+#include <PR/mbi.h>
+#include "src/pc/gfx/gfx_pc.c"
+#include "src/pc/gfx/gfx_soft.c"
+
+#define NUM_PROFILED 200
+#define NUM_OBJECTS 128
+
+static Gfx display_list[NUM_OBJECTS * 6 + 16];
+static Gfx empty_display_list[1];
+static Vtx vertices[3];
+static Mtx identity;
+static Vp test_viewport = { { { 640, 480, 511, 0 }, { 640, 480, 511, 0 } } };
+
+static uint32_t profiled_id(int i) {
+    // Distinct color combines made of the inputs and texels, with and without alpha
+    return (i & 7) | (((i >> 3) & 7) << 3) | (((i >> 6) & 1) << 6) | (((i >> 7) & 1) ? SHADER_OPT_ALPHA : 0);
+}
+
+// Objects cycle through combiners of primitive, shade and environment colors, half of them fogged
+static void build_display_list(void) {
+    static const uint32_t items[] = { G_CCMUX_1, G_CCMUX_PRIMITIVE, G_CCMUX_SHADE, G_CCMUX_ENVIRONMENT };
+    Gfx *gfx = display_list;
+
+    for (int i = 0; i < 4; i++) {
+        identity.m[i][i] = 1.0f;
+    }
+    for (int i = 0; i < 3; i++) {
+        vertices[i].v.ob[0] = i == 1 ? 1 : 0;
+        vertices[i].v.ob[1] = i == 2 ? 1 : 0;
+        vertices[i].v.cn[3] = 255;
+    }
+
+    gSPViewport(gfx++, &test_viewport);
+    gSPMatrix(gfx++, &identity, G_MTX_PROJECTION | G_MTX_LOAD | G_MTX_NOPUSH);
+    gSPMatrix(gfx++, &identity, G_MTX_MODELVIEW | G_MTX_LOAD | G_MTX_NOPUSH);
+    gSPClearGeometryMode(gfx++, G_LIGHTING | G_CULL_BOTH);
+    gSPSetGeometryMode(gfx++, G_SHADE | G_SHADING_SMOOTH);
+    gSPVertex(gfx++, vertices, 3, 0);
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        // (a - b) * c + d, with the alpha set to shade
+        gDPSetCombine(gfx++, _SHIFTL(items[i & 3], 20, 4) | _SHIFTL(items[(i >> 4) & 3], 15, 5) |
+                             _SHIFTL(G_ACMUX_0, 12, 3) | _SHIFTL(G_ACMUX_0, 9, 3),
+                      _SHIFTL(items[(i >> 2) & 3], 28, 4) | _SHIFTL(items[2 + ((i >> 6) & 1)], 15, 3) |
+                      _SHIFTL(G_ACMUX_0, 12, 3) | _SHIFTL(G_ACMUX_SHADE, 9, 3));
+        if (i % 2 == 0) {
+            gSPSetGeometryMode(gfx++, G_FOG);
+            gDPSetRenderMode(gfx++, G_RM_FOG_SHADE_A, G_RM_OPA_SURF2);
+        } else {
+            gSPClearGeometryMode(gfx++, G_FOG);
+            gDPSetRenderMode(gfx++, G_RM_OPA_SURF, G_RM_OPA_SURF2);
+        }
+        gSP1Triangle(gfx++, 0, 1, 2, 0);
+    }
+    gSPEndDisplayList(gfx++);
+}
+
+static void run_frame(Gfx *commands) {
+    gfx_start_frame();
+    gfx_run(commands);
+    gfx_end_frame();
+}
+
+static long file_size(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+int main(void) {
+    char profile_filename[] = "/tmp/test_shader_pool_XXXXXX";
+    int fd = mkstemp(profile_filename);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < NUM_PROFILED; i++) {
+        fprintf(file, "%08x\n", profiled_id(i));
+    }
+    fclose(file);
+    long profile_size = file_size(profile_filename);
+
+    gfx_soft_set_options(1, 0, false, 0);
+    gfx_shader_profile_load(profile_filename);
+    gfx_init(&gfx_soft_wm_api, &gfx_soft_renderer_api, "test_shader_pool", false);
+    gSPEndDisplayList(empty_display_list);
+    int failures = 0;
+
+    // The warm-up compiles a few shaders per frame
+    run_frame(empty_display_list);
+    struct ShaderProgram *first = gfx_rapi->lookup_shader(profiled_id(0));
+    for (int i = 0; i < 1000 && shader_profile.num_prewarmed < NUM_PROFILED; i++) {
+        run_frame(empty_display_list);
+    }
+    if (shader_profile.num_ids != NUM_PROFILED || shader_profile.num_prewarmed != NUM_PROFILED) {
+        printf("profile: %u ids loaded and %u warmed up, expected %d\n", shader_profile.num_ids, shader_profile.num_prewarmed, NUM_PROFILED);
+        failures++;
+    }
+    for (int i = 0; i < NUM_PROFILED; i++) {
+        struct ShaderProgram *prg = gfx_rapi->lookup_shader(profiled_id(i));
+        if (prg == NULL || prg->shader_id != profiled_id(i)) {
+            printf("shader %08x: not created\n", profiled_id(i));
+            failures++;
+        }
+    }
+    if (first == NULL || gfx_rapi->lookup_shader(profiled_id(0)) != first) {
+        printf("shader %08x: moved while the pool grew\n", profiled_id(0));
+        failures++;
+    }
+    if (file_size(profile_filename) != profile_size) {
+        printf("profile: warming up wrote to the file\n");
+        failures++;
+    }
+
+    build_display_list();
+    run_frame(display_list);
+    run_frame(display_list);
+    if (color_combiner_pool_size <= 64) {
+        printf("combiners: %u created, expected more than 64\n", color_combiner_pool_size);
+        failures++;
+    }
+    for (uint32_t i = 0; i < color_combiner_pool_size; i++) {
+        struct ColorCombiner *comb = &color_combiner_pool[i];
+        if (comb->prg == NULL || gfx_rapi->lookup_shader(comb->prg->shader_id) != comb->prg) {
+            printf("combiner %08x: program not in the pool\n", comb->cc_id);
+            failures++;
+        }
+    }
+    if (file_size(profile_filename) <= profile_size) {
+        printf("profile: shaders used by the frame were not recorded\n");
+        failures++;
+    }
+
+    // Without a profile, the built-in list is warmed up but only shaders that are used are written
+    fclose(shader_profile.file);
+    shader_profile.file = NULL;
+    shader_profile.num_ids = 0;
+    shader_profile.num_prewarmed = 0;
+    unlink(profile_filename);
+    gfx_shader_profile_load(profile_filename);
+    for (int i = 0; i < 1000 && shader_profile.num_prewarmed < sizeof(default_shader_profile) / sizeof(default_shader_profile[0]); i++) {
+        run_frame(empty_display_list);
+    }
+    for (size_t i = 0; i < sizeof(default_shader_profile) / sizeof(default_shader_profile[0]); i++) {
+        if (gfx_rapi->lookup_shader(default_shader_profile[i]) == NULL) {
+            printf("default shader %08x: not warmed up\n", default_shader_profile[i]);
+            failures++;
+        }
+    }
+    fflush(shader_profile.file);
+    if (file_size(profile_filename) != 0) {
+        printf("profile: the built-in list was written to the file\n");
+        failures++;
+    }
+    unlink(profile_filename);
+
+    printf("test_shader_pool: %u shaders, %u combiners, %s\n", shader_program_pool_size, color_combiner_pool_size,
+           failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}